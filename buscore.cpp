@@ -0,0 +1,25 @@
+//
+// buscore.cpp
+//
+#include "buscore.h"
+
+#ifdef ARM_ALLOW_MULTI_CORE
+
+#include "kernel.h"
+#include <circle/memory.h>
+
+CBusCore::CBusCore (CKernel *pKernel)
+:   CMultiCoreSupport (CMemorySystem::Get ()),
+    m_pKernel (pKernel)
+{
+}
+
+void CBusCore::Run (unsigned nCore)
+{
+    if (nCore == BUS_CORE)
+    {
+        m_pKernel->BusCoreRun ();
+    }
+}
+
+#endif
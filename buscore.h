@@ -0,0 +1,33 @@
+//
+// buscore.h
+//
+// Secondary-core entry point for multicore builds (ARM_ALLOW_MULTI_CORE).
+// Core 1 runs the Spinbus pump; core 0 keeps USB, MIDI and voice allocation.
+//
+#ifndef _buscore_h
+#define _buscore_h
+
+#include <circle/sysconfig.h>
+
+#ifdef ARM_ALLOW_MULTI_CORE
+
+#include <circle/multicore.h>
+
+#define BUS_CORE 1
+
+class CKernel;
+
+class CBusCore : public CMultiCoreSupport
+{
+public:
+    CBusCore (CKernel *pKernel);
+
+    void Run (unsigned nCore) override;
+
+private:
+    CKernel *m_pKernel;
+};
+
+#endif
+
+#endif
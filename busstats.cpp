@@ -0,0 +1,79 @@
+//
+// busstats.cpp
+//
+#include "busstats.h"
+
+CBusStats::CBusStats (u32 nClockRate)
+:   m_nClockRate (nClockRate),
+    m_nInterval ((u32) ((u64) STATS_INTERVAL_US * nClockRate / 1000000)),
+    m_nIntervalStart (0)
+{
+    for (unsigned i = 0; i < YM_COUNT * YM_CHANNELS; i++)
+        m_KeyOn[i].store (0, std::memory_order_relaxed);
+}
+
+void CBusStats::Reset (u32 nNow)
+{
+    m_Live = TBusStatsSnapshot ();
+    m_nIntervalStart = nNow;
+    m_bPublished.store (false, std::memory_order_relaxed);
+    for (unsigned i = 0; i < YM_COUNT * YM_CHANNELS; i++)
+        m_KeyOn[i].store (0, std::memory_order_relaxed);
+}
+
+void CBusStats::KeyOnQueued (u8 nChip, u8 nChannel, u32 nArrival)
+{
+    // 0 means no key on pending
+    m_KeyOn[nChip * YM_CHANNELS + nChannel].store (nArrival ? nArrival : 1, std::memory_order_relaxed);
+}
+
+void CBusStats::Sync (bool bSuccess)
+{
+    m_Live.Syncs++;
+    if (!bSuccess)
+        m_Live.SyncFailures++;
+}
+
+void CBusStats::QueueDepth (u8 nChip, unsigned nDepth)
+{
+    if (nDepth > m_Live.HighWater[nChip])
+        m_Live.HighWater[nChip] = nDepth > 0xffff ? 0xffff : nDepth;
+}
+
+void CBusStats::Sent (u8 nChip, const YMCommand &command, u32 nNow)
+{
+    // key on: 0x28 with any operator bit set; channel bits 0-1, bank bit 2
+    if (command.bank || command.address != 0x28 || !(command.data & 0xf0) || (command.data & 3) == 3)
+        return;
+
+    u8 nChannel = (command.data & 3) + (command.data & 4 ? 3 : 0);
+    u32 nArrival = m_KeyOn[nChip * YM_CHANNELS + nChannel].exchange (0, std::memory_order_relaxed);
+    if (nArrival != 0)
+        m_Live.Latency.Add (ToMicroseconds (nNow - nArrival));
+}
+
+void CBusStats::Publish (u32 nNow, bool bForce)
+{
+    if (!bForce && nNow - m_nIntervalStart < m_nInterval)
+        return;
+    // the last one hasn't been picked up yet; keep counting into this interval
+    if (m_bPublished.load (std::memory_order_acquire))
+        return;
+
+    m_Published = m_Live;
+    m_Published.Interval = ToMicroseconds (nNow - m_nIntervalStart);
+    m_bPublished.store (true, std::memory_order_release);
+
+    m_Live = TBusStatsSnapshot ();
+    m_nIntervalStart = nNow;
+}
+
+bool CBusStats::TakeSnapshot (TBusStatsSnapshot *pSnapshot)
+{
+    if (!m_bPublished.load (std::memory_order_acquire))
+        return false;
+
+    *pSnapshot = m_Published;
+    m_bPublished.store (false, std::memory_order_release);
+    return true;
+}
@@ -0,0 +1,138 @@
+//
+// busstats.h
+//
+// Counters for the bus path: MIDI-in to key-on-sent latency, per-chip queue
+// high-water marks, bus bytes and sync/error events.
+//
+// The hot path only bumps counters and stamps events with a free-running clock
+// (StatsClock, the ARM generic timer). Whichever core owns the bus hands a copy
+// of the counters over with Publish () once per interval; another core picks it
+// up with TakeSnapshot () and does the slow formatting, so reporting never
+// holds up the bus loop.
+//
+// StatsClock reads the generic timer rather than the PMU cycle counter: a
+// note is stamped on arrival on core 0 and its key on is timed on the bus
+// core, and the cycle counters of two cores neither start together nor keep
+// counting at a fixed rate once the CPU clock is throttled. The generic timer
+// is one counter for all cores at a fixed rate (54 MHz on a Pi 4, 19.2 MHz on
+// earlier models), so a tick is 19-52 ns, and its low 32 bits wrap after 79 s
+// at the earliest, far beyond any latency or STATS_INTERVAL_US. Latencies are
+// converted to whole microseconds, so mean and max have 1 us resolution; the
+// histogram, and the percentiles read from it, have STATS_LATENCY_WIDTH_US
+// buckets up to 3.2 ms and one overflow bucket past that.
+//
+// Timestamps are passed in, so the host tools can drive the same code from the
+// simulated bus clock.
+//
+#ifndef _busstats_h
+#define _busstats_h
+
+#include "spinbus.h"
+#include "ymqueue.h"
+#include "histogram.h"
+#include <atomic>
+
+#define STATS_INTERVAL_US       10000000    // how often the counters are handed over
+#define STATS_LATENCY_BUCKETS   64
+#define STATS_LATENCY_WIDTH_US  50
+
+#ifndef SPINDASH_HOST
+
+/// @return the low half of the ARM generic timer's counter.
+static inline u32 StatsClock (void)
+{
+#if AARCH == 64
+    u64 nCount;
+    asm volatile ("mrs %0, cntpct_el0" : "=r" (nCount));
+    return (u32) nCount;
+#else
+    u32 nLow, nHigh;
+    asm volatile ("mrrc p15, 0, %0, %1, c14" : "=r" (nLow), "=r" (nHigh));
+    return nLow;
+#endif
+}
+
+/// @return the frequency StatsClock counts at, in Hz.
+static inline u32 StatsClockRate (void)
+{
+    u32 nRate;
+#if AARCH == 64
+    u64 nValue;
+    asm volatile ("mrs %0, cntfrq_el0" : "=r" (nValue));
+    nRate = (u32) nValue;
+#else
+    asm volatile ("mrc p15, 0, %0, c14, c0, 0" : "=r" (nRate));
+#endif
+    return nRate;
+}
+
+#endif
+
+/// @brief One interval's worth of counters, as handed over by CBusStats::Publish.
+struct TBusStatsSnapshot
+{
+    TBusStatsSnapshot (void) : Latency (STATS_LATENCY_WIDTH_US) {}
+
+    u32 Interval = 0;           // us covered by the counters below
+    u32 Bytes = 0;              // bytes transferred on the bus
+    u32 Syncs = 0;              // SpinbusSync runs
+    u32 SyncFailures = 0;
+    u32 Errors = 0;             // error reports read back from the FPGA
+    u32 Resyncs = 0;            // return byte boundary found again after a slip
+    u32 ResyncBits = 0;         // return bits lost to those, summed
+    u16 HighWater[YM_COUNT] = { 0 };
+    CHistogram<STATS_LATENCY_BUCKETS> Latency;  // MIDI-in to key-on-sent, us
+};
+
+class CBusStats
+{
+public:
+    /// @param nClockRate Hz of the clock the timestamps are taken from.
+    CBusStats (u32 nClockRate);
+
+    /// @brief Clears every counter and starts a new interval at nNow.
+    /// Only while nothing else is using the statistics.
+    void Reset (u32 nNow);
+
+    /// @brief Voice side: a key on for this channel was queued for a MIDI message that arrived at nArrival.
+    /// Call before queueing the key-on write, so the bus side sees the stamp when it sends it.
+    void KeyOnQueued (u8 nChip, u8 nChannel, u32 nArrival);
+
+    // Bus side
+    void AddBytes (unsigned nCount) { m_Live.Bytes += nCount; }
+    void Sync (bool bSuccess);
+    void Error (void) { m_Live.Errors++; }
+    void Resync (unsigned nBitsLost)
+    {
+        m_Live.Resyncs++;
+        m_Live.ResyncBits += nBitsLost;
+    }
+    void QueueDepth (u8 nChip, unsigned nDepth);
+    /// @brief Records a write that just went out; key ons complete a latency measurement.
+    void Sent (u8 nChip, const YMCommand &command, u32 nNow);
+
+    /// @brief Bus side: hands the counters over and starts a new interval once
+    /// STATS_INTERVAL_US has passed and the previous snapshot was taken.
+    /// @param bForce hand over now, regardless of the interval.
+    void Publish (u32 nNow, bool bForce = false);
+
+    /// @brief Any core: fetches the last published snapshot.
+    /// @return false if nothing new was published since the last call.
+    bool TakeSnapshot (TBusStatsSnapshot *pSnapshot);
+
+    u32 ToMicroseconds (u32 nTicks) const { return (u32) ((u64) nTicks * 1000000 / m_nClockRate); }
+
+private:
+    u32 m_nClockRate;
+    u32 m_nInterval;        // STATS_INTERVAL_US in clock ticks
+    u32 m_nIntervalStart;
+
+    TBusStatsSnapshot m_Live;
+    TBusStatsSnapshot m_Published;
+    std::atomic<bool> m_bPublished {false};
+
+    // arrival stamp of the key on pending on each channel, 0 if none
+    std::atomic<u32> m_KeyOn[YM_COUNT * YM_CHANNELS];
+};
+
+#endif
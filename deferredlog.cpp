@@ -0,0 +1,45 @@
+//
+// deferredlog.cpp
+//
+#include "deferredlog.h"
+#include <stdio.h>
+
+struct TLogFormat
+{
+    TLogSeverity Severity;
+    const char *Format;
+};
+
+static const TLogFormat s_Formats[MsgCount] =
+{
+    { LogNotice,    "Synchronized after %u writes. (last byte %04X)" },
+    { LogNotice,    "Couldn't synchronize after %u writes. (last byte %04X)" },
+    { LogNotice,    "Hit queue limit (%u) for chip %u (addr %02X data %02X)" },
+    { LogWarning,   "Chip %u overloaded at %u queued writes (policy %u)" },
+    { LogError,     "SPINDASH ERROR %02X, %u data bytes: %02X %02X" },
+    { LogError,     "Unknown command received: %02X" },
+    { LogError,     "Invalid command receiver state: %02X" },
+    { LogError,     "Received too many bytes for command: %02X" },
+    { LogError,     "YM chip index out of range: %u" },
+    { LogError,     "YM double submission on chip index: %u" },
+    { LogError,     "Unknown error code: %02X" }
+};
+
+bool CDeferredLog::Read (char *pLine, unsigned nSize, TLogSeverity *pSeverity)
+{
+    TLogRecord record;
+    if (!m_Ring.Pop (record))
+        return false;
+
+    if (record.Message >= MsgCount)
+    {
+        snprintf (pLine, nSize, "Unknown log message %u", record.Message);
+        *pSeverity = LogWarning;
+        return true;
+    }
+
+    const TLogFormat &format = s_Formats[record.Message];
+    snprintf (pLine, nSize, format.Format, record.Arg[0], record.Arg[1], record.Arg[2], record.Arg[3]);
+    *pSeverity = format.Severity;
+    return true;
+}
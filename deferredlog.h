@@ -0,0 +1,72 @@
+//
+// deferredlog.h
+//
+// Log for the bus hot path. Write () only stores a message id and up to
+// LOG_ARGS integer arguments in a lock-free ring, which costs about as much
+// as queueing a YM write; the formatting and the (slow) trip through CLogger
+// happen later, when Read () is called in idle time or on the other core.
+// A full ring drops the message and counts it rather than waiting.
+//
+// One producer at a time: whichever core owns the bus. Formats take 32-bit
+// integer arguments only (%u, %d, %x and friends), so a record never points
+// at memory that may be gone by the time it is formatted.
+//
+#ifndef _deferredlog_h
+#define _deferredlog_h
+
+#include "spinbus.h"
+#include "spscring.h"
+
+#ifdef SPINDASH_HOST
+enum TLogSeverity { LogPanic, LogError, LogWarning, LogNotice, LogDebug };
+#else
+#include <circle/logger.h>
+#endif
+
+#define LOG_RING_SIZE   256
+#define LOG_ARGS        4
+#define LOG_LINE_SIZE   96
+
+enum TLogMessage : u16
+{
+    MsgSynchronized,
+    MsgSyncFailed,
+    MsgQueueLimit,
+    MsgOverloaded,
+    MsgSpinbusError,
+    MsgErrorUnknownCommand,
+    MsgErrorInvalidState,
+    MsgErrorTooManyBytes,
+    MsgErrorIndexRange,
+    MsgErrorDoubleSubmit,
+    MsgErrorUnknownCode,
+    MsgCount
+};
+
+struct TLogRecord
+{
+    TLogMessage Message;
+    u32 Arg[LOG_ARGS];
+};
+
+class CDeferredLog
+{
+public:
+    /// @brief Producer side; never blocks.
+    void Write (TLogMessage message, u32 nArg0 = 0, u32 nArg1 = 0, u32 nArg2 = 0, u32 nArg3 = 0)
+    {
+        m_Ring.Push ({message, {nArg0, nArg1, nArg2, nArg3}});
+    }
+
+    /// @brief Consumer side: takes the oldest message and formats it.
+    /// @return false if there was nothing to read.
+    bool Read (char *pLine, unsigned nSize, TLogSeverity *pSeverity);
+
+    /// @return messages dropped on a full ring so far.
+    unsigned GetDropped (void) const { return m_Ring.GetOverflows (); }
+
+private:
+    CSPSCRing<TLogRecord, LOG_RING_SIZE> m_Ring;
+};
+
+#endif
@@ -0,0 +1,51 @@
+//
+// eventscheduler.cpp
+//
+#include "eventscheduler.h"
+
+static const u64 SampleDenominator = (u64) YM_SAMPLE_DIV * EVENT_TICKS_PER_SECOND;
+
+CEventScheduler::CEventScheduler (u32 nLookahead)
+:   m_nLookahead (nLookahead),
+    m_Jitter (EVENT_JITTER_WIDTH_US)
+{
+    Reset (0);
+}
+
+void CEventScheduler::Reset (u64 nNow)
+{
+    m_nEpoch = nNow;
+    m_Jitter.Clear ();
+    m_nLate = 0;
+}
+
+/// @return the index of the first sample boundary at or after nTime.
+u64 CEventScheduler::GetSample (u64 nTime) const
+{
+    if (nTime <= m_nEpoch)
+        return 0;
+    return ((nTime - m_nEpoch) * YM_CLOCK + SampleDenominator - 1) / SampleDenominator;
+}
+
+/// @return the clock tick a sample boundary falls on, rounded up to a whole tick.
+u64 CEventScheduler::GetSampleTime (u64 nSample) const
+{
+    return m_nEpoch + (nSample * SampleDenominator + YM_CLOCK - 1) / YM_CLOCK;
+}
+
+u64 CEventScheduler::GetDueTime (u64 nTimestamp) const
+{
+    return GetSampleTime (GetSample (nTimestamp + m_nLookahead));
+}
+
+void CEventScheduler::Dispatched (u64 nTimestamp, u64 nNow)
+{
+    u64 nDue = GetDueTime (nTimestamp);
+    if (nNow < nDue)
+        return;     // dispatched early on purpose, e.g. flushed by a reset
+
+    u64 nJitter = nNow - nDue;
+    m_Jitter.Add (nJitter > 0xffffffff ? 0xffffffff : (u32) nJitter);
+    if (nJitter > m_nLookahead)
+        m_nLate++;
+}
@@ -0,0 +1,54 @@
+//
+// eventscheduler.h
+//
+// Releases timestamped events at a fixed lookahead after they arrived, on the
+// YM sample grid (YM_CLOCK / YM_SAMPLE_DIV, ~18.77 us). Jitter between the
+// due time and the actual dispatch is recorded in a histogram.
+//
+// Time is passed in by the caller in CTimer clock ticks (1 MHz), so the same
+// code runs against the simulated bus clock on the host.
+//
+#ifndef _eventscheduler_h
+#define _eventscheduler_h
+
+#include "spinbus.h"
+#include "histogram.h"
+
+#define EVENT_TICKS_PER_SECOND  1000000     // CTimer clock ticks
+#define EVENT_LOOKAHEAD_US      1000
+#define EVENT_JITTER_BUCKETS    64
+#define EVENT_JITTER_WIDTH_US   5
+
+class CEventScheduler
+{
+public:
+    CEventScheduler (u32 nLookahead = EVENT_LOOKAHEAD_US);
+
+    /// @brief Restarts the sample grid at nNow and clears the jitter statistics.
+    /// Elapsed ticks are multiplied by YM_CLOCK, which stays within 64 bits for about 27 days.
+    void Reset (u64 nNow);
+
+    /// @return the first sample boundary at least the lookahead after nTimestamp.
+    u64 GetDueTime (u64 nTimestamp) const;
+    bool IsDue (u64 nTimestamp, u64 nNow) const { return GetDueTime (nTimestamp) <= nNow; }
+
+    /// @brief Records that an event with this timestamp was handled at nNow.
+    void Dispatched (u64 nTimestamp, u64 nNow);
+
+    u64 GetSample (u64 nTime) const;
+    u64 GetSampleTime (u64 nSample) const;
+
+    const CHistogram<EVENT_JITTER_BUCKETS> &GetJitter (void) const { return m_Jitter; }
+    u32 GetLate (void) const { return m_nLate; }
+
+private:
+    u32 m_nLookahead;
+    u64 m_nEpoch;
+
+    // dispatch time minus due time, in clock ticks
+    CHistogram<EVENT_JITTER_BUCKETS> m_Jitter;
+    // events dispatched more than a whole lookahead after they were due, e.g. after a stall
+    u32 m_nLate;
+};
+
+#endif
@@ -0,0 +1,85 @@
+//
+// fnumtable.h
+//
+// Compile-time MIDI key -> YM block/fnum table, in FNUM_FINE_STEPS steps per
+// semitone so pitch bend is a table lookup too.
+//
+#ifndef _fnumtable_h
+#define _fnumtable_h
+
+#include "spinbus.h"
+
+#define YM_TRANSPOSE        -2          // octaves; the pitch the controller has always played at
+#define FNUM_FINE_STEPS     32          // table entries per semitone
+#define FNUM_TABLE_SIZE     (128*FNUM_FINE_STEPS)
+#define PITCH_BEND_RANGE    2           // semitones at full MIDI pitch bend
+
+constexpr double FnumExp2 (double x)
+{
+    int whole = (int) x;
+    if (whole > x)
+        whole--;
+    double frac = x - whole;
+
+    // 2^frac = e^(frac ln 2); frac is in [0, 1) so the series converges quickly
+    double term = 1.0, sum = 1.0, y = frac * 0.69314718055994530942;
+    for (int n = 1; n < 24; n++) {
+        term *= y / n;
+        sum += term;
+    }
+    for (; whole > 0; whole--)
+        sum *= 2.0;
+    for (; whole < 0; whole++)
+        sum /= 2.0;
+    return sum;
+}
+
+/// @brief The 14-bit block/fnum word (block in bits 11-13) for a pitch in table steps.
+constexpr u16 FnumWord (int step)
+{
+    double frequency = 440.0 * FnumExp2 ((step - 69 * FNUM_FINE_STEPS) / (12.0 * FNUM_FINE_STEPS));
+    // fnum * 2^block for this frequency
+    double units = 2.0 * YM_SAMPLE_DIV * 1048576.0 * frequency / YM_CLOCK * FnumExp2 (YM_TRANSPOSE);
+
+    // the lowest block that fits keeps the most fnum resolution
+    int block = 0;
+    while (block < 7 && units / (1 << block) + 0.5 >= 2048)
+        block++;
+    double fnum = units / (1 << block) + 0.5;
+    if (fnum >= 2048)
+        fnum = 2047;
+    return (u16) ((block << 11) | (int) fnum);
+}
+
+struct TFnumTable
+{
+    u16 Words[FNUM_TABLE_SIZE];
+
+    constexpr TFnumTable (void)
+    :   Words ()
+    {
+        for (int i = 0; i < FNUM_TABLE_SIZE; i++)
+            Words[i] = FnumWord (i);
+    }
+};
+
+inline constexpr TFnumTable g_FnumTable;
+
+/// @param fine offset in 1/FNUM_FINE_STEPS semitones, e.g. from YMBendToFine
+inline u16 YMKeyToNote (u8 key, int fine = 0)
+{
+    int step = key * FNUM_FINE_STEPS + fine;
+    if (step < 0)
+        step = 0;
+    else if (step >= FNUM_TABLE_SIZE)
+        step = FNUM_TABLE_SIZE - 1;
+    return g_FnumTable.Words[step];
+}
+
+/// @param bend MIDI pitch bend, -8192..8191
+inline int YMBendToFine (int bend)
+{
+    return bend * (PITCH_BEND_RANGE * FNUM_FINE_STEPS) / 8192;
+}
+
+#endif
@@ -0,0 +1,77 @@
+//
+// histogram.h
+//
+// Fixed-bucket histogram for timing measurements. Values are bucketed
+// linearly; anything past the last bucket lands in an overflow bucket, but
+// still counts towards the maximum and the sum.
+//
+#ifndef _histogram_h
+#define _histogram_h
+
+#include "spinbus.h"
+
+template <unsigned BUCKETS>
+class CHistogram
+{
+public:
+    static constexpr unsigned Buckets = BUCKETS;
+
+    CHistogram (u32 nBucketWidth = 1)
+    :   m_nBucketWidth (nBucketWidth)
+    {
+        Clear ();
+    }
+
+    void Clear (void)
+    {
+        for (unsigned i = 0; i <= BUCKETS; i++)
+            m_nBucket[i] = 0;
+        m_nCount = 0;
+        m_nSum = 0;
+        m_nMax = 0;
+    }
+
+    void Add (u32 nValue)
+    {
+        u32 nBucket = nValue / m_nBucketWidth;
+        m_nBucket[nBucket < BUCKETS ? nBucket : BUCKETS]++;
+        m_nCount++;
+        m_nSum += nValue;
+        if (nValue > m_nMax)
+            m_nMax = nValue;
+    }
+
+    u32 GetBucketWidth (void) const { return m_nBucketWidth; }
+    /// @param nBucket 0 to BUCKETS - 1, or BUCKETS for the overflow bucket.
+    u32 GetBucket (unsigned nBucket) const { return m_nBucket[nBucket]; }
+    u32 GetCount (void) const { return m_nCount; }
+    u32 GetMax (void) const { return m_nMax; }
+    u32 GetMean (void) const { return m_nCount ? (u32) (m_nSum / m_nCount) : 0; }
+
+    /// @return upper edge of the bucket holding the given percentile, capped at
+    /// the maximum (which is also returned if it falls into the overflow bucket).
+    u32 GetPercentile (unsigned nPercent) const
+    {
+        u64 nTarget = ((u64) m_nCount * nPercent + 99) / 100;
+        u64 nSeen = 0;
+        for (unsigned i = 0; i < BUCKETS; i++)
+        {
+            nSeen += m_nBucket[i];
+            if (nSeen >= nTarget && nSeen > 0)
+            {
+                u32 nEdge = (i + 1) * m_nBucketWidth - 1;
+                return nEdge < m_nMax ? nEdge : m_nMax;
+            }
+        }
+        return m_nMax;
+    }
+
+private:
+    u32 m_nBucketWidth;
+    u32 m_nBucket[BUCKETS + 1];
+    u32 m_nCount;
+    u64 m_nSum;
+    u32 m_nMax;
+};
+
+#endif
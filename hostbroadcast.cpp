@@ -0,0 +1,273 @@
+//
+// hostbroadcast.cpp
+//
+// Startup time and master volume sweeps with and without CMD_YM_BROADCAST:
+//
+//   make hostbroadcast && ./hostbroadcast [sweeps]
+//
+// Both run the kernel's CSpinbusPump on the simulated Spinbus with single
+// writes, broadcasts, bursts, and both, and time is the simulated bus clock.
+//
+// The startup is what CKernel queues on its first pass: YMPrepareGlobal and
+// every channel of every chip prepared with patch 0, timed from the first
+// write queued to the last one out.
+//
+// The sweep fills every voice (all chips but the last VGM_CHIPS) with a
+// random patch and velocity, then moves CC7 from 127 to 0 and back one step
+// at a time, rewriting each carrier TL as CKernel::YMQueueVolume does and
+// draining before the next step; the step time is how long a volume change
+// takes to reach every chip. Voices with the same patch and velocity end up
+// with the same level, which is what broadcasts share, so the sweep is run
+// with the voices on 1, 4 and 8 patches.
+//
+// Every configuration has to leave the chips with the same registers as
+// single writes do, else the run fails.
+//
+#include "spinbussim.h"
+#include "spinbuspump.h"
+#include "fnumtable.h"
+#include "patches.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define VGM_CHIPS           2       // kernel.h VGM_PLAYERS, one chip each
+#define VOICE_CHIPS         (YM_COUNT - VGM_CHIPS)
+#define VELOCITIES          4       // distinct note velocities in the sweep
+
+enum TConfig
+{
+    ConfigSingle,
+    ConfigBroadcast,
+    ConfigBurst,
+    ConfigBoth,
+    Configs
+};
+
+static const char *s_ConfigNames[Configs] = { "single", "broadcast", "burst", "both" };
+
+static u32 Random (u32 *pSeed)
+{
+    *pSeed ^= *pSeed << 13;
+    *pSeed ^= *pSeed >> 17;
+    *pSeed ^= *pSeed << 5;
+    return *pSeed;
+}
+
+class CBench
+{
+public:
+    CBench (TConfig eConfig)
+    :   m_Overload (OverloadShed),
+        m_Pump (&m_Bus, &m_Overload, &m_Stats, &m_Log, PumpClock, this)
+    {
+        m_Pump.SetBroadcast (eConfig == ConfigBroadcast || eConfig == ConfigBoth);
+        m_Pump.SetBurst (eConfig == ConfigBurst || eConfig == ConfigBoth);
+        m_Pump.Reset ();
+        m_Pump.Sync ();
+    }
+
+    /// @return ns from the first write queued to the last one sent.
+    u64 Startup (void)
+    {
+        u64 nStart = m_Bus.GetTime ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            m_Pump.Enqueue (chip, YMCommand (0, 0x22, 0x00));
+            m_Pump.Enqueue (chip, YMCommand (0, 0x27, 0x00));
+            m_Pump.Enqueue (chip, YMCommand (0, 0x2B, 0x00));
+        }
+        for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+        {
+            for (u8 chip = 0; chip < YM_COUNT; chip++)
+                Prepare (chip, channel, 0);
+        }
+        Drain ();
+        return m_Bus.GetTime () - nStart;
+    }
+
+    /// @brief Prepares every voice with one of nPatches patches and sounds a note on it.
+    void Voices (unsigned nPatches)
+    {
+        u32 nSeed = 0x9e3779b9;
+        for (u8 chip = 0; chip < VOICE_CHIPS; chip++)
+        {
+            for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+            {
+                Prepare (chip, channel, Random (&nSeed) % nPatches);
+                m_Velocity[chip][channel] = 0x7f - Random (&nSeed) % VELOCITIES * 0x10;
+                u16 word = YMKeyToNote (36 + Random (&nSeed) % 48);
+                bool bank = channel > 2;
+                m_Pump.Enqueue (chip, YMCommand (bank, 0xA4 + channel % 3, word >> 8));
+                m_Pump.Enqueue (chip, YMCommand (bank, 0xA0 + channel % 3, word & 0xff));
+                m_Pump.Enqueue (chip, YMCommand (0, YM_REG_KEY_ON, 0xf0 | (bank ? channel + 1 : channel)));
+            }
+        }
+        Drain ();
+    }
+
+    /// @return ns from the first TL queued to the last one sent.
+    u64 Volume (u8 volume)
+    {
+        u64 nStart = m_Bus.GetTime ();
+        for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+        {
+            for (u8 op = 0; op < 4; op++)
+            {
+                for (u8 chip = 0; chip < VOICE_CHIPS; chip++)
+                {
+                    const YMPatch &patch = g_Patches[m_Patch[chip][channel]];
+                    if (!(YMPatchCarriers (patch) & BIT(op)))
+                        continue;
+                    unsigned level = patch.TotalLevel[op] + (0x7f - m_Velocity[chip][channel]) + (0x7f - volume);
+                    m_Pump.Enqueue (chip, YMCommand (channel > 2, 0x40 + op*4 + channel % 3, level > 0x7f ? 0x7f : level));
+                }
+            }
+        }
+        Drain ();
+        return m_Bus.GetTime () - nStart;
+    }
+
+    u64 GetBytes (void) const { return m_Bus.GetStats ().Bytes; }
+    u64 GetErrors (void) const { return m_Bus.GetStats ().Errors; }
+
+    /// @return true if every chip holds the same registers as in the other bench.
+    bool SameRegisters (const CBench &other) const
+    {
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            for (unsigned address = 0x22; address < 0x100; address++)
+            {
+                for (int bank = 0; bank < 2; bank++)
+                {
+                    if (m_Bus.GetRegister (chip, bank, address) != other.m_Bus.GetRegister (chip, bank, address))
+                        return false;
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    /// @brief Same writes as CKernel::YMPrepare.
+    void Prepare (u8 chip, u8 channelIdx, u8 patchId)
+    {
+        bool bank = channelIdx > 2;
+        u8 chMod = channelIdx % 3;
+        const YMPatch &patch = g_Patches[patchId];
+
+        m_Pump.Enqueue (chip, YMCommand (0, YM_REG_KEY_ON, bank ? channelIdx + 1 : channelIdx));
+        for (u8 op = 0; op < 4; op++)
+        {
+            u8 opMod = chMod + op*4;
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x30+opMod, patch.DetuneMultiply[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x40+opMod, patch.TotalLevel[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x50+opMod, patch.AttackRate[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x60+opMod, patch.DecayRate[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x70+opMod, patch.SustainRate[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x80+opMod, patch.ReleaseRate[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x90+opMod, patch.SSGEG[op]));
+        }
+        m_Pump.Enqueue (chip, YMCommand (bank, 0xB0+chMod, patch.FeedbackAlgorithm));
+        m_Pump.Enqueue (chip, YMCommand (bank, 0xB4+chMod, patch.PanModulation));
+        m_Patch[chip][channelIdx] = patchId;
+    }
+
+    void Drain (void)
+    {
+        while (m_Pump.GetPending ())
+            m_Pump.Process ();
+    }
+
+    static u32 PumpClock (void *pParam)
+    {
+        return (u32) (((CBench *) pParam)->m_Bus.GetTime () / 1000);
+    }
+
+    CSimSpinbus m_Bus;
+    COverloadControl m_Overload;
+    CBusStats m_Stats {1000000};
+    CDeferredLog m_Log;
+    CSpinbusPump m_Pump;
+    u8 m_Patch[YM_COUNT][YM_CHANNELS] = {};
+    u8 m_Velocity[YM_COUNT][YM_CHANNELS] = {};
+};
+
+int main (int argc, char **argv)
+{
+    unsigned nSweeps = argc > 1 ? atoi (argv[1]) : 4;
+    if (nSweeps == 0)
+    {
+        fprintf (stderr, "sweeps must be positive\n");
+        return 1;
+    }
+
+    int nResult = 0;
+    CBench *pBench[Configs];
+
+    printf ("startup, %u chips\n", YM_COUNT);
+    printf ("%-10s %10s %10s %8s\n", "", "ms", "bytes", "gain");
+    u64 nSingleNs = 0;
+    for (unsigned c = 0; c < Configs; c++)
+    {
+        pBench[c] = new CBench ((TConfig) c);
+        u64 nNs = pBench[c]->Startup ();
+        if (c == ConfigSingle)
+            nSingleNs = nNs;
+        printf ("%-10s %10.2f %10llu %7.2fx\n", s_ConfigNames[c], nNs / 1e6, (unsigned long long) pBench[c]->GetBytes (),
+                (double) nSingleNs / nNs);
+    }
+    for (unsigned c = 0; c < Configs; c++)
+    {
+        if (!pBench[c]->SameRegisters (*pBench[ConfigSingle]) || pBench[c]->GetErrors ())
+        {
+            printf ("%-10s FAIL: registers differ from single writes, or bus errors\n", s_ConfigNames[c]);
+            nResult = 2;
+        }
+    }
+    for (unsigned c = 0; c < Configs; c++)
+        delete pBench[c];
+
+    static const unsigned s_Patches[] = { 1, 4, 8 };
+    printf ("\nvolume sweeps 127-0-127, %u voice chips, %u sweeps\n", VOICE_CHIPS, nSweeps);
+    printf ("%-8s %-10s %12s %12s %12s %8s\n", "patches", "", "step us", "max us", "bytes/step", "gain");
+    for (unsigned nPatches : s_Patches)
+    {
+        double fSingleNs = 0;
+        for (unsigned c = 0; c < Configs; c++)
+        {
+            pBench[c] = new CBench ((TConfig) c);
+            pBench[c]->Voices (nPatches);
+            u64 nBytes = pBench[c]->GetBytes ();
+            u64 nTotal = 0, nMax = 0;
+            unsigned nSteps = 0;
+            for (unsigned s = 0; s < nSweeps; s++)
+            {
+                for (int step = 0; step < 2 * 0x7f; step++, nSteps++)
+                {
+                    u64 nNs = pBench[c]->Volume (step < 0x7f ? 0x7e - step : step - 0x7f + 1);
+                    nTotal += nNs;
+                    if (nNs > nMax)
+                        nMax = nNs;
+                }
+            }
+            double fMeanNs = (double) nTotal / nSteps;
+            if (c == ConfigSingle)
+                fSingleNs = fMeanNs;
+            printf ("%-8u %-10s %12.1f %12.1f %12.0f %7.2fx\n", nPatches, s_ConfigNames[c], fMeanNs / 1e3, nMax / 1e3,
+                    (double) (pBench[c]->GetBytes () - nBytes) / nSteps, fSingleNs / fMeanNs);
+        }
+        for (unsigned c = 0; c < Configs; c++)
+        {
+            if (!pBench[c]->SameRegisters (*pBench[ConfigSingle]) || pBench[c]->GetErrors ())
+            {
+                printf ("%-8u %-10s FAIL: registers differ from single writes, or bus errors\n", nPatches,
+                        s_ConfigNames[c]);
+                nResult = 2;
+            }
+        }
+        for (unsigned c = 0; c < Configs; c++)
+            delete pBench[c];
+    }
+
+    return nResult;
+}
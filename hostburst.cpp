@@ -0,0 +1,228 @@
+//
+// hostburst.cpp
+//
+// Bus bytes and time with and without CMD_YM_BURST, for the kernel's usual
+// kinds of traffic:
+//
+//   make hostburst && ./hostburst [rounds]
+//
+// Each workload is queued on every chip and drained through the kernel's
+// CSpinbusPump on the simulated Spinbus, once with SetBurst (false) and once
+// with SetBurst (true), starting from the same power-on state so the shadow
+// elides the same writes both times. Time is the simulated bus clock, so
+// the figures are the same from run to run.
+//
+// The startup load is what CKernel queues on its first pass (YMPrepareGlobal
+// and every channel prepared with patch 0); the patch changes load one patch
+// into a random channel of each chip, the notes set up a note (carrier TLs,
+// fnum pair, key on) on every channel, and the stream writes one register
+// per chip at a time, as a VGM player does. Gain is the time without bursts
+// over the time with them.
+//
+#include "spinbussim.h"
+#include "spinbuspump.h"
+#include "fnumtable.h"
+#include "patches.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+enum TWorkload
+{
+    WorkloadStartup,
+    WorkloadPatches,
+    WorkloadNotes,
+    WorkloadStream,
+    Workloads
+};
+
+static const char *s_WorkloadNames[Workloads] = { "startup", "patch changes", "notes", "stream" };
+
+struct TResult
+{
+    u64 Bytes;
+    u64 Writes;
+    u64 Ns;
+};
+
+static u32 Random (u32 *pSeed)
+{
+    *pSeed ^= *pSeed << 13;
+    *pSeed ^= *pSeed >> 17;
+    *pSeed ^= *pSeed << 5;
+    return *pSeed;
+}
+
+class CBench
+{
+public:
+    CBench (bool bBurst)
+    :   m_Overload (OverloadShed),
+        m_Pump (&m_Bus, &m_Overload, &m_Stats, &m_Log, PumpClock, this)
+    {
+        m_Pump.SetBurst (bBurst);
+        m_Pump.Reset ();
+        m_Pump.Sync ();
+    }
+
+    TResult Run (TWorkload eWorkload, unsigned nRounds)
+    {
+        u64 nStart = m_Bus.GetTime ();
+        u64 nBytes = m_Bus.GetStats ().Bytes;
+        u64 nWrites = m_Bus.GetStats ().Writes;
+        for (unsigned r = 0; r < nRounds; r++)
+        {
+            switch (eWorkload)
+            {
+            case WorkloadStartup:
+                m_Pump.Clear ();
+                PrepareGlobal ();
+                for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+                {
+                    for (u8 chip = 0; chip < YM_COUNT; chip++)
+                        Prepare (chip, channel, 0);
+                }
+                break;
+
+            case WorkloadPatches:
+                for (u8 chip = 0; chip < YM_COUNT; chip++)
+                    Prepare (chip, Random (&m_nSeed) % YM_CHANNELS, Random (&m_nSeed) % g_nPatches);
+                break;
+
+            case WorkloadNotes:
+                for (u8 chip = 0; chip < YM_COUNT; chip++)
+                {
+                    for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+                        Note (chip, channel, 24 + Random (&m_nSeed) % 72, Random (&m_nSeed) % 0x80);
+                }
+                break;
+
+            case WorkloadStream:
+                for (unsigned n = 0; n < YM_CHANNELS; n++)
+                {
+                    for (u8 chip = 0; chip < YM_COUNT; chip++)
+                        m_Pump.Enqueue (chip, YMCommand (n & 1, 0x40 + Random (&m_nSeed) % 12, Random (&m_nSeed) & 0x7f));
+                }
+                break;
+
+            default:
+                break;
+            }
+            while (m_Pump.GetPending ())
+                m_Pump.Process ();
+        }
+        return { m_Bus.GetStats ().Bytes - nBytes, m_Bus.GetStats ().Writes - nWrites, m_Bus.GetTime () - nStart };
+    }
+
+    u64 GetErrors (void) const { return m_Bus.GetStats ().Errors; }
+
+private:
+    /// @brief Same writes as CKernel::YMPrepareGlobal.
+    void PrepareGlobal (void)
+    {
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            m_Pump.Enqueue (chip, YMCommand (0, 0x22, 0x00));
+            m_Pump.Enqueue (chip, YMCommand (0, 0x27, 0x00));
+            m_Pump.Enqueue (chip, YMCommand (0, 0x2B, 0x00));
+        }
+    }
+
+    /// @brief Same writes as CKernel::YMPrepare.
+    void Prepare (u8 chip, u8 channelIdx, u8 patchId)
+    {
+        bool bank = channelIdx > 2;
+        u8 chMod = channelIdx % 3;
+        const YMPatch &patch = g_Patches[patchId];
+
+        m_Pump.Enqueue (chip, YMCommand (0, YM_REG_KEY_ON, bank ? channelIdx + 1 : channelIdx));
+        for (u8 op = 0; op < 4; op++)
+        {
+            u8 opMod = chMod + op*4;
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x30+opMod, patch.DetuneMultiply[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x40+opMod, patch.TotalLevel[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x50+opMod, patch.AttackRate[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x60+opMod, patch.DecayRate[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x70+opMod, patch.SustainRate[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x80+opMod, patch.ReleaseRate[op]));
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x90+opMod, patch.SSGEG[op]));
+        }
+        m_Pump.Enqueue (chip, YMCommand (bank, 0xB0+chMod, patch.FeedbackAlgorithm));
+        m_Pump.Enqueue (chip, YMCommand (bank, 0xB4+chMod, patch.PanModulation));
+        m_Patch[chip][channelIdx] = patchId;
+    }
+
+    /// @brief Same writes as CKernel::YMQueueNoteRaw, with a simpler velocity scale.
+    void Note (u8 chip, u8 channelIdx, u8 key, u8 velocity)
+    {
+        bool bank = channelIdx > 2;
+        u8 chMod = channelIdx % 3;
+        const YMPatch &patch = g_Patches[m_Patch[chip][channelIdx]];
+        u8 carriers = YMPatchCarriers (patch);
+        for (u8 op = 0; op < 4; op++)
+        {
+            if (!(carriers & BIT(op)))
+                continue;
+            unsigned level = patch.TotalLevel[op] + (0x7f - velocity) / 4;
+            m_Pump.Enqueue (chip, YMCommand (bank, 0x40 + op*4 + chMod, level > 0x7f ? 0x7f : level));
+        }
+        u16 word = YMKeyToNote (key);
+        m_Pump.Enqueue (chip, YMCommand (bank, 0xA4+chMod, word >> 8));
+        m_Pump.Enqueue (chip, YMCommand (bank, 0xA0+chMod, word & 0xff));
+        m_Pump.Enqueue (chip, YMCommand (0, YM_REG_KEY_ON, 0xf0 | (bank ? channelIdx + 1 : channelIdx)));
+    }
+
+    static u32 PumpClock (void *pParam)
+    {
+        return (u32) (((CBench *) pParam)->m_Bus.GetTime () / 1000);
+    }
+
+    CSimSpinbus m_Bus;
+    COverloadControl m_Overload;
+    CBusStats m_Stats {1000000};
+    CDeferredLog m_Log;
+    CSpinbusPump m_Pump;
+    u8 m_Patch[YM_COUNT][YM_CHANNELS] = {};
+    u32 m_nSeed = 0x68e31da4;
+};
+
+int main (int argc, char **argv)
+{
+    unsigned nRounds = argc > 1 ? atoi (argv[1]) : 200;
+    if (nRounds == 0)
+    {
+        fprintf (stderr, "rounds must be positive\n");
+        return 1;
+    }
+
+    printf ("%u rounds per workload over %u chips\n", nRounds, YM_COUNT);
+    printf ("%-14s %9s %11s %11s %11s %11s %11s %6s\n", "workload", "writes", "bytes/write", "with burst",
+            "writes/s", "with burst", "burst ms", "gain");
+
+    int nResult = 0;
+    for (unsigned w = 0; w < Workloads; w++)
+    {
+        TWorkload eWorkload = (TWorkload) w;
+        CBench *pSingle = new CBench (false);
+        CBench *pBurst = new CBench (true);
+        TResult single = pSingle->Run (eWorkload, nRounds);
+        TResult burst = pBurst->Run (eWorkload, nRounds);
+
+        printf ("%-14s %9llu %11.2f %11.2f %11.0f %11.0f %11.1f %5.2fx\n", s_WorkloadNames[w],
+                (unsigned long long) single.Writes, (double) single.Bytes / single.Writes,
+                (double) burst.Bytes / burst.Writes, single.Writes * 1e9 / single.Ns,
+                burst.Writes * 1e9 / burst.Ns, burst.Ns / 1e6, (double) single.Ns / burst.Ns);
+
+        // both have to get the same writes to the chips, cleanly
+        if (single.Writes != burst.Writes || pSingle->GetErrors () || pBurst->GetErrors ())
+        {
+            printf ("%-14s writes %llu against %llu, errors %llu/%llu\n", "  FAIL", (unsigned long long) single.Writes,
+                    (unsigned long long) burst.Writes, (unsigned long long) pSingle->GetErrors (),
+                    (unsigned long long) pBurst->GetErrors ());
+            nResult = 2;
+        }
+        delete pBurst;
+        delete pSingle;
+    }
+
+    return nResult;
+}
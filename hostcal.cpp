@@ -0,0 +1,48 @@
+//
+// hostcal.cpp
+//
+// Runs the Spinbus calibration against the simulated bus:
+//
+//   make hostcal && ./hostcal [min-setup-ns min-hold-ns]
+//
+// The limits stand in for the wiring; the calibration should settle
+// CAL_MARGIN_STEPS steps above the last clean setting, and no faster than the
+// CAL_FLOOR_NS setting allows. Time is the simulated bus clock.
+//
+#include "spinbussim.h"
+#include "spinbuscal.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static CSimSpinbus s_Bus;
+
+static u32 Clock (void *)
+{
+    return (u32) s_Bus.GetTime ();
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nMinSetup = argc > 2 ? atoi (argv[1]) : SIM_MIN_SETUP_NS;
+    unsigned nMinHold = argc > 2 ? atoi (argv[2]) : SIM_MIN_HOLD_NS;
+    s_Bus.SetTimingLimit (nMinSetup, nMinHold);
+
+    CSpinbusCalibrator calibrator (&s_Bus, Clock, 0, 1000000000);
+    bool bOK = calibrator.Run ();
+
+    printf ("limits %u/%u ns\n", nMinSetup, nMinHold);
+    for (unsigned i = 0; i < calibrator.GetStepCount (); i++)
+    {
+        const TCalibrationStep &step = calibrator.GetStep (i);
+        printf ("%2u/%2u ns: %3u ns/byte, %7u bytes/s, %4u/%u bit errors%s%s%s\n",
+                step.SetupNs, step.HoldNs, step.PeriodNs, step.BytesPerSecond, step.BitErrors, step.Bits,
+                step.Synchronized ? "" : ", no sync", step.Faulted ? ", FPGA error" : "",
+                &step == calibrator.GetResult () ? "  <- chosen" : "");
+    }
+    if (!bOK)
+    {
+        printf ("no clean setting\n");
+        return 2;
+    }
+    return 0;
+}
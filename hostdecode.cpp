@@ -0,0 +1,171 @@
+//
+// hostdecode.cpp
+//
+// Runs CSpinbusDecoder on the return stream of the simulated bus, with bit
+// errors injected between the two, and reports what resyncs cost:
+//
+//   make hostdecode && ./hostdecode [bytes]
+//
+// Traffic is YM writes across all chips with an invalid command now and then,
+// so error frames are part of the stream. Faults are flipped bits and slips
+// (a return bit dropped or seen twice). The clean run has to decode every
+// error frame without a single slip; the exit code says whether it did.
+//
+#include "spinbussim.h"
+#include "spinbusdecoder.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BAD_COMMAND_EVERY   500     // YM writes between invalid commands
+#define CHANNEL_DELAY       8       // bits the fault channel can hold back
+
+struct TScenario
+{
+    const char *Name;
+    unsigned FlipPer;       // one in this many bits flipped, 0 for none
+    unsigned SlipPer;       // one in this many bits dropped or doubled, 0 for none
+};
+
+static const TScenario s_Scenarios[] =
+{
+    { "clean",          0,      0 },
+    { "flips 1e-4",     10000,  0 },
+    { "slips 1e-4",     0,      10000 },
+    { "flips+slips 1e-3", 1000, 1000 }
+};
+
+/// @brief Bit errors between the FPGA and the decoder.
+class CFaultChannel
+{
+public:
+    CFaultChannel (const TScenario &scenario) : m_Scenario (scenario) {}
+
+    bool Pass (bool bBit)
+    {
+        if (m_Scenario.FlipPer && Random () % m_Scenario.FlipPer == 0)
+            bBit = !bBit;
+
+        if (m_Scenario.SlipPer && Random () % m_Scenario.SlipPer == 0)
+        {
+            if (Random () & 1)
+                Put (bBit);     // seen twice
+            else
+                return Take (); // this one is lost
+        }
+        Put (bBit);
+        return Take ();
+    }
+
+private:
+    u32 Random (void)
+    {
+        m_nSeed ^= m_nSeed << 13;
+        m_nSeed ^= m_nSeed >> 17;
+        m_nSeed ^= m_nSeed << 5;
+        return m_nSeed;
+    }
+
+    void Put (bool bBit)
+    {
+        if (m_nCount < CHANNEL_DELAY)
+            m_Bits[(m_nHead + m_nCount++) % CHANNEL_DELAY] = bBit;
+    }
+
+    bool Take (void)
+    {
+        if (m_nCount == 0)
+            return false;
+        bool bBit = m_Bits[m_nHead];
+        m_nHead = (m_nHead + 1) % CHANNEL_DELAY;
+        m_nCount--;
+        return bBit;
+    }
+
+    const TScenario &m_Scenario;
+    u32 m_nSeed = 0x9e3779b9;
+    bool m_Bits[CHANNEL_DELAY];
+    unsigned m_nHead = 0;
+    unsigned m_nCount = 0;
+};
+
+struct TResult
+{
+    u32 Bytes = 0;
+    u32 Idle = 0;
+    u32 Errors = 0;
+};
+
+/// @return false once an error frame came in; the rest of the command is dropped, as the kernel does.
+static bool Send (CSimSpinbus &bus, CFaultChannel &channel, CSpinbusDecoder &decoder, TResult &result, u8 nByte)
+{
+    TSpinbusEvent event = decoder.Push (channel.Pass (bus.Transfer (nByte)));
+    result.Bytes++;
+    for (unsigned i = 0; decoder.InErrorFrame () && i < SPINBUS_ERROR_FRAME_BITS; i++)
+    {
+        event = decoder.Push (channel.Pass (bus.Transfer (CMD_DEBUG)));
+        result.Bytes++;
+    }
+
+    if (event == SpinbusIdle)
+        result.Idle++;
+    else if (event == SpinbusError)
+        result.Errors++;
+    return event != SpinbusError;
+}
+
+static bool Run (const TScenario &scenario, unsigned nBytes)
+{
+    CSimSpinbus bus;
+    CFaultChannel channel (scenario);
+    CSpinbusDecoder decoder;
+    TResult result;
+
+    while (!decoder.IsAligned ())
+        decoder.Push (channel.Pass (bus.Transfer (CMD_NOP)));
+
+    u32 nWrites = 0;
+    while (result.Bytes < nBytes)
+    {
+        while (!bus.GetSent ())
+            ;
+        u8 chip = nWrites % YM_COUNT;
+        if (++nWrites % BAD_COMMAND_EVERY == 0)
+        {
+            Send (bus, channel, decoder, result, 0x3c);     // unknown command
+            continue;
+        }
+        u8 frame[] = { CMD_YM_REGDATA, (u8) (chip << 1), (u8) (0x30 + nWrites % 0x60), (u8) nWrites };
+        for (u8 nByte : frame)
+        {
+            if (!Send (bus, channel, decoder, result, nByte))
+                break;
+        }
+    }
+
+    const TSpinbusDecoderStats &stats = decoder.GetStats ();
+    u32 nSent = (u32) bus.GetStats ().Errors;
+    double fByteNs = SIM_TRANSFER_NS + bus.GetSetupNs () + bus.GetHoldNs ();
+    double fMeanBits = stats.Resyncs ? (double) stats.LostBits / stats.Resyncs : 0.0;
+
+    printf ("%-18s %9u %6u/%-6u %6u %6u %6u %8.1f %6u %8.2f\n", scenario.Name, result.Bytes, result.Errors, nSent,
+            stats.Slips, stats.Resyncs, stats.LookBacks, fMeanBits, stats.MaxLostBits, fMeanBits * fByteNs / 1000);
+
+    return result.Errors == nSent && stats.Slips == 0;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nBytes = argc > 1 ? atoi (argv[1]) : 1000000;
+
+    printf ("%-18s %9s %13s %6s %6s %6s %8s %6s %8s\n", "scenario", "bytes", "errors", "slips", "resync",
+            "lookbk", "bits/rs", "max", "us/rs");
+    bool bClean = true;
+    for (const TScenario &scenario : s_Scenarios)
+    {
+        bool bPerfect = Run (scenario, nBytes);
+        if (scenario.FlipPer == 0 && scenario.SlipPer == 0)
+            bClean = bPerfect;
+    }
+
+    return bClean ? 0 : 2;
+}
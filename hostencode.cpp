@@ -0,0 +1,100 @@
+//
+// hostencode.cpp
+//
+// Microbenchmark of the GPIO word encoding: TO_DATA_OUT per byte, as
+// CGPIOSpinbus::Transfer used to do, against the g_SpinbusPins lookup it
+// does now:
+//
+//   make hostencode && ./hostencode [seconds]
+//
+// Before the timings, every table entry is checked against the macro; the
+// run fails if any differs.
+//
+#include "spinbusencoder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_COMMANDS  64
+#define BENCH_BYTES     (BENCH_COMMANDS * 4)
+
+static u8 s_Bytes[BENCH_BYTES];
+static TSpinbusWord s_Words[BENCH_BYTES];
+static volatile u32 s_nSink;
+
+static double Seconds (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/// @brief The old path: the shift/mask macro, and the clear word derived from
+/// it the way CGPIOPin::WriteAll does.
+static TSpinbusWord EncodeMacro (u8 nByte)
+{
+    u32 nSet = TO_DATA_OUT(nByte);
+    return { nSet & DATA_MASK, ~nSet & DATA_MASK };
+}
+
+template <typename TFunction>
+static double Run (const char *pName, double fSeconds, TFunction function)
+{
+    u64 nBytes = 0;
+    unsigned nRounds = 0;
+    double fStart = Seconds (), fElapsed;
+    do
+    {
+        for (unsigned i = 0; i < 1000; i++)
+        {
+            function ();
+            s_nSink = s_Words[nRounds++ % BENCH_BYTES].Set;
+            nBytes += BENCH_BYTES;
+        }
+        fElapsed = Seconds () - fStart;
+    } while (fElapsed < fSeconds);
+
+    double fRate = nBytes / fElapsed;
+    printf ("%-8s %8.1f M bytes/s\n", pName, fRate / 1e6);
+    return fRate;
+}
+
+int main (int argc, char **argv)
+{
+    double fSeconds = argc > 1 ? atof (argv[1]) : 1.0;
+
+    // both must produce the same words
+    for (unsigned i = 0; i < 256; i++)
+    {
+        TSpinbusWord word = EncodeMacro (i);
+        if (g_SpinbusPins.Word[i].Set != word.Set || g_SpinbusPins.Word[i].Clear != word.Clear)
+        {
+            fprintf (stderr, "byte %02x differs\n", i);
+            return 1;
+        }
+    }
+
+    // CMD_YM_REGDATA frames, as CSpinbusPump::Write sends them
+    srand (1);
+    for (unsigned i = 0; i < BENCH_COMMANDS; i++)
+    {
+        s_Bytes[i*4] = CMD_YM_REGDATA;
+        s_Bytes[i*4 + 1] = (rand () % YM_COUNT) << 1 | (rand () & 1);
+        s_Bytes[i*4 + 2] = rand () & 0xff;
+        s_Bytes[i*4 + 3] = rand () & 0xff;
+    }
+
+    double fMacro = Run ("macro", fSeconds, [] (void)
+    {
+        for (unsigned i = 0; i < BENCH_BYTES; i++)
+            s_Words[i] = EncodeMacro (s_Bytes[i]);
+    });
+    double fTable = Run ("table", fSeconds, [] (void)
+    {
+        for (unsigned i = 0; i < BENCH_BYTES; i++)
+            s_Words[i] = g_SpinbusPins.Word[s_Bytes[i]];
+    });
+    printf ("table/macro %.2fx\n", fTable / fMacro);
+
+    return 0;
+}
@@ -0,0 +1,207 @@
+//
+// hostfnum.cpp
+//
+// Checks every g_FnumTable entry against the exact equal-tempered pitch and
+// times a note's block/fnum against the computation it replaced:
+//
+//   make hostfnum && ./hostfnum [notes]
+//
+// Each word is decoded back to the frequency the chip plays (undoing
+// YM_TRANSPOSE) and compared with 440 * 2^((step - 69 steps) / 12 semitones)
+// in cents. FnumWord rounds to the nearest fnum, so the stated tolerance of
+// an entry is half an fnum step at its fnum, 1200 * log2(fnum / (fnum - 0.5)),
+// which is under 0.85 cents wherever fnum >= 1024, that is everywhere but
+// the lowest keys of block 0; the run fails if any entry is outside it.
+//
+// The old note setup took the key's frequency from a table of floats, cut it
+// to whole Hz and scaled it to an fnum with float arithmetic, halving it into
+// higher blocks from block 2 with truncation at each step. Its tuning error
+// is shown per octave next to the table's, and both are timed per note.
+//
+#include "fnumtable.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#define KEYS                128
+
+static u64 NowNs (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u32 Random (u32 *pSeed)
+{
+    *pSeed ^= *pSeed << 13;
+    *pSeed ^= *pSeed >> 17;
+    *pSeed ^= *pSeed << 5;
+    return *pSeed;
+}
+
+static volatile u32 s_nSink;
+
+static float s_KeyFrequency[KEYS];
+
+/// @brief The note setup before g_FnumTable.
+static u16 OldKeyToNote (u8 key)
+{
+    u16 frequency = (u16) s_KeyFrequency[key];
+    u16 fnum = (144 * (float) frequency * pow (2, 20) / 7669857) / 8;
+    u8 block = 2;
+    while (fnum >= 2048)
+    {
+        fnum /= 2;
+        block++;
+    }
+    return ((block & 7) << 11) | (fnum & 0x7ff);
+}
+
+/// @return the frequency a block/fnum word plays, before YM_TRANSPOSE.
+static double WordFrequency (u16 word)
+{
+    unsigned block = (word >> 11) & 7;
+    unsigned fnum = word & 0x7ff;
+    return fnum * (double) (1 << block) * YM_CLOCK / (2.0 * YM_SAMPLE_DIV * 1048576.0) / pow (2, YM_TRANSPOSE);
+}
+
+static double ExactFrequency (int step)
+{
+    return 440.0 * pow (2, (step - 69 * FNUM_FINE_STEPS) / (12.0 * FNUM_FINE_STEPS));
+}
+
+static double Cents (double frequency, double exact)
+{
+    return 1200.0 * log2 (frequency / exact);
+}
+
+static bool CheckTable (void)
+{
+    unsigned nOverTolerance = 0, nOverCent = 0, nOverCentUpper = 0;
+    double fMax = 0.0, fMaxUpper = 0.0;
+    int nWorst = 0;
+    for (int step = 0; step < FNUM_TABLE_SIZE; step++)
+    {
+        u16 word = g_FnumTable.Words[step];
+        unsigned fnum = word & 0x7ff;
+        double fCents = fabs (Cents (WordFrequency (word), ExactFrequency (step)));
+        double fTolerance = fnum ? 1200.0 * log2 (fnum / (fnum - 0.5)) + 1e-9 : 0.0;
+        if (fnum == 0 || fCents > fTolerance)
+        {
+            if (nOverTolerance++ < 10)
+                printf ("step %4d: word %04x is %.3f cents off, tolerance %.3f\n", step, word, fCents, fTolerance);
+        }
+        if (fCents > 1.0)
+        {
+            nOverCent++;
+            nOverCentUpper += fnum >= 1024;
+        }
+        if (fCents > fMax)
+        {
+            fMax = fCents;
+            nWorst = step;
+        }
+        if (fnum >= 1024 && fCents > fMaxUpper)
+            fMaxUpper = fCents;
+    }
+
+    printf ("%d entries, %d per semitone\n", FNUM_TABLE_SIZE, FNUM_FINE_STEPS);
+    printf ("largest error %.3f cents at step %d (key %d), %.3f cents where fnum >= 1024\n",
+            fMax, nWorst, nWorst / FNUM_FINE_STEPS, fMaxUpper);
+    printf ("%u entries over 1 cent, %u of them with fnum >= 1024\n", nOverCent, nOverCentUpper);
+    printf ("%-48s %s\n", "every entry within half an fnum step", nOverTolerance ? "FAIL" : "ok");
+    return nOverTolerance == 0;
+}
+
+static void CompareOld (void)
+{
+    printf ("\n%6s %6s %13s %13s %13s %13s\n", "octave", "keys", "table max", "table mean", "before max",
+            "before mean");
+    for (int octave = 0; octave * 12 < KEYS; octave++)
+    {
+        double fMax = 0.0, fTotal = 0.0, fOldMax = 0.0, fOldTotal = 0.0;
+        int nKeys = 0;
+        for (int key = octave * 12; key < KEYS && key < (octave + 1) * 12; key++, nKeys++)
+        {
+            double exact = ExactFrequency (key * FNUM_FINE_STEPS);
+            double fCents = fabs (Cents (WordFrequency (YMKeyToNote (key)), exact));
+            u16 old = OldKeyToNote (key);
+            double fOld = old & 0x7ff ? fabs (Cents (WordFrequency (old), exact)) : 1200.0;
+            fTotal += fCents;
+            fOldTotal += fOld;
+            if (fCents > fMax)
+                fMax = fCents;
+            if (fOld > fOldMax)
+                fOldMax = fOld;
+        }
+        printf ("%6d %3d-%-3d %13.2f %13.2f %13.2f %13.2f\n", octave - 1, octave * 12, octave * 12 + nKeys - 1,
+                fMax, fTotal / nKeys, fOldMax, fOldTotal / nKeys);
+    }
+}
+
+static double BenchOld (const std::vector<u8> &keys, unsigned nRounds)
+{
+    u32 nSum = 0;
+    u64 nStart = NowNs ();
+    for (unsigned r = 0; r < nRounds; r++)
+    {
+        for (u8 key : keys)
+            nSum += OldKeyToNote (key);
+    }
+    u64 nTime = NowNs () - nStart;
+    s_nSink = nSum;
+    return (double) nTime / ((double) nRounds * keys.size ());
+}
+
+static double BenchTable (const std::vector<u8> &keys, const std::vector<int> &bends, unsigned nRounds)
+{
+    u32 nSum = 0;
+    u64 nStart = NowNs ();
+    for (unsigned r = 0; r < nRounds; r++)
+    {
+        for (size_t i = 0; i < keys.size (); i++)
+            nSum += YMKeyToNote (keys[i], YMBendToFine (bends[i]));
+    }
+    u64 nTime = NowNs () - nStart;
+    s_nSink = nSum;
+    return (double) nTime / ((double) nRounds * keys.size ());
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nNotes = argc > 1 ? atoi (argv[1]) : 20000000;
+    if (nNotes == 0)
+    {
+        fprintf (stderr, "notes must be positive\n");
+        return 1;
+    }
+
+    for (int key = 0; key < KEYS; key++)
+        s_KeyFrequency[key] = (float) (440.0 * pow (2, (key - 69) / 12.0));
+
+    if (!CheckTable ())
+        return 2;
+    CompareOld ();
+
+    const unsigned nPerRound = 100000;
+    unsigned nRounds = (nNotes + nPerRound - 1) / nPerRound;
+    std::vector<u8> keys;
+    std::vector<int> bends, noBends (nPerRound, 0);
+    u32 nSeed = 0x2545f491;
+    for (unsigned n = 0; n < nPerRound; n++)
+    {
+        keys.push_back (Random (&nSeed) % KEYS);
+        bends.push_back ((int) (Random (&nSeed) % 16384) - 8192);
+    }
+
+    printf ("\n%u notes\n", nRounds * nPerRound);
+    printf ("%-32s %8s\n", "note setup", "ns/note");
+    printf ("%-32s %8.2f\n", "before (float, whole Hz)", BenchOld (keys, nRounds));
+    printf ("%-32s %8.2f\n", "table", BenchTable (keys, noBends, nRounds));
+    printf ("%-32s %8.2f\n", "table with pitch bend", BenchTable (keys, bends, nRounds));
+
+    return 0;
+}
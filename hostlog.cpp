@@ -0,0 +1,104 @@
+//
+// hostlog.cpp
+//
+// What a log call costs the bus loop, deferred (CDeferredLog::Write) against
+// formatting the line on the spot:
+//
+//   make hostlog && ./hostlog [calls]
+//
+// The synchronous figure is snprintf alone, a lower bound: on the target
+// CLogger also copies the line into its buffer and out to the screen and the
+// serial port, which the last column estimates for the serial port only.
+// A second run has a producer thread log flat out while a consumer thread
+// reads and formats, to show the ring dropping rather than blocking.
+//
+#include "deferredlog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+
+#define SERIAL_BAUD     3000000     // kernel.h
+
+static u64 NowNs (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static volatile u32 s_nSink;
+
+int main (int argc, char **argv)
+{
+    unsigned nCalls = argc > 1 ? atoi (argv[1]) : 10000000;
+
+    // deferred: LOG_RING_SIZE / 2 writes at a time, read back outside the timed part
+    static CDeferredLog log;
+    char line[LOG_LINE_SIZE];
+    TLogSeverity severity;
+    u64 nWriteNs = 0, nReadNs = 0;
+    unsigned nLines = 0, nLineBytes = 0;
+    for (unsigned i = 0; i < nCalls; )
+    {
+        u64 nStart = NowNs ();
+        for (unsigned n = 0; n < LOG_RING_SIZE / 2 && i < nCalls; n++, i++)
+            log.Write (MsgQueueLimit, 1000, i % YM_COUNT, 0x30 + (i & 0x3f), i & 0xff);
+        u64 nMiddle = NowNs ();
+        while (log.Read (line, sizeof line, &severity))
+        {
+            nLines++;
+            nLineBytes += strlen (line) + 2;
+        }
+        nWriteNs += nMiddle - nStart;
+        nReadNs += NowNs () - nMiddle;
+    }
+
+    // synchronous: the same line formatted at the call
+    u64 nStart = NowNs ();
+    for (unsigned i = 0; i < nCalls; i++)
+    {
+        snprintf (line, sizeof line, "Hit queue limit (%u) for chip %u (addr %02X data %02X)",
+                  1000, i % YM_COUNT, 0x30 + (i & 0x3f), i & 0xff);
+        s_nSink += line[0];
+    }
+    u64 nFormatNs = NowNs () - nStart;
+
+    double fLineBytes = nLines ? (double) nLineBytes / nLines : 0.0;
+    printf ("%-22s %10s %12s\n", "per log call", "ns", "on the bus");
+    printf ("%-22s %10.1f %12s\n", "deferred write", (double) nWriteNs / nCalls, "yes");
+    printf ("%-22s %10.1f %12s\n", "deferred read+format", (double) nReadNs / nCalls, "no");
+    printf ("%-22s %10.1f %12s\n", "synchronous snprintf", (double) nFormatNs / nCalls, "yes");
+    printf ("%-22s %10.1f %12s\n", "+ serial out (est.)", fLineBytes * 10 * 1e9 / SERIAL_BAUD, "yes");
+    printf ("%u lines, %u dropped\n", nLines, log.GetDropped ());
+
+    // two threads: the producer never waits, the ring drops what the consumer can't keep up with
+    static CDeferredLog shared;
+    std::atomic<bool> bDone {false};
+    unsigned nRead = 0;
+    std::thread consumer ([&] {
+        char buffer[LOG_LINE_SIZE];
+        TLogSeverity eSeverity;
+        for (;;)
+        {
+            bool bFinished = bDone.load ();
+            while (shared.Read (buffer, sizeof buffer, &eSeverity))
+                nRead++;
+            if (bFinished)
+                break;
+        }
+    });
+    nStart = NowNs ();
+    for (unsigned i = 0; i < nCalls; i++)
+        shared.Write (MsgSpinbusError, 0xf9, 2, CMD_YM_REGDATA, i & 0xff);
+    u64 nProducerNs = NowNs () - nStart;
+    bDone = true;
+    consumer.join ();
+
+    printf ("threaded: %.1f ns per write, %u read, %u dropped, %u lost\n", (double) nProducerNs / nCalls,
+            nRead, shared.GetDropped (), nCalls - nRead - shared.GetDropped ());
+
+    return nCalls == nRead + shared.GetDropped () ? 0 : 2;
+}
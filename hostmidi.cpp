@@ -0,0 +1,428 @@
+//
+// hostmidi.cpp
+//
+// Fuzz test and throughput benchmark for CMIDIParser:
+//
+//   make hostmidi && ./hostmidi [fuzz rounds]
+//
+// The fuzz part encodes random channel messages as a byte stream (running
+// status where it applies, real-time bytes dropped in anywhere, SysEx and
+// system common messages in between), cuts the stream into random pieces,
+// and checks the parser gives back exactly the messages that went in; the
+// same again as USB-MIDI event packets, taken apart as CUSBMIDIDevice does
+// before the kernel sees them: the MIDI bytes of each packet, one call each.
+// Random garbage then has to come out as well-formed messages only.
+//
+// The benchmark parses 64-byte buffers (a full-speed bulk packet) of dense
+// note traffic into an SPSC ring the size of the kernel's note ring, batched
+// as MIDIPacketHandler does and with a ring push per message, and the same
+// notes as USB-MIDI packets the way the kernel gets them under Circle, a
+// call and a commit per packet. For comparison, the old handler is given
+// the same buffers (it takes the first message of each) and the messages
+// split out one call each, which is as fast as it gets.
+//
+#include "midiparser.h"
+#include "spscring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#define NOTE_QUEUE_SIZE     256     // kernel.h
+#define USB_BUFFER_SIZE     64
+#define USB_PACKET_SIZE     4       // cable and code index, then up to 3 MIDI bytes
+
+/// @brief MIDI bytes in a USB-MIDI event packet by code index (USB MIDI 1.0, table 4-1).
+static const unsigned s_PacketLength[16] = { 0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1 };
+
+static u32 s_nSeed = 0x1b873593;
+
+static u32 Random (void)
+{
+    s_nSeed ^= s_nSeed << 13;
+    s_nSeed ^= s_nSeed >> 17;
+    s_nSeed ^= s_nSeed << 5;
+    return s_nSeed;
+}
+
+static u64 NowNs (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static TMIDIMessage RandomMessage (void)
+{
+    TMIDIMessage message;
+    message.Status = 0x80 + Random () % 0x70;
+    message.Data[0] = Random () & 0x7f;
+    message.Data[1] = CMIDIParser::GetDataLength (message.Status) > 1 ? Random () & 0x7f : 0;
+    return message;
+}
+
+static void Collect (void *pParam, const TMIDIMessage &message)
+{
+    ((std::vector<TMIDIMessage> *) pParam)->push_back (message);
+}
+
+/// @brief As CUSBMIDIDevice hands a buffer of event packets to the kernel's packet handler.
+/// @return the number of messages handed to pHandler.
+static unsigned ParseUSB (CMIDIParser *pParser, const u8 *pPackets, unsigned nLength, TMIDIMessageHandler *pHandler,
+                          void *pParam)
+{
+    unsigned nMessages = 0;
+    for (unsigned n = 0; n + USB_PACKET_SIZE <= nLength; n += USB_PACKET_SIZE)
+        nMessages += pParser->Parse (pPackets + n + 1, s_PacketLength[pPackets[n] & 0x0f], pHandler, pParam);
+    return nMessages;
+}
+
+static bool Same (const std::vector<TMIDIMessage> &in, const std::vector<TMIDIMessage> &out)
+{
+    if (in.size () != out.size ())
+        return false;
+    for (size_t i = 0; i < in.size (); i++)
+    {
+        if (   in[i].Status != out[i].Status
+            || in[i].Data[0] != out[i].Data[0]
+            || in[i].Data[1] != out[i].Data[1])
+            return false;
+    }
+    return true;
+}
+
+/// @brief A real-time byte one time in eight.
+static void MaybeRealtime (std::vector<u8> &stream)
+{
+    if (Random () % 8 == 0)
+        stream.push_back (MIDI_STATUS_REALTIME + Random () % 8);
+}
+
+static bool FuzzStream (unsigned nMessages)
+{
+    std::vector<TMIDIMessage> in;
+    std::vector<u8> stream;
+    u8 nRunning = 0;
+    for (unsigned i = 0; i < nMessages; i++)
+    {
+        switch (Random () % 16)
+        {
+        case 0:     // SysEx
+            stream.push_back (MIDI_STATUS_SYSEX);
+            for (unsigned n = Random () % 20; n > 0; n--)
+            {
+                stream.push_back (Random () & 0x7f);
+                MaybeRealtime (stream);
+            }
+            stream.push_back (MIDI_STATUS_SYSEX_END);
+            nRunning = 0;
+            break;
+        case 1:     // system common: MTC quarter frame, song position, song select, tune request
+            {
+                static const u8 s_Common[] = { 0xf1, 0xf2, 0xf3, 0xf6 };
+                static const u8 s_Length[] = { 1, 2, 1, 0 };
+                unsigned n = Random () % 4;
+                stream.push_back (s_Common[n]);
+                for (unsigned j = 0; j < s_Length[n]; j++)
+                    stream.push_back (Random () & 0x7f);
+                nRunning = 0;
+            }
+            break;
+        default:
+            break;
+        }
+
+        TMIDIMessage message = RandomMessage ();
+        // reuse the last status half the time, so runs build up
+        if (nRunning && Random () % 2)
+        {
+            message.Status = nRunning;
+            if (CMIDIParser::GetDataLength (message.Status) < 2)
+                message.Data[1] = 0;
+        }
+        in.push_back (message);
+        if (message.Status != nRunning || Random () % 4 == 0)
+            stream.push_back (message.Status);
+        nRunning = message.Status;
+        MaybeRealtime (stream);
+        stream.push_back (message.Data[0]);
+        if (CMIDIParser::GetDataLength (message.Status) > 1)
+        {
+            MaybeRealtime (stream);
+            stream.push_back (message.Data[1]);
+        }
+    }
+
+    CMIDIParser parser;
+    std::vector<TMIDIMessage> out;
+    for (size_t nPos = 0; nPos < stream.size (); )
+    {
+        unsigned nChunk = 1 + Random () % 80;
+        if (nChunk > stream.size () - nPos)
+            nChunk = stream.size () - nPos;
+        parser.Parse (&stream[nPos], nChunk, Collect, &out);
+        nPos += nChunk;
+    }
+    return Same (in, out) && parser.GetErrors () == 0;
+}
+
+static void Packet (std::vector<u8> &packets, u8 nCIN, u8 b0, u8 b1, u8 b2)
+{
+    packets.push_back ((Random () % 16) << 4 | nCIN);
+    packets.push_back (b0);
+    packets.push_back (b1);
+    packets.push_back (b2);
+}
+
+static bool FuzzPackets (unsigned nMessages)
+{
+    std::vector<TMIDIMessage> in;
+    std::vector<u8> packets;
+    for (unsigned i = 0; i < nMessages; i++)
+    {
+        switch (Random () % 8)
+        {
+        case 0:     // SysEx: start/continue, then end with 1-3 bytes
+            Packet (packets, 0x4, MIDI_STATUS_SYSEX, Random () & 0x7f, Random () & 0x7f);
+            switch (Random () % 3)
+            {
+            case 0: Packet (packets, 0x5, MIDI_STATUS_SYSEX_END, 0, 0); break;
+            case 1: Packet (packets, 0x6, Random () & 0x7f, MIDI_STATUS_SYSEX_END, 0); break;
+            case 2: Packet (packets, 0x7, Random () & 0x7f, Random () & 0x7f, MIDI_STATUS_SYSEX_END); break;
+            }
+            break;
+        case 1:     // song position
+            Packet (packets, 0x3, 0xf2, Random () & 0x7f, Random () & 0x7f);
+            break;
+        case 2:     // timing clock as a single byte
+            Packet (packets, 0xf, MIDI_STATUS_REALTIME, 0, 0);
+            break;
+        default:
+            break;
+        }
+
+        TMIDIMessage message = RandomMessage ();
+        in.push_back (message);
+        Packet (packets, message.Status >> 4, message.Status, message.Data[0], message.Data[1]);
+    }
+
+    CMIDIParser parser;
+    std::vector<TMIDIMessage> out;
+    for (size_t nPos = 0; nPos < packets.size (); )
+    {
+        unsigned nChunk = USB_PACKET_SIZE * (1 + Random () % 16);
+        if (nChunk > packets.size () - nPos)
+            nChunk = packets.size () - nPos;
+        ParseUSB (&parser, &packets[nPos], nChunk, Collect, &out);
+        nPos += nChunk;
+    }
+    return Same (in, out) && parser.GetErrors () == 0;
+}
+
+static bool WellFormed (const std::vector<TMIDIMessage> &out)
+{
+    for (const TMIDIMessage &message : out)
+    {
+        if (   message.Status < 0x80 || message.Status >= MIDI_STATUS_SYSEX
+            || message.Data[0] >= 0x80 || message.Data[1] >= 0x80
+            || (CMIDIParser::GetDataLength (message.Status) < 2 && message.Data[1] != 0))
+            return false;
+    }
+    return true;
+}
+
+static bool FuzzGarbage (unsigned nBytes)
+{
+    std::vector<u8> garbage (nBytes);
+    for (u8 &nByte : garbage)
+        nByte = Random ();
+
+    CMIDIParser parser, usb;
+    std::vector<TMIDIMessage> stream, packets;
+    parser.Parse (garbage.data (), nBytes, Collect, &stream);
+    ParseUSB (&usb, garbage.data (), nBytes, Collect, &packets);
+    return WellFormed (stream) && WellFormed (packets) && stream.size () <= nBytes && packets.size () <= nBytes;
+}
+
+// what MIDIPacketHandler turns a message into
+struct TNote
+{
+    u8 Event;
+    u8 Channel;
+    u8 KeyNumber;
+    u8 Velocity;
+    u8 Patch;
+    s16 Bend;
+    u64 Timestamp;
+    u32 Arrival;
+};
+
+struct TBatch
+{
+    unsigned Count;
+    unsigned Free;
+    unsigned Dropped;
+    CSPSCRing<TNote, NOTE_QUEUE_SIZE> *pRing;
+};
+
+static TNote Convert (u8 nStatus, u8 nData0, u8 nData1)
+{
+    return { (u8) (nStatus >> 4 == 0x9 && nData1), (u8) (nStatus & 0x0f), nData0, nData1, 0, 0, 0, 0 };
+}
+
+/// @brief As CKernel::MIDIMessageHandler: the note is built in its ring slot.
+static void BatchHandler (void *pParam, const TMIDIMessage &message)
+{
+    TBatch *pBatch = (TBatch *) pParam;
+    if (pBatch->Count < pBatch->Free)
+        pBatch->pRing->GetSlot (pBatch->Count++) = Convert (message.Status, message.Data[0], message.Data[1]);
+    else
+        pBatch->Dropped++;
+}
+
+static void PushHandler (void *pParam, const TMIDIMessage &message)
+{
+    ((CSPSCRing<TNote, NOTE_QUEUE_SIZE> *) pParam)->Push (Convert (message.Status, message.Data[0], message.Data[1]));
+}
+
+/// @brief The old MIDIPacketHandler: one call per message, three bytes looked at.
+static void __attribute__ ((noinline)) OldHandler (CSPSCRing<TNote, NOTE_QUEUE_SIZE> *pRing, const u8 *pPacket, unsigned nLength)
+{
+    if (nLength < 3)
+        return;
+    pRing->Push (Convert (pPacket[0], pPacket[1], pPacket[2]));
+}
+
+enum TBenchCase
+{
+    BenchStreamBatched,
+    BenchStreamSingle,
+    BenchPackets,
+    BenchOldBuffer,
+    BenchOldSplit,
+    BenchCount
+};
+
+static const char *const s_BenchName[BenchCount] =
+{
+    "stream, batched push",
+    "stream, push per message",
+    "USB-MIDI packets, call per packet",
+    "old handler, stream buffer",
+    "old handler, split by the USB layer"
+};
+
+struct TBench
+{
+    u64 Ns;
+    unsigned Messages;
+    unsigned Bytes;
+    unsigned Delivered;
+};
+
+int main (int argc, char **argv)
+{
+    unsigned nRounds = argc > 1 ? atoi (argv[1]) : 2000;
+
+    unsigned nFailures = 0;
+    for (unsigned i = 0; i < nRounds; i++)
+    {
+        if (!FuzzStream (1 + Random () % 200))
+            nFailures++;
+        if (!FuzzPackets (1 + Random () % 200))
+            nFailures++;
+        if (!FuzzGarbage (1 + Random () % 1000))
+            nFailures++;
+    }
+    printf ("fuzz: %u rounds, %u failures\n", nRounds, nFailures);
+
+    // dense chords: note on and off pairs on one channel, each buffer a status byte,
+    // 31 messages in running status and a timing clock to fill it up
+    std::vector<u8> stream, packets;
+    unsigned nStreamMessages = 0;
+    for (unsigned i = 0; i < 1 << 20; i++)
+    {
+        u8 nKey = 36 + i % 48;
+        u8 nVelocity = i & 1 ? 0 : 0x64;
+        if (stream.size () % USB_BUFFER_SIZE == 0)
+            stream.push_back (0x90);
+        stream.push_back (nKey);
+        stream.push_back (nVelocity);
+        if (stream.size () % USB_BUFFER_SIZE == USB_BUFFER_SIZE - 1)
+            stream.push_back (MIDI_STATUS_REALTIME);
+        Packet (packets, 0x9, 0x90, nKey, nVelocity);
+        nStreamMessages++;
+    }
+    nStreamMessages -= nStreamMessages % (USB_BUFFER_SIZE / 2 - 1);
+    stream.resize (nStreamMessages / (USB_BUFFER_SIZE / 2 - 1) * USB_BUFFER_SIZE);
+    unsigned nPacketMessages = packets.size () / USB_PACKET_SIZE;
+
+    static CSPSCRing<TNote, NOTE_QUEUE_SIZE> ring;
+    static CMIDIParser parser;
+    TBatch batch;
+    batch.pRing = &ring;
+    TBench bench[BenchCount] = {};
+
+    for (unsigned b = 0; b < BenchCount; b++)
+    {
+        bool bPackets = b == BenchPackets || b == BenchOldSplit;
+        const std::vector<u8> &input = bPackets ? packets : stream;
+        bench[b].Messages = bPackets ? nPacketMessages : nStreamMessages;
+        bench[b].Bytes = input.size ();
+
+        u64 nStart = NowNs ();
+        for (size_t nPos = 0; nPos < input.size (); nPos += USB_BUFFER_SIZE)
+        {
+            const u8 *pBuffer = &input[nPos];
+            batch.Count = 0;
+            batch.Free = ring.GetFree ();
+            batch.Dropped = 0;
+            switch (b)
+            {
+            case BenchStreamBatched:
+                parser.Parse (pBuffer, USB_BUFFER_SIZE, BatchHandler, &batch);
+                break;
+            case BenchStreamSingle:
+                parser.Parse (pBuffer, USB_BUFFER_SIZE, PushHandler, &ring);
+                break;
+            case BenchPackets:
+                // a batch of one packet's messages each, as MIDIPacketHandler is called
+                for (unsigned n = 0; n < USB_BUFFER_SIZE; n += USB_PACKET_SIZE)
+                {
+                    batch.Count = 0;
+                    batch.Free = ring.GetFree ();
+                    parser.Parse (pBuffer + n + 1, s_PacketLength[pBuffer[n] & 0x0f], BatchHandler, &batch);
+                    ring.Commit (batch.Count, batch.Dropped);
+                    batch.Dropped = 0;
+                }
+                batch.Count = 0;
+                break;
+            case BenchOldBuffer:
+                OldHandler (&ring, pBuffer, USB_BUFFER_SIZE);
+                break;
+            case BenchOldSplit:
+                for (unsigned n = 0; n < USB_BUFFER_SIZE; n += USB_PACKET_SIZE)
+                    OldHandler (&ring, pBuffer + n + 1, 3);
+                break;
+            }
+            ring.Commit (batch.Count, batch.Dropped);
+            TNote note;
+            while (ring.Pop (note))
+                bench[b].Delivered++;
+        }
+        bench[b].Ns = NowNs () - nStart;
+    }
+
+    printf ("%-36s %8s %12s %8s %10s\n", "64-byte buffers of note on/off", "ns/msg", "messages/s", "MB/s", "delivered");
+    for (unsigned b = 0; b < BenchCount; b++)
+    {
+        printf ("%-36s %8.2f %12.0f %8.1f %9.1f%%\n", s_BenchName[b], (double) bench[b].Ns / bench[b].Messages,
+                bench[b].Messages * 1e9 / bench[b].Ns, bench[b].Bytes * 1e3 / bench[b].Ns,
+                100.0 * bench[b].Delivered / bench[b].Messages);
+    }
+    printf ("%u ring overflows, %u parse errors\n", ring.GetOverflows (), parser.GetErrors ());
+
+    bool bComplete = bench[BenchStreamBatched].Delivered == nStreamMessages
+                  && bench[BenchPackets].Delivered == nPacketMessages;
+    return nFailures == 0 && bComplete && ring.GetOverflows () == 0 && parser.GetErrors () == 0 ? 0 : 2;
+}
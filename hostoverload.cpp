@@ -0,0 +1,490 @@
+//
+// hostoverload.cpp
+//
+// Each COverloadControl policy under twice the load the simulated Spinbus
+// can carry:
+//
+//   make hostoverload && ./hostoverload [seconds]
+//
+// The capacity is measured first, as the writes per second that get out
+// with every chip's queue full. The load is then notes worth 1.5 times that
+// (note on with a patch load when the voice doesn't hold it, note off half
+// a millisecond later) over the voice chips, and a VGM-like stream worth
+// another half over the last quarter of the chips, which the voices leave
+// alone as they leave the VGM players' chips alone on the target. Notes go
+// through a NOTE_QUEUE_SIZE ring as on the target, which loses what doesn't
+// fit, and are taken off it the way CKernel::NoteIntake does: while intake
+// is held or a reset is under way note ons wait in a second ring and note
+// offs cancel them or go out at once. The run fails if a note off is lost
+// or a key is left sounding after its note off.
+//
+// The reset policy models the kernel's old reaction: the queues go, the bus
+// sits idle for a second, every chip is prepared again with patch 0. The
+// queues and the pump are the kernel's CSpinbusPump with bursts. Latency runs
+// from a note arriving on the ring to the end of the pump pass that got its
+// key on to the chip.
+//
+#include "spinbussim.h"
+#include "spinbuspump.h"
+#include "voiceallocator.h"
+#include "fnumtable.h"
+#include "patches.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#define NOTE_QUEUE_SIZE     256             // kernel.h
+#define RESET_DELAY_NS      1000000000      // the old reset path's MsDelay (1000)
+#define VGM_CHIPS           (YM_COUNT / 4)
+#define VOICE_CHIPS         (YM_COUNT - VGM_CHIPS)
+#define NOTE_LENGTH_NS      500000
+#define KEY_COUNT           VOICE_KEYS
+#define STREAM_KEY_EVERY    8               // a key on or off among the stream's writes this often
+
+static const u8 s_KeyChannel[YM_CHANNELS] = { 0, 1, 2, 4, 5, 6 };
+
+struct TNote
+{
+    bool On;
+    u8 Key;
+    u8 Patch;
+    u8 Velocity;
+    u64 Arrival;
+};
+
+struct TResult
+{
+    double Offered;         // writes/s generated
+    double Delivered;       // writes/s sent
+    double NotesOffered;    // note ons/s arriving
+    double NotesPlayed;     // key ons/s reaching a chip
+    unsigned NotesLost;     // note ons the rings couldn't take
+    unsigned OffsLost;      // note offs the ring couldn't take
+    unsigned Stuck;         // keys still on a voice after their note off
+    double LatencyMean;     // us
+    double LatencyP99;
+    unsigned Dropped;
+    unsigned Resets;
+    unsigned Episodes;
+    unsigned MaxDepth;
+};
+
+class CHarness
+{
+public:
+    CHarness (TOverloadPolicy ePolicy)
+    :   m_Overload (ePolicy),
+        m_Pump (&m_Bus, &m_Overload, &m_Stats, &m_Log, PumpClock, this)
+    {
+        m_Pump.SetBurst (true);
+        m_Overload.SetVoiceChips (BIT(VOICE_CHIPS) - 1);
+        Reset ();
+    }
+
+    /// @return writes per second the bus gets out with every queue full.
+    double Capacity (void)
+    {
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            for (unsigned n = 0; n < QUEUE_SIZE_LIMIT * 3 / 4; n++)
+                m_Pump.GetQueue (chip).Push (YMCommand (n / YM_BURST_MAX & 1, 0x50 + n % 0x50, n), 0);
+        }
+        u64 nStart = m_Bus.GetTime ();
+        u64 nSent = Sent ();
+        while (Pending ())
+            Pump ();
+        return (Sent () - nSent) * 1e9 / (m_Bus.GetTime () - nStart);
+    }
+
+    /// @param nNoteNs interval between note ons, 0 for none.
+    /// @param nStreamNs interval between stream writes, 0 for none.
+    TResult Run (u64 nDurationNs, u64 nNoteNs, u64 nStreamNs)
+    {
+        u64 nStart = m_Bus.GetTime ();
+        u64 nEnd = nStart + nDurationNs;
+        u64 nNextNote = nStart, nNextStream = nStart;
+        u64 nOffered = m_nOffered, nSent = Sent ();
+        unsigned nNotes = 0, nStream = 0;
+        u8 nVGMChip = VOICE_CHIPS;
+
+        while (m_Bus.GetTime () < nEnd)
+        {
+            u64 nNow = m_Bus.GetTime ();
+
+            // MIDI side: note offs as they come due, note ons at the set rate
+            for (unsigned key = 0; key < KEY_COUNT; key++)
+            {
+                if (m_OffAt[key] && m_OffAt[key] <= nNow)
+                {
+                    m_OffAt[key] = 0;
+                    Arrive ({false, (u8) key, 0, 0, nNow});
+                }
+            }
+            while (nNoteNs && nNextNote <= nNow)
+            {
+                nNextNote += nNoteNs;
+                unsigned key = Random () % KEY_COUNT;
+                for (unsigned n = 0; n < KEY_COUNT && m_OffAt[key]; n++)
+                    key = (key + 1) % KEY_COUNT;
+                if (m_OffAt[key])
+                    continue;   // every key held
+                m_OffAt[key] = nNow + NOTE_LENGTH_NS;
+                Arrive ({true, (u8) key, (u8) (Random () % g_nPatches), (u8) (0x60 + Random () % 0x20), nNow});
+                nNotes++;
+            }
+
+            if (m_nResumeAt)
+            {
+                if (nNow < m_nResumeAt)
+                {
+                    Dispatch (false);
+                    m_Bus.Advance (1000);
+                    continue;
+                }
+                m_nResumeAt = 0;
+                PrepareAll ();
+            }
+
+            Dispatch (true);
+
+            while (nStreamNs && nNextStream <= nNow)
+            {
+                nNextStream += nStreamNs;
+                u32 nRandom = Random ();
+                // key writes are ordering barriers, so the stream can't all be coalesced away
+                if (++nStream % STREAM_KEY_EVERY == 0)
+                    Enqueue (nVGMChip, 0, YM_REG_KEY_ON, (nRandom & 0xf0) | s_KeyChannel[(nRandom >> 8) % YM_CHANNELS]);
+                else
+                    Enqueue (nVGMChip, nRandom & 1, 0x50 + (nRandom >> 1) % 0x50, nRandom >> 8);
+                if (++nVGMChip == YM_COUNT)
+                    nVGMChip = VOICE_CHIPS;
+            }
+
+            if (Pending () && !m_nResumeAt)
+                Pump ();
+            else
+                m_Bus.Advance (1000);
+        }
+
+        double fSeconds = (m_Bus.GetTime () - nStart) / 1e9;
+        TResult result = {};
+        result.Offered = (m_nOffered - nOffered) / fSeconds;
+        result.Delivered = (Sent () - nSent) / fSeconds;
+        result.NotesOffered = nNotes / fSeconds;
+        result.NotesPlayed = m_Latency.size () / fSeconds;
+        result.NotesLost = m_nNotesLost;
+        result.OffsLost = m_nOffsLost;
+        for (u16 voice = 0; voice < m_Voices.GetVoiceCount (); voice++)
+        {
+            u8 key = m_Voices.GetKey (voice);
+            if (key != VOICE_KEY_NONE && !m_OffAt[key])
+                result.Stuck++;
+        }
+        if (!m_Latency.empty ())
+        {
+            double fTotal = 0;
+            for (u32 nLatency : m_Latency)
+                fTotal += nLatency;
+            result.LatencyMean = fTotal / m_Latency.size ();
+            std::sort (m_Latency.begin (), m_Latency.end ());
+            result.LatencyP99 = m_Latency[m_Latency.size () * 99 / 100];
+        }
+        result.Resets = m_nResets;
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            const TOverloadStats &stats = m_Overload.GetStats (chip);
+            result.Dropped += stats.Dropped;
+            result.Episodes += stats.Episodes;
+            result.MaxDepth = std::max<unsigned> (result.MaxDepth, stats.MaxDepth);
+        }
+        return result;
+    }
+
+private:
+    static u32 Random (void)
+    {
+        static u32 s_nSeed = 0x6c8e9cf5;
+        s_nSeed ^= s_nSeed << 13;
+        s_nSeed ^= s_nSeed >> 17;
+        s_nSeed ^= s_nSeed << 5;
+        return s_nSeed;
+    }
+
+    void Arrive (const TNote &note)
+    {
+        if (!m_Notes.full ())
+            m_Notes.push (note);
+        else if (note.On)
+            m_nNotesLost++;
+        else
+            m_nOffsLost++;
+    }
+
+    /// @brief CKernel::NoteIntake without the scheduler.
+    /// @param bPlay false while a reset is under way.
+    void Dispatch (bool bPlay)
+    {
+        u32 nLostChips = m_Overload.TakeLostChips ();
+        for (u8 chip = 0; chip < VOICE_CHIPS; chip++)
+        {
+            if (!(nLostChips & BIT(chip)))
+                continue;
+            u8 lost = m_Overload.TakeLostChannels (chip);
+            for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+            {
+                if (lost & BIT(channel))
+                    m_Voices.SetPatch (chip*YM_CHANNELS + channel, PATCH_NONE);
+            }
+        }
+
+        while (bPlay && !m_nResumeAt && !m_Held.empty () && !m_Overload.HoldIntake ())
+        {
+            NoteOn (m_Held.front ());
+            m_Held.pop ();
+        }
+
+        while (!m_Notes.empty ())
+        {
+            TNote note = m_Notes.front ();
+            m_Notes.pop ();
+            bool bPlaying = bPlay && !m_nResumeAt;
+            if (note.On)
+            {
+                if (bPlaying && m_Held.empty () && !m_Overload.HoldIntake ())
+                    NoteOn (note);
+                else if (!m_Held.full ())
+                    m_Held.push (note);
+                else
+                    m_nNotesLost++;
+                continue;
+            }
+
+            for (unsigned nCount = m_Held.size (); nCount > 0; nCount--)
+            {
+                TNote held = m_Held.front ();
+                m_Held.pop ();
+                if (held.Key != note.Key)
+                    m_Held.push (held);
+            }
+            // a reset keys every channel off and frees every voice
+            if (!bPlaying)
+                continue;
+            u16 voice = m_Voices.NoteOff (note.Key);
+            if (voice != VOICE_NONE)
+                KeyOff (voice / YM_CHANNELS, voice % YM_CHANNELS);
+        }
+    }
+
+    void NoteOn (const TNote &note)
+    {
+        u32 avoid = m_Overload.GetAvoidMask ();
+        TVoiceAllocation voice = m_Voices.NoteOn (note.Key, note.Patch, avoid,
+                                                  m_Overload.GetPolicy () == OverloadStealVoices);
+        u8 chip = voice.Voice / YM_CHANNELS;
+        u8 channel = voice.Voice % YM_CHANNELS;
+        if (avoid)
+            m_Overload.Placed (chip, avoid);
+        if (voice.Stolen || voice.Retrigger)
+            KeyOff (chip, channel);
+        if (m_Voices.GetPatch (voice.Voice) != note.Patch)
+            Prepare (chip, channel, note.Patch);
+        KeyOn (chip, channel, note);
+    }
+
+    void Enqueue (u8 chip, bool bank, u8 address, u8 data)
+    {
+        m_nOffered++;
+        if (m_nResumeAt)
+            return;
+        m_Pump.Enqueue (chip, YMCommand (bank, address, data));
+        if (m_Pump.IsResetRequested ())
+        {
+            m_Pump.ClearResetRequest ();
+            m_nResets++;
+            m_nResumeAt = m_Bus.GetTime () + RESET_DELAY_NS;
+            Reset ();
+        }
+    }
+
+    /// @brief Same writes as CKernel::YMPrepare.
+    void Prepare (u8 chip, u8 channelIdx, u8 patchId)
+    {
+        bool bank = channelIdx > 2;
+        u8 chMod = channelIdx % 3;
+        const YMPatch &patch = g_Patches[patchId];
+
+        Enqueue (chip, 0, YM_REG_KEY_ON, bank ? channelIdx + 1 : channelIdx);
+        for (u8 op = 0; op < 4; op++)
+        {
+            u8 opMod = chMod + op*4;
+            Enqueue (chip, bank, 0x30+opMod, patch.DetuneMultiply[op]);
+            Enqueue (chip, bank, 0x40+opMod, patch.TotalLevel[op]);
+            Enqueue (chip, bank, 0x50+opMod, patch.AttackRate[op]);
+            Enqueue (chip, bank, 0x60+opMod, patch.DecayRate[op]);
+            Enqueue (chip, bank, 0x70+opMod, patch.SustainRate[op]);
+            Enqueue (chip, bank, 0x80+opMod, patch.ReleaseRate[op]);
+            Enqueue (chip, bank, 0x90+opMod, patch.SSGEG[op]);
+        }
+        Enqueue (chip, bank, 0xB0+chMod, patch.FeedbackAlgorithm);
+        Enqueue (chip, bank, 0xB4+chMod, patch.PanModulation);
+        if (chip < VOICE_CHIPS)
+            m_Voices.SetPatch (chip*YM_CHANNELS + channelIdx, patchId);
+    }
+
+    void PrepareAll (void)
+    {
+        for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+        {
+            for (u8 chip = 0; chip < YM_COUNT; chip++)
+                Prepare (chip, channel, 0);
+        }
+    }
+
+    /// @brief Same writes as CKernel::YMQueueNoteRaw, with a simpler velocity scale.
+    void KeyOn (u8 chip, u8 channelIdx, const TNote &note)
+    {
+        bool bank = channelIdx > 2;
+        u8 chMod = channelIdx % 3;
+        const YMPatch &patch = g_Patches[note.Patch];
+        u8 carriers = YMPatchCarriers (patch);
+        for (u8 op = 0; op < 4; op++)
+        {
+            if (carriers & BIT(op))
+                Enqueue (chip, bank, 0x40 + op*4 + chMod, std::min (patch.TotalLevel[op] + (0x7f - note.Velocity) / 4, 0x7f));
+        }
+        u16 word = YMKeyToNote (note.Key);
+        Enqueue (chip, bank, 0xA4+chMod, word >> 8);
+        Enqueue (chip, bank, 0xA0+chMod, word & 0xff);
+        Enqueue (chip, 0, YM_REG_KEY_ON, 0xf0 | (bank ? channelIdx + 1 : channelIdx));
+        if (!m_nResumeAt)
+        {
+            m_KeyOnArrival[chip][channelIdx] = note.Arrival;
+            m_KeyOns[chip][channelIdx] = m_Bus.GetKeyOns (chip, channelIdx);
+        }
+    }
+
+    void KeyOff (u8 chip, u8 channelIdx)
+    {
+        Enqueue (chip, 0, YM_REG_KEY_ON, channelIdx > 2 ? channelIdx + 1 : channelIdx);
+    }
+
+    unsigned Pending (void)
+    {
+        return m_Pump.GetPending ();
+    }
+
+    /// @return register writes that reached the chips so far.
+    u64 Sent (void) const
+    {
+        return m_Bus.GetStats ().Writes;
+    }
+
+    void Pump (void)
+    {
+        m_Pump.Process ();
+
+        // a key on that reached a channel completes the note waiting on it
+        for (u8 chip = 0; chip < VOICE_CHIPS; chip++)
+        {
+            for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+            {
+                u64 &nArrival = m_KeyOnArrival[chip][channel];
+                if (!nArrival || m_Bus.GetKeyOns (chip, channel) == m_KeyOns[chip][channel])
+                    continue;
+                m_Latency.push_back ((m_Bus.GetTime () - nArrival) / 1000);
+                nArrival = 0;
+            }
+        }
+    }
+
+    void Reset (void)
+    {
+        m_Pump.Clear ();
+        m_Pump.Reset ();
+        m_Pump.Sync ();
+        m_Voices.Reset (VOICE_CHIPS, YM_CHANNELS);
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+                m_KeyOnArrival[chip][channel] = 0;
+        }
+    }
+
+    static u32 PumpClock (void *pParam)
+    {
+        return (u32) (((CHarness *) pParam)->m_Bus.GetTime () / 1000);
+    }
+
+    CSimSpinbus m_Bus;
+    COverloadControl m_Overload;
+    CBusStats m_Stats {1000000};
+    CDeferredLog m_Log;
+    CSpinbusPump m_Pump;
+    CVoiceAllocator m_Voices;
+    CRingBuffer<TNote, NOTE_QUEUE_SIZE> m_Notes;
+    CRingBuffer<TNote, NOTE_QUEUE_SIZE> m_Held;     // m_HeldNotes
+
+    u64 m_OffAt[KEY_COUNT] = {};
+    u64 m_KeyOnArrival[YM_COUNT][YM_CHANNELS] = {};
+    u32 m_KeyOns[YM_COUNT][YM_CHANNELS] = {};     // GetKeyOns () when the key on was queued
+    u64 m_nResumeAt = 0;
+
+    u64 m_nOffered = 0;
+    unsigned m_nNotesLost = 0;
+    unsigned m_nOffsLost = 0;
+    unsigned m_nResets = 0;
+    std::vector<u32> m_Latency;
+};
+
+int main (int argc, char **argv)
+{
+    double fSeconds = argc > 1 ? atof (argv[1]) : 2.0;
+    if (fSeconds <= 0)
+    {
+        fprintf (stderr, "seconds must be positive\n");
+        return 1;
+    }
+    u64 nDurationNs = (u64) (fSeconds * 1e9);
+
+    double fCapacity = CHarness (OverloadReset).Capacity ();
+
+    // writes per note at a rate the bus easily keeps up with
+    TResult pilot = CHarness (OverloadReset).Run (200000000, 1000000000 / 2000, 0);
+    double fNoteWrites = pilot.Offered / pilot.NotesOffered;
+
+    // twice what the bus can carry
+    u64 nNoteNs = (u64) (1e9 * fNoteWrites / (fCapacity * 1.5));
+    u64 nStreamNs = (u64) (1e9 / (fCapacity * 0.5));
+
+    printf ("capacity %.0f writes/s, %.1f writes per note; offered: a note every %llu ns, a stream write every %llu ns\n",
+            fCapacity, fNoteWrites, (unsigned long long) nNoteNs, (unsigned long long) nStreamNs);
+    printf ("%-13s %9s %9s %8s %8s %7s %8s %9s %9s %8s %6s %8s %6s\n", "policy", "offered/s", "sent/s", "notes/s",
+            "played/s", "lost", "offs lost", "lat us", "p99 us", "dropped", "resets", "episodes", "depth");
+
+    int nResult = 0;
+    for (unsigned p = 0; p < OverloadPolicies; p++)
+    {
+        TOverloadPolicy ePolicy = (TOverloadPolicy) p;
+        CHarness *pHarness = new CHarness (ePolicy);
+        TResult result = pHarness->Run (nDurationNs, nNoteNs, nStreamNs);
+        delete pHarness;
+
+        printf ("%-13s %9.0f %9.0f %8.0f %8.0f %7u %8u %9.0f %9.0f %8u %6u %8u %6u\n",
+                COverloadControl::GetPolicyName (ePolicy), result.Offered, result.Delivered,
+                result.NotesOffered, result.NotesPlayed, result.NotesLost, result.OffsLost,
+                result.LatencyMean, result.LatencyP99, result.Dropped, result.Resets, result.Episodes, result.MaxDepth);
+        if (result.Stuck)
+            printf ("%-13s %u keys still sounding after their note off\n", "", result.Stuck);
+
+        // no policy may lose a note off
+        if (result.OffsLost || result.Stuck)
+            nResult = 2;
+
+        // anything but the reset policy has to keep the bus busy the whole time
+        if (ePolicy != OverloadReset && (result.Resets || result.Delivered < fCapacity * 0.8))
+            nResult = 2;
+    }
+
+    return nResult;
+}
@@ -0,0 +1,226 @@
+//
+// hostpatch.cpp
+//
+// How often a note finds a voice that already holds its patch, on workloads
+// with several patches playing at once:
+//
+//   make hostpatch && ./hostpatch [notes]
+//
+// CVoiceAllocator, which looks for a free voice holding the patch first, is
+// set against the allocation the kernel had before the patch cache: the
+// voice the key last played on if it is free, else the free voice released
+// longest ago, else the oldest sounding one. Both keep track of the patch in
+// each voice; a note whose voice holds another patch costs a YMPrepare on
+// top of its note writes, which is what the writes/note column counts (as
+// CKernel queues them, before the shadow).
+//
+// The workloads give every part its own key range, since voices are found
+// by key. There are fewer patches in g_Patches than some workloads use, so
+// the writes for patch n are those of g_Patches[n % g_nPatches].
+//
+#include "voiceallocator.h"
+#include "patches.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#define PREPARE_WRITES      31      // key off, 7 registers x 4 operators, B0 and B4
+
+struct TPart
+{
+    u8 Patch;
+    u8 KeyBase;
+    u8 KeyRange;
+    u8 Polyphony;   // notes held at once
+};
+
+struct TWorkload
+{
+    const char *Name;
+    std::vector<TPart> Parts;
+    unsigned ProgramEvery;  // notes between program changes of part 0, 0 for none
+    u8 Programs;            // patches part 0 cycles through
+};
+
+static u32 Random (u32 *pSeed)
+{
+    *pSeed ^= *pSeed << 13;
+    *pSeed ^= *pSeed >> 17;
+    *pSeed ^= *pSeed << 5;
+    return *pSeed;
+}
+
+static unsigned NoteWrites (u8 patch)
+{
+    // carrier TLs, fnum pair, key on
+    u8 carriers = YMPatchCarriers (g_Patches[patch % g_nPatches]);
+    return __builtin_popcount (carriers) + 3;
+}
+
+/// @brief Allocation as it was before the patch cache.
+class CPlainAllocator
+{
+public:
+    CPlainAllocator (unsigned nVoices)
+    :   m_nVoices (nVoices)
+    {
+        for (unsigned key = 0; key < VOICE_KEYS; key++)
+            m_LastVoice[key] = VOICE_NONE;
+        for (unsigned voice = 0; voice < nVoices; voice++)
+        {
+            m_Key[voice] = VOICE_KEY_NONE;
+            m_Patch[voice] = PATCH_NONE;
+            m_Age[voice] = 0;
+        }
+    }
+
+    /// @return the voice, whether a patch load is needed and whether it was sounding another key.
+    u16 NoteOn (u8 key, u8 patch, bool *pLoad, bool *pStolen)
+    {
+        u16 voice = m_LastVoice[key];
+        if (voice == VOICE_NONE || m_Key[voice] != VOICE_KEY_NONE)
+        {
+            // longest free first, then longest sounding
+            voice = VOICE_NONE;
+            for (int bFree = 1; bFree >= 0 && voice == VOICE_NONE; bFree--)
+            {
+                for (unsigned n = 0; n < m_nVoices; n++)
+                {
+                    if ((m_Key[n] == VOICE_KEY_NONE) == bFree && (voice == VOICE_NONE || m_Age[n] < m_Age[voice]))
+                        voice = n;
+                }
+            }
+        }
+        *pStolen = m_Key[voice] != VOICE_KEY_NONE;
+        m_Key[voice] = key;
+        m_Age[voice] = ++m_nClock;
+        m_LastVoice[key] = voice;
+        *pLoad = m_Patch[voice] != patch;
+        m_Patch[voice] = patch;
+        return voice;
+    }
+
+    void NoteOff (u8 key)
+    {
+        u16 voice = m_LastVoice[key];
+        if (voice == VOICE_NONE || m_Key[voice] != key)
+            return;
+        m_Key[voice] = VOICE_KEY_NONE;
+        m_Age[voice] = ++m_nClock;
+    }
+
+private:
+    unsigned m_nVoices;
+    u8  m_Key[VOICE_LIMIT];
+    u8  m_Patch[VOICE_LIMIT];
+    u32 m_Age[VOICE_LIMIT];
+    u16 m_LastVoice[VOICE_KEYS];
+    u32 m_nClock = 0;
+};
+
+struct TResult
+{
+    unsigned Hits;
+    unsigned Loads;
+    unsigned Writes;
+};
+
+/// @brief Plays the workload on both allocators: every note on releases the part's oldest note once it holds Polyphony.
+static void Play (const TWorkload &workload, unsigned nVoices, unsigned nNotes, TResult *pCache, TResult *pPlain)
+{
+    CVoiceAllocator *pVoices = new CVoiceAllocator;
+    pVoices->Reset (nVoices / YM_CHANNELS, YM_CHANNELS);
+    CPlainAllocator *pPlainVoices = new CPlainAllocator (nVoices);
+    *pCache = {};
+    *pPlain = {};
+
+    std::vector<std::vector<u8>> held (workload.Parts.size ());
+    u32 nSeed = 0x1b873593;
+    u8 program = workload.Parts[0].Patch;
+    for (unsigned n = 0; n < nNotes; n++)
+    {
+        unsigned nPart = Random (&nSeed) % workload.Parts.size ();
+        const TPart &part = workload.Parts[nPart];
+        u8 patch = part.Patch;
+        if (nPart == 0 && workload.ProgramEvery)
+        {
+            if (n % workload.ProgramEvery == 0)
+                program = (program + 1) % workload.Programs;
+            patch = program;
+        }
+
+        if (held[nPart].size () >= part.Polyphony)
+        {
+            u8 key = held[nPart].front ();
+            held[nPart].erase (held[nPart].begin ());
+            pVoices->NoteOff (key);
+            pPlainVoices->NoteOff (key);
+        }
+        u8 key = part.KeyBase + Random (&nSeed) % part.KeyRange;
+        for (u8 other : held[nPart])
+        {
+            if (other == key)
+            {
+                key = VOICE_KEY_NONE;
+                break;
+            }
+        }
+        if (key == VOICE_KEY_NONE)
+            continue;   // already held; a retrigger, not what this measures
+        held[nPart].push_back (key);
+
+        TVoiceAllocation voice = pVoices->NoteOn (key, patch);
+        bool bLoad = pVoices->GetPatch (voice.Voice) != patch;
+        if (bLoad)
+            pVoices->SetPatch (voice.Voice, patch);
+        (bLoad ? pCache->Loads : pCache->Hits)++;
+        pCache->Writes += NoteWrites (patch) + (bLoad ? PREPARE_WRITES : 0) + (voice.Stolen ? 1 : 0);
+
+        bool bStolen;
+        pPlainVoices->NoteOn (key, patch, &bLoad, &bStolen);
+        (bLoad ? pPlain->Loads : pPlain->Hits)++;
+        pPlain->Writes += NoteWrites (patch) + (bLoad ? PREPARE_WRITES : 0) + (bStolen ? 1 : 0);
+    }
+
+    delete pPlainVoices;
+    delete pVoices;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nNotes = argc > 1 ? atoi (argv[1]) : 200000;
+    if (nNotes == 0)
+    {
+        fprintf (stderr, "notes must be positive\n");
+        return 1;
+    }
+
+    static const TWorkload s_Workloads[] =
+    {
+        { "one patch",      { {0, 36, 48, 10} }, 0, 0 },
+        { "band",           { {3, 0, 12, 1}, {1, 24, 12, 1}, {0, 48, 24, 6}, {2, 84, 24, 2} }, 0, 0 },
+        { "eight parts",    { {0, 0, 16, 4}, {1, 16, 16, 4}, {2, 32, 16, 4}, {3, 48, 16, 4},
+                              {4, 64, 16, 4}, {5, 80, 16, 4}, {6, 96, 16, 4}, {7, 112, 16, 4} }, 0, 0 },
+        { "program changes", { {0, 48, 36, 6}, {1, 0, 24, 2} }, 16, 8 }
+    };
+    static const unsigned s_Voices[] = { 2 * YM_CHANNELS, 8 * YM_CHANNELS, YM_COUNT * YM_CHANNELS };
+
+    printf ("%u notes per run\n", nNotes);
+    printf ("%-16s %6s %8s %12s %12s %8s\n", "workload", "voices", "hits", "hits before", "writes/note",
+            "before");
+    for (const TWorkload &workload : s_Workloads)
+    {
+        for (unsigned nVoices : s_Voices)
+        {
+            TResult cache, plain;
+            Play (workload, nVoices, nNotes, &cache, &plain);
+            unsigned nCache = cache.Hits + cache.Loads;
+            unsigned nPlain = plain.Hits + plain.Loads;
+            printf ("%-16s %6u %7.1f%% %11.1f%% %12.1f %8.1f\n", workload.Name, nVoices,
+                    100.0 * cache.Hits / nCache, 100.0 * plain.Hits / nPlain,
+                    (double) cache.Writes / nCache, (double) plain.Writes / nPlain);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,363 @@
+//
+// hostpipeline.cpp
+//
+// The multicore pipeline of the kernel on host threads, against the simulated
+// Spinbus, to see how throughput scales when the stages get a core each:
+//
+//   make hostpipeline && ./hostpipeline [notes]
+//
+// Three stages, as on the target:
+//
+//   USB       note events into a NOTE_QUEUE_SIZE CSPSCRing (m_Notes)
+//   voice     CVoiceAllocator and the YMPrepare/YMQueueNoteRaw writes into a
+//             BUS_FEED_SIZE CSPSCRing (m_BusFeed), waiting while it is full
+//             and while the overload control holds intake
+//   bus       YMDrainFeed into the kernel's CSpinbusPump, then Process ()
+//
+// "inline" runs them round robin on one thread, as a single-core build does;
+// "threads" gives each its own thread, spinning (with a yield) while it has
+// nothing to do, as the cores do. Each is run with the voices spread over 1,
+// 5, 10 and 20 chips. The rates are in wall-clock time; "x real" is simulated
+// bus time over wall-clock time, so above 1 the host keeps up with the bus
+// the simulator models and the bus is the limit. "dropped" counts writes
+// the overload control had to drop at QUEUE_SIZE_LIMIT: the feed holds more
+// writes than a chip's queue, so with the voices on one chip a drained feed
+// can overrun it before HoldIntake () takes effect.
+//
+#include "spinbussim.h"
+#include "spinbuspump.h"
+#include "spscring.h"
+#include "voiceallocator.h"
+#include "fnumtable.h"
+#include "patches.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#define NOTE_QUEUE_SIZE     256     // kernel.h
+#define BUS_FEED_SIZE       4096
+#define NOTE_WRITES_MAX     40      // key off, patch load and key on of one note
+#define HELD_KEYS           48      // a note is released this many notes later
+#define PRODUCE_BATCH       32
+
+struct TNote
+{
+    bool On;
+    u8 Key;
+    u8 Patch;
+    u8 Velocity;
+};
+
+struct YMChipCommand
+{
+    u8 chip;
+    YMCommand command;
+};
+
+static u64 NowNs (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct TResult
+{
+    double Seconds;
+    double NotesPerSecond;
+    double WritesPerSecond;     // reaching the chips
+    double RealTime;            // simulated bus time / wall-clock time
+    unsigned Dropped;
+};
+
+class CPipeline
+{
+public:
+    CPipeline (unsigned nVoiceChips, unsigned nNotes)
+    :   m_nVoiceChips (nVoiceChips),
+        m_nNotes (nNotes),
+        m_Overload (OverloadThrottle),
+        m_Pump (&m_Bus, &m_Overload, &m_Stats, &m_Log, PumpClock, this)
+    {
+        m_Pump.SetBurst (true);
+        m_Voices.Reset (nVoiceChips, YM_CHANNELS);
+        m_Overload.SetVoiceChips (BIT(nVoiceChips) - 1);
+        m_Pump.Reset ();
+        m_Pump.Sync ();
+    }
+
+    TResult RunInline (void)
+    {
+        u64 nStart = Start ();
+        while (!BusDone ())
+        {
+            Produce ();
+            Voice ();
+            Bus ();
+        }
+        return Finish (nStart);
+    }
+
+    TResult RunThreads (void)
+    {
+        u64 nStart = Start ();
+        std::thread usb ([this] {
+            while (!ProduceDone ())
+                Idle (Produce ());
+        });
+        std::thread voice ([this] {
+            while (!VoiceDone ())
+                Idle (Voice ());
+        });
+        std::thread bus ([this] {
+            while (!BusDone ())
+                Idle (Bus ());
+        });
+        usb.join ();
+        voice.join ();
+        bus.join ();
+        return Finish (nStart);
+    }
+
+private:
+    u64 Start (void)
+    {
+        m_nSimStart = m_Bus.GetTime ();
+        m_nSentStart = m_Bus.GetStats ().Writes;
+        return NowNs ();
+    }
+
+    TResult Finish (u64 nStart)
+    {
+        TResult result = {};
+        result.Seconds = (NowNs () - nStart) / 1e9;
+        result.NotesPerSecond = m_nNotes / result.Seconds;
+        result.WritesPerSecond = (m_Bus.GetStats ().Writes - m_nSentStart) / result.Seconds;
+        result.RealTime = (m_Bus.GetTime () - m_nSimStart) / 1e9 / result.Seconds;
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+            result.Dropped += m_Overload.GetStats (chip).Dropped;
+        return result;
+    }
+
+    static void Idle (bool bProgress)
+    {
+        if (!bProgress)
+            std::this_thread::yield ();
+    }
+
+    bool ProduceDone (void) const { return m_bProduced.load (std::memory_order_acquire); }
+    bool VoiceDone (void) const { return m_bVoiced.load (std::memory_order_acquire); }
+    bool BusDone (void) const { return m_bBused; }
+
+    /// @brief USB stage: a batch of note events, a note on and the note off it displaces.
+    bool Produce (void)
+    {
+        if (ProduceDone ())
+            return false;
+        unsigned nCount = std::min<unsigned> (m_Notes.GetFree () / 2, PRODUCE_BATCH);
+        nCount = std::min (nCount, m_nNotes - m_nProduced);
+        for (unsigned n = 0; n < nCount; n++, m_nProduced++)
+        {
+            u8 key = m_nProduced % HELD_KEYS;
+            m_Notes.Push ({false, key, 0, 0});
+            m_Notes.Push ({true, key, (u8) (Random () % 4), (u8) (0x60 + Random () % 0x20)});
+        }
+        if (m_nProduced == m_nNotes)
+            m_bProduced.store (true, std::memory_order_release);
+        return nCount > 0;
+    }
+
+    /// @brief Voice stage: the Run loop's note dispatch, feeding the bus stage.
+    bool Voice (void)
+    {
+        if (VoiceDone ())
+            return false;
+
+        u32 nLostChips = m_Overload.TakeLostChips ();
+        for (u8 chip = 0; chip < m_nVoiceChips; chip++)
+        {
+            if (!(nLostChips & BIT(chip)))
+                continue;
+            u8 lost = m_Overload.TakeLostChannels (chip);
+            for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+            {
+                if (lost & BIT(channel))
+                    m_Voices.SetPatch (chip*YM_CHANNELS + channel, PATCH_NONE);
+            }
+        }
+
+        bool bProduced = ProduceDone ();
+        bool bProgress = false;
+        TNote note;
+        while (   m_Feed.GetFree () >= NOTE_WRITES_MAX
+               && !m_Overload.HoldIntake ()
+               && m_Notes.Pop (note))
+        {
+            bProgress = true;
+            if (!note.On)
+            {
+                u16 voice = m_Voices.NoteOff (note.Key);
+                if (voice != VOICE_NONE)
+                    KeyOff (voice / YM_CHANNELS, voice % YM_CHANNELS);
+                continue;
+            }
+
+            TVoiceAllocation voice = m_Voices.NoteOn (note.Key, note.Patch);
+            u8 chip = voice.Voice / YM_CHANNELS;
+            u8 channel = voice.Voice % YM_CHANNELS;
+            if (voice.Stolen || voice.Retrigger)
+                KeyOff (chip, channel);
+            if (m_Voices.GetPatch (voice.Voice) != note.Patch)
+                Prepare (chip, channel, note.Patch);
+            KeyOn (chip, channel, note);
+        }
+        if (bProduced && m_Notes.GetCount () == 0)
+            m_bVoiced.store (true, std::memory_order_release);
+        return bProgress;
+    }
+
+    /// @brief Bus stage: CKernel::BusCoreRun's loop body.
+    bool Bus (void)
+    {
+        if (BusDone ())
+            return false;
+
+        bool bVoiced = VoiceDone ();
+        bool bProgress = false;
+        YMChipCommand item;
+        while (m_Feed.Pop (item))
+        {
+            m_Pump.Enqueue (item.chip, item.command);
+            bProgress = true;
+        }
+        if (m_Pump.GetPending ())
+        {
+            m_Pump.Process ();
+            bProgress = true;
+        }
+        if (bVoiced && m_Feed.GetCount () == 0 && m_Pump.GetPending () == 0)
+            m_bBused = true;
+        return bProgress;
+    }
+
+    void Feed (u8 chip, bool bank, u8 address, u8 data)
+    {
+        m_Feed.Push ({chip, YMCommand (bank, address, data)});
+    }
+
+    /// @brief Same writes as CKernel::YMPrepare.
+    void Prepare (u8 chip, u8 channelIdx, u8 patchId)
+    {
+        bool bank = channelIdx > 2;
+        u8 chMod = channelIdx % 3;
+        const YMPatch &patch = g_Patches[patchId];
+
+        Feed (chip, 0, YM_REG_KEY_ON, bank ? channelIdx + 1 : channelIdx);
+        for (u8 op = 0; op < 4; op++)
+        {
+            u8 opMod = chMod + op*4;
+            Feed (chip, bank, 0x30+opMod, patch.DetuneMultiply[op]);
+            Feed (chip, bank, 0x40+opMod, patch.TotalLevel[op]);
+            Feed (chip, bank, 0x50+opMod, patch.AttackRate[op]);
+            Feed (chip, bank, 0x60+opMod, patch.DecayRate[op]);
+            Feed (chip, bank, 0x70+opMod, patch.SustainRate[op]);
+            Feed (chip, bank, 0x80+opMod, patch.ReleaseRate[op]);
+            Feed (chip, bank, 0x90+opMod, patch.SSGEG[op]);
+        }
+        Feed (chip, bank, 0xB0+chMod, patch.FeedbackAlgorithm);
+        Feed (chip, bank, 0xB4+chMod, patch.PanModulation);
+        m_Voices.SetPatch (chip*YM_CHANNELS + channelIdx, patchId);
+    }
+
+    /// @brief Same writes as CKernel::YMQueueNoteRaw, with a simpler velocity scale.
+    void KeyOn (u8 chip, u8 channelIdx, const TNote &note)
+    {
+        bool bank = channelIdx > 2;
+        u8 chMod = channelIdx % 3;
+        const YMPatch &patch = g_Patches[note.Patch];
+        u8 carriers = YMPatchCarriers (patch);
+        for (u8 op = 0; op < 4; op++)
+        {
+            if (carriers & BIT(op))
+                Feed (chip, bank, 0x40 + op*4 + chMod, std::min (patch.TotalLevel[op] + (0x7f - note.Velocity) / 4, 0x7f));
+        }
+        u16 word = YMKeyToNote (note.Key);
+        Feed (chip, bank, 0xA4+chMod, word >> 8);
+        Feed (chip, bank, 0xA0+chMod, word & 0xff);
+        Feed (chip, 0, YM_REG_KEY_ON, 0xf0 | (bank ? channelIdx + 1 : channelIdx));
+    }
+
+    void KeyOff (u8 chip, u8 channelIdx)
+    {
+        Feed (chip, 0, YM_REG_KEY_ON, channelIdx > 2 ? channelIdx + 1 : channelIdx);
+    }
+
+    /// @brief Only called from the USB stage.
+    u32 Random (void)
+    {
+        m_nSeed ^= m_nSeed << 13;
+        m_nSeed ^= m_nSeed >> 17;
+        m_nSeed ^= m_nSeed << 5;
+        return m_nSeed;
+    }
+
+    static u32 PumpClock (void *pParam)
+    {
+        return (u32) (((CPipeline *) pParam)->m_Bus.GetTime () / 1000);
+    }
+
+    unsigned m_nVoiceChips;
+    unsigned m_nNotes;
+
+    // USB stage
+    unsigned m_nProduced = 0;
+    u32 m_nSeed = 0x6c8e9cf5;
+    CSPSCRing<TNote, NOTE_QUEUE_SIZE> m_Notes;
+    std::atomic<bool> m_bProduced {false};
+
+    // voice stage
+    CVoiceAllocator m_Voices;
+    CSPSCRing<YMChipCommand, BUS_FEED_SIZE> m_Feed;
+    std::atomic<bool> m_bVoiced {false};
+
+    // bus stage
+    CSimSpinbus m_Bus;
+    COverloadControl m_Overload;
+    CBusStats m_Stats {1000000};
+    CDeferredLog m_Log;
+    CSpinbusPump m_Pump;
+    bool m_bBused = false;
+    u64 m_nSimStart = 0;
+    u64 m_nSentStart = 0;
+};
+
+int main (int argc, char **argv)
+{
+    unsigned nNotes = argc > 1 ? atoi (argv[1]) : 50000;
+    if (nNotes == 0)
+    {
+        fprintf (stderr, "notes must be positive\n");
+        return 1;
+    }
+
+    printf ("%u notes, %u hardware threads\n", nNotes, std::thread::hardware_concurrency ());
+    printf ("%5s %-8s %9s %11s %11s %8s %8s\n", "chips", "mode", "ms", "notes/s", "writes/s", "x real", "dropped");
+    static const unsigned s_VoiceChips[] = { 1, 5, 10, YM_COUNT };
+    for (unsigned nChips : s_VoiceChips)
+    {
+        for (int bThreads = 0; bThreads < 2; bThreads++)
+        {
+            CPipeline *pPipeline = new CPipeline (nChips, nNotes);
+            TResult result = bThreads ? pPipeline->RunThreads () : pPipeline->RunInline ();
+            delete pPipeline;
+            printf ("%5u %-8s %9.1f %11.0f %11.0f %8.2f %8u\n", nChips, bThreads ? "threads" : "inline",
+                    result.Seconds * 1000, result.NotesPerSecond, result.WritesPerSecond, result.RealTime,
+                    result.Dropped);
+        }
+    }
+
+    return 0;
+}
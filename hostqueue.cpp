@@ -0,0 +1,330 @@
+//
+// hostqueue.cpp
+//
+// What a YM write costs to queue and to take off the queue again, for the
+// per-chip queue as it was (a std::queue, so a std::deque) against the
+// fixed-capacity ring that replaced it, and against YMQueue as the pump uses
+// it today (two classes, coalescing index, delay statistics):
+//
+//   make hostqueue && ./hostqueue [rounds]
+//
+// A round is a 120-voice chord: every channel of every chip keyed off, given
+// a patch and keyed on again, the writes YMPrepareChips and YMQueueNoteRaw
+// queue, about 190 per chip. They are pushed into 20 queues, then popped
+// until every queue is empty. The clear column is ClearQueues' share: the
+// deque version built a fresh std::queue per chip.
+//
+// Before the timings, YMQueue's ordering rules are checked on short write
+// sequences: the order writes leave in has to match the expected one, and
+// the run fails if any doesn't.
+//
+#include "ymqueue.h"
+#include "ringbuffer.h"
+#include "patches.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <queue>
+#include <vector>
+
+static u64 NowNs (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static volatile u32 s_nSink;
+
+/// @brief One chip's share of the chord, in queueing order.
+static std::vector<YMCommand> ChordWrites (void)
+{
+    std::vector<YMCommand> writes;
+    for (u8 channelIdx = 0; channelIdx < YM_CHANNELS; channelIdx++)
+    {
+        bool bank = channelIdx > 2;
+        u8 chMod = channelIdx % 3;
+        u8 key = bank ? channelIdx + 1 : channelIdx;
+        const YMPatch &patch = g_Patches[channelIdx % g_nPatches];
+
+        writes.push_back (YMCommand (0, 0x28, key));
+        for (u8 op = 0; op < 4; op++)
+        {
+            u8 opMod = chMod + op*4;
+            writes.push_back (YMCommand (bank, 0x30+opMod, patch.DetuneMultiply[op]));
+            writes.push_back (YMCommand (bank, 0x40+opMod, patch.TotalLevel[op]));
+            writes.push_back (YMCommand (bank, 0x50+opMod, patch.AttackRate[op]));
+            writes.push_back (YMCommand (bank, 0x60+opMod, patch.DecayRate[op]));
+            writes.push_back (YMCommand (bank, 0x70+opMod, patch.SustainRate[op]));
+            writes.push_back (YMCommand (bank, 0x80+opMod, patch.ReleaseRate[op]));
+            writes.push_back (YMCommand (bank, 0x90+opMod, patch.SSGEG[op]));
+        }
+        writes.push_back (YMCommand (bank, 0xb0+chMod, patch.FeedbackAlgorithm));
+        writes.push_back (YMCommand (bank, 0xb4+chMod, patch.PanModulation));
+        for (u8 op = 0; op < 4; op++)
+            writes.push_back (YMCommand (bank, 0x40 + op*4 + chMod, patch.TotalLevel[op] + 8));
+        writes.push_back (YMCommand (bank, 0xa4+chMod, 0x22));
+        writes.push_back (YMCommand (bank, 0xa0+chMod, 0x69));
+        writes.push_back (YMCommand (0, 0x28, 0xf0 | key));
+    }
+    return writes;
+}
+
+struct TResult
+{
+    double PushNs;      // per write
+    double PopNs;       // per write
+    double ClearNs;     // per ClearQueues (all chips)
+};
+
+/// @brief The queue before: std::queue<YMCommand>, rebuilt to clear.
+static TResult BenchDeque (const std::vector<YMCommand> &writes, unsigned nRounds)
+{
+    std::queue<YMCommand> *pQueues = new std::queue<YMCommand>[YM_COUNT];
+    u64 nPush = 0, nPop = 0, nClear = 0;
+    u32 nSum = 0;
+    for (unsigned r = 0; r < nRounds; r++)
+    {
+        u64 nStart = NowNs ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            for (const YMCommand &command : writes)
+                pQueues[chip].push (command);
+        }
+        u64 nMiddle = NowNs ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            while (!pQueues[chip].empty ())
+            {
+                nSum += pQueues[chip].front ().data;
+                pQueues[chip].pop ();
+            }
+        }
+        u64 nEnd = NowNs ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+            pQueues[chip] = std::queue<YMCommand> ();
+        nClear += NowNs () - nEnd;
+        nPush += nMiddle - nStart;
+        nPop += nEnd - nMiddle;
+    }
+    delete [] pQueues;
+    s_nSink = nSum;
+
+    double fWrites = (double) nRounds * YM_COUNT * writes.size ();
+    return { nPush / fWrites, nPop / fWrites, (double) nClear / nRounds };
+}
+
+/// @brief The ring that replaced it, on its own.
+static TResult BenchRing (const std::vector<YMCommand> &writes, unsigned nRounds)
+{
+    typedef CRingBuffer<YMCommand, QUEUE_SIZE_LIMIT + 1> TRing;
+    TRing *pQueues = new TRing[YM_COUNT];
+    u64 nPush = 0, nPop = 0, nClear = 0;
+    u32 nSum = 0;
+    for (unsigned r = 0; r < nRounds; r++)
+    {
+        u64 nStart = NowNs ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            for (const YMCommand &command : writes)
+                pQueues[chip].push (command);
+        }
+        u64 nMiddle = NowNs ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            while (!pQueues[chip].empty ())
+            {
+                nSum += pQueues[chip].front ().data;
+                pQueues[chip].pop ();
+            }
+        }
+        u64 nEnd = NowNs ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+            pQueues[chip].clear ();
+        nClear += NowNs () - nEnd;
+        nPush += nMiddle - nStart;
+        nPop += nEnd - nMiddle;
+    }
+    delete [] pQueues;
+    s_nSink = nSum;
+
+    double fWrites = (double) nRounds * YM_COUNT * writes.size ();
+    return { nPush / fWrites, nPop / fWrites, (double) nClear / nRounds };
+}
+
+/// @brief YMQueue as CSpinbusPump drives it: Coalesce, then Push; front, then pop.
+static TResult BenchYMQueue (const std::vector<YMCommand> &writes, unsigned nRounds)
+{
+    YMQueue *pQueues = new YMQueue[YM_COUNT];
+    u64 nPush = 0, nPop = 0, nClear = 0;
+    u32 nSum = 0;
+    for (unsigned r = 0; r < nRounds; r++)
+    {
+        u64 nStart = NowNs ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            for (const YMCommand &command : writes)
+            {
+                if (!pQueues[chip].Coalesce (command))
+                    pQueues[chip].Push (command, r);
+            }
+        }
+        u64 nMiddle = NowNs ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            while (pQueues[chip].size ())
+            {
+                nSum += pQueues[chip].front ().data;
+                pQueues[chip].pop (r);
+            }
+        }
+        u64 nEnd = NowNs ();
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+            pQueues[chip].clear ();
+        nClear += NowNs () - nEnd;
+        nPush += nMiddle - nStart;
+        nPop += nEnd - nMiddle;
+    }
+    delete [] pQueues;
+    s_nSink = nSum;
+
+    double fWrites = (double) nRounds * YM_COUNT * writes.size ();
+    return { nPush / fWrites, nPop / fWrites, (double) nClear / nRounds };
+}
+
+/// @brief Queues writes as the pump does: fnum pairs through CoalescePair, the rest through Coalesce.
+static void Queue (YMQueue &queue, const std::vector<YMCommand> &writes)
+{
+    for (size_t n = 0; n < writes.size (); n++)
+    {
+        const YMCommand &command = writes[n];
+        if ((command.address & 0xf4) == 0xa4 && (command.address & 3) != 3 && n + 1 < writes.size ())
+        {
+            if (!queue.CoalescePair (command, writes[n + 1]))
+            {
+                queue.Push (command, 0);
+                queue.Push (writes[n + 1], 0);
+            }
+            n++;
+            continue;
+        }
+        if (!queue.Coalesce (command))
+            queue.Push (command, 0);
+    }
+}
+
+/// @param nSendFirst writes popped after the first nSendFirst writes were queued, as if sent meanwhile.
+static bool Check (const char *pName, const std::vector<YMCommand> &writes, unsigned nSendFirst,
+                   const std::vector<YMCommand> &expected)
+{
+    YMQueue *pQueue = new YMQueue;
+    std::vector<YMCommand> sent;
+    std::vector<YMCommand> first (writes.begin (), writes.begin () + nSendFirst);
+    std::vector<YMCommand> rest (writes.begin () + nSendFirst, writes.end ());
+    Queue (*pQueue, first);
+    if (nSendFirst)
+    {
+        sent.push_back (pQueue->front ());
+        pQueue->pop (0);
+    }
+    Queue (*pQueue, rest);
+    while (pQueue->size ())
+    {
+        sent.push_back (pQueue->front ());
+        pQueue->pop (0);
+    }
+    delete pQueue;
+
+    bool bOK = sent.size () == expected.size ();
+    for (size_t n = 0; bOK && n < sent.size (); n++)
+    {
+        bOK =    sent[n].bank == expected[n].bank && sent[n].address == expected[n].address
+              && sent[n].data == expected[n].data;
+    }
+    printf ("%-48s %s\n", pName, bOK ? "ok" : "FAIL");
+    if (!bOK)
+    {
+        for (const YMCommand &command : sent)
+            printf ("  %u:%02x=%02x", command.bank, command.address, command.data);
+        printf ("\n");
+    }
+    return bOK;
+}
+
+static bool CheckOrdering (void)
+{
+    const YMCommand h1 (0, 0xa4, 0x22), l1 (0, 0xa0, 0x69);
+    const YMCommand h2 (0, 0xa4, 0x23), l2 (0, 0xa0, 0x10);
+    const YMCommand key (0, 0x28, 0xf0);
+    const YMCommand tl (0, 0x40, 0x10);
+    bool bOK = true;
+    bOK &= Check ("fnum pair folds into the pending pair", {h1, l1, h2, l2}, 0, {h2, l2});
+    bOK &= Check ("fnum pair doesn't fold across a key on", {h1, l1, key, h2, l2}, 0, {h1, l1, key, h2, l2});
+    bOK &= Check ("fnum pair doesn't fold into a sent half", {h1, l1, h2, l2}, 1, {h1, l1, h2, l2});
+    bOK &= Check ("fnum pair stays together around a TL", {h1, l1, tl, h2, l2}, 0, {h2, l2, tl});
+
+    // channel 3 special mode: 0x27 switches it on, then the per-operator fnums
+    bool bChannel3 = true;
+    for (u8 address : { 0xa8, 0xa9, 0xaa, 0xac, 0xad, 0xae })
+        bChannel3 &= YMQueue::Channel (YMCommand (0, address, 0)) == 2;
+    printf ("%-48s %s\n", "special-mode fnums belong to channel 3", bChannel3 ? "ok" : "FAIL");
+    bOK &= bChannel3;
+    const YMCommand mode (0, 0x27, 0x40), dt (0, 0x30, 0x71);
+    const YMCommand h3 (0, 0xad, 0x22), l3 (0, 0xa9, 0x69);
+    bOK &= Check ("critical writes wait for a chip-wide write", {dt, mode, h3, l3, tl}, 0, {dt, mode, h3, l3, tl});
+
+    // more critical writes than YM_CRITICAL_RUN, so a ready bulk write would get a turn
+    std::vector<YMCommand> levels;
+    for (u8 n = 0; n < 2 * YM_CRITICAL_RUN; n++)
+        levels.push_back (YMCommand (n & 1, 0x40 + (n / 2) % 4 * 4 + n / 8, n));
+    std::vector<YMCommand> writes = levels, expected = levels;
+    writes.push_back (YMCommand (0, 0x22, 0x08));
+    expected.push_back (YMCommand (0, 0x22, 0x08));
+    bOK &= Check ("a chip-wide write waits for critical writes", writes, 0, expected);
+    writes.push_back (YMCommand (0, 0x22, 0x00));
+    expected.back () = YMCommand (0, 0x22, 0x00);
+    bOK &= Check ("a chip-wide write folds into a pending one", writes, 0, expected);
+    writes.insert (writes.end () - 1, tl);
+    expected = levels;
+    expected.push_back (YMCommand (0, 0x22, 0x08));
+    expected.push_back (tl);
+    expected.push_back (YMCommand (0, 0x22, 0x00));
+    bOK &= Check ("a chip-wide write doesn't fold across critical", writes, 0, expected);
+    return bOK;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nRounds = argc > 1 ? atoi (argv[1]) : 20000;
+    if (nRounds == 0)
+    {
+        fprintf (stderr, "rounds must be positive\n");
+        return 1;
+    }
+
+    if (!CheckOrdering ())
+        return 2;
+
+    std::vector<YMCommand> writes = ChordWrites ();
+    printf ("%u rounds of %u writes per chip, %u chips\n", nRounds, (unsigned) writes.size (), YM_COUNT);
+    printf ("%-22s %10s %10s %12s\n", "queue", "push ns", "pop ns", "clear ns");
+
+    static const struct
+    {
+        const char *Name;
+        TResult (*Bench) (const std::vector<YMCommand> &writes, unsigned nRounds);
+    }
+    s_Queues[] =
+    {
+        { "std::queue (before)", BenchDeque },
+        { "CRingBuffer (after)", BenchRing },
+        { "YMQueue (today)", BenchYMQueue }
+    };
+    for (const auto &queue : s_Queues)
+    {
+        TResult result = queue.Bench (writes, nRounds);
+        printf ("%-22s %10.2f %10.2f %12.1f\n", queue.Name, result.PushNs, result.PopNs, result.ClearNs);
+    }
+
+    return 0;
+}
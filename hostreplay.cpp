@@ -0,0 +1,339 @@
+//
+// hostreplay.cpp
+//
+// Glitches the simulated FPGA's command receiver and compares three ways of
+// getting over the error frames that come out of it:
+//
+//   replay  resend only what CYMJournal hasn't seen confirmed (the kernel's)
+//   reset   drop the queues, wait a second, reset and prepare every chip again
+//           (what the kernel used to do)
+//   none    carry on, and lose whatever the glitch swallowed
+//
+//   make hostreplay && ./hostreplay [writes] [glitch rate]
+//
+// The workload is random register writes spread over all chips at a steady
+// rate; one in [glitch rate] bus bytes glitches. Recovery time runs from the
+// error frame to the next time nothing is left to send. At the end every
+// register the shadow holds is compared against the simulated chips; the exit
+// code says whether the replay run ended up with none different.
+//
+// All three run the kernel's CSpinbusPump with bursts; reset and none turn its
+// replay off, so an error frame asks for a reset, which none ignores.
+//
+// The workload leaves out the writes the journal treats specially, so those
+// are checked on a CYMJournal of their own first: key on/off and DAC writes,
+// and fnum pairs kept together when the journal overflows, when a high half
+// is confirmed ahead of its low half, and at the end of a replay burst.
+//
+#include "spinbussim.h"
+#include "spinbuspump.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define WRITE_INTERVAL_NS   5000        // workload: one register write this often
+#define RESET_DELAY_NS      1000000000  // the old recovery's MsDelay (1000)
+
+enum TRecovery
+{
+    RecoveryReplay,
+    RecoveryReset,
+    RecoveryNone
+};
+
+static const char *const s_RecoveryName[] = { "replay", "reset", "none" };
+
+/// @return a register the workload writes: operator registers and the per-channel B0-B6, no fnums or key on.
+static u8 WorkloadAddress (u32 nRandom)
+{
+    static const unsigned nOperator = 0xa0 - 0x30;
+    nRandom %= nOperator + 7;
+    return nRandom < nOperator ? 0x30 + nRandom : 0xb0 + (nRandom - nOperator);
+}
+
+static bool Check (const char *pName, bool bOK)
+{
+    printf ("%-48s %s\n", pName, bOK ? "ok" : "FAIL");
+    return bOK;
+}
+
+/// @return true if the next writes to replay to chip 0 are pExpected, and nothing after them.
+static bool ReplayIs (CYMJournal *pJournal, const YMCommand *pExpected, unsigned nExpected, unsigned nMax = YM_BURST_MAX)
+{
+    YMCommand replay[2 * YM_JOURNAL_SIZE];
+    unsigned nCount = 0;
+    while (pJournal->HasReplay (0))
+        nCount += pJournal->TakeReplay (0, replay + nCount, nMax);
+    if (nCount != nExpected)
+        return false;
+    for (unsigned n = 0; n < nCount; n++)
+    {
+        if (   replay[n].bank != pExpected[n].bank || replay[n].address != pExpected[n].address
+            || replay[n].data != pExpected[n].data)
+            return false;
+    }
+    return true;
+}
+
+static bool CheckJournal (void)
+{
+    CYMJournal *pJournal = new CYMJournal;
+    bool bOK = true;
+
+    const YMCommand keyOff (0, YM_REG_KEY_ON, 0x00), keyOn (0, YM_REG_KEY_ON, 0xf0);
+    const YMCommand high (0, 0xa4, 0x22), low (0, 0xa0, 0x69), tl (0, 0x40, 0x10);
+    pJournal->Record (0, keyOff, 0);
+    pJournal->Record (0, YMCommand (0, YM_REG_DAC, 0x80), 0);
+    pJournal->Record (0, high, 0);
+    pJournal->Record (0, low, 0);
+    pJournal->Record (0, keyOn, 0);
+    pJournal->Fail ();
+    const YMCommand replayed[] = { high, low, keyOn };
+    bOK &= Check ("replay keeps only the last key on/off, no DAC", ReplayIs (pJournal, replayed, 3)
+                  && pJournal->GetStats ().Skipped == 2);
+
+    // a full journal whose oldest writes are a pair
+    pJournal->Clear ();
+    pJournal->Record (0, high, 0);
+    pJournal->Record (0, low, 0);
+    for (unsigned n = 2; n < YM_JOURNAL_SIZE; n++)
+        pJournal->Record (0, tl, 0);
+    pJournal->Record (0, tl, 0);
+    pJournal->Fail ();
+    YMCommand tls[YM_JOURNAL_SIZE - 1];
+    for (YMCommand &command : tls)
+        command = tl;
+    bOK &= Check ("overflow drops an fnum pair whole", ReplayIs (pJournal, tls, YM_JOURNAL_SIZE - 1));
+
+    // the high half's frame is confirmed, the low half's isn't yet
+    pJournal->Clear ();
+    pJournal->Record (0, high, 0);
+    pJournal->Record (0, low, 100);
+    pJournal->Acknowledge (SPINBUS_ACK_LAG + 50);
+    pJournal->Fail ();
+    const YMCommand pair[] = { high, low };
+    bOK &= Check ("a high half waits for its low half's ack", ReplayIs (pJournal, pair, 2));
+
+    pJournal->Clear ();
+    pJournal->Record (0, tl, 0);
+    pJournal->Record (0, high, 0);
+    pJournal->Record (0, low, 0);
+    pJournal->Fail ();
+    YMCommand burst[2];
+    bOK &= Check ("a replay burst doesn't end on a high half",
+                  pJournal->TakeReplay (0, burst, 2) == 1 && pJournal->TakeReplay (0, burst, 2) == 2
+                  && burst[0].address == high.address && burst[1].address == low.address);
+
+    delete pJournal;
+    return bOK;
+}
+
+class CHarness
+{
+public:
+    CHarness (TRecovery eRecovery, unsigned nGlitchPer)
+    :   m_eRecovery (eRecovery),
+        m_Overload (OverloadShed),
+        m_Pump (&m_Bus, &m_Overload, &m_Stats, &m_Log, PumpClock, this)
+    {
+        m_Bus.SetGlitchRate (nGlitchPer);
+        m_Pump.SetBurst (true);
+        m_Pump.SetReplay (eRecovery == RecoveryReplay);
+    }
+
+    void Run (unsigned nWrites)
+    {
+        m_Pump.Sync ();
+        u64 nNextWrite = m_Bus.GetTime ();
+        unsigned nQueued = 0;
+        while (nQueued < nWrites || m_Pump.GetPending ())
+        {
+            while (nQueued < nWrites && nNextWrite <= m_Bus.GetTime ())
+            {
+                u32 nRandom = Random ();
+                m_Pump.Enqueue (nRandom % YM_COUNT, YMCommand ((nRandom >> 8) & 1, WorkloadAddress (nRandom >> 9), Random ()));
+                nQueued++;
+                nNextWrite += WRITE_INTERVAL_NS;
+            }
+
+            if (m_Pump.IsResetRequested ())
+            {
+                if (m_eRecovery == RecoveryReset)
+                {
+                    Reset ();
+                    // the workload waits out the delay along with the kernel
+                    nNextWrite += RESET_DELAY_NS;
+                    continue;
+                }
+                m_Pump.ClearResetRequest ();
+            }
+
+            bool bSent = Pump ();
+            if (!m_Pump.GetPending () && !m_Pump.IsResetRequested ())
+            {
+                EndRecovery ();
+                // nothing to send: skip ahead to the next write
+                if (!bSent && nQueued < nWrites && nNextWrite > m_Bus.GetTime ())
+                    m_Bus.Advance (nNextWrite - m_Bus.GetTime ());
+            }
+        }
+        EndRecovery ();
+
+        // clock until a glitch in the last frames would have come back
+        m_Bus.SetGlitchRate (0);
+        for (unsigned i = 0; i < SPINBUS_ACK_LAG + 8; i++)
+            m_Pump.WriteRead (CMD_NOP);
+        while (m_Pump.GetJournal ().GetReplayCount ())
+            Pump ();
+    }
+
+    void Print (void)
+    {
+        m_nMismatches = 0;
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            for (unsigned bank = 0; bank < 2; bank++)
+            {
+                for (unsigned address = 0; address < 256; address++)
+                {
+                    u8 nData;
+                    if (   m_Pump.GetShadow ().Get (chip, bank, address, &nData)
+                        && m_Bus.GetRegister (chip, bank, address) != nData)
+                        m_nMismatches++;
+                }
+            }
+        }
+
+        unsigned nResentBytes = m_nReprepareBytes + m_Pump.GetReplayBytes ();
+        unsigned nErrors = m_Pump.GetErrors ();
+        unsigned nLimitHits = 0;
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+            nLimitHits += m_Overload.GetStats (chip).LimitHits;
+
+        double fMeanUs = m_nRecoveries ? m_nRecoveryNs / 1000.0 / m_nRecoveries : 0.0;
+        printf ("%-8s %8llu %7llu %7u %10.1f %10.1f %9u %8.1f %6u\n", s_RecoveryName[m_eRecovery],
+                (unsigned long long) m_Bus.GetStats ().Bytes, (unsigned long long) m_Bus.GetStats ().Glitches,
+                nErrors, fMeanUs, m_nMaxRecoveryNs / 1000.0, nResentBytes,
+                nErrors ? (double) nResentBytes / nErrors : 0.0, m_nMismatches);
+        if (nLimitHits)
+            printf ("         %u writes dropped at the queue limit\n", nLimitHits);
+    }
+
+    unsigned GetMismatches (void) const { return m_nMismatches; }
+
+private:
+    u32 Random (void)
+    {
+        m_nSeed ^= m_nSeed << 13;
+        m_nSeed ^= m_nSeed >> 17;
+        m_nSeed ^= m_nSeed << 5;
+        return m_nSeed;
+    }
+
+    /// @return true if anything was sent.
+    bool Pump (void)
+    {
+        u32 nErrors = m_Pump.GetErrors ();
+        u32 nBytes = m_Pump.GetBusBytes ();
+        m_Pump.Process ();
+        if (m_Pump.GetErrors () != nErrors)
+            StartRecovery ();
+        if (m_bReprepare)
+            m_nReprepareBytes += m_Pump.GetBusBytes () - nBytes;
+        return m_Pump.GetBusBytes () != nBytes;
+    }
+
+    /// @brief The old recovery: queues dropped, a second's wait, then every chip prepared again from scratch.
+    void Reset (void)
+    {
+        // the prepare writes everything the voices need, which is what the shadow holds
+        CYMShadow shadow = m_Pump.GetShadow ();
+        m_Pump.ClearResetRequest ();
+        m_Pump.Clear ();
+        m_Bus.Advance (RESET_DELAY_NS);
+        m_Pump.Reset ();
+        m_Pump.Sync ();
+
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            for (unsigned bank = 0; bank < 2; bank++)
+            {
+                for (unsigned address = 0; address < 256; address++)
+                {
+                    u8 nData;
+                    if (shadow.Get (chip, bank, address, &nData))
+                        m_Pump.Enqueue (chip, YMCommand (bank, address, nData));
+                }
+            }
+        }
+        m_bReprepare = true;
+    }
+
+    void StartRecovery (void)
+    {
+        if (m_bRecovering)
+            return;
+        m_bRecovering = true;
+        m_nRecoveryStart = m_Bus.GetTime ();
+    }
+
+    void EndRecovery (void)
+    {
+        m_bReprepare = false;
+        if (!m_bRecovering)
+            return;
+        m_bRecovering = false;
+        u64 nTime = m_Bus.GetTime () - m_nRecoveryStart;
+        m_nRecoveries++;
+        m_nRecoveryNs += nTime;
+        if (nTime > m_nMaxRecoveryNs)
+            m_nMaxRecoveryNs = nTime;
+    }
+
+    static u32 PumpClock (void *pParam)
+    {
+        return (u32) (((CHarness *) pParam)->m_Bus.GetTime () / 1000);
+    }
+
+    TRecovery m_eRecovery;
+    CSimSpinbus m_Bus;
+    COverloadControl m_Overload;
+    CBusStats m_Stats {1000000};
+    CDeferredLog m_Log;
+    CSpinbusPump m_Pump;
+
+    u32 m_nSeed = 0x1b873593;
+    bool m_bReprepare = false;
+
+    bool m_bRecovering = false;
+    u64 m_nRecoveryStart = 0;
+    unsigned m_nRecoveries = 0;
+    u64 m_nRecoveryNs = 0;
+    u64 m_nMaxRecoveryNs = 0;
+    unsigned m_nReprepareBytes = 0;
+    unsigned m_nMismatches = 0;
+};
+
+int main (int argc, char **argv)
+{
+    unsigned nWrites = argc > 1 ? atoi (argv[1]) : 200000;
+    unsigned nGlitchPer = argc > 2 ? atoi (argv[2]) : 50000;
+
+    if (!CheckJournal ())
+        return 2;
+
+    printf ("%-8s %8s %7s %7s %10s %10s %9s %8s %6s\n", "recovery", "bytes", "glitch", "errors",
+            "mean us", "max us", "resent", "B/error", "wrong");
+    bool bClean = false;
+    for (unsigned i = RecoveryReplay; i <= RecoveryNone; i++)
+    {
+        TRecovery eRecovery = (TRecovery) i;
+        CHarness *pHarness = new CHarness (eRecovery, nGlitchPer);
+        pHarness->Run (nWrites);
+        pHarness->Print ();
+        if (eRecovery == RecoveryReplay)
+            bClean = pHarness->GetMismatches () == 0;
+        delete pHarness;
+    }
+
+    return bClean ? 0 : 2;
+}
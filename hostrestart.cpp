@@ -0,0 +1,323 @@
+//
+// hostrestart.cpp
+//
+// Time to first note after a bus reset on the simulated Spinbus, cold (the
+// full prepare of every channel) against warm (CYMSnapshot restoring what
+// differs from power-on, sounding channels first):
+//
+//   make hostrestart && ./hostrestart [sounding channels]
+//
+// A session loads a random patch into every channel and leaves some of them
+// sounding, then the bus is reset. The first note after the reset goes to a
+// channel that was sounding, with the patch it had; a second one goes to a
+// channel that wasn't. Each is timed from the reset to its key on reaching
+// the chip, with the kernel's order of things: the restart is queued, the
+// queues drain (the cold path all the way, the warm path until the sounding
+// channels' writes are out, by YMQueue marks as in CKernel::YMRestoreSent),
+// then the note is queued. At that point every restore write to a sounding
+// channel has to be on its chip already; the run fails if one isn't. The queues and the pump are the
+// kernel's CSpinbusPump with bursts; broadcasts are left out, which favours
+// neither side.
+//
+#include "spinbussim.h"
+#include "spinbuspump.h"
+#include "ymsnapshot.h"
+#include "patches.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static u32 PumpClock (void *);
+
+static CSimSpinbus s_Bus;
+static COverloadControl s_Overload;
+static CBusStats s_Stats (1000000);
+static CDeferredLog s_Log;
+static CSpinbusPump s_Pump (&s_Bus, &s_Overload, &s_Stats, &s_Log, PumpClock);
+static CYMSnapshot s_Snapshot;
+static CYMShadow s_Session;                     // register image at the reset
+static u8 s_Patch[YM_COUNT][YM_CHANNELS];       // patch each channel holds
+static u8 s_SessionPatch[YM_COUNT][YM_CHANNELS];
+static bool s_Restored[YM_COUNT][2][256];       // written by the warm restart
+static u8 s_RestoredData[YM_COUNT][2][256];
+static u32 s_nSeed = 0x2f6b3c1d;
+
+static u32 PumpClock (void *)
+{
+    return (u32) (s_Bus.GetTime () / 1000);
+}
+
+static u32 Random (void)
+{
+    s_nSeed ^= s_nSeed << 13;
+    s_nSeed ^= s_nSeed >> 17;
+    s_nSeed ^= s_nSeed << 5;
+    return s_nSeed;
+}
+
+static void Queue (u8 chip, bool bank, u8 address, u8 data)
+{
+    s_Pump.Enqueue (chip, YMCommand (bank, address, data));
+}
+
+static void RestoreHandler (void *, u8 nChip, bool bBank, u8 nAddress, u8 nData)
+{
+    s_Restored[nChip][bBank][nAddress] = true;
+    s_RestoredData[nChip][bBank][nAddress] = nData;
+    Queue (nChip, bBank, nAddress, nData);
+}
+
+/// @brief Same writes as CKernel::YMPrepareGlobal.
+static void PrepareGlobal (u8 chip)
+{
+    Queue (chip, 0, 0x22, 0x00);
+    Queue (chip, 0, 0x27, 0x00);
+    Queue (chip, 0, 0x2b, 0x00);
+}
+
+/// @brief Same writes as CKernel::YMPrepareChips, for one chip.
+static void Prepare (u8 chip, u8 channelIdx, u8 patchId)
+{
+    bool bank = channelIdx > 2;
+    u8 chMod = channelIdx % 3;
+    const YMPatch &patch = g_Patches[patchId];
+
+    Queue (chip, 0, YM_REG_KEY_ON, bank ? channelIdx + 1 : channelIdx);
+    for (u8 op = 0; op < 4; op++)
+    {
+        u8 opMod = chMod + op*4;
+        Queue (chip, bank, 0x30+opMod, patch.DetuneMultiply[op]);
+        Queue (chip, bank, 0x40+opMod, patch.TotalLevel[op]);
+        Queue (chip, bank, 0x50+opMod, patch.AttackRate[op]);
+        Queue (chip, bank, 0x60+opMod, patch.DecayRate[op]);
+        Queue (chip, bank, 0x70+opMod, patch.SustainRate[op]);
+        Queue (chip, bank, 0x80+opMod, patch.ReleaseRate[op]);
+        Queue (chip, bank, 0x90+opMod, patch.SSGEG[op]);
+    }
+    Queue (chip, bank, 0xB0+chMod, patch.FeedbackAlgorithm);
+    Queue (chip, bank, 0xB4+chMod, patch.PanModulation);
+    s_Patch[chip][channelIdx] = patchId;
+}
+
+static void KeyOn (u8 chip, u8 channelIdx)
+{
+    bool bank = channelIdx > 2;
+    u8 chMod = channelIdx % 3;
+    u16 note = 4 << 11 | 644;   // A4
+    Queue (chip, bank, 0xA4+chMod, note >> 8);
+    Queue (chip, bank, 0xA0+chMod, note & 0xff);
+    Queue (chip, 0, YM_REG_KEY_ON, 0xf0 | (bank ? channelIdx + 1 : channelIdx));
+}
+
+static unsigned Pending (void)
+{
+    return s_Pump.GetPending ();
+}
+
+/// @return the number of writes still queued before this pass, as CSpinbusPump::Process.
+static unsigned Pump (void)
+{
+    return s_Pump.Process ();
+}
+
+static void Reset (void)
+{
+    s_Pump.Clear ();
+    s_Pump.Reset ();
+    s_Pump.Sync ();
+}
+
+/// @return simulated ns from nStart until the channel is keyed on.
+static u64 PlayNote (u8 chip, u8 channelIdx, u8 patchId, u64 nStart)
+{
+    if (s_Patch[chip][channelIdx] != patchId)
+        Prepare (chip, channelIdx, patchId);
+    KeyOn (chip, channelIdx);
+    while (!s_Bus.GetKeyState (chip, channelIdx))
+        Pump ();
+    return s_Bus.GetTime () - nStart;
+}
+
+struct TResult
+{
+    unsigned Writes;
+    u64 Bytes;
+    u64 SoundingNs;     // first note, on a channel that was sounding
+    u64 OtherNs;        // second note, on one that wasn't
+    unsigned Missing;   // restore writes to sounding channels not on the chip when notes may start
+};
+
+/// @brief Drains the queues until what notes wait for is out, as CKernel::YMRestoreSent.
+/// @param bWarm only the sounding channels count, else everything.
+static void Drain (bool bWarm)
+{
+    TYMQueueMark marks[YM_COUNT];
+    u8 channels[YM_COUNT];
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+    {
+        s_Pump.GetQueue (chip).Mark (&marks[chip]);
+        channels[chip] = BIT (YM_CHANNELS);
+        for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+        {
+            if (!bWarm || s_Snapshot.IsSounding (chip, channel))
+                channels[chip] |= BIT (channel);
+        }
+    }
+
+    for (;;)
+    {
+        Pump ();
+        bool bSent = !s_Pump.GetJournal ().GetReplayCount ();
+        for (u8 chip = 0; bSent && chip < YM_COUNT; chip++)
+            bSent = s_Pump.GetQueue (chip).IsSent (marks[chip], channels[chip]);
+        if (bSent)
+            break;
+    }
+}
+
+/// @return restore writes to sounding channels and chip-wide registers the chips don't hold yet.
+static unsigned CountMissing (void)
+{
+    unsigned nMissing = 0;
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+    {
+        for (unsigned bank = 0; bank < 2; bank++)
+        {
+            for (unsigned address = 0; address < 256; address++)
+            {
+                if (!s_Restored[chip][bank][address])
+                    continue;
+                u8 channel = YMQueue::Channel (YMCommand (bank, address, 0));
+                if (   (channel == YM_CHANNELS || s_Snapshot.IsSounding (chip, channel))
+                    && s_Bus.GetRegister (chip, bank, address) != s_RestoredData[chip][bank][address])
+                    nMissing++;
+            }
+        }
+    }
+    return nMissing;
+}
+
+static TResult Restart (bool bWarm, u8 soundingChip, u8 soundingChannel, u8 otherChip, u8 otherChannel)
+{
+    Reset ();
+    u64 nStart = s_Bus.GetTime ();
+    u64 nBytes = s_Bus.GetStats ().Bytes;
+
+    TResult result;
+    result.Missing = 0;
+    if (bWarm)
+    {
+        result.Writes = s_Snapshot.Restore (YM_MASK_ALL, RestoreHandler, 0);
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+                s_Patch[chip][channel] = s_Snapshot.GetPatch (chip, channel);
+        }
+    }
+    else
+    {
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+            PrepareGlobal (chip);
+        for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+        {
+            for (u8 chip = 0; chip < YM_COUNT; chip++)
+                Prepare (chip, channel, 0);
+        }
+        result.Writes = Pending ();
+    }
+
+    Drain (bWarm);
+    if (bWarm)
+        result.Missing = CountMissing ();
+
+    result.SoundingNs = PlayNote (soundingChip, soundingChannel, s_SessionPatch[soundingChip][soundingChannel], nStart);
+    result.OtherNs = PlayNote (otherChip, otherChannel, s_SessionPatch[otherChip][otherChannel], nStart);
+    while (Pending ())
+        Pump ();
+    result.Bytes = s_Bus.GetStats ().Bytes - nBytes;
+    return result;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nSounding = argc > 1 ? atoi (argv[1]) : 16;
+    if (nSounding < 1 || nSounding >= YM_COUNT * YM_CHANNELS)
+    {
+        fprintf (stderr, "sounding channels must be 1-%u\n", YM_COUNT * YM_CHANNELS - 1);
+        return 1;
+    }
+
+    s_Pump.SetBurst (true);
+
+    // session: every channel gets a patch, some keep sounding
+    Reset ();
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+        PrepareGlobal (chip);
+    for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+    {
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+            Prepare (chip, channel, Random () % g_nPatches);
+    }
+    bool sounding[YM_COUNT][YM_CHANNELS] = {};
+    for (unsigned n = 0; n < nSounding; )
+    {
+        u32 nRandom = Random ();
+        u8 chip = nRandom % YM_COUNT;
+        u8 channel = (nRandom >> 8) % YM_CHANNELS;
+        if (sounding[chip][channel])
+            continue;
+        sounding[chip][channel] = true;
+        KeyOn (chip, channel);
+        n++;
+    }
+    while (Pending ())
+        Pump ();
+
+    s_Snapshot.Take (s_Pump.GetShadow ());
+    s_Session = s_Pump.GetShadow ();
+    u8 soundingChip = 0, soundingChannel = 0, otherChip = 0, otherChannel = 0;
+    for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+    {
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+        {
+            s_Snapshot.SetChannel (chip, channel, s_Patch[chip][channel], sounding[chip][channel]);
+            s_SessionPatch[chip][channel] = s_Patch[chip][channel];
+            // the last of each kind in restore order, the worst case for the warm path
+            if (sounding[chip][channel])
+                soundingChip = chip, soundingChannel = channel;
+            else
+                otherChip = chip, otherChannel = channel;
+        }
+    }
+
+    TResult cold = Restart (false, soundingChip, soundingChannel, otherChip, otherChannel);
+    TResult warm = Restart (true, soundingChip, soundingChannel, otherChip, otherChannel);
+
+    // the warm restart has to leave every chip where the session left it, fnums and key on aside
+    unsigned nMismatches = 0;
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+    {
+        for (unsigned bank = 0; bank < 2; bank++)
+        {
+            for (unsigned address = 0x21; address < 0xb8; address++)
+            {
+                u8 nData;
+                if (   address != YM_REG_KEY_ON
+                    && !(address >= 0xa0 && address < 0xb0)
+                    && s_Session.Get (chip, bank, address, &nData)
+                    && s_Bus.GetRegister (chip, bank, address) != nData)
+                    nMismatches++;
+            }
+        }
+    }
+
+    printf ("%u of %u channels sounding at the reset\n", nSounding, YM_COUNT * YM_CHANNELS);
+    printf ("%-6s %8s %8s %14s %14s\n", "start", "writes", "bytes", "sounding us", "other us");
+    printf ("%-6s %8u %8llu %14.1f %14.1f\n", "cold", cold.Writes, (unsigned long long) cold.Bytes,
+            cold.SoundingNs / 1000.0, cold.OtherNs / 1000.0);
+    printf ("%-6s %8u %8llu %14.1f %14.1f\n", "warm", warm.Writes, (unsigned long long) warm.Bytes,
+            warm.SoundingNs / 1000.0, warm.OtherNs / 1000.0);
+    printf ("sounding-channel writes not in when notes may start: %u\n", warm.Missing);
+    printf ("registers different after the warm start: %u\n", nMismatches);
+
+    return nMismatches == 0 && warm.Missing == 0 ? 0 : 2;
+}
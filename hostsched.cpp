@@ -0,0 +1,144 @@
+//
+// hostsched.cpp
+//
+// Drives CEventScheduler from a fake clock the way CKernel::Run does and
+// prints its jitter histogram:
+//
+//   make hostsched && ./hostsched [events]
+//
+// Notes arrive with random gaps (mean NOTE_GAP_US) and wait on a FIFO, as on
+// m_Notes; a simulated Run loop polls the front of it once per pass and
+// dispatches whatever IsDue says is due. A pass takes a random time around
+// the loop period, and every STALL_EVERY_US the loop stalls for STALL_US, as
+// when a log line or a USB transfer holds it up. Time is the fake clock in
+// CTimer ticks throughout, so the run is the same every time.
+//
+// Each loop period prints the histogram's summary as the kernel logs it, then
+// the non-empty buckets. The due times themselves are checked: the first
+// whole tick at or after a YM sample boundary, no earlier than the lookahead
+// after the timestamp and at most one sample (rounded up to a tick) later,
+// and nothing dispatched before it is due; the run fails if any isn't.
+//
+#include "eventscheduler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <deque>
+
+#define NOTE_GAP_US         300
+#define STALL_EVERY_US      100000
+#define STALL_US            1500
+
+static u32 Random (u32 *pSeed)
+{
+    *pSeed ^= *pSeed << 13;
+    *pSeed ^= *pSeed >> 17;
+    *pSeed ^= *pSeed << 5;
+    return *pSeed;
+}
+
+struct TResult
+{
+    unsigned Early;         // dispatched before due
+    unsigned OffGrid;       // due time not on a sample boundary
+    unsigned OffLookahead;  // due time before the lookahead or more than a sample after it
+};
+
+static TResult Run (CEventScheduler *pScheduler, unsigned nLoopUs, unsigned nEvents)
+{
+    TResult result = {};
+    u32 nSeed = 0x7f4a7c15;
+    const u64 nSampleDenominator = (u64) YM_SAMPLE_DIV * EVENT_TICKS_PER_SECOND;
+    // one sample, rounded up to whole ticks as GetSampleTime rounds
+    u64 nSampleTicks = ((u64) YM_SAMPLE_DIV * EVENT_TICKS_PER_SECOND + YM_CLOCK - 1) / YM_CLOCK;
+
+    const u64 nEpoch = 1000;
+    u64 nNow = nEpoch;
+    pScheduler->Reset (nEpoch);
+    std::deque<u64> notes;
+    u64 nNextArrival = nNow;
+    u64 nNextStall = nNow + STALL_EVERY_US;
+    unsigned nArrived = 0, nDispatched = 0;
+    while (nDispatched < nEvents)
+    {
+        // arrivals up to now, stamped when they came in, as the MIDI handler does
+        while (nArrived < nEvents && nNextArrival <= nNow)
+        {
+            notes.push_back (nNextArrival);
+            nArrived++;
+            nNextArrival += 1 + Random (&nSeed) % (2 * NOTE_GAP_US);
+        }
+
+        while (!notes.empty () && pScheduler->IsDue (notes.front (), nNow))
+        {
+            u64 nTimestamp = notes.front ();
+            notes.pop_front ();
+            u64 nDue = pScheduler->GetDueTime (nTimestamp);
+            if (nNow < nDue)
+                result.Early++;
+            // a boundary n * YM_SAMPLE_DIV / YM_CLOCK s after the epoch has to fall in (due - 1, due]
+            u64 nTicks = nDue - nEpoch;
+            if (nTicks && (nTicks * YM_CLOCK / nSampleDenominator == (nTicks - 1) * YM_CLOCK / nSampleDenominator))
+                result.OffGrid++;
+            if (nDue < nTimestamp + EVENT_LOOKAHEAD_US || nDue > nTimestamp + EVENT_LOOKAHEAD_US + nSampleTicks)
+                result.OffLookahead++;
+            pScheduler->Dispatched (nTimestamp, nNow);
+            nDispatched++;
+        }
+
+        // the rest of the pass: the bus, the VGM players, the serial link
+        nNow += nLoopUs / 2 + Random (&nSeed) % (nLoopUs + 1);
+        if (nNow >= nNextStall)
+        {
+            nNow += STALL_US;
+            nNextStall += STALL_EVERY_US;
+        }
+    }
+    return result;
+}
+
+static void Print (const CEventScheduler &scheduler, unsigned nLoopUs)
+{
+    const CHistogram<EVENT_JITTER_BUCKETS> &jitter = scheduler.GetJitter ();
+    printf ("loop %u us: %u events, mean %u us, p50 %u us, p99 %u us, max %u us, %u late\n", nLoopUs,
+            jitter.GetCount (), jitter.GetMean (), jitter.GetPercentile (50), jitter.GetPercentile (99),
+            jitter.GetMax (), scheduler.GetLate ());
+    for (unsigned b = 0; b <= jitter.Buckets; b++)
+    {
+        if (!jitter.GetBucket (b))
+            continue;
+        unsigned nPercent = (unsigned) ((u64) jitter.GetBucket (b) * 100 / jitter.GetCount ());
+        printf ("  %s%4u us: %8u ", b == jitter.Buckets ? ">=" : "< ",
+                (b == jitter.Buckets ? b : b + 1) * jitter.GetBucketWidth (), jitter.GetBucket (b));
+        for (unsigned n = 0; n < nPercent / 2; n++)
+            putchar ('#');
+        putchar ('\n');
+    }
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nEvents = argc > 1 ? atoi (argv[1]) : 200000;
+    if (nEvents == 0)
+    {
+        fprintf (stderr, "events must be positive\n");
+        return 1;
+    }
+
+    static const unsigned s_LoopUs[] = { 5, 20, 50, 200 };
+    CEventScheduler *pScheduler = new CEventScheduler;
+    TResult total = {};
+    for (unsigned nLoopUs : s_LoopUs)
+    {
+        TResult result = Run (pScheduler, nLoopUs, nEvents);
+        Print (*pScheduler, nLoopUs);
+        total.Early += result.Early;
+        total.OffGrid += result.OffGrid;
+        total.OffLookahead += result.OffLookahead;
+    }
+    delete pScheduler;
+
+    printf ("%-48s %s\n", "nothing dispatched before it was due", total.Early ? "FAIL" : "ok");
+    printf ("%-48s %s\n", "due times on the sample grid", total.OffGrid ? "FAIL" : "ok");
+    printf ("%-48s %s\n", "due at most a sample after the lookahead", total.OffLookahead ? "FAIL" : "ok");
+    return total.Early || total.OffGrid || total.OffLookahead ? 2 : 0;
+}
@@ -0,0 +1,483 @@
+//
+// hostserial.cpp
+//
+// Stand-in for the UART register-stream link on Linux, over a pty:
+//
+//   make hostserial && ./hostserial
+//
+// One thread is the device: it reads the pty's slave end in raw mode, feeds
+// CSerialLink as the kernel's main loop does and plays the frames onto a
+// simulated bus that takes a set number of writes per second and refuses
+// writes past a queue depth, like the overload watermark. The main
+// thread is the PC: it sends a random register stream (runs over all chips,
+// with waits in the timed case) as data frames on the master end, paced to
+// 3 Mbaud, keeps within the credits of the replies, and goes back to the
+// frame after ack on an error reply or when replies stop coming.
+//
+// Line errors are injected in both directions (flipped bits, dropped and
+// stray bytes) at a per-byte rate. Every case checks the device played
+// exactly the writes that were sent, in order, none lost or doubled, and
+// that no frame had to be turned away for lack of credit; the timed case
+// also checks the waits took as long as they add up to.
+//
+#include "seriallink.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define LINE_BYTES_PER_SECOND   300000      // 3 Mbaud, 8N1
+#define REPLY_TIMEOUT_US        20000
+#define BUS_QUEUE_LIMIT         1000        // QUEUE_SIZE_LIMIT
+#define BUS_BUSY                (BUS_QUEUE_LIMIT * 3 / 4)
+#define RUN_MAX                 12
+
+static u64 NowUs (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/// @brief xorshift, one per thread.
+struct TRandom
+{
+    u32 Seed;
+
+    u32 operator() (void)
+    {
+        Seed ^= Seed << 13;
+        Seed ^= Seed >> 17;
+        Seed ^= Seed << 5;
+        return Seed;
+    }
+
+    /// @brief true with probability fRate.
+    bool Chance (double fRate)
+    {
+        return fRate > 0 && (*this) () < fRate * 4294967296.0;
+    }
+};
+
+/// @brief Flips bits, drops bytes and adds stray ones at a per-byte rate.
+static void Corrupt (std::vector<u8> &bytes, double fRate, TRandom &random)
+{
+    if (fRate <= 0)
+        return;
+    std::vector<u8> out;
+    out.reserve (bytes.size () + 8);
+    for (u8 nByte : bytes)
+    {
+        if (random.Chance (fRate))
+        {
+            switch (random () % 3)
+            {
+            case 0:     out.push_back (nByte ^ 1 << random () % 8);                 break;
+            case 1:                                                                 break;
+            default:    out.push_back (nByte); out.push_back ((u8) random ());      break;
+            }
+            continue;
+        }
+        out.push_back (nByte);
+    }
+    bytes.swap (out);
+}
+
+struct TWrite
+{
+    u8 Chip;
+    bool Bank;
+    u8 Address;
+    u8 Data;
+
+    bool operator== (const TWrite &other) const
+    {
+        return    Chip == other.Chip && Bank == other.Bank
+               && Address == other.Address && Data == other.Data;
+    }
+};
+
+struct TCase
+{
+    const char *Name;
+    unsigned Writes;
+    unsigned BusRate;           // writes per second the simulated bus takes
+    double ErrorRate;           // per byte, each direction
+    unsigned WaitSamples;       // a wait after every run of writes, 0 for none
+};
+
+/// @brief The device end: what the kernel's main loop does with m_Serial.
+class CDevice
+{
+public:
+    CDevice (int nFD, const TCase &test)
+    :   m_nFD (nFD),
+        m_Test (test),
+        m_Link (WriteHandler, SendHandler, this)
+    {
+        m_Random.Seed = 0x27d4eb2f;
+    }
+
+    void Run (void)
+    {
+        u64 nLast = NowUs ();
+        u8 buffer[256];
+        while (!m_bStop.load ())
+        {
+            pollfd fd = { m_nFD, POLLIN, 0 };
+            poll (&fd, 1, 1);
+            int nBytes;
+            while ((nBytes = read (m_nFD, buffer, sizeof buffer)) > 0)
+                m_Link.Receive (buffer, nBytes);
+
+            // the bus drains at its rate
+            u64 nNow = NowUs ();
+            double fDrained = (double) (nNow - nLast) * m_Test.BusRate / 1e6 + m_fCarry;
+            unsigned nDrained = (unsigned) fDrained;
+            m_fCarry = fDrained - nDrained;
+            m_nDepth = m_nDepth > nDrained ? m_nDepth - nDrained : 0;
+            nLast = nNow;
+
+            m_Link.Update (nNow);
+            if (m_nDepth > m_nMaxDepth)
+                m_nMaxDepth = m_nDepth;
+        }
+    }
+
+    std::atomic<bool> m_bStop {false};
+    std::atomic<size_t> m_nWrites {0};
+    std::vector<TWrite> m_Writes;
+    u64 m_nFirstWrite = 0;
+    u64 m_nLastWrite = 0;
+    unsigned m_nMaxDepth = 0;
+
+    const TSerialStats &GetStats (void) const { return m_Link.GetStats (); }
+
+private:
+    static bool WriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData)
+    {
+        CDevice *pThis = (CDevice *) pParam;
+        if (pThis->m_nDepth >= BUS_BUSY)
+            return false;
+        pThis->m_Writes.push_back ({ nChip, bBank, nAddress, nData });
+        pThis->m_nWrites++;
+        pThis->m_nDepth++;
+        pThis->m_nLastWrite = NowUs ();
+        if (!pThis->m_nFirstWrite)
+            pThis->m_nFirstWrite = pThis->m_nLastWrite;
+        return true;
+    }
+
+    static void SendHandler (void *pParam, const u8 *pData, unsigned nLength)
+    {
+        CDevice *pThis = (CDevice *) pParam;
+        std::vector<u8> bytes (pData, pData + nLength);
+        Corrupt (bytes, pThis->m_Test.ErrorRate, pThis->m_Random);
+        if (!bytes.empty () && write (pThis->m_nFD, bytes.data (), bytes.size ()) < 0)
+            perror ("device write");
+    }
+
+    int m_nFD;
+    const TCase &m_Test;
+    CSerialLink m_Link;
+    TRandom m_Random;
+    unsigned m_nDepth = 0;
+    double m_fCarry = 0;
+};
+
+/// @brief The PC end.
+class CHost
+{
+public:
+    CHost (int nFD, const TCase &test)
+    :   m_nFD (nFD),
+        m_Test (test)
+    {
+        m_Random.Seed = 0x165667b1;
+        Build ();
+    }
+
+    /// @return false if it gave up.
+    bool Run (void)
+    {
+        u64 nStart = NowUs ();
+        m_nLineFree = nStart;
+        m_nLastReply = nStart;
+        Query ();
+
+        while (m_nAcked < m_Frames.size ())
+        {
+            Replies ();
+
+            u64 nNow = NowUs ();
+            if (nNow - m_nLastReply > REPLY_TIMEOUT_US)
+            {
+                if (m_nNext > m_nAcked)
+                {
+                    // lost replies or lost frames: start over from the frame after ack
+                    m_nTimeouts++;
+                    m_nNext = m_nAcked;
+                    m_nCredits = 0;
+                    Query ();
+                }
+                else if (!m_nCredits)
+                {
+                    // the reply that frees a buffer may have been lost
+                    Query ();
+                }
+                m_nLastReply = nNow;
+            }
+            if (nNow - nStart > 60000000)
+                return false;
+
+            while (m_bSynced && m_nCredits && m_nNext < m_Frames.size ())
+            {
+                Send (m_Frames[m_nNext], m_nNext >= m_nHighest);
+                m_nNext++;
+                if (m_nNext > m_nHighest)
+                    m_nHighest = m_nNext;
+                m_nCredits--;
+            }
+
+            pollfd fd = { m_nFD, POLLIN, 0 };
+            poll (&fd, 1, 1);
+        }
+        return true;
+    }
+
+    std::vector<TWrite> m_Expected;
+    u64 m_nWaitUs = 0;              // what the waits add up to
+    unsigned m_nSent = 0;           // data frames, repeats included
+    unsigned m_nResent = 0;
+    unsigned m_nTimeouts = 0;
+    unsigned m_nErrorReplies = 0;
+    u64 m_nWireBytes = 0;
+
+    size_t GetFrames (void) const { return m_Frames.size (); }
+
+private:
+    void Build (void)
+    {
+        TRandom random = { 0x9e3779b9 };
+        std::vector<u8> payload;
+        unsigned nWrites = 0;
+        while (nWrites < m_Test.Writes)
+        {
+            std::vector<u8> run;
+            unsigned nRun = 1 + random () % RUN_MAX;
+            u8 nChip = random () % YM_COUNT;
+            bool bBank = random () & 1;
+            run.push_back (nChip << 1 | bBank);
+            run.push_back (nRun);
+            for (unsigned i = 0; i < nRun; i++)
+            {
+                TWrite write = { nChip, bBank, (u8) random (), (u8) random () };
+                run.push_back (write.Address);
+                run.push_back (write.Data);
+                m_Expected.push_back (write);
+            }
+            if (m_Test.WaitSamples)
+            {
+                run.insert (run.end (), { REGISTER_STREAM_WAIT, (u8) m_Test.WaitSamples, (u8) (m_Test.WaitSamples >> 8) });
+                m_nWaitSamples += m_Test.WaitSamples;
+            }
+            if (payload.size () + run.size () > SERIAL_PAYLOAD_MAX)
+            {
+                m_Frames.push_back (payload);
+                payload.clear ();
+            }
+            payload.insert (payload.end (), run.begin (), run.end ());
+            nWrites += nRun;
+        }
+        m_Frames.push_back (payload);
+        m_nWaitUs = m_nWaitSamples * 1000000 / VGM_SAMPLE_RATE;
+    }
+
+    /// @brief Writes to the line no faster than the UART would.
+    void Line (std::vector<u8> &bytes)
+    {
+        Corrupt (bytes, m_Test.ErrorRate, m_Random);
+        u64 nNow = NowUs ();
+        if (m_nLineFree < nNow)
+            m_nLineFree = nNow;
+        m_nLineFree += (u64) bytes.size () * 1000000 / LINE_BYTES_PER_SECOND;
+        while (NowUs () < m_nLineFree)
+            Replies ();
+        size_t nDone = 0;
+        while (nDone < bytes.size ())
+        {
+            ssize_t nBytes = write (m_nFD, bytes.data () + nDone, bytes.size () - nDone);
+            if (nBytes > 0)
+                nDone += nBytes;
+            else
+                Replies ();
+        }
+        m_nWireBytes += bytes.size ();
+    }
+
+    void Query (void)
+    {
+        std::vector<u8> frame (CSerialLink::EncodedSize (0));
+        frame.resize (CSerialLink::Encode (SerialFrameQuery, 0, 0, 0, frame.data ()));
+        Line (frame);
+    }
+
+    void Send (const std::vector<u8> &payload, bool bFirst)
+    {
+        std::vector<u8> frame (CSerialLink::EncodedSize (payload.size ()));
+        frame.resize (CSerialLink::Encode (SerialFrameData, (u8) (m_nBase + m_nNext), payload.data (), payload.size (), frame.data ()));
+        m_nSent++;
+        if (!bFirst)
+            m_nResent++;
+        Line (frame);
+    }
+
+    /// @brief Takes whatever replies have come in.
+    void Replies (void)
+    {
+        u8 buffer[256];
+        ssize_t nBytes;
+        while ((nBytes = read (m_nFD, buffer, sizeof buffer)) > 0)
+        {
+            for (ssize_t i = 0; i < nBytes; i++)
+            {
+                if (buffer[i])
+                {
+                    if (m_Reply.size () < 64)
+                        m_Reply.push_back (buffer[i]);
+                    continue;
+                }
+                TSerialReply reply;
+                if (CSerialLink::DecodeReply (m_Reply.data (), m_Reply.size (), &reply))
+                    Reply (reply);
+                m_Reply.clear ();
+            }
+        }
+    }
+
+    void Reply (const TSerialReply &reply)
+    {
+        m_nLastReply = NowUs ();
+        if (!m_bSynced)
+        {
+            // the first reply says where the device's sequence is
+            m_nBase = reply.Ack + 1;
+            m_bSynced = true;
+        }
+
+        // frames up to ack are done; an ack from before them is stale
+        unsigned nAcked = (u8) (reply.Ack - (u8) (m_nBase + m_nAcked - 1));
+        if (nAcked <= m_nHighest - m_nAcked)
+            m_nAcked += nAcked;
+        if (m_nNext < m_nAcked)
+            m_nNext = m_nAcked;
+
+        if (reply.Status != SerialOK && reply.Status != SerialBadStream)
+        {
+            m_nErrorReplies++;
+            m_nNext = m_nAcked;
+        }
+        unsigned nOutstanding = m_nNext - m_nAcked;
+        m_nCredits = reply.Credits > nOutstanding ? reply.Credits - nOutstanding : 0;
+    }
+
+    int m_nFD;
+    const TCase &m_Test;
+    TRandom m_Random;
+    std::vector<std::vector<u8>> m_Frames;
+    std::vector<u8> m_Reply;
+    u64 m_nWaitSamples = 0;
+
+    bool m_bSynced = false;
+    u8 m_nBase = 0;                 // seq of frame 0
+    size_t m_nAcked = 0;            // frames the device has taken
+    size_t m_nNext = 0;             // next frame to send
+    size_t m_nHighest = 0;          // frames sent at least once
+    unsigned m_nCredits = 0;
+    u64 m_nLineFree = 0;
+    u64 m_nLastReply = 0;
+};
+
+static const TCase s_Cases[] =
+{
+    { "clean",              400000, 1600000, 0,     0   },
+    { "slow bus",           100000,   50000, 0,     0   },
+    { "errors 1e-5",        200000, 1600000, 1e-5,  0   },
+    { "errors 1e-4",        200000, 1600000, 1e-4,  0   },
+    { "errors 1e-3",         50000, 1600000, 1e-3,  0   },
+    { "timed",               20000, 1600000, 0,     44  },
+    { "timed, errors 1e-4",  20000, 1600000, 1e-4,  44  },
+};
+
+static void Raw (int nFD)
+{
+    termios tio;
+    tcgetattr (nFD, &tio);
+    cfmakeraw (&tio);
+    tcsetattr (nFD, TCSANOW, &tio);
+    fcntl (nFD, F_SETFL, fcntl (nFD, F_GETFL) | O_NONBLOCK);
+}
+
+int main (void)
+{
+    unsigned nFailed = 0;
+
+    printf ("%-19s %7s %6s %10s %7s %7s %6s %6s %7s %7s %7s %7s %6s\n", "case", "writes", "frames", "writes/s",
+            "line %", "resent", "tmouts", "badcrc", "badfrm", "seq", "credit", "maxq", "result");
+    for (const TCase &test : s_Cases)
+    {
+        int nMaster, nSlave;
+        if (openpty (&nMaster, &nSlave, 0, 0, 0) < 0)
+        {
+            perror ("openpty");
+            return 1;
+        }
+        Raw (nMaster);
+        Raw (nSlave);
+
+        CDevice device (nSlave, test);
+        CHost host (nMaster, test);
+        std::thread thread (&CDevice::Run, &device);
+        u64 nStart = NowUs ();
+        bool bDone = host.Run ();
+
+        // let the device play what it has
+        while (device.m_nWrites < host.m_Expected.size () && NowUs () - nStart < 70000000)
+            usleep (1000);
+        usleep (10000);
+        device.m_bStop = true;
+        thread.join ();
+        close (nMaster);
+        close (nSlave);
+
+        const TSerialStats &stats = device.GetStats ();
+        bool bOK = bDone && device.m_Writes == host.m_Expected && stats.NoCredit == 0 && device.m_nMaxDepth <= BUS_QUEUE_LIMIT;
+        double fSeconds = (device.m_nLastWrite - nStart) / 1e6;
+        double fLine = 100.0 * host.m_nWireBytes / (fSeconds * LINE_BYTES_PER_SECOND);
+        double fWaits = 0, fPlayed = 0;
+        if (test.WaitSamples)
+        {
+            // the waits set the pace: the last write comes after all but the last wait
+            fWaits = (host.m_nWaitUs - test.WaitSamples * 1000000.0 / VGM_SAMPLE_RATE) / 1e6;
+            fPlayed = (device.m_nLastWrite - device.m_nFirstWrite) / 1e6;
+            bOK = bOK && fPlayed >= fWaits * 0.999 && fPlayed < fWaits * 1.02 + 0.01;
+        }
+        printf ("%-19s %7zu %6zu %10.0f %7.1f %7u %6u %6u %7u %7u %7u %7u %6s\n", test.Name, host.m_Expected.size (),
+                host.GetFrames (), host.m_Expected.size () / fSeconds, fLine, host.m_nResent, host.m_nTimeouts,
+                stats.BadCRC, stats.BadFrames, stats.OutOfSequence, stats.NoCredit, device.m_nMaxDepth,
+                bOK ? "ok" : "FAILED");
+        if (test.WaitSamples)
+            printf ("%-19s waits add up to %.3f s, played in %.3f s, %u late waits rebased\n", "", fWaits, fPlayed, stats.Rebased);
+        nFailed += !bOK;
+    }
+
+    return nFailed ? 1 : 0;
+}
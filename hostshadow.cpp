@@ -0,0 +1,300 @@
+//
+// hostshadow.cpp
+//
+// Bus bytes the register shadow saves on a MIDI workload, through the
+// kernel's CSpinbusPump against the simulated Spinbus:
+//
+//   make hostshadow && ./hostshadow [seconds]
+//
+// The workload is four MIDI channels as a song would have them, each with its
+// own patch: a drum hit repeating the same key every 125 ms, a bass line
+// walking around an octave every 250 ms, three-note chords every second, and
+// a lead whose notes are bent up and back over their length with a pitch
+// bend every 10 ms. The master volume moves every two seconds. Notes take
+// voices from CVoiceAllocator and queue the writes CKernel does (YMPrepare
+// when the voice doesn't hold the patch, YMQueueNoteRaw, YMQueuePitchBend,
+// YMQueueVolume), and the pump runs until the queues are empty every 10 ms.
+//
+// Without the shadow every write offered would go out as a CMD_YM_REGDATA
+// of YM_WRITE_BYTES; bursts are off so the pump sends those too, and the
+// bytes it clocks out are set against that. At the end the simulator's
+// registers, including the fnum pairs behind its one latch per chip, have
+// to match the shadow.
+//
+#include "spinbussim.h"
+#include "spinbuspump.h"
+#include "voiceallocator.h"
+#include "fnumtable.h"
+#include "patches.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define YM_WRITE_BYTES      4       // CMD_YM_REGDATA, chip and bank, address, data
+#define VOICE_CHIPS         4
+#define TICK_MS             10
+#define MIDI_CHANNELS       4
+
+enum TPart
+{
+    PartDrum,
+    PartBass,
+    PartChords,
+    PartLead
+};
+
+static const u8 s_Patch[MIDI_CHANNELS] = { 3, 1, 0, 2 };
+
+class CWorkload
+{
+public:
+    CWorkload (void)
+    :   m_Pump (&m_Bus, &m_Overload, &m_Stats, &m_Log, PumpClock, this)
+    {
+        m_Voices.Reset (VOICE_CHIPS, YM_CHANNELS);
+        m_Pump.Reset ();
+        m_Pump.Sync ();
+        for (u16 voice = 0; voice < VOICE_LIMIT; voice++)
+            m_VoiceChannel[voice] = 0xff;
+    }
+
+    void Run (unsigned nMs)
+    {
+        unsigned nChord = 0;
+        u8 bassKey = 40;
+        for (m_nMs = 0; m_nMs < nMs; m_nMs += TICK_MS)
+        {
+            if (m_nMs % 125 == 0)
+            {
+                NoteOff (PartDrum, 36);
+                NoteOn (PartDrum, 36, 0x70);
+            }
+            if (m_nMs % 250 == 0)
+            {
+                NoteOff (PartBass, bassKey);
+                bassKey = 36 + (bassKey - 36 + 1 + Random () % 4) % 12;
+                NoteOn (PartBass, bassKey, 0x50 + Random () % 0x20);
+            }
+            if (m_nMs % 1000 == 0)
+            {
+                static const u8 s_Chords[4][3] = { {60, 64, 67}, {57, 60, 64}, {53, 57, 60}, {55, 59, 62} };
+                for (u8 n = 0; n < 3; n++)
+                    NoteOff (PartChords, s_Chords[nChord % 4][n]);
+                nChord++;
+                for (u8 n = 0; n < 3; n++)
+                    NoteOn (PartChords, s_Chords[nChord % 4][n], 0x60);
+            }
+            if (m_nMs % 500 == 0)
+            {
+                NoteOff (PartLead, m_LeadKey);
+                m_LeadKey = 72 + Random () % 12;
+                PitchBend (PartLead, 0);
+                NoteOn (PartLead, m_LeadKey, 0x68);
+            }
+            else
+            {
+                // up a semitone and back over the note's 500 ms
+                int phase = m_nMs % 500;
+                PitchBend (PartLead, (phase < 250 ? phase : 500 - phase) * 4096 / 250);
+            }
+            if (m_nMs % 2000 == 1000)
+            {
+                m_Volume = 0x60 + Random () % 0x20;
+                Volume ();
+            }
+
+            while (m_Pump.GetPending ())
+                m_Pump.Process ();
+        }
+    }
+
+    /// @return false if the chips don't hold what the shadow says.
+    bool Report (void) const
+    {
+        const CYMShadow &shadow = m_Pump.GetShadow ();
+        u32 nCoalesced = 0;
+        for (u8 chip = 0; chip < YM_COUNT; chip++)
+            nCoalesced += m_Pump.GetQueue (chip).GetCoalesced ();
+
+        unsigned nMismatches = 0;
+        for (u8 chip = 0; chip < VOICE_CHIPS; chip++)
+        {
+            for (unsigned bank = 0; bank < 2; bank++)
+            {
+                for (unsigned address = 0x30; address < 0xb8; address++)
+                {
+                    u8 nData;
+                    if (   shadow.Get (chip, bank, address, &nData)
+                        && m_Bus.GetRegister (chip, bank, address) != nData)
+                        nMismatches++;
+                }
+            }
+        }
+
+        u64 nRaw = m_nOffered * YM_WRITE_BYTES;
+        printf ("%u s of MIDI on %u chips\n", m_nMs / 1000, VOICE_CHIPS);
+        printf ("writes offered         %10llu\n", (unsigned long long) m_nOffered);
+        printf ("writes sent            %10llu\n", (unsigned long long) m_Bus.GetStats ().Writes);
+        printf ("elided by the shadow   %10u\n", shadow.GetElidedWrites ());
+        printf ("coalesced in queues    %10u\n", nCoalesced);
+        printf ("bus bytes, no shadow   %10llu\n", (unsigned long long) nRaw);
+        printf ("bus bytes, shadow      %10u  (%.1f%% saved)\n", m_Pump.GetBusBytes (),
+                100.0 * (nRaw - m_Pump.GetBusBytes ()) / nRaw);
+        printf ("register mismatches    %10u\n", nMismatches);
+        return nMismatches == 0;
+    }
+
+private:
+    void Enqueue (u8 chip, u8 address, u8 data, bool bank)
+    {
+        m_nOffered++;
+        m_Pump.Enqueue (chip, YMCommand (bank, address, data));
+    }
+
+    void NoteOn (u8 part, u8 key, u8 velocity)
+    {
+        // every part gets its own range of keys on the allocator
+        u8 voiceKey = (key & 0x1f) | part << 5;
+        TVoiceAllocation voice = m_Voices.NoteOn (voiceKey, s_Patch[part]);
+        u8 chip = voice.Voice / YM_CHANNELS;
+        u8 channel = voice.Voice % YM_CHANNELS;
+        if (voice.Stolen || voice.Retrigger)
+            Enqueue (chip, 0x28, channel + (channel > 2 ? 1 : 0), 0);
+        if (m_Voices.GetPatch (voice.Voice) != s_Patch[part])
+            Prepare (chip, channel, s_Patch[part]);
+        m_VoiceChannel[voice.Voice] = part;
+        m_VoiceKey[voice.Voice] = key;
+        m_VoiceVelocity[voice.Voice] = velocity;
+
+        const YMPatch &patch = g_Patches[s_Patch[part]];
+        u8 carriers = YMPatchCarriers (patch);
+        for (u8 op = 0; op < 4; op++)
+        {
+            if (carriers & BIT(op))
+                Enqueue (chip, 0x40 + op*4 + channel % 3, CarrierLevel (patch, op, velocity), channel > 2);
+        }
+        Fnum (chip, channel, YMKeyToNote (key, YMBendToFine (m_Bend[part])));
+        Enqueue (chip, 0x28, 0xf0 + channel + (channel > 2 ? 1 : 0), 0);
+    }
+
+    void NoteOff (u8 part, u8 key)
+    {
+        u16 voice = m_Voices.NoteOff ((key & 0x1f) | part << 5);
+        if (voice == VOICE_NONE)
+            return;
+        u8 channel = voice % YM_CHANNELS;
+        m_VoiceChannel[voice] = 0xff;
+        Enqueue (voice / YM_CHANNELS, 0x28, channel + (channel > 2 ? 1 : 0), 0);
+    }
+
+    /// @brief CKernel::YMQueuePitchBend.
+    void PitchBend (u8 part, int bend)
+    {
+        m_Bend[part] = bend;
+        for (u16 voice = 0; voice < m_Voices.GetVoiceCount (); voice++)
+        {
+            if (m_VoiceChannel[voice] == part)
+                Fnum (voice / YM_CHANNELS, voice % YM_CHANNELS, YMKeyToNote (m_VoiceKey[voice], YMBendToFine (bend)));
+        }
+    }
+
+    /// @brief CKernel::YMQueueVolume, one write per chip.
+    void Volume (void)
+    {
+        for (u16 voice = 0; voice < m_Voices.GetVoiceCount (); voice++)
+        {
+            u8 patchId = m_Voices.GetPatch (voice);
+            const YMPatch &patch = g_Patches[patchId == PATCH_NONE ? 0 : patchId];
+            u8 channel = voice % YM_CHANNELS;
+            for (u8 op = 0; op < 4; op++)
+            {
+                if (YMPatchCarriers (patch) & BIT(op))
+                    Enqueue (voice / YM_CHANNELS, 0x40 + op*4 + channel % 3,
+                             CarrierLevel (patch, op, m_VoiceVelocity[voice]), channel > 2);
+            }
+        }
+    }
+
+    void Fnum (u8 chip, u8 channel, u16 word)
+    {
+        Enqueue (chip, 0xa4 + channel % 3, word >> 8, channel > 2);
+        Enqueue (chip, 0xa0 + channel % 3, word & 0xff, channel > 2);
+    }
+
+    /// @brief CKernel::YMPrepareChips for one chip.
+    void Prepare (u8 chip, u8 channelIdx, u8 patchId)
+    {
+        bool bank = channelIdx > 2;
+        u8 chMod = channelIdx % 3;
+        const YMPatch &patch = g_Patches[patchId];
+
+        Enqueue (chip, 0x28, bank ? channelIdx + 1 : channelIdx, 0);
+        for (u8 op = 0; op < 4; op++)
+        {
+            u8 opMod = chMod + op*4;
+            Enqueue (chip, 0x30+opMod, patch.DetuneMultiply[op], bank);
+            Enqueue (chip, 0x40+opMod, patch.TotalLevel[op], bank);
+            Enqueue (chip, 0x50+opMod, patch.AttackRate[op], bank);
+            Enqueue (chip, 0x60+opMod, patch.DecayRate[op], bank);
+            Enqueue (chip, 0x70+opMod, patch.SustainRate[op], bank);
+            Enqueue (chip, 0x80+opMod, patch.ReleaseRate[op], bank);
+            Enqueue (chip, 0x90+opMod, patch.SSGEG[op], bank);
+        }
+        Enqueue (chip, 0xB0+chMod, patch.FeedbackAlgorithm, bank);
+        Enqueue (chip, 0xB4+chMod, patch.PanModulation, bank);
+        m_Voices.SetPatch (chip*YM_CHANNELS + channelIdx, patchId);
+    }
+
+    /// @brief CKernel::YMCarrierLevel.
+    u8 CarrierLevel (const YMPatch &patch, u8 op, u8 velocity) const
+    {
+        u16 level = patch.TotalLevel[op] + (0x7f - velocity) + (0x7f - m_Volume);
+        return level > 0x7f ? 0x7f : level;
+    }
+
+    static u32 Random (void)
+    {
+        static u32 s_nSeed = 0x2f6b4e13;
+        s_nSeed ^= s_nSeed << 13;
+        s_nSeed ^= s_nSeed >> 17;
+        s_nSeed ^= s_nSeed << 5;
+        return s_nSeed;
+    }
+
+    static u32 PumpClock (void *pParam)
+    {
+        return (u32) (((CWorkload *) pParam)->m_Bus.GetTime () / 1000);
+    }
+
+    CSimSpinbus m_Bus;
+    COverloadControl m_Overload;
+    CBusStats m_Stats {1000000};
+    CDeferredLog m_Log;
+    CSpinbusPump m_Pump;
+    CVoiceAllocator m_Voices;
+
+    u8 m_VoiceChannel[VOICE_LIMIT];
+    u8 m_VoiceKey[VOICE_LIMIT] = {};
+    u8 m_VoiceVelocity[VOICE_LIMIT] = {};
+    int m_Bend[MIDI_CHANNELS] = {};
+    u8 m_LeadKey = 72;
+    u8 m_Volume = 0x7f;
+    unsigned m_nMs = 0;
+    u64 m_nOffered = 0;
+};
+
+int main (int argc, char **argv)
+{
+    double fSeconds = argc > 1 ? atof (argv[1]) : 60.0;
+    if (fSeconds <= 0)
+    {
+        fprintf (stderr, "seconds must be positive\n");
+        return 1;
+    }
+
+    CWorkload *pWorkload = new CWorkload;
+    pWorkload->Run ((unsigned) (fSeconds * 1000));
+    bool bOK = pWorkload->Report ();
+    delete pWorkload;
+
+    return bOK ? 0 : 2;
+}
@@ -0,0 +1,213 @@
+//
+// hostspsc.cpp
+//
+// Stress test for CSPSCRing with the producer and the consumer on separate
+// threads, as MIDIPacketHandler and the Run loop use m_Notes:
+//
+//   make hostspsc && ./hostspsc [events]
+//
+// The producer numbers every event it gets into the ring and fills the rest
+// of it from that number, so the consumer can tell a lost, repeated, reordered
+// or torn event from a good one. It pushes one at a time (Push) and in
+// batches built in place (GetSlot/Commit, as a USB buffer's notes are), and
+// the consumer alternates Peek and Pop, sometimes dawdling so the ring fills
+// up and rejects. Whichever side the ring turns away yields, so the two
+// interleave even where there is only one core. Rejected events are never numbered, so the consumer has to
+// see every number exactly once, in order, and the ring's overflow count has
+// to match the producer's rejections. Each mode runs on a ring the size of
+// m_Notes and on a tiny one that is full most of the time.
+//
+#include "spscring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+
+#define NOTE_QUEUE_SIZE     256     // kernel.h
+#define BATCH_MAX           16      // events per batch in the batched mode
+
+struct TEvent
+{
+    u32 Sequence;
+    u8  Key;
+    u8  Velocity;
+    u64 Timestamp;
+    u32 Check;
+};
+
+static TEvent MakeEvent (u32 nSequence)
+{
+    TEvent event;
+    event.Sequence = nSequence;
+    event.Key = nSequence & 0x7f;
+    event.Velocity = (nSequence >> 7) & 0x7f;
+    event.Timestamp = (u64) nSequence * 0x9e3779b97f4a7c15ULL;
+    event.Check = nSequence ^ 0xa5a5a5a5;
+    return event;
+}
+
+static bool IsIntact (const TEvent &event)
+{
+    TEvent expected = MakeEvent (event.Sequence);
+    return    event.Key == expected.Key && event.Velocity == expected.Velocity
+           && event.Timestamp == expected.Timestamp && event.Check == expected.Check;
+}
+
+static u64 NowNs (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u32 XorShift (u32 *pState)
+{
+    *pState ^= *pState << 13;
+    *pState ^= *pState >> 17;
+    *pState ^= *pState << 5;
+    return *pState;
+}
+
+struct TResult
+{
+    unsigned Received;
+    unsigned Rejected;      // as counted by the producer
+    unsigned Overflows;     // as counted by the ring
+    unsigned Lost;          // numbers skipped
+    unsigned OutOfOrder;    // numbers repeated or going backwards
+    unsigned Torn;
+    unsigned PeekMismatches;
+    double Seconds;
+};
+
+template <unsigned SIZE>
+static TResult Run (unsigned nEvents, bool bBatched)
+{
+    CSPSCRing<TEvent, SIZE> *pRing = new CSPSCRing<TEvent, SIZE>;
+    CSPSCRing<TEvent, SIZE> &ring = *pRing;
+
+    std::atomic<bool> bDone {false};
+    TResult result = {};
+    u64 nStart = NowNs ();
+
+    std::thread producer ([&] {
+        u32 nSeed = 0x12345678;
+        u32 nSequence = 0;
+        unsigned nRejected = 0;
+        for (unsigned nAttempts = 0; nAttempts < nEvents; )
+        {
+            // events come in about as fast as the consumer takes them
+            for (volatile unsigned n = XorShift (&nSeed) % (bBatched ? 400 : 40); n > 0; n--)
+                ;
+
+            if (!bBatched)
+            {
+                if (ring.Push (MakeEvent (nSequence)))
+                    nSequence++;
+                else
+                {
+                    nRejected++;
+                    std::this_thread::yield ();
+                }
+                nAttempts++;
+                continue;
+            }
+
+            unsigned nBatch = 1 + XorShift (&nSeed) % BATCH_MAX;
+            if (nBatch > nEvents - nAttempts)
+                nBatch = nEvents - nAttempts;
+            unsigned nFree = ring.GetFree ();
+            unsigned nCount = nBatch < nFree ? nBatch : nFree;
+            for (unsigned n = 0; n < nCount; n++)
+                ring.GetSlot (n) = MakeEvent (nSequence + n);
+            ring.Commit (nCount, nBatch - nCount);
+            nSequence += nCount;
+            nRejected += nBatch - nCount;
+            nAttempts += nBatch;
+            if (nCount < nBatch)
+                std::this_thread::yield ();
+        }
+        result.Rejected = nRejected;
+        bDone.store (true, std::memory_order_release);
+    });
+
+    std::thread consumer ([&] {
+        u32 nSeed = 0x87654321;
+        u32 nExpected = 0;
+        TEvent event;
+        while (true)
+        {
+            const TEvent *pPeek = ring.Peek ();
+            if (pPeek == 0)
+            {
+                if (bDone.load (std::memory_order_acquire) && ring.GetCount () == 0)
+                    break;
+                std::this_thread::yield ();
+                continue;
+            }
+            u32 nPeeked = pPeek->Sequence;
+            if (!ring.Pop (event))
+            {
+                result.PeekMismatches++;
+                continue;
+            }
+            if (event.Sequence != nPeeked)
+                result.PeekMismatches++;
+            if (!IsIntact (event))
+                result.Torn++;
+            if (event.Sequence > nExpected)
+                result.Lost += event.Sequence - nExpected;
+            else if (event.Sequence < nExpected)
+                result.OutOfOrder++;
+            nExpected = event.Sequence + 1;
+            result.Received++;
+
+            // now and then the Run loop is busy elsewhere
+            if (XorShift (&nSeed) % 256 == 0)
+            {
+                for (volatile unsigned n = 0; n < 2000; n++)
+                    ;
+            }
+        }
+    });
+
+    producer.join ();
+    consumer.join ();
+    result.Overflows = ring.GetOverflows ();
+    delete pRing;
+    result.Seconds = (NowNs () - nStart) / 1e9;
+    return result;
+}
+
+static bool Print (const char *pName, const TResult &result, unsigned nEvents)
+{
+    bool bOK =    result.Lost == 0 && result.OutOfOrder == 0 && result.Torn == 0 && result.PeekMismatches == 0
+               && result.Overflows == result.Rejected && result.Received + result.Rejected == nEvents;
+    printf ("%-18s %10u %10u %10u %6u %6u %6u %6u %10.0f  %s\n", pName, result.Received, result.Rejected,
+            result.Overflows, result.Lost, result.OutOfOrder, result.Torn, result.PeekMismatches,
+            result.Received / result.Seconds, bOK ? "ok" : "FAIL");
+    return bOK;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nEvents = argc > 1 ? atoi (argv[1]) : 2000000;
+    if (nEvents == 0)
+    {
+        fprintf (stderr, "events must be positive\n");
+        return 1;
+    }
+
+    // on one core the threads only meet at preemption points and the yields
+    printf ("%u events per run, %u hardware threads\n", nEvents, std::thread::hardware_concurrency ());
+    printf ("%-18s %10s %10s %10s %6s %6s %6s %6s %10s\n", "ring", "received", "rejected", "overflows",
+            "lost", "order", "torn", "peek", "events/s");
+    bool bOK = true;
+    bOK &= Print ("256, push", Run<NOTE_QUEUE_SIZE> (nEvents, false), nEvents);
+    bOK &= Print ("256, batched", Run<NOTE_QUEUE_SIZE> (nEvents, true), nEvents);
+    bOK &= Print ("8, push", Run<8> (nEvents, false), nEvents);
+    bOK &= Print ("8, batched", Run<8> (nEvents, true), nEvents);
+
+    return bOK ? 0 : 2;
+}
@@ -0,0 +1,604 @@
+//
+// hostsysex.cpp
+//
+// Test and USB loopback benchmark for register streams over SysEx:
+//
+//   make hostsysex && ./hostsysex [fuzz rounds]
+//
+// The device side is the kernel's, minus the hardware: CMIDIParser hands the
+// SysEx to CSysExStream, which decodes writes straight into slots of an SPSC
+// feed ring and publishes each message at its F7, replying with an ack that
+// carries the credits left.
+//
+// The fuzz part sends random register streams (with runs for chips that
+// don't exist, truncated streams, other manufacturers' SysEx, note traffic
+// and messages cut short by a status byte in between) as USB-MIDI event
+// packets in random buffer sizes, taken apart as CUSBMIDIDevice does, and
+// checks the feed gets exactly the writes of each message and every reply
+// says what happened. A chip past its overload watermark has to have its
+// writes refused and the reply give no credits.
+//
+// The benchmark stands in for the USB link and the bus in simulated time:
+// the host packs a tracker-like stream (runs of 1-12 writes, all chips) into
+// messages, sends them as 64-byte bulk packets as fast as the link and its
+// credits allow, the device parses every packet as it comes in, the bus
+// drains the feed at BUS_WRITES_PER_SECOND (what hostoverload measures for
+// the simulated bus), and replies reach the host in the next (micro)frame.
+// It reports sustained writes per second for full-speed and high-speed
+// links and several message sizes, and what happens to a host that ignores
+// the credits. The device-side CPU cost per write is measured for real.
+//
+#include "midiparser.h"
+#include "sysexstream.h"
+#include "spscring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <deque>
+#include <vector>
+
+#define SYSEX_FEED_SIZE         4096        // kernel.h
+#define SYSEX_ACK_QUEUE         16
+#define USB_BULK_PACKET         64
+#define USB_PACKET_SIZE         4           // a USB-MIDI event packet
+#define BUS_WRITES_PER_SECOND   1600000
+#define RUN_MAX                 12
+
+static u32 s_nSeed = 0x85ebca6b;
+
+static u32 Random (void)
+{
+    s_nSeed ^= s_nSeed << 13;
+    s_nSeed ^= s_nSeed >> 17;
+    s_nSeed ^= s_nSeed << 5;
+    return s_nSeed;
+}
+
+static u64 NowNs (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct TWrite
+{
+    u8 Chip;
+    bool Bank;
+    u8 Address;
+    u8 Data;
+
+    bool operator== (const TWrite &other) const
+    {
+        return    Chip == other.Chip && Bank == other.Bank
+               && Address == other.Address && Data == other.Data;
+    }
+};
+
+/// @brief The device: what MIDIPacketHandler, SysExHandler and SysExWriteHandler do in the kernel.
+class CDevice
+{
+public:
+    CDevice (void)
+    :   m_SysEx (WriteHandler, this)
+    {
+        m_Parser.SetSysExHandler (SysExHandler, this);
+    }
+
+    /// @brief As CUSBMIDIDevice calls MIDIPacketHandler: the MIDI bytes of each event packet, one call each.
+    void Receive (const u8 *pPackets, unsigned nLength)
+    {
+        // MIDI bytes by code index, USB MIDI 1.0 table 4-1
+        static const unsigned s_Length[16] = { 0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1 };
+        for (unsigned n = 0; n + USB_PACKET_SIZE <= nLength; n += USB_PACKET_SIZE)
+            m_Parser.Parse (pPackets + n + 1, s_Length[pPackets[n] & 0x0f], MessageHandler, this);
+    }
+
+    CSPSCRing<TWrite, SYSEX_FEED_SIZE> m_Feed;
+    CSPSCRing<TSysExAck, SYSEX_ACK_QUEUE> m_Acks;
+    unsigned m_nNotes = 0;
+    u32 m_nOverloaded = 0;      // as COverloadControl::GetOverloaded
+
+private:
+    static void MessageHandler (void *pParam, const TMIDIMessage &)
+    {
+        ((CDevice *) pParam)->m_nNotes++;
+    }
+
+    static void SysExHandler (void *pParam, TMIDISysExEvent eEvent, const u8 *pData, unsigned nLength)
+    {
+        CDevice *pThis = (CDevice *) pParam;
+        TSysExAck ack;
+        switch (eEvent)
+        {
+        case SysExStart:
+            pThis->m_SysEx.Start ();
+            pThis->m_nPending = 0;
+            pThis->m_nFree = pThis->m_Feed.GetFree ();
+            break;
+        case SysExData:
+            pThis->m_SysEx.Data (pData, nLength);
+            break;
+        case SysExEnd:
+            if (pThis->m_SysEx.End (&ack))
+            {
+                pThis->m_Feed.Commit (pThis->m_nPending, pThis->m_SysEx.GetDropped ());
+                unsigned nFree = pThis->m_nOverloaded ? 0 : pThis->m_Feed.GetFree ();
+                ack.Credits = nFree < SYSEX_VALUE_MAX ? nFree : SYSEX_VALUE_MAX;
+                pThis->m_Acks.Push (ack);
+            }
+            pThis->m_nPending = 0;
+            break;
+        case SysExAbort:
+            pThis->m_SysEx.Abort ();
+            pThis->m_nPending = 0;
+            break;
+        }
+    }
+
+    static bool WriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData)
+    {
+        CDevice *pThis = (CDevice *) pParam;
+        if (pThis->m_nOverloaded & BIT(nChip))
+            return false;
+        if (pThis->m_nPending == pThis->m_nFree)
+        {
+            pThis->m_nFree = pThis->m_Feed.GetFree ();
+            if (pThis->m_nPending == pThis->m_nFree)
+                return false;
+        }
+        pThis->m_Feed.GetSlot (pThis->m_nPending++) = { nChip, bBank, nAddress, nData };
+        return true;
+    }
+
+    CMIDIParser m_Parser;
+    CSysExStream m_SysEx;
+    unsigned m_nPending = 0;
+    unsigned m_nFree = 0;
+};
+
+/// @brief Appends a SysEx message as USB-MIDI event packets on cable 0.
+static void SysExPackets (std::vector<u8> &packets, const u8 *pMessage, unsigned nLength)
+{
+    while (nLength > 3)
+    {
+        packets.insert (packets.end (), { 0x04, pMessage[0], pMessage[1], pMessage[2] });
+        pMessage += 3;
+        nLength -= 3;
+    }
+    packets.push_back (0x04 + nLength);     // 5, 6, 7: ends with 1, 2, 3 bytes
+    for (unsigned i = 0; i < 3; i++)
+        packets.push_back (i < nLength ? pMessage[i] : 0);
+}
+
+/// @brief Appends a random register stream of about nWrites writes.
+/// @param pExpected gets the writes the device should take, if not 0.
+/// @param bBadChips throw in runs for chips that don't exist.
+/// @return the writes in the stream, including those for bad chips.
+static unsigned RandomStream (std::vector<u8> &stream, unsigned nWrites, std::vector<TWrite> *pExpected, bool bBadChips)
+{
+    unsigned nTotal = 0;
+    while (nTotal < nWrites)
+    {
+        unsigned nRun = 1 + Random () % RUN_MAX;
+        if (nRun > nWrites - nTotal)
+            nRun = nWrites - nTotal;
+        u8 nChip = bBadChips && Random () % 8 == 0 ? YM_COUNT + Random () % (127 - YM_COUNT) : Random () % YM_COUNT;
+        bool bBank = Random () & 1;
+        if (Random () % 16 == 0)
+        {
+            // an empty run now and then
+            stream.insert (stream.end (), { (u8) (nChip << 1 | bBank), 0 });
+        }
+        stream.insert (stream.end (), { (u8) (nChip << 1 | bBank), (u8) nRun });
+        for (unsigned i = 0; i < nRun; i++)
+        {
+            TWrite write = { nChip, bBank, (u8) Random (), (u8) Random () };
+            stream.insert (stream.end (), { write.Address, write.Data });
+            if (pExpected && nChip < YM_COUNT)
+                pExpected->push_back (write);
+        }
+        nTotal += nRun;
+    }
+    return nTotal;
+}
+
+/// @brief Walks a stream the slow way: the writes and status the device should come up with.
+static TRegisterStreamStatus Expect (const std::vector<u8> &stream, std::vector<TWrite> &writes)
+{
+    bool bBadChip = false;
+    size_t i = 0;
+    while (i < stream.size ())
+    {
+        if (i + 2 > stream.size ())
+            return RegisterStreamTruncated;
+        u8 nChip = stream[i] >> 1;
+        bool bBank = stream[i] & 1;
+        unsigned nRun = stream[i + 1];
+        i += 2;
+        bBadChip = bBadChip || (nRun && nChip >= YM_COUNT);
+        for (unsigned j = 0; j < nRun; j++, i += 2)
+        {
+            if (i + 2 > stream.size ())
+                return RegisterStreamTruncated;
+            if (nChip < YM_COUNT)
+                writes.push_back ({ nChip, bBank, stream[i], stream[i + 1] });
+        }
+    }
+    return bBadChip ? RegisterStreamBadChip : RegisterStreamOK;
+}
+
+static bool Check (bool bOK, const char *pWhat, unsigned nRound)
+{
+    if (!bOK)
+        printf ("  round %u: %s\n", nRound, pWhat);
+    return bOK;
+}
+
+/// @brief One round of random traffic; true if the device got it all right.
+static bool Fuzz (unsigned nRound)
+{
+    CDevice device;
+    std::vector<u8> packets;
+    std::vector<TWrite> expected;
+    std::vector<TSysExAck> acks;
+    u8 sequence = Random () & 0x7f;
+
+    for (unsigned nMessages = 1 + Random () % 8; nMessages; nMessages--)
+    {
+        std::vector<u8> stream;
+        std::vector<TWrite> writes;
+        TSysExAck ack = { sequence, RegisterStreamOK, 0, 0 };
+        TSysExCommand eCommand = SysExCmdWrite;
+        bool bSent = true;      // false if the device shouldn't see a message of its own
+        bool bAbort = false;
+
+        switch (Random () % 8)
+        {
+        case 0:
+            eCommand = SysExCmdQuery;
+            break;
+        case 1:
+            RandomStream (stream, 1 + Random () % 200, 0, true);
+            ack.Status = Expect (stream, writes);
+            break;
+        case 2:
+            // cut anywhere: the writes before the cut still count
+            RandomStream (stream, 2 + Random () % 200, 0, false);
+            stream.resize (1 + Random () % (stream.size () - 1));
+            ack.Status = Expect (stream, writes);
+            break;
+        case 3:
+            eCommand = (TSysExCommand) 0x7f;
+            ack.Status = RegisterStreamBadCommand;
+            break;
+        case 4:
+            // someone else's SysEx
+            bSent = false;
+            {
+                u8 message[] = { MIDI_STATUS_SYSEX, 0x7e, 0x7f, 0x06, 0x01, MIDI_STATUS_SYSEX_END };
+                SysExPackets (packets, message, sizeof message);
+            }
+            break;
+        case 5:
+            // cut short by a note on
+            bAbort = true;
+            RandomStream (stream, 1 + Random () % 50, 0, false);
+            break;
+        default:
+            RandomStream (stream, 1 + Random () % 400, &writes, false);
+            break;
+        }
+
+        if (bSent)
+        {
+            std::vector<u8> message (CSysExStream::EncodedSize (stream.size ()));
+            unsigned nLength = CSysExStream::Encode (eCommand, sequence, stream.data (), stream.size (), message.data ());
+            if (bAbort)
+            {
+                SysExPackets (packets, message.data (), nLength - 1);
+                packets.resize (packets.size () - 4);
+                packets.insert (packets.end (), { 0x09, 0x90, 0x40, 0x7f });
+            }
+            else
+            {
+                SysExPackets (packets, message.data (), nLength);
+                ack.Writes = writes.size ();
+                acks.push_back (ack);
+                expected.insert (expected.end (), writes.begin (), writes.end ());
+                sequence = (sequence + 1) & 0x7f;
+            }
+        }
+        if (Random () % 2)
+            packets.insert (packets.end (), { 0x08, 0x80, 0x40, 0x00 });
+    }
+
+    // in buffers of random size, as the USB layer may deliver them
+    for (size_t i = 0; i < packets.size (); )
+    {
+        size_t nLength = USB_PACKET_SIZE * (1 + Random () % 16);
+        if (nLength > packets.size () - i)
+            nLength = packets.size () - i;
+        device.Receive (&packets[i], nLength);
+        i += nLength;
+    }
+
+    bool bOK = true;
+    TWrite write;
+    std::vector<TWrite> got;
+    while (device.m_Feed.Pop (write))
+        got.push_back (write);
+    bOK = Check (got == expected, "writes differ", nRound) && bOK;
+
+    TSysExAck ack;
+    size_t nAck = 0;
+    while (device.m_Acks.Pop (ack))
+    {
+        if (nAck < acks.size ())
+        {
+            const TSysExAck &want = acks[nAck];
+            bOK = Check (   ack.Sequence == want.Sequence && ack.Status == want.Status
+                         && ack.Writes == want.Writes, "wrong reply", nRound) && bOK;
+        }
+        nAck++;
+    }
+    bOK = Check (nAck == acks.size (), "missing or extra replies", nRound) && bOK;
+
+    // the reply survives the trip
+    u8 reply[SYSEX_ACK_SIZE];
+    TSysExAck in = { 0x55, RegisterStreamOverflow, 12345, 4096 }, out;
+    bOK = Check (   CSysExStream::DecodeAck (reply, CSysExStream::EncodeAck (in, reply), &out)
+                 && out.Sequence == in.Sequence && out.Status == in.Status
+                 && out.Writes == in.Writes && out.Credits == in.Credits, "reply encoding", nRound) && bOK;
+    return bOK;
+}
+
+/// @brief A message bigger than the room left gets what fits and says so.
+static bool Overflow (void)
+{
+    CDevice device;
+    std::vector<u8> stream, packets;
+    std::vector<TWrite> writes;
+    RandomStream (stream, SYSEX_FEED_SIZE + 100, &writes, false);
+    std::vector<u8> message (CSysExStream::EncodedSize (stream.size ()));
+    SysExPackets (packets, message.data (), CSysExStream::Encode (SysExCmdWrite, 1, stream.data (), stream.size (), message.data ()));
+    device.Receive (packets.data (), packets.size ());
+
+    TSysExAck ack;
+    return    device.m_Acks.Pop (ack) && ack.Status == RegisterStreamOverflow
+           && ack.Writes == SYSEX_FEED_SIZE && ack.Credits == 0
+           && device.m_Feed.GetCount () == SYSEX_FEED_SIZE;
+}
+
+/// @brief Writes to an overloaded chip are refused, the rest taken, and no credits given.
+static bool Overloaded (void)
+{
+    CDevice device;
+    device.m_nOverloaded = BIT(3);
+    std::vector<u8> stream, packets;
+    std::vector<TWrite> writes, taken;
+    RandomStream (stream, 400, &writes, false);
+    for (const TWrite &write : writes)
+    {
+        if (write.Chip != 3)
+            taken.push_back (write);
+    }
+    std::vector<u8> message (CSysExStream::EncodedSize (stream.size ()));
+    SysExPackets (packets, message.data (), CSysExStream::Encode (SysExCmdWrite, 1, stream.data (), stream.size (), message.data ()));
+    device.Receive (packets.data (), packets.size ());
+
+    TSysExAck ack;
+    std::vector<TWrite> got;
+    TWrite write;
+    while (device.m_Feed.Pop (write))
+        got.push_back (write);
+    return    device.m_Acks.Pop (ack) && ack.Status == (taken.size () < writes.size () ? RegisterStreamOverflow : RegisterStreamOK)
+           && ack.Writes == taken.size () && ack.Credits == 0 && got == taken;
+}
+
+struct TLink
+{
+    const char *Name;
+    unsigned FrameNs;       // (micro)frame
+    unsigned Packets;       // bulk packets of USB_BULK_PACKET bytes per frame the host gets out
+};
+
+static const TLink s_Links[] =
+{
+    { "full speed",  1000000, 19 },     // 1216 bytes/ms, about all a full-speed frame holds
+    { "high speed",   125000, 13 },     // 64-byte packets still, 13 per microframe
+};
+
+struct TResult
+{
+    double WritesPerSecond;
+    double WireBytesPerWrite;
+    double AckLatencyUs;
+    unsigned Overflows;
+    unsigned MaxFeed;
+};
+
+/// @brief Runs the loopback for nSeconds of simulated time.
+static TResult Loopback (const TLink &link, unsigned nMessageWrites, bool bCredits, double nSeconds)
+{
+    CDevice device;
+    std::deque<u8> wire;            // USB-MIDI packets queued on the host side
+    struct TSent { u8 Sequence; unsigned Writes; u64 Time; };
+    std::deque<TSent> sent;         // not yet acknowledged
+    std::vector<TSysExAck> replies; // on their way back
+
+    u8 sequence = 0;
+    unsigned nCredits = 0;
+    bool bQueried = false;
+    u64 nWireBytes = 0, nDrained = 0, nAcks = 0;
+    double fLatency = 0, fBusCredit = 0;
+    unsigned nMaxFeed = 0;
+
+    u64 nFrames = (u64) (nSeconds * 1e9 / link.FrameNs);
+    double fPerFrame = (double) BUS_WRITES_PER_SECOND * link.FrameNs / 1e9;
+    std::vector<u8> stream, message, packets;
+    for (u64 frame = 0; frame < nFrames; frame++)
+    {
+        u64 now = frame * link.FrameNs;
+
+        // replies from the last frame
+        for (const TSysExAck &ack : replies)
+        {
+            while (!sent.empty () && sent.front ().Sequence != ack.Sequence)
+                sent.pop_front ();
+            if (!sent.empty ())
+            {
+                fLatency += now - sent.front ().Time;
+                nAcks++;
+                sent.pop_front ();
+            }
+            unsigned nOutstanding = 0;
+            for (const TSent &s : sent)
+                nOutstanding += s.Writes;
+            nCredits = ack.Credits > nOutstanding ? ack.Credits - nOutstanding : 0;
+        }
+        replies.clear ();
+
+        // the host keeps a frame's worth of packets queued, within its credits
+        if (!bQueried || (bCredits && sent.empty () && nCredits < nMessageWrites))
+        {
+            u8 query[8];
+            packets.clear ();
+            SysExPackets (packets, query, CSysExStream::Encode (SysExCmdQuery, sequence, 0, 0, query));
+            wire.insert (wire.end (), packets.begin (), packets.end ());
+            sent.push_back ({ sequence, 0, now });
+            sequence = (sequence + 1) & 0x7f;
+            bQueried = true;
+        }
+        while (wire.size () < 2 * link.Packets * USB_BULK_PACKET && (bCredits ? nCredits >= nMessageWrites : sent.size () < 100))
+        {
+            stream.clear ();
+            RandomStream (stream, nMessageWrites, 0, false);
+            message.resize (CSysExStream::EncodedSize (stream.size ()));
+            packets.clear ();
+            SysExPackets (packets, message.data (), CSysExStream::Encode (SysExCmdWrite, sequence, stream.data (), stream.size (), message.data ()));
+            wire.insert (wire.end (), packets.begin (), packets.end ());
+            sent.push_back ({ sequence, nMessageWrites, now });
+            sequence = (sequence + 1) & 0x7f;
+            if (bCredits)
+                nCredits -= nMessageWrites;
+        }
+
+        // the link and the device; the bus drains evenly over the frame
+        u8 buffer[USB_BULK_PACKET];
+        for (unsigned i = 0; i < link.Packets; i++)
+        {
+            if (!wire.empty ())
+            {
+                unsigned nLength = wire.size () < USB_BULK_PACKET ? wire.size () : USB_BULK_PACKET;
+                std::copy (wire.begin (), wire.begin () + nLength, buffer);
+                wire.erase (wire.begin (), wire.begin () + nLength);
+                nWireBytes += nLength;
+                device.Receive (buffer, nLength);
+            }
+
+            fBusCredit += fPerFrame / link.Packets;
+            TWrite write;
+            while (fBusCredit >= 1 && device.m_Feed.Pop (write))
+            {
+                fBusCredit--;
+                nDrained++;
+            }
+            if (device.m_Feed.GetCount () > nMaxFeed)
+                nMaxFeed = device.m_Feed.GetCount ();
+        }
+        if (fBusCredit > fPerFrame)
+            fBusCredit = fPerFrame;     // an idle bus doesn't save up
+
+        TSysExAck ack;
+        while (device.m_Acks.Pop (ack))
+            replies.push_back (ack);
+    }
+
+    TResult result;
+    result.WritesPerSecond = nDrained / nSeconds;
+    result.WireBytesPerWrite = nDrained ? (double) nWireBytes / nDrained : 0;
+    result.AckLatencyUs = nAcks ? fLatency / nAcks / 1000 : 0;
+    result.Overflows = device.m_Feed.GetOverflows ();
+    result.MaxFeed = nMaxFeed;
+    return result;
+}
+
+/// @brief Real time the device takes per write, parsing 64-byte buffers of packets.
+static double DecodeNs (unsigned nMessageWrites)
+{
+    std::vector<u8> packets, stream, message;
+    unsigned nWrites = 0;
+    while (nWrites < 200000)
+    {
+        stream.clear ();
+        nWrites += RandomStream (stream, nMessageWrites, 0, false);
+        message.resize (CSysExStream::EncodedSize (stream.size ()));
+        SysExPackets (packets, message.data (), CSysExStream::Encode (SysExCmdWrite, 0, stream.data (), stream.size (), message.data ()));
+    }
+
+    CDevice device;
+    u64 nBest = ~(u64) 0;
+    for (unsigned pass = 0; pass < 5; pass++)
+    {
+        u64 nStart = NowNs ();
+        for (size_t i = 0; i < packets.size (); i += USB_BULK_PACKET)
+        {
+            device.Receive (&packets[i], packets.size () - i < USB_BULK_PACKET ? packets.size () - i : USB_BULK_PACKET);
+            TWrite write;
+            while (device.m_Feed.Pop (write))
+                ;
+            TSysExAck ack;
+            while (device.m_Acks.Pop (ack))
+                ;
+        }
+        u64 nTime = NowNs () - nStart;
+        if (nTime < nBest)
+            nBest = nTime;
+    }
+    return (double) nBest / nWrites;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nRounds = argc > 1 ? atoi (argv[1]) : 2000;
+
+    unsigned nFailed = 0;
+    for (unsigned i = 0; i < nRounds; i++)
+        nFailed += !Fuzz (i);
+    if (!Overflow ())
+    {
+        printf ("  overflow: wrong reply or feed\n");
+        nFailed++;
+    }
+    if (!Overloaded ())
+    {
+        printf ("  overloaded chip: wrong reply or feed\n");
+        nFailed++;
+    }
+    printf ("fuzz: %u rounds, %u failed\n\n", nRounds, nFailed);
+
+    static const unsigned s_Sizes[] = { 16, 64, 256, 1024 };
+    printf ("%-11s %6s %8s %12s %11s %9s %8s %9s\n",
+            "link", "msg", "credits", "writes/s", "wire B/wr", "ack us", "max feed", "overflow");
+    for (const TLink &link : s_Links)
+    {
+        for (unsigned nSize : s_Sizes)
+        {
+            TResult result = Loopback (link, nSize, true, 2.0);
+            printf ("%-11s %6u %8s %12.0f %11.2f %9.0f %8u %9u\n", link.Name, nSize, "yes",
+                    result.WritesPerSecond, result.WireBytesPerWrite, result.AckLatencyUs, result.MaxFeed, result.Overflows);
+            nFailed += result.Overflows != 0;
+        }
+        TResult result = Loopback (link, 256, false, 2.0);
+        printf ("%-11s %6u %8s %12.0f %11.2f %9.0f %8u %9u\n", link.Name, 256, "ignored",
+                result.WritesPerSecond, result.WireBytesPerWrite, result.AckLatencyUs, result.MaxFeed, result.Overflows);
+    }
+
+    printf ("\ndevice decode, 64-byte buffers:\n");
+    for (unsigned nSize : s_Sizes)
+        printf ("  %4u writes/message: %5.1f ns/write\n", nSize, DecodeNs (nSize));
+
+    return nFailed ? 1 : 0;
+}
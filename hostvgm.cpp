@@ -0,0 +1,176 @@
+//
+// hostvgm.cpp
+//
+// Native VGM player against the simulated Spinbus, for checking sustained
+// throughput and deadline misses on a dev box:
+//
+//   make hostvgm && ./hostvgm song.vgm [unison [sector-us]]
+//
+// With unison N each of the file's YM2612s is played on N chips, which is an
+// easy way to load the bus. With sector-us, every file read advances the
+// simulated clock by that many microseconds per 512 bytes, standing in for
+// SD card reads: the reads run inside CVGMPlayer::Fill, so the longest Fill
+// is the stall they put on playback, and late writes show up as misses. Time is the simulated bus clock throughout, so
+// results are reproducible. The queues and the pump are the kernel's
+// CSpinbusPump, one write per chip per sent-latch cycle (no bursts or
+// broadcasts, which the current gateware doesn't take).
+//
+// The bus statistics are the kernel's CBusStats on the simulated clock; key-on
+// latency here runs from the VGM write falling due to the key on going out.
+//
+#include "spinbussim.h"
+#include "spinbuspump.h"
+#include "vgmplayer.h"
+#include "vgmfile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static u64 Now (void);
+static u32 PumpClock (void *) { return (u32) Now (); }
+
+static CSimSpinbus s_Bus;
+static COverloadControl s_Overload (OverloadShed);   // only drops at the queue limit here
+static CBusStats s_Stats (1000000);     // clock is Now ()
+static CDeferredLog s_Log;
+static CSpinbusPump s_Pump (&s_Bus, &s_Overload, &s_Stats, &s_Log, PumpClock);
+
+static u64 Now (void)
+{
+    return s_Bus.GetTime () / 1000;
+}
+
+static void WriteHandler (void *, u32 nChipMask, bool bBank, u8 nAddress, u8 nData)
+{
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+    {
+        if (!(nChipMask & BIT (chip)))
+            continue;
+        if (!bBank && nAddress == 0x28 && (nData & 0xf0) && (nData & 3) != 3)
+            s_Stats.KeyOnQueued (chip, (nData & 3) + (nData & 4 ? 3 : 0), (u32) Now ());
+        s_Pump.Enqueue (chip, YMCommand (bBank, nAddress, nData));
+    }
+}
+
+/// @brief CVGMFile with SD card read times, on the simulated clock.
+class CSlowFile : public CVGMFile
+{
+public:
+    CSlowFile (unsigned nSectorUs) : m_nSectorUs (nSectorUs) {}
+
+    unsigned Read (void *pBuffer, unsigned nCount) override
+    {
+        s_Bus.Advance ((u64) (nCount + 511) / 512 * m_nSectorUs * 1000);
+        return CVGMFile::Read (pBuffer, nCount);
+    }
+
+private:
+    unsigned m_nSectorUs;
+};
+
+/// @return true if anything was sent.
+static bool Pump (void)
+{
+    u32 nBytes = s_Pump.GetBusBytes ();
+    s_Pump.Process ();
+    return s_Pump.GetBusBytes () != nBytes;
+}
+
+static void PrintStats (const TBusStatsSnapshot &stats)
+{
+    printf ("%6.1f s: %u bytes/s, key-on latency %u notes, mean %u us, p99 %u us, max %u us, high water",
+            s_Bus.GetTime () / 1e9, stats.Interval ? (u32) ((u64) stats.Bytes * 1000000 / stats.Interval) : 0,
+            stats.Latency.GetCount (), stats.Latency.GetMean (), stats.Latency.GetPercentile (99), stats.Latency.GetMax ());
+    for (unsigned i = 0; i < YM_COUNT; i++)
+        printf (" %u", stats.HighWater[i]);
+    printf ("\n");
+}
+
+static bool QueuesEmpty (void)
+{
+    return s_Pump.GetPending () == 0;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf (stderr, "usage: %s file.vgm [unison [sector-us]]\n", argv[0]);
+        return 1;
+    }
+    unsigned nUnison = argc > 2 ? atoi (argv[2]) : 1;
+    unsigned nSectorUs = argc > 3 ? atoi (argv[3]) : 0;
+    if (nUnison < 1 || nUnison * VGM_CHIPS > YM_COUNT)
+    {
+        fprintf (stderr, "unison must be 1-%u\n", YM_COUNT / VGM_CHIPS);
+        return 1;
+    }
+
+    u32 chipMask[VGM_CHIPS];
+    for (unsigned i = 0; i < VGM_CHIPS; i++)
+        chipMask[i] = ((1U << nUnison) - 1) << (i * nUnison);
+
+    CSlowFile file (nSectorUs);
+    CVGMPlayer player (WriteHandler, 0);
+    if (!file.Open (argv[1]) || !player.Start (&file, chipMask, Now ()))
+    {
+        fprintf (stderr, "%s: not a VGM file\n", argv[1]);
+        return 1;
+    }
+
+    s_Pump.Sync ();
+    u64 nSimStart = s_Bus.GetTime ();
+    s_Stats.Reset ((u32) Now ());
+    TBusStatsSnapshot snapshot;
+    clock_t wallStart = clock ();
+    u64 nFillMax = 0;
+
+    while (player.IsPlaying () || !QueuesEmpty ())
+    {
+        u64 nNow = Now ();
+        player.Fill (nNow);
+        if (Now () - nNow > nFillMax)
+            nFillMax = Now () - nNow;
+        nNow = Now ();
+        player.Update (nNow);
+        s_Stats.Publish ((u32) nNow);
+        if (s_Stats.TakeSnapshot (&snapshot))
+            PrintStats (snapshot);
+        if (Pump ())
+            continue;
+
+        // nothing to send: skip ahead to the next due write
+        u64 nNext = player.GetNextDue ();
+        if (QueuesEmpty () && nNext > nNow)
+            s_Bus.Advance ((nNext - nNow) * 1000);
+        else if (QueuesEmpty () && nNext == 0)
+            s_Bus.Advance (1000);
+    }
+
+    s_Stats.Publish ((u32) Now (), true);
+    if (s_Stats.TakeSnapshot (&snapshot))
+        PrintStats (snapshot);
+
+    double simSeconds = (s_Bus.GetTime () - nSimStart) / 1e9;
+    double wallSeconds = (double) (clock () - wallStart) / CLOCKS_PER_SEC;
+    const TVGMStats &stats = player.GetStats ();
+    const TSimStats &bus = s_Bus.GetStats ();
+    u32 nCoalesced = 0;
+    for (unsigned i = 0; i < YM_COUNT; i++)
+        nCoalesced += s_Pump.GetQueue (i).GetCoalesced ();
+
+    printf ("YM2612 clock:      %u Hz\n", player.GetYM2612Clock ());
+    printf ("song time:         %.3f s (simulated)\n", simSeconds);
+    printf ("VGM writes:        %u (%u skipped commands, %u loops)\n", stats.Writes, stats.Skipped, stats.Loops);
+    printf ("bus writes:        %llu, %.0f/s simulated, %.0f/s host\n", (unsigned long long) bus.Writes,
+            simSeconds > 0 ? bus.Writes / simSeconds : 0.0, wallSeconds > 0 ? bus.Writes / wallSeconds : 0.0);
+    printf ("elided/coalesced:  %u / %u\n", s_Pump.GetShadow ().GetElidedWrites (), nCoalesced);
+    printf ("deadline misses:   %u (> %u us), max lateness %u us\n", stats.Misses, VGM_DEADLINE_US, stats.MaxLateness);
+    printf ("reader underruns:  %u, longest Fill %u us\n", stats.Underruns, (u32) nFillMax);
+    u32 nLimitHits = 0;
+    for (u8 i = 0; i < YM_COUNT; i++)
+        nLimitHits += s_Overload.GetStats (i).LimitHits;
+    printf ("bus errors:        %llu, queue limit hits %u\n", (unsigned long long) bus.Errors, nLimitHits);
+
+    return stats.Misses == 0 && bus.Errors == 0 ? 0 : 2;
+}
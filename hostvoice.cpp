@@ -0,0 +1,318 @@
+//
+// hostvoice.cpp
+//
+// Checks CVoiceAllocator's allocation, stealing and release, then times it
+// against the channel scans it replaced in CKernel::Run:
+//
+//   make hostvoice && ./hostvoice [events]
+//
+// The checks each play a few notes on a small allocator and compare the
+// voices handed out with the ones the rules in voiceallocator.h call for;
+// the run fails if any doesn't match.
+//
+// The scan is the old Run loop's: a pass over every channel for the key's
+// last channel, another for a free one (preferring the patch), a rotating
+// start, and a pass for the key at note off. Both get the same random note
+// ons and offs with the voices about three quarters busy (at most 120 keys
+// held), at 20, 32 and 64 chips, and are timed per event.
+//
+#include "voiceallocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+
+#define PATCHES             4
+#define HELD_MAX            120
+
+static u64 NowNs (void)
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u32 Random (u32 *pSeed)
+{
+    *pSeed ^= *pSeed << 13;
+    *pSeed ^= *pSeed >> 17;
+    *pSeed ^= *pSeed << 5;
+    return *pSeed;
+}
+
+static volatile u32 s_nSink;
+
+static bool Check (const char *pName, bool bOK)
+{
+    printf ("%-56s %s\n", pName, bOK ? "ok" : "FAIL");
+    return bOK;
+}
+
+static bool CheckAllocator (void)
+{
+    CVoiceAllocator *pVoices = new CVoiceAllocator;
+    CVoiceAllocator &voices = *pVoices;
+    bool bOK = true;
+
+    // 3 chips of 2 channels: voices 0-1, 2-3, 4-5
+    voices.Reset (3, 2);
+    TVoiceAllocation a = voices.NoteOn (60, 0);
+    TVoiceAllocation b = voices.NoteOn (61, 0);
+    TVoiceAllocation c = voices.NoteOn (62, 0);
+    bOK &= Check ("fresh voices spread across chips first",
+                  a.Voice == 0 && b.Voice == 2 && c.Voice == 4 && !a.Stolen && !a.Retrigger);
+    bOK &= Check ("active count", voices.GetActiveCount () == 3);
+
+    TVoiceAllocation again = voices.NoteOn (61, 0);
+    bOK &= Check ("a sounding key retriggers its voice", again.Voice == 2 && again.Retrigger && !again.Stolen);
+
+    bOK &= Check ("note off returns the voice", voices.NoteOff (61) == 2 && voices.GetKey (2) == VOICE_KEY_NONE);
+    bOK &= Check ("a second note off finds nothing", voices.NoteOff (61) == VOICE_NONE);
+
+    // voices 1, 3, 5 were never used; 2 was released last
+    TVoiceAllocation d = voices.NoteOn (63, 0);
+    bOK &= Check ("the free voice released longest ago comes first", d.Voice == 1);
+
+    voices.SetPatch (5, 2);
+    TVoiceAllocation e = voices.NoteOn (64, 2);
+    bOK &= Check ("a free voice holding the patch comes before older ones", e.Voice == 5);
+
+    voices.SetPatch (2, 1);
+    voices.NoteOff (64);
+    voices.NoteOn (65, 1);      // takes voice 2, which holds patch 1
+    voices.NoteOff (65);
+    voices.NoteOn (66, 1);      // the only free voice with patch 1 is 2 again
+    voices.SetPatch (3, 1);
+    voices.NoteOff (66);        // 3 now comes before 2 among the free voices with patch 1
+    TVoiceAllocation f = voices.NoteOn (65, 1);
+    bOK &= Check ("a key gets its last voice back if it holds the patch", f.Voice == 2);
+
+    // 60, 62, 63, 65 sounding on 0, 4, 1, 2; 3 and 5 free
+    voices.NoteOn (67, 0);
+    voices.NoteOn (68, 0);
+    TVoiceAllocation g = voices.NoteOn (69, 0);
+    bOK &= Check ("with every voice busy the oldest note is stolen",
+                  g.Voice == 0 && g.Stolen && g.StolenKey == 60 && voices.GetKey (0) == 69);
+    bOK &= Check ("the stolen key's note off finds nothing", voices.NoteOff (60) == VOICE_NONE);
+    bOK &= Check ("stealing keeps the active count", voices.GetActiveCount () == 6);
+
+    // avoiding chip 0 (voices 0 and 1)
+    voices.Reset (3, 2);
+    voices.NoteOn (70, 0);      // voice 0
+    voices.NoteOff (70);
+    TVoiceAllocation h = voices.NoteOn (71, 0, BIT(0));
+    bOK &= Check ("notes keep off avoided chips while others have room", h.Voice / 2 != 0);
+    for (u8 key = 72; key < 76; key++)
+        voices.NoteOn (key, 0, BIT(0));
+    TVoiceAllocation i = voices.NoteOn (76, 0, BIT(0));
+    bOK &= Check ("an avoided chip is used once nothing else is free", i.Voice / 2 == 0 && !i.Stolen);
+    TVoiceAllocation j = voices.NoteOn (77, 0, BIT(0), true);
+    bOK &= Check ("stealing for an avoided chip takes a voice elsewhere", j.Voice / 2 != 0 && j.Stolen);
+
+    voices.Reset (3, 2);
+    for (u16 voice = 0; voice < 6; voice++)
+        voices.SetPatch (voice, 1);
+    voices.NoteOn (80, 1);
+    voices.Reset (3, 2);
+    bOK &= Check ("reset frees every voice and forgets patches",
+                  voices.GetActiveCount () == 0 && voices.GetPatch (0) == PATCH_NONE && voices.NoteOff (80) == VOICE_NONE);
+
+    delete pVoices;
+    return bOK;
+}
+
+/// @brief The channel scans of the Run loop before CVoiceAllocator, for any chip count.
+class CScanAllocator
+{
+public:
+    CScanAllocator (unsigned nVoices)
+    :   m_nVoices (nVoices)
+    {
+        for (unsigned i = 0; i < nVoices; i++)
+        {
+            m_ChannelKeys[i] = 0;
+            m_LastChannelKeys[i] = 0;
+            m_ChannelPatch[i] = PATCH_NONE;
+        }
+    }
+
+    /// @return the voice; pPrepare is set if it needs the patch loaded.
+    unsigned NoteOn (u8 key, u8 patch, bool *pPrepare)
+    {
+        bool reuse = false;
+        // find the last channel we used for this, if it still holds the patch
+        for (unsigned i = 0; i < m_nVoices; i++)
+        {
+            if (m_LastChannelKeys[i] == key && m_ChannelKeys[i] == 0 && m_ChannelPatch[i] == patch)
+            {
+                m_NextChannel = i;
+                reuse = true;
+                break;
+            }
+        }
+        if (!reuse)
+        {
+            // find a free channel, preferring one that already has the patch loaded
+            bool found = false;
+            unsigned start = m_NextChannel;
+            unsigned firstFree = m_nVoices;
+            for (unsigned i = 0; i < m_nVoices; i++)
+            {
+                unsigned idx = (start + i) % m_nVoices;
+                if (m_ChannelKeys[idx] != 0)
+                    continue;
+                if (m_ChannelPatch[idx] == patch)
+                {
+                    m_NextChannel = idx;
+                    found = true;
+                    break;
+                }
+                if (firstFree == m_nVoices)
+                    firstFree = idx;
+            }
+            if (!found && firstFree != m_nVoices)
+                m_NextChannel = firstFree;
+        }
+        unsigned voice = m_NextChannel;
+        m_ChannelKeys[voice] = key;
+        m_LastChannelKeys[voice] = key;
+        *pPrepare = m_ChannelPatch[voice] != patch;
+        m_ChannelPatch[voice] = patch;
+        if (++m_NextChannel == m_nVoices)
+            m_NextChannel = 0;
+        return voice;
+    }
+
+    /// @return the voice the key was sounding on, or VOICE_NONE.
+    unsigned NoteOff (u8 key)
+    {
+        for (unsigned i = 0; i < m_nVoices; i++)
+        {
+            if (m_ChannelKeys[i] == key)
+            {
+                m_ChannelKeys[i] = 0;
+                return i;
+            }
+        }
+        return VOICE_NONE;
+    }
+
+private:
+    unsigned m_nVoices;
+    unsigned m_NextChannel = 0;
+    u8 m_ChannelKeys[VOICE_LIMIT];
+    u8 m_LastChannelKeys[VOICE_LIMIT];
+    u8 m_ChannelPatch[VOICE_LIMIT];
+};
+
+struct TEvent
+{
+    bool On;
+    u8 Key;
+    u8 Patch;
+};
+
+/// @brief Note ons and offs that keep about three quarters of the voices busy; keys 1-127, as 0 meant free to the scan.
+static std::vector<TEvent> Events (unsigned nVoices, unsigned nEvents)
+{
+    unsigned nHeld = nVoices * 3 / 4 < HELD_MAX ? nVoices * 3 / 4 : HELD_MAX;
+    std::vector<TEvent> events;
+    std::vector<u8> held;
+    bool bSounding[VOICE_KEYS] = {};
+    u32 nSeed = 0x5bd1e995;
+    while (events.size () < nEvents)
+    {
+        if (held.size () >= nHeld || (!held.empty () && Random (&nSeed) % 2))
+        {
+            unsigned n = Random (&nSeed) % held.size ();
+            events.push_back ({false, held[n], 0});
+            bSounding[held[n]] = false;
+            held[n] = held.back ();
+            held.pop_back ();
+            continue;
+        }
+        u8 key = 1 + Random (&nSeed) % (VOICE_KEYS - 1);
+        if (bSounding[key])
+            continue;
+        bSounding[key] = true;
+        held.push_back (key);
+        events.push_back ({true, key, (u8) (Random (&nSeed) % PATCHES)});
+    }
+    return events;
+}
+
+static double BenchAllocator (unsigned nChips, const std::vector<TEvent> &events, unsigned nRounds)
+{
+    CVoiceAllocator *pVoices = new CVoiceAllocator;
+    u32 nSum = 0;
+    u64 nStart = NowNs ();
+    for (unsigned r = 0; r < nRounds; r++)
+    {
+        pVoices->Reset (nChips, YM_CHANNELS);
+        for (const TEvent &event : events)
+        {
+            if (event.On)
+            {
+                TVoiceAllocation voice = pVoices->NoteOn (event.Key, event.Patch);
+                if (pVoices->GetPatch (voice.Voice) != event.Patch)
+                    pVoices->SetPatch (voice.Voice, event.Patch);
+                nSum += voice.Voice;
+            }
+            else
+                nSum += pVoices->NoteOff (event.Key);
+        }
+    }
+    u64 nTime = NowNs () - nStart;
+    delete pVoices;
+    s_nSink = nSum;
+    return (double) nTime / ((double) nRounds * events.size ());
+}
+
+static double BenchScan (unsigned nChips, const std::vector<TEvent> &events, unsigned nRounds)
+{
+    u32 nSum = 0;
+    u64 nStart = NowNs ();
+    for (unsigned r = 0; r < nRounds; r++)
+    {
+        CScanAllocator scan (nChips * YM_CHANNELS);
+        for (const TEvent &event : events)
+        {
+            bool bPrepare;
+            if (event.On)
+                nSum += scan.NoteOn (event.Key, event.Patch, &bPrepare) + bPrepare;
+            else
+                nSum += scan.NoteOff (event.Key);
+        }
+    }
+    u64 nTime = NowNs () - nStart;
+    s_nSink = nSum;
+    return (double) nTime / ((double) nRounds * events.size ());
+}
+
+int main (int argc, char **argv)
+{
+    unsigned nEvents = argc > 1 ? atoi (argv[1]) : 10000000;
+    if (nEvents == 0)
+    {
+        fprintf (stderr, "events must be positive\n");
+        return 1;
+    }
+
+    if (!CheckAllocator ())
+        return 2;
+
+    const unsigned nPerRound = 100000;
+    unsigned nRounds = (nEvents + nPerRound - 1) / nPerRound;
+    printf ("%u events per chip count\n", nRounds * nPerRound);
+    printf ("%5s %6s %12s %12s\n", "chips", "voices", "scan ns", "allocator ns");
+    static const unsigned s_Chips[] = { 20, 32, 64 };
+    for (unsigned nChips : s_Chips)
+    {
+        std::vector<TEvent> events = Events (nChips * YM_CHANNELS, nPerRound);
+        double fScan = BenchScan (nChips, events, nRounds);
+        double fAllocator = BenchAllocator (nChips, events, nRounds);
+        printf ("%5u %6u %12.1f %12.1f\n", nChips, nChips * YM_CHANNELS, fScan, fAllocator);
+    }
+
+    return 0;
+}
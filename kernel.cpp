@@ -27,11 +27,13 @@
 #include <circle/machineinfo.h>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
 #include "vector"
 #include "queue"
 #include "string"
-#include "cmath"
 #include "spindashgadget.h"
+#include "spinbusgpio.h"
+#include "spinbussim.h"
 
 
 // See: http://www.deimos.ca/notefreqs/
@@ -73,8 +75,23 @@ CKernel *CKernel::s_pThis = 0;
 
 static const char FromKernel[] = "kernel";
 
+// VGM files started from the SD card on every (re)start, and the chips each file's
+// YM2612s are played on. MIDI voices only use the chips below the lowest one claimed
+// by a file that is present.
+static const struct
+{
+    const char *Path;
+    u32 ChipMask[VGM_CHIPS];
+}
+s_VGMSlots[VGM_PLAYERS] =
+{
+    { SD_DRIVE "/spindash/1.vgm", { BIT(16), BIT(17) } },
+    { SD_DRIVE "/spindash/2.vgm", { BIT(18), BIT(19) } }
+};
+
 CKernel::CKernel (void)
 :    m_Screen (m_Options.GetWidth (), m_Options.GetHeight ()),
+    m_Serial (&m_Interrupt),
     m_Timer (&m_Interrupt),
     m_Logger (m_Options.GetLogLevel (), &m_Timer),
 #ifndef USB_GADGET_MODE
@@ -84,25 +101,32 @@ CKernel::CKernel (void)
 #endif
 	m_pMIDIDevice (0),
 	m_pKeyboard (0),
+    m_EMMC (&m_Interrupt, &m_Timer, &m_ActLED),
     m_BtnPin(BTN_PIN, GPIOModeInputPullDown),
-    m_RSTPin(RST_PIN, GPIOModeOutput),
-    m_SCKPin(SCK_PIN, GPIOModeOutput),
-    m_D0Pin(D0_PIN, GPIOModeOutput),
-    m_D1Pin(D1_PIN, GPIOModeOutput),
-    m_D2Pin(D2_PIN, GPIOModeOutput),
-    m_D3Pin(D3_PIN, GPIOModeOutput),
-    m_D4Pin(D4_PIN, GPIOModeOutput),
-    m_D5Pin(D5_PIN, GPIOModeOutput),
-    m_D6Pin(D6_PIN, GPIOModeOutput),
-    m_D7Pin(D7_PIN, GPIOModeOutput),
-    m_RETPin(RET_PIN, GPIOModeInputPullDown),
-    m_YMSentPin(YM_SENT_PIN, GPIOModeInputPullDown),
+#ifndef SPINBUS_SIMULATOR
+    m_pBus (new CGPIOSpinbus (&m_Timer)),
+#else
+    m_pBus (new CSimSpinbus ()),
+#endif
+#ifdef ARM_ALLOW_MULTI_CORE
+    m_BusCore (this),
+#endif
 	m_nFrequency (0),
 	m_nPrevFrequency (0),
 	m_ucKeyNumber (KEY_NONE),
-	m_bSetVolume (FALSE)
+	m_bSetVolume (FALSE),
+	m_uchVolume (0x7f)
 {
 	s_pThis = this;
+    for (unsigned i = 0; i < VGM_PLAYERS; i++)
+        m_pVGM[i] = new CVGMPlayer (VGMWriteHandler, this);
+    m_MIDIParser[SYSEX_CABLE].SetSysExHandler (SysExHandler, this);
+#ifdef SPINBUS_BURST
+    m_Pump.SetBurst (true);
+#endif
+#ifdef SPINBUS_BROADCAST
+    m_Pump.SetBroadcast (true);
+#endif
     m_ActLED.Blink (5);    // show we are alive
 }
 
@@ -120,6 +144,12 @@ boolean CKernel::Initialize (void)
         bOK = m_Screen.Initialize ();
     }
 
+    // the UART is interrupt driven, so the interrupt system comes first
+    if (bOK)
+    {
+        bOK = m_Interrupt.Initialize ();
+    }
+
     if (bOK)
     {
         bOK = m_Serial.Initialize (SERIAL_BAUD);
@@ -134,16 +164,33 @@ boolean CKernel::Initialize (void)
         }
 
         bOK = m_Logger.Initialize (pTarget);
+
+        // log lines on the link's UART would break its frames
+        m_bSerialLink = strcmp (m_Options.GetLogDevice (), SERIAL_DEVICE) != 0;
+        if (bOK && !m_bSerialLink)
+        {
+            m_Logger.Write (FromKernel, LogWarning, "The log goes to %s, so the serial link is off", SERIAL_DEVICE);
+        }
     }
 
     if (bOK)
     {
-        bOK = m_Interrupt.Initialize ();
+        bOK = m_Timer.Initialize ();
     }
 
+#ifdef ARM_ALLOW_MULTI_CORE
     if (bOK)
     {
-        bOK = m_Timer.Initialize ();
+        bOK = m_BusCore.Initialize ();
+    }
+#endif
+
+    if (bOK)
+    {
+        // the SD card is optional; without it there is just no VGM playback
+        m_bFileSystem = m_EMMC.Initialize () && f_mount (&m_FileSystem, SD_DRIVE, 1) == FR_OK;
+        if (!m_bFileSystem)
+            m_Logger.Write (FromKernel, LogNotice, "No SD card file system, VGM playback disabled");
     }
 
 	if (bOK)
@@ -165,19 +212,37 @@ TShutdownMode CKernel::Run (void)
 
         m_Logger.Write (FromKernel, LogNotice, "");
         m_Logger.Write (FromKernel, LogNotice, "Queueing YM prep instructions...");
-        for (u8 chip = 0; chip < YM_COUNT; chip++) {
-            for (u8 channelIdx = 0; channelIdx < 6; channelIdx++) {
-                YMPrepare(chip, channelIdx);
-            }
+        m_Voices.Reset(VGMOpen(), YM_CHANNELS);
+        m_Overload.SetVoiceChips(BIT(m_Voices.GetVoiceCount() / YM_CHANNELS) - 1);
+        // after the first pass only what differs from power-on goes out again,
+        // and notes can start once the channels that were sounding are back
+        bool restored = m_Snapshot.IsValid();
+        if (restored) {
+            YMRestore();
+        }
+        else {
+            YMPrepareGlobal(YM_MASK_ALL);
+            // channel-major, so the allocator hands out voices across chips first
+            for (u8 channelIdx = 0; channelIdx < YM_CHANNELS; channelIdx++)
+                YMPrepareChips(YM_MASK_ALL, channelIdx);
+            m_Logger.Write (FromKernel, LogNotice, "%u instructions queued per YM.", m_Pump.GetQueue(0).size());
         }
-        m_Logger.Write (FromKernel, LogNotice, "%d instructions queued per YM.", queues[0].queue.size());
+        YMRestoreMark(restored);
+        YMSnapshot();
         m_Logger.Write (FromKernel, LogNotice, "Resetting...");
 
-        YMReset();
+        m_Stats.Reset(StatsClock());
+#ifdef SPINBUS_CALIBRATE
+        if (!m_Calibrated) {
+            SpinbusCalibrate();
+            m_Calibrated = true;
+        }
+#endif
+        m_Pump.Reset();
         
         // Wait for the YM to indicate it's ready to receive data
         m_Logger.Write (FromKernel, LogNotice, "Waiting for YM...");
-        while (!m_YMSentPin.Read())
+        while (!m_pBus->GetSent())
             m_Timer.nsDelay(1);
         
         
@@ -185,31 +250,44 @@ TShutdownMode CKernel::Run (void)
         // until we receive an 0x01 idle byte from the spinbus.
         m_Logger.Write (FromKernel, LogNotice, "Synchronizing...");
 
-        YMSyncResult syncResult = SpinbusSync();
+        YMSyncResult syncResult = m_Pump.Sync();
+        LogDrain();
 
         if (!syncResult.success) {
+            m_Timer.MsDelay(100);
             continue;
         }
         
-        int remaining = 0;
         do
         {
-            remaining = YMProcessQueue();
-        } while (remaining > 0);
+            m_Pump.Process();
+            NoteIntake(m_Timer.GetClockTicks64(), false);
+        } while (!YMRestoreSent() && !m_Pump.IsResetRequested());
+        LogDrain();
 
-        if (m_ErrorLen > 0 && m_ErrorBytesRead >= m_ErrorLen)
+        if (m_Pump.InErrorFrame())
         {
-            DumpError();
+            m_Pump.DumpError();
             ClearQueues();
-            m_Timer.MsDelay(1000);
+            WaitSettled();
             continue;
         }
 
+        // From here on the bus core (if any) owns the bus and the YM queues
+        BusCoreStart();
+        m_Scheduler.Reset(m_Timer.GetClockTicks64());
+        VGMStart();
+
         while (true) {
             m_Timer.usDelay(1);
-            if (m_DoReset) {
-                m_Timer.MsDelay(1000);
-                m_DoReset = false;
+            if (m_Pump.IsResetRequested()) {
+                BusCoreStop();
+                LogDrain();
+                VGMStop();
+                YMSnapshot();
+                ClearQueues();
+                WaitSettled();
+                m_Pump.ClearResetRequest();
                 break;
             }
 		    bool bUpdated = m_pUSB->UpdatePlugAndPlay ();
@@ -236,69 +314,87 @@ TShutdownMode CKernel::Run (void)
                 }
             }
 
-            // Play sounds
-            while (m_Notes.size() > 0 && !m_DoReset) {
-                PlayedNote note = m_Notes.front();
-                if (note.KeyOn) {
-                    bool reuse = 0;
-                    // find the last channel we used for this
-                    for (u8 i = 0; i < YM_COUNT*YM_CHANNELS; i++) {
-                        if (m_LastChannelKeys[i] == note.KeyNumber && m_ChannelKeys[i] == 0) {
-                            // found it, reuse this channel
-                            m_NextChannel = i;
-                            reuse = true;
-                            break;
-                        }
-                    }
-                    if (!reuse) {
-                        // find a free channel
-                        for (u8 i = 0; i < YM_COUNT*YM_CHANNELS; i++) {
-                            // check the key playing at the current channel index
-                            u16 playingKey = m_ChannelKeys[m_NextChannel];
-                            if (playingKey == 0) {
-                                // we found an empty channel
-                                break;
-                            }
-                            // check the next channel index
-                            if (++m_NextChannel == YM_COUNT*YM_CHANNELS)
-                                m_NextChannel = 0;
-                        }
-                    }
-                    u8 chip = m_NextChannel/6;
-                    u8 channel = m_NextChannel%6;
-                    // if we didn't find it, just steal the channel we started on
-                    if (m_ChannelKeys[m_NextChannel] != 0)
-                        YMQueueNoteStop(chip, channel);
-                    m_ChannelKeys[m_NextChannel] = note.KeyNumber;
-                    m_LastChannelKeys[m_NextChannel] = note.KeyNumber;
-                    //u16 noteShort =
-                    YMQueueNote(chip, channel, note, !reuse);
-                    //m_Logger.Write (FromKernel, LogNotice, "Note: chip %2d:%d %4dhz b:%d fnum:%4d (%04X) vel:%02X",
-                        //chip+1, channel+1, note.Frequency, noteShort >> 11, noteShort & 0x7ff, noteShort & 0x7ff, note.Velocity);
-                    // prep for next note
-                    if (++m_NextChannel == YM_COUNT*YM_CHANNELS)
-                        m_NextChannel = 0;
+            TBusStatsSnapshot stats;
+            if (m_Stats.TakeSnapshot(&stats)) {
+                StatsDump(stats);
+                CountersDump();
+            }
+            LogDrain();
+
+            // replies to host register streams, in the order the messages came in
+            TSysExAck ack;
+            while (m_SysExAcks.Pop(ack)) {
+                u8 reply[SYSEX_ACK_SIZE];
+                unsigned length = CSysExStream::EncodeAck(ack, reply);
+                if (m_pMIDIDevice != 0)
+                    m_pMIDIDevice->SendPlainMIDI(SYSEX_CABLE, reply, length);
+            }
+
+            if (m_SysExFeed.GetOverflows() != m_nSysExOverflows) {
+                m_nSysExOverflows = m_SysExFeed.GetOverflows();
+                m_Logger.Write (FromKernel, LogWarning, "Register stream overflow, %u writes dropped so far", m_nSysExOverflows);
+            }
+            if (m_Notes.GetOverflows() != m_nNoteOverflows) {
+                m_nNoteOverflows = m_Notes.GetOverflows();
+                m_Logger.Write (FromKernel, LogWarning, "Note queue overflow, %u events dropped so far", m_nNoteOverflows);
+            }
+
+            // channels that lost a patch write to an overloaded queue load their patch again
+            u32 lostChips = m_Overload.TakeLostChips();
+            for (u8 chip = 0; lostChips; chip++) {
+                if (!(lostChips & BIT(chip)))
+                    continue;
+                lostChips &= ~BIT(chip);
+                u8 lost = m_Overload.TakeLostChannels(chip);
+                for (u8 channel = 0; channel < YM_CHANNELS; channel++) {
+                    u16 voice = chip*YM_CHANNELS + channel;
+                    if ((lost & BIT(channel)) && voice < m_Voices.GetVoiceCount())
+                        m_Voices.SetPatch(voice, PATCH_NONE);
                 }
-                else {
-                    // find the channel the key is playing on
-                    for (u8 i = 0; i < YM_COUNT*YM_CHANNELS; i++) {
-                        if (m_ChannelKeys[i] == note.KeyNumber) {
-                            m_ChannelKeys[i] = 0;
-                            u8 chip = i/6;
-                            u8 channel = i%6;
-		                    //m_Logger.Write(FromKernel, LogDebug, "keyoff: %d, chip %d chan %d", note.KeyNumber, chip, channel);
-                            YMQueueNoteStop(chip, channel);
-                            break;
-                        }
-                    }
+            }
+
+            // Play sounds once they are due
+            u64 now = m_Timer.GetClockTicks64();
+            NoteIntake(now, true);
+
+            // keep the VGM players parsed ahead and hand over whatever is due
+            for (unsigned i = 0; i < VGM_PLAYERS && !m_Pump.IsResetRequested(); i++) {
+                if (m_pVGM[i]->IsPlaying()) {
+                    u64 fillStart = m_Timer.GetClockTicks64();
+                    m_pVGM[i]->Fill(now);
+                    u32 fill = (u32) (m_Timer.GetClockTicks64() - fillStart);
+                    if (fill > m_VGMFillMax[i])
+                        m_VGMFillMax[i] = fill;
+                    m_pVGM[i]->Update(now);
+                }
+            }
+
+            // register streams from the PC; frames wait in their buffers while a chip is backed up
+            if (m_bSerialLink) {
+                u8 serialData[SERIAL_READ_SIZE];
+                int serialBytes;
+                while ((serialBytes = m_Serial.Read(serialData, sizeof serialData)) != 0) {
+                    if (serialBytes < 0)
+                        m_SerialLink.LineError();
+                    else
+                        m_SerialLink.Receive(serialData, serialBytes);
                 }
-                m_Notes.pop();
+                m_SerialLink.Update(now);
+            }
+
+            if (m_bSetVolume && !m_Pump.IsResetRequested()) {
+                m_bSetVolume = FALSE;
+                YMQueueVolume();
             }
+#ifndef ARM_ALLOW_MULTI_CORE
+            YMDrainFeed();
             int remaining = 0;
             do
             {
-                remaining = YMProcessQueue();
+                remaining = m_Pump.Process();
             } while (remaining > 0);
+            m_Stats.Publish(StatsClock());
+#endif
         }
     }
     
@@ -331,9 +427,10 @@ void CKernel::YMTest() {
         m_Timer.nsDelay(1);
 
 
-        if (m_ErrorLen > 0 && m_ErrorBytesRead >= m_ErrorLen)
+        if (m_Pump.InErrorFrame())
         {
-            DumpError();
+            m_Pump.DumpError();
+            LogDrain();
             ClearQueues();
             break;
         }
@@ -347,14 +444,14 @@ void CKernel::YMTest() {
         ticks_cnt -= TICKS_DIV;
 
         
-        //YMReset();
-        //SpinbusSync();
+        //m_Pump.Reset();
+        //m_Pump.Sync();
         YMPrepare(chip, channel);
         YMQueueNoteStop(chip, channel);
         YMQueueNoteRaw(chip, channel, notes[note]);
         u32 remaining;
         do {
-            remaining = YMProcessQueue();
+            remaining = m_Pump.Process();
         } while (remaining > 0);
         m_Logger.Write (FromKernel, LogNotice, "Played note %d/%d (%d) for chip %d channel %d.", note+1, NOTES_LENGTH, notes[note], chip+1, channel+1);
 
@@ -369,67 +466,116 @@ void CKernel::YMTest() {
     }
 }
 
-void CKernel::YMPrepare (u8 chip, u8 channelIdx) {
+void CKernel::YMPrepareGlobal (u32 chipMask) {
+    YMQueueBroadcast(chipMask, 0x22, 0x00); // LFO off
+    //YMQueueBroadcast(chipMask, 0x24, 0x00); // Timer A Freq (high)
+    //YMQueueBroadcast(chipMask, 0x25, 0x00); // Timer A Freq (low)
+    //YMQueueBroadcast(chipMask, 0x26, 0x00); // Timer B Freq
+    YMQueueBroadcast(chipMask, 0x27, 0x00); // Ch3 mode normal + timer off
+    //YMQueueBroadcast(chipMask, 0x29, 0x00); // Ch6 DAC output
+    YMQueueBroadcast(chipMask, 0x2B, 0x00); // Ch6 DAC off
+    // jt12-specific registers
+    // 0x00: ADPCMA_ON
+    // 0x01: ADPCMA_TL
+    // 0x02: ADPCMA_TEST
+    // 0x21: TESTYM
+    // 0x2C: DACTEST
+    // 0x2D: CLK_N6
+    // 0x2E: CLK_N3
+    // 0x2F: CLK_N2
+}
+
+/// @brief Keys off a channel and loads a patch from g_Patches into it.
+void CKernel::YMPrepare (u8 chip, u8 channelIdx, u8 patchId) {
+    YMPrepareChips(BIT(chip), channelIdx, patchId);
+}
+
+/// @brief Keys off the same channel on every chip in a mask and loads a patch from g_Patches into it.
+void CKernel::YMPrepareChips (u32 chipMask, u8 channelIdx, u8 patchId) {
     bool bank = channelIdx > 2;
-        u8 chMod = channelIdx % 3;
+    u8 chMod = channelIdx % 3;
     u8 channel = bank ? channelIdx + 1 : channelIdx;
-    // global
-    if (channelIdx == 0) {
-        YMQueueData(chip, 0x22, 0x00); // LFO off
-        //YMQueueData(chip, 0x24, 0x00); // Timer A Freq (high)
-        //YMQueueData(chip, 0x25, 0x00); // Timer A Freq (low)
-        //YMQueueData(chip, 0x26, 0x00); // Timer B Freq
-        YMQueueData(chip, 0x27, 0x00); // Ch3 mode normal + timer off
-        //YMQueueData(chip, 0x29, 0x00); // Ch6 DAC output
-        YMQueueData(chip, 0x2B, 0x00); // Ch6 DAC off
-        // jt12-specific registers
-        // 0x00: ADPCMA_ON
-        // 0x01: ADPCMA_TL
-        // 0x02: ADPCMA_TEST
-        // 0x21: TESTYM
-        // 0x2C: DACTEST
-        // 0x2D: CLK_N6
-        // 0x2E: CLK_N3
-        // 0x2F: CLK_N2
-    }
-
-    YMQueueData(chip, 0x28, channel);
+    const YMPatch &patch = g_Patches[patchId];
+
+    YMQueueBroadcast(chipMask, 0x28, channel);
 
     // operator
-    YMQueueData(chip, 0x30+chMod, 0x71, bank); // OP1 DeTune / MULtiply (DT/MUL)
-    YMQueueData(chip, 0x34+chMod, 0x0D, bank); // OP3
-    YMQueueData(chip, 0x38+chMod, 0x33, bank); // OP2
-    YMQueueData(chip, 0x3C+chMod, 0x01, bank); // OP4
-    YMQueueData(chip, 0x40+chMod, 0x23, bank); // OP1 Total Level (TL)
-    YMQueueData(chip, 0x44+chMod, 0x2D, bank); // OP3
-    YMQueueData(chip, 0x48+chMod, 0x26, bank); // OP2
-    YMQueueData(chip, 0x4C+chMod, 0x00, bank); // OP4
-    YMQueueData(chip, 0x50+chMod, 0x5F, bank); // OP1 AttackRate/RateScale (AR/RS)
-    YMQueueData(chip, 0x54+chMod, 0x99, bank); // OP3
-    YMQueueData(chip, 0x58+chMod, 0x5F, bank); // OP2
-    YMQueueData(chip, 0x5C+chMod, 0x92, bank); // OP4 (original 0x94)
-    YMQueueData(chip, 0x60+chMod, 0x05, bank); // OP1 DecayRate / AmpMod Enable (DR[D1R]/AM)
-    YMQueueData(chip, 0x64+chMod, 0x05, bank); // OP3
-    YMQueueData(chip, 0x68+chMod, 0x05, bank); // OP2
-    YMQueueData(chip, 0x6C+chMod, 0x07, bank); // OP4
-    YMQueueData(chip, 0x70+chMod, 0x02, bank); // OP1 SustainRate (SR[D2R])
-    YMQueueData(chip, 0x74+chMod, 0x02, bank); // OP3
-    YMQueueData(chip, 0x78+chMod, 0x02, bank); // OP2
-    YMQueueData(chip, 0x7C+chMod, 0x02, bank); // OP4
-    YMQueueData(chip, 0x80+chMod, 0x11, bank); // OP1 ReleaseRate / SustainLevel (RR/SL)
-    YMQueueData(chip, 0x84+chMod, 0x11, bank); // OP3
-    YMQueueData(chip, 0x88+chMod, 0x11, bank); // OP2
-    YMQueueData(chip, 0x8C+chMod, 0xA3, bank); // OP4 (def:A6)
-    YMQueueData(chip, 0x90+chMod, 0x00, bank); // OP1 SSG-EG
-    YMQueueData(chip, 0x94+chMod, 0x00, bank); // OP3
-    YMQueueData(chip, 0x98+chMod, 0x00, bank); // OP2
-    YMQueueData(chip, 0x9C+chMod, 0x00, bank); // OP4
+    for (u8 op = 0; op < 4; op++) {
+        u8 opMod = chMod + op*4;
+        YMQueueBroadcast(chipMask, 0x30+opMod, patch.DetuneMultiply[op], bank); // DeTune / MULtiply (DT/MUL)
+        YMQueueBroadcast(chipMask, 0x40+opMod, patch.TotalLevel[op], bank); // Total Level (TL)
+        YMQueueBroadcast(chipMask, 0x50+opMod, patch.AttackRate[op], bank); // AttackRate/RateScale (AR/RS)
+        YMQueueBroadcast(chipMask, 0x60+opMod, patch.DecayRate[op], bank); // DecayRate / AmpMod Enable (DR[D1R]/AM)
+        YMQueueBroadcast(chipMask, 0x70+opMod, patch.SustainRate[op], bank); // SustainRate (SR[D2R])
+        YMQueueBroadcast(chipMask, 0x80+opMod, patch.ReleaseRate[op], bank); // ReleaseRate / SustainLevel (RR/SL)
+        YMQueueBroadcast(chipMask, 0x90+opMod, patch.SSGEG[op], bank); // SSG-EG
+    }
 
     // Channel registers
-    YMQueueData(chip, 0xA4+chMod, 0x22, bank); // block/fnum (high)
-    YMQueueData(chip, 0xA0+chMod, 0x69, bank); // fnum (low)
-    YMQueueData(chip, 0xB0+chMod, 0x32, bank); // Feedback/algorithm
-    YMQueueData(chip, 0xB4+chMod, 0xC0, bank); // Pan/PMS/AMS
+    YMQueueBroadcast(chipMask, 0xB0+chMod, patch.FeedbackAlgorithm, bank); // Feedback/algorithm
+    YMQueueBroadcast(chipMask, 0xB4+chMod, patch.PanModulation, bank); // Pan/PMS/AMS
+
+    for (u8 chip = 0; chip < YM_COUNT; chip++) {
+        if (chipMask & BIT(chip))
+            m_Voices.SetPatch(chip*YM_CHANNELS + channelIdx, patchId);
+    }
+}
+
+/// @brief Queues the writes that bring freshly reset voice chips back to m_Snapshot,
+/// and tells the voice allocator which patch each channel holds again.
+void CKernel::YMRestore () {
+    u8 chips = m_Voices.GetVoiceCount() / YM_CHANNELS;
+    u32 chipMask = (1U << chips) - 1;
+    unsigned deferred = 0;
+    unsigned count = m_Snapshot.Restore(chipMask, RestoreWriteHandler, this, &deferred);
+
+    for (u8 channelIdx = 0; channelIdx < YM_CHANNELS; channelIdx++) {
+        for (u8 chip = 0; chip < chips; chip++) {
+            u8 patchId = m_Snapshot.GetPatch(chip, channelIdx);
+            if (patchId != PATCH_NONE)
+                m_Voices.SetPatch(chip*YM_CHANNELS + channelIdx, patchId);
+        }
+    }
+
+    m_Logger.Write (FromKernel, LogNotice, "Warm restart: %u writes queued for %u chips, %u of them deferred",
+        count, chips, deferred);
+}
+
+/// @brief Marks the end of the writes the restore or the full prepare queued, for YMRestoreSent.
+/// After a restore only the channels that were sounding count: the others' writes may
+/// still be going out when notes start, since a note on one of those channels queues
+/// behind them anyway.
+/// Called before YMSnapshot, which forgets what was sounding.
+void CKernel::YMRestoreMark (bool restored) {
+    for (u8 chip = 0; chip < YM_COUNT; chip++) {
+        m_Pump.GetQueue(chip).Mark(&m_RestoreMark[chip]);
+        u8 channels = BIT(YM_CHANNELS);
+        for (u8 channel = 0; channel < YM_CHANNELS; channel++) {
+            if (!restored || m_Snapshot.IsSounding(chip, channel))
+                channels |= BIT(channel);
+        }
+        m_RestoreChannels[chip] = channels;
+    }
+}
+
+/// @return true once every write YMRestoreMark marked is on its chip, replays included.
+bool CKernel::YMRestoreSent () {
+    if (m_Pump.GetJournal().GetReplayCount())
+        return false;
+    for (u8 chip = 0; chip < YM_COUNT; chip++) {
+        if (!m_Pump.GetQueue(chip).IsSent(m_RestoreMark[chip], m_RestoreChannels[chip]))
+            return false;
+    }
+    return true;
+}
+
+/// @brief Merges the intended register image and each voice's patch into m_Snapshot.
+/// Only called while no other core is queueing.
+void CKernel::YMSnapshot () {
+    m_Snapshot.Take(m_Pump.GetShadow());
+    for (u16 voice = 0; voice < m_Voices.GetVoiceCount(); voice++)
+        m_Snapshot.SetChannel(voice / YM_CHANNELS, voice % YM_CHANNELS, m_Voices.GetPatch(voice),
+            m_Voices.GetKey(voice) != VOICE_KEY_NONE);
 }
 
 /// @brief gets the two-byte YM block+fnum value to send for selecting a note frequency
@@ -440,11 +586,13 @@ u16 CKernel::YMGetNote(u8 block, u16 fnum) {
   return ((block & 7) << 11) | (fnum & 0x7ff);
 }
 
-u16 CKernel::YMQueueNote(u8 chip, u8 channel, PlayedNote note, bool prepare) {
-    if (note.KeyOn) {
+u16 CKernel::YMQueueNote(u8 chip, u8 channel, const PlayedNote &note, bool prepare) {
+    if (note.Event == NoteEventOn) {
         if (prepare)
-            YMPrepare(chip, channel);
-        return YMQueueNote(chip, channel, note.Frequency, note.Velocity);
+            YMPrepare(chip, channel, note.Patch);
+        u16 word = YMKeyToNote(note.KeyNumber, YMBendToFine(m_ChannelBend[note.Channel]));
+        YMQueueNoteRaw(chip, channel, word, note.Velocity);
+        return word;
     }
     else {
         YMQueueNoteStop(chip, channel);
@@ -452,207 +600,208 @@ u16 CKernel::YMQueueNote(u8 chip, u8 channel, PlayedNote note, bool prepare) {
     }
 }
 
-u16 CKernel::YMQueueNote(u8 chip, u8 channel, u16 frequency, u8 velocity) {
-    u16 fnum = (144*(float)frequency*pow(2,20)/7669857) / 8;
-    u8 block = 2;
-    while (fnum >= 2048)
-    {
-        fnum /= 2;
-        block++;
+/// @brief Takes the due note events off m_Notes, so the ring keeps draining and never
+/// loses a note off. Note ons wait in m_HeldNotes while the throttle policy holds intake
+/// or a bus reset is under way (play false), and behind any that already wait; a note off
+/// drops the held note ons for its key, then goes out like a pitch bend. Without play
+/// nothing goes to the chips: the reset keys every channel off, so only the bend is kept.
+void CKernel::NoteIntake (u64 now, bool play)
+{
+    // note ons held back earlier go first, in order
+    while (play && !m_HeldNotes.empty() && !m_Pump.IsResetRequested() && !m_Overload.HoldIntake()) {
+        NoteDispatch(m_HeldNotes.front(), now);
+        m_HeldNotes.pop();
     }
-    u16 note = ((block & 0x7) << 11) | (fnum & 0x07ff);
-    YMQueueNoteRaw(chip, channel, note, velocity);
-    return note;
-}
-
-void CKernel::YMQueueNoteRaw(u8 chip, u8 channel, u16 note, u8 velocity) {
-    YMQueueData(chip, 0x4C + channel % 3, 0x7f-velocity, channel > 2);
-    YMQueueData(chip, 0xA4 + channel % 3, note >> 8, channel > 2); // block/fnum (high)
-    YMQueueData(chip, 0xA0 + channel % 3, note & 0xff, channel > 2); // fnum (low)
-    YMQueueData(chip, 0x28, 0xF0 + channel + (channel > 2 ? 1 : 0)); // Key on
-}
 
-void CKernel::YMQueueNoteStop(u8 chip, u8 channel) {
-    YMQueueData(chip, 0x28, channel + (channel > 2 ? 1 : 0)); // Key off
-}
-
-void CKernel::YMReset () {
-    m_RSTPin.Write(HIGH);
-    m_Timer.usDelay(10);
-    m_RSTPin.Write(LOW);
-    m_Timer.usDelay(20);
-    m_BitsRead = 0;
-    m_LastReadByte = 0;
-    m_PrevReadByte = 0;
-}
-
-YMSyncResult CKernel::SpinbusSync() {
-    u8 count = 0;
-    u8 ones = 0;
-    do {
-        ones += WriteReadRaw(CMD_NOP);
-        if (m_LastBits == 0x0101) {
-            m_LastReadByte = 1;
-            m_PrevReadByte = 1;
-            m_BitsRead = 0;
-            break;
+    const PlayedNote *pNext;
+    PlayedNote note;
+    while ((pNext = m_Notes.Peek()) != 0 && m_Scheduler.IsDue(pNext->Timestamp, now)) {
+        m_Notes.Pop(note);
+        bool playing = play && !m_Pump.IsResetRequested();
+        if (note.Event == NoteEventOn) {
+            if (playing && m_HeldNotes.empty() && !m_Overload.HoldIntake())
+                NoteDispatch(note, now);
+            else if (!m_HeldNotes.full())
+                m_HeldNotes.push(note);
+            else
+                m_nHeldDropped++;
+            continue;
         }
-    } while (++count < SYNC_WRITE_LIMIT);
-
-    if (count == SYNC_WRITE_LIMIT) {
-        m_Logger.Write (FromKernel, LogNotice, "Couldn't synchronize after %d writes. (last byte %04X)", count, m_LastBits);
-        m_Timer.MsDelay(100);
-        return { count, ones, false };
+        if (note.Event == NoteEventOff)
+            NoteCancel(note.KeyNumber);
+        if (playing)
+            NoteDispatch(note, now);
+        else if (note.Event == NoteEventPitchBend)
+            m_ChannelBend[note.Channel] = note.Bend;
     }
-    m_Logger.Write (FromKernel, LogNotice, "Synchronized after %d writes. (last byte %04X)", count, m_LastBits);
-    return { count, ones, true };
 }
 
-void CKernel::YMQueueData(u8 chip, u8 address, u8 data, bool bank) {
-    if (queues[chip].queue.size() > QUEUE_SIZE_LIMIT) {
-        m_Logger.Write (FromKernel, LogNotice, "Hit queue limit (%d) for chip %d (addr %02X data %02X)", QUEUE_SIZE_LIMIT, chip, address, data);
-        m_DoReset = true;
-        m_Timer.MsDelay(100);
+/// @brief Drops the held note ons for a key whose note off came before they could play.
+void CKernel::NoteCancel (u8 key)
+{
+    for (unsigned count = m_HeldNotes.size(); count > 0; count--) {
+        PlayedNote note = m_HeldNotes.front();
+        m_HeldNotes.pop();
+        if (note.KeyNumber != key)
+            m_HeldNotes.push(note);
     }
-    else
-        queues[chip].queue.emplace((bool)bank, address, data);
 }
 
-u32 CKernel::YMProcessQueue()
+/// @brief Sends one note event to the voices and the chips' queues.
+void CKernel::NoteDispatch (const PlayedNote &note, u64 now)
 {
-    // If the YM commands have been sent, reset the queues
-    bool sentState = m_YMSentPin.Read();
-    if (sentState) { // Sent flag rise
-        for (int i = 0; i < YM_COUNT; i++)
-            queues[i].sent = 0;
+    m_Scheduler.Dispatched(note.Timestamp, now);
+    if (note.Event == NoteEventPitchBend) {
+        YMQueuePitchBend(note.Channel, note.Bend);
     }
-
-    // Iterate through the send queues
-    u32 remaining = 0;
-    for (int i = 0; i < YM_COUNT; i++) {
-        remaining += queues[i].queue.size();
-        // if the YM data has been latched, we can now send to the same chips again
-        // don't bother checking if there's nothing to send though
-        if (!queues[i].queue.size() || queues[i].sent)
-            continue;
-            
-        // send the command
-        queues[i].sent = true;
-        YMCommand cmd = queues[i].queue.front();
-        YMWrite(i, cmd);
-        queues[i].queue.pop();
-
-        // send resulted in the completion of a return byte
-        // YM reg-data commands are typically 4 bytes,
-        // so we'll get a byte every two commands
-
-        if (m_HasError) {
-            ClearQueues();
-            return 0;
+    else if (note.Event == NoteEventOn) {
+        u32 avoid = m_Overload.GetAvoidMask();
+        TVoiceAllocation voice = m_Voices.NoteOn(note.KeyNumber, note.Patch, avoid,
+            m_Overload.GetPolicy() == OverloadStealVoices);
+        m_VoiceChannel[voice.Voice] = note.Channel;
+        u8 chip = voice.Voice/YM_CHANNELS;
+        u8 channel = voice.Voice%YM_CHANNELS;
+        if (avoid)
+            m_Overload.Placed(chip, avoid);
+        // a stolen or retriggered channel has to be keyed off first
+        if (voice.Stolen || voice.Retrigger)
+            YMQueueNoteStop(chip, channel);
+        bool prepare = m_Voices.GetPatch(voice.Voice) != note.Patch;
+        if (prepare)
+            m_PatchLoads++;
+        else
+            m_PatchHits++;
+        m_Stats.KeyOnQueued(chip, channel, note.Arrival);
+        //u16 noteShort =
+        YMQueueNote(chip, channel, note, prepare);
+        //m_Logger.Write (FromKernel, LogNotice, "Note: chip %2d:%d key:%3d b:%d fnum:%4d (%04X) vel:%02X",
+            //chip+1, channel+1, note.KeyNumber, noteShort >> 11, noteShort & 0x7ff, noteShort & 0x7ff, note.Velocity);
+    }
+    else {
+        // find the channel the key is playing on
+        u16 voice = m_Voices.NoteOff(note.KeyNumber);
+        if (voice != VOICE_NONE) {
+            u8 chip = voice/YM_CHANNELS;
+            u8 channel = voice%YM_CHANNELS;
+            //m_Logger.Write(FromKernel, LogDebug, "keyoff: %d, chip %d chan %d", note.KeyNumber, chip, channel);
+            YMQueueNoteStop(chip, channel);
         }
     }
-    return remaining;
 }
 
-/// @brief Writes a YMCommand to the FPGA.
-/// @param chip chip index to send the command to.
-/// @param command YMCommand to sent.
-/// @return true if the write resulted in the completion of a return data byte (stored in `m_LastReadByte`).
-bool CKernel::YMWrite (u8 chip, YMCommand command)
-{
-    return YMWrite(chip, command.address, command.data, command.bank);
+/// @brief Re-tunes every voice sounding on a MIDI channel after a pitch bend.
+/// Only the fnum registers are rewritten; the envelope keeps running.
+void CKernel::YMQueuePitchBend(u8 midiChannel, s16 bend) {
+    m_ChannelBend[midiChannel] = bend;
+    int fine = YMBendToFine(bend);
+    for (u16 voice = 0; voice < m_Voices.GetVoiceCount(); voice++) {
+        u8 key = m_Voices.GetKey(voice);
+        if (key == VOICE_KEY_NONE || m_VoiceChannel[voice] != midiChannel)
+            continue;
+        YMQueueFnum(voice/YM_CHANNELS, voice%YM_CHANNELS, YMKeyToNote(key, fine));
+    }
 }
 
-/// @brief Writes a YM command to the FPGA.
-/// @param chip chip index to send the command to.
-/// @param address address to write the data to.
-/// @param data data to write.
-/// @param bank 0: channels 1~3, 1: channels 4~6.
-/// @return true if the write resulted in the completion of a return data byte (stored in `m_LastReadByte`).
-bool CKernel::YMWrite (u8 chip, u8 address, u8 data, bool bank)
-{
-    bool byteCompleted = false;
-
-    byteCompleted |= WriteRead(CMD_YM_REGDATA) << 3;
-    byteCompleted |= WriteRead(chip << 1 | bank) << 2;
-    byteCompleted |= WriteRead(address) << 1;
-    byteCompleted |= WriteRead(data);
-
-    return byteCompleted;
+void CKernel::YMQueueFnum(u8 chip, u8 channel, u16 note) {
+    YMQueueData(chip, 0xA4 + channel % 3, note >> 8, channel > 2); // block/fnum (high)
+    YMQueueData(chip, 0xA0 + channel % 3, note & 0xff, channel > 2); // fnum (low)
 }
 
-
-/// @brief Writes a byte of data to the FPGA, and shifts the return bit into m_LastBits.
-/// @param data byte to write to the FPGA.
-/// @return true if the write resulted in the completion of a return data byte (stored in `m_LastReadByte`).
-bool CKernel::WriteRead (u8 data)
-{
-    WriteReadRaw(data);
-
-    // check for error
-    u8 errCnt = 0;
-    if (!m_HasError && m_LastBits == 0xf0d4) {
-        m_PrevReadByte = m_LastBits >> 8;
-        m_LastReadByte = m_LastBits & 0xff;
-        m_BitsRead = 0;
-        m_HasError = true;
-        errCnt = 32;
+void CKernel::YMQueueNoteRaw(u8 chip, u8 channel, u16 note, u8 velocity) {
+    // velocity attenuates the carriers on top of the patch's own levels
+    u16 voice = chip*YM_CHANNELS + channel;
+    u8 patchId = m_Voices.GetPatch(voice);
+    const YMPatch &patch = g_Patches[patchId == PATCH_NONE ? 0 : patchId];
+    u8 carriers = YMPatchCarriers(patch);
+    m_VoiceVelocity[voice] = velocity;
+    for (u8 op = 0; op < 4; op++) {
+        if (!(carriers & BIT(op)))
+            continue;
+        YMQueueData(chip, 0x40 + op*4 + channel % 3, YMCarrierLevel(patch, op, velocity), channel > 2);
     }
-    // found error
-    while (m_HasError && errCnt > 0) {
-        // read another byte
-        for (u8 i = 0; i < 8; i++)
-            WriteReadRaw(CMD_DEBUG);
+    YMQueueFnum(chip, channel, note);
+    YMQueueData(chip, 0x28, 0xF0 + channel + (channel > 2 ? 1 : 0)); // Key on
+}
 
-        // third byte is the error code
-        if (m_ErrorCode == 0) {
-            m_ErrorCode = m_LastReadByte;
-        }
-        // fourth byte is the error data length
-        else if (m_ErrorLen == 0) {
-            m_ErrorLen = m_LastReadByte;
-            if (m_ErrorLen > 8)
-                m_ErrorLen = 8;
-        }
-        // remaining bytes are error data
-        else if (m_ErrorBytesRead < m_ErrorLen) {
-            m_ErrorData[m_ErrorBytesRead++] = m_LastReadByte;
-        }
-        
-        if (m_ErrorLen > 0 && m_ErrorBytesRead >= m_ErrorLen)  {
-            DumpError();
-            return 0;
+void CKernel::YMQueueNoteStop(u8 chip, u8 channel) {
+    YMQueueData(chip, 0x28, channel + (channel > 2 ? 1 : 0)); // Key off
+}
+
+/// @brief Rewrites every carrier TL after a master volume (CC7) change.
+/// Chips that end up with the same level for a register share one broadcast.
+void CKernel::YMQueueVolume() {
+    // chips past the voices belong to the VGM players
+    u8 chips = m_Voices.GetVoiceCount() / YM_CHANNELS;
+    for (u8 channel = 0; channel < YM_CHANNELS; channel++) {
+        for (u8 op = 0; op < 4; op++) {
+            u8 level[YM_COUNT];
+            u32 pending = 0;
+            for (u8 chip = 0; chip < chips; chip++) {
+                u16 voice = chip*YM_CHANNELS + channel;
+                u8 patchId = m_Voices.GetPatch(voice);
+                const YMPatch &patch = g_Patches[patchId == PATCH_NONE ? 0 : patchId];
+                if (!(YMPatchCarriers(patch) & BIT(op)))
+                    continue;
+                level[chip] = YMCarrierLevel(patch, op, m_VoiceVelocity[voice]);
+                pending |= BIT(chip);
+            }
+            while (pending) {
+                u8 first = __builtin_ctz(pending);
+                u32 mask = 0;
+                for (u8 chip = first; chip < chips; chip++) {
+                    if ((pending & BIT(chip)) && level[chip] == level[first])
+                        mask |= BIT(chip);
+                }
+                YMQueueBroadcast(mask, 0x40 + op*4 + channel % 3, level[first], channel > 2);
+                pending &= ~mask;
+            }
         }
     }
-    if (++m_BitsRead == 8)
-    {
-        m_BitsRead = 0;
-        m_PrevReadByte = m_LastBits >> 8;
-        m_LastReadByte = m_LastBits & 0xff;
-        
-        if (m_LastReadByte != 1) {
-            YMSyncResult syncResult = SpinbusSync();
-            m_Synchronized = syncResult.success;
-            if (!syncResult.success)
-                return false;
+}
+
+/// @brief Carrier TL for a patch operator, attenuated by note velocity and master volume.
+u8 CKernel::YMCarrierLevel(const YMPatch &patch, u8 op, u8 velocity) {
+    u16 level = patch.TotalLevel[op] + (0x7f-velocity) + (0x7f-m_uchVolume);
+    return level > 0x7f ? 0x7f : level;
+}
+
+/// @brief Queues a YM register write from the voice side.
+/// While the bus core is running the write is handed over through m_BusFeed,
+/// otherwise it goes straight into the chip's queue.
+void CKernel::YMQueueData(u8 chip, u8 address, u8 data, bool bank) {
+    YMCommand command(bank, address, data);
+#ifdef ARM_ALLOW_MULTI_CORE
+    if (m_BusCoreRequested.load(std::memory_order_relaxed)) {
+        // the bus core drains continuously; only wait while it is still there to do so
+        while (m_BusFeed.GetCount() == m_BusFeed.Capacity) {
+            if (m_Pump.IsResetRequested())
+                return;
         }
-        return true;
+        m_BusFeed.Push({chip, command});
+        return;
     }
-    return false;
+#endif
+    m_Pump.Enqueue(chip, command);
 }
 
-bool CKernel::WriteReadRaw(u8 data) {
-    u32 outWord = TO_DATA_OUT(data);
-    CGPIOPin::WriteAll(outWord, DATA_MASK);
-    m_Timer.nsDelay(40);
-    m_SCKPin.Write(HIGH);
-    m_Timer.nsDelay(40);
-    m_SCKPin.Write(LOW);
+/// @brief Queues the same register write for every chip in a mask.
+/// Each chip's copy is shadowed and coalesced on its own; the pump then sends
+/// copies that reach the front of their queues together as one CMD_YM_BROADCAST.
+void CKernel::YMQueueBroadcast(u32 chipMask, u8 address, u8 data, bool bank) {
+    for (u8 chip = 0; chip < YM_COUNT; chip++) {
+        if (chipMask & BIT(chip))
+            YMQueueData(chip, address, data, bank);
+    }
+}
 
-    bool bit = m_RETPin.Read();
-    m_LastBits <<= 1;
-    m_LastBits |= bit;
-    return bit;
+/// @brief Moves writes handed over by the voice core and by host register streams into the per-chip queues.
+void CKernel::YMDrainFeed()
+{
+    YMChipCommand item;
+    while (m_BusFeed.Pop(item))
+        m_Pump.Enqueue(item.chip, item.command);
+    while (!m_Pump.IsResetRequested() && m_SysExFeed.Pop(item))
+        m_Pump.Enqueue(item.chip, item.command);
 }
 
 std::string hexStr(unsigned char *data, int len)
@@ -666,57 +815,49 @@ std::string hexStr(unsigned char *data, int len)
   return s;
 }
 
-void CKernel::DumpError ()
+/// @brief Formats and writes out what the bus path logged through m_Log.
+/// Only called from core 0, outside the bus loop.
+void CKernel::LogDrain ()
 {
-    m_Logger.Write(FromKernel, LogError, "");
-    m_Logger.Write(FromKernel, LogError, "SPINDASH ERROR");
-    if (auto search = m_ErrorMap.find(m_ErrorCode); search != m_ErrorMap.end())
-        m_Logger.Write(FromKernel, LogError, search->second);
-    m_Logger.Write(FromKernel, LogError, "ERRCODE: %02X", m_ErrorCode);
-    for (int i = 0; i < m_ErrorLen; i++)
-        m_Logger.Write(FromKernel, LogError, "DATA %2d: %02X", i, m_ErrorData[i]);
-
-    switch (m_ErrorCode) {
-        case ERROR_COMMAND_UNKNOWN:
-            m_Logger.Write(FromKernel, LogError, "Unknown command received: %02X", m_ErrorData[0]);
-            break;
-        case ERROR_INVALID_STATE:
-            m_Logger.Write(FromKernel, LogError, "Invalid command receiver state: %02X", m_ErrorData[1]);
-            break;
-        case ERROR_TOO_MANY_BYTES:
-            m_Logger.Write(FromKernel, LogError, "Received too many bytes for command: %02X", m_ErrorData[0]);
-            break;
-        case ERROR_YM_IDX_OUTOFRANGE:
-            m_Logger.Write(FromKernel, LogError, "YM chip index out of range: %d", m_ErrorData[1] >> 1);
-            break;
-        case ERROR_YM_DOUBLE_SUBMIT:
-            m_Logger.Write(FromKernel, LogError, "YM double submission on chip index: %d", m_ErrorData[1] >> 1);
-            break;
-        default:
-            m_Logger.Write(FromKernel, LogError, "Unknown error code: %02X", m_ErrorCode);
-            break;
+    char line[LOG_LINE_SIZE];
+    TLogSeverity severity;
+    while (m_Log.Read(line, sizeof line, &severity))
+        m_Logger.Write(FromKernel, severity, "%s", line);
+
+    if (m_Log.GetDropped() != m_nLogDropped) {
+        m_nLogDropped = m_Log.GetDropped();
+        m_Logger.Write(FromKernel, LogWarning, "Log ring overflow, %u messages dropped so far", m_nLogDropped);
     }
-
-    
-    m_HasError = false;
-    m_ErrorCode = 0;
-    m_ErrorLen = 0;
-    m_ErrorBytesRead = 0;
-
-    m_LastReadByte = 0;
-    m_PrevReadByte = 0;
-    m_BitsRead = 0;
-    m_BytesRead = 0;
-
-    m_SentState = false;
-    m_Reading = false;
 }
 
 void CKernel::ClearQueues () {
-    for (int i = 0; i < YM_COUNT; i++) {
-        std::queue<YMCommand> empty;
-        std::swap(queues[i].queue, empty);
+    m_Pump.Clear();
+
+    // only called by whichever core currently owns the bus, which is also the feed consumer
+    YMChipCommand item;
+    while (m_BusFeed.Pop(item))
+        ;
+    while (m_SysExFeed.Pop(item))
+        ;
+}
+
+/// @brief Waits until the YM writes the FPGA still holds have reached their chips, so the
+/// reset doesn't cut one short, rather than sitting out a fixed second before every reset.
+/// Gives up after YM_SETTLE_LIMIT_MS; the time it took is logged.
+void CKernel::WaitSettled ()
+{
+    u64 start = m_Timer.GetClockTicks64();
+    u64 limit = start + YM_SETTLE_LIMIT_MS * (CLOCKHZ / 1000);
+    bool settled;
+    while (!(settled = m_pBus->GetSent()) && m_Timer.GetClockTicks64() < limit) {
+        NoteIntake(m_Timer.GetClockTicks64(), false);
+        m_Timer.usDelay(1);
     }
+    u32 us = (u32) ((m_Timer.GetClockTicks64() - start) * 1000000 / CLOCKHZ);
+    if (settled)
+        m_Logger.Write (FromKernel, LogNotice, "Bus settled in %u us", us);
+    else
+        m_Logger.Write (FromKernel, LogWarning, "Bus still busy after %u us, resetting anyway", us);
 }
 
 void CKernel::DumpValue (u32 data, u8 len)
@@ -747,25 +888,353 @@ bool CKernel::RebootCheck()
     return false;
 }
 
+/// @brief Bus core main loop: pumps the YM queues whenever core 0 has handed over the bus.
+void CKernel::BusCoreRun ()
+{
+    while (true) {
+        bool requested = m_BusCoreRequested.load(std::memory_order_acquire);
+        if (requested != m_BusCoreRunning.load(std::memory_order_relaxed))
+            m_BusCoreRunning.store(requested, std::memory_order_release);
+        if (!requested || m_Pump.IsResetRequested())
+            continue;
+
+        YMDrainFeed();
+        m_Pump.Process();
+        m_Stats.Publish(StatsClock());
+    }
+}
+
+/// @brief Hands the bus to the bus core and waits until it has picked it up.
+/// No-op on single-core builds, where Run pumps the queues itself.
+void CKernel::BusCoreStart ()
+{
+#ifdef ARM_ALLOW_MULTI_CORE
+    m_BusCoreRequested.store(true, std::memory_order_release);
+    while (!m_BusCoreRunning.load(std::memory_order_acquire))
+        ;
+#endif
+}
+
+/// @brief Takes the bus back from the bus core once it has finished its current pass.
+void CKernel::BusCoreStop ()
+{
+#ifdef ARM_ALLOW_MULTI_CORE
+    m_BusCoreRequested.store(false, std::memory_order_release);
+    while (m_BusCoreRunning.load(std::memory_order_acquire))
+        ;
+#endif
+}
+
+/// @brief Opens the VGM files that are present on the SD card.
+/// @return the number of chips left for MIDI voices.
+u8 CKernel::VGMOpen ()
+{
+    u8 voiceChips = YM_COUNT;
+    for (unsigned i = 0; i < VGM_PLAYERS; i++) {
+        if (!m_bFileSystem || !m_VGMFile[i].Open(s_VGMSlots[i].Path))
+            continue;
+        for (unsigned n = 0; n < VGM_CHIPS; n++) {
+            u32 mask = s_VGMSlots[i].ChipMask[n];
+            if (mask && __builtin_ctz(mask) < voiceChips)
+                voiceChips = __builtin_ctz(mask);
+        }
+    }
+    return voiceChips;
+}
+
+/// @brief Starts every VGM file VGMOpen found, from the beginning, looping forever.
+void CKernel::VGMStart ()
+{
+    for (unsigned i = 0; i < VGM_PLAYERS; i++) {
+        if (!m_VGMFile[i].IsOpen())
+            continue;
+        m_VGMFillMax[i] = 0;
+        if (m_pVGM[i]->Start(&m_VGMFile[i], s_VGMSlots[i].ChipMask, m_Timer.GetClockTicks64(), (unsigned) -1))
+            m_Logger.Write (FromKernel, LogNotice, "Playing %s", s_VGMSlots[i].Path);
+        else
+            m_Logger.Write (FromKernel, LogWarning, "%s is not a VGM file", s_VGMSlots[i].Path);
+    }
+}
+
+void CKernel::VGMStop ()
+{
+    for (unsigned i = 0; i < VGM_PLAYERS; i++) {
+        if (!m_VGMFile[i].IsOpen())
+            continue;
+        VGMLog(i);
+        m_pVGM[i]->Stop();
+        m_VGMFile[i].Close();
+    }
+}
+
+void CKernel::VGMLog (unsigned player)
+{
+    const TVGMStats &stats = m_pVGM[player]->GetStats();
+    m_Logger.Write (FromKernel, LogNotice, "%s: %u writes, %u deadline misses (max %u us late), %u underruns, longest Fill %u us",
+        s_VGMSlots[player].Path, stats.Writes, stats.Misses, stats.MaxLateness, stats.Underruns, m_VGMFillMax[player]);
+}
+
+/// @brief Steps the bus delays down to the fastest setting that passes the idle pattern.
+/// Leaves the bus reset, so it has to be followed by m_Pump.Reset and a sync.
+void CKernel::SpinbusCalibrate ()
+{
+    m_Logger.Write (FromKernel, LogNotice, "Calibrating bus timing...");
+    CSpinbusCalibrator calibrator(m_pBus, CalibrationClock, 0, StatsClockRate());
+    bool ok = calibrator.Run();
+
+    for (unsigned i = 0; i < calibrator.GetStepCount(); i++) {
+        const TCalibrationStep &step = calibrator.GetStep(i);
+        m_Logger.Write (FromKernel, LogDebug, "  %2u/%2u ns: %3u ns/byte, %u bytes/s, %u/%u bit errors%s%s",
+            step.SetupNs, step.HoldNs, step.PeriodNs, step.BytesPerSecond, step.BitErrors, step.Bits,
+            step.Synchronized ? "" : ", no sync", step.Faulted ? ", FPGA error" : "");
+    }
+
+    const TCalibrationStep *pResult = calibrator.GetResult();
+    if (!ok || pResult == 0) {
+        m_Logger.Write (FromKernel, LogWarning, "Bus calibration failed, keeping %u/%u ns",
+            m_pBus->GetSetupNs(), m_pBus->GetHoldNs());
+        return;
+    }
+    m_Logger.Write (FromKernel, LogNotice, "Bus timing %u/%u ns: %u ns/byte, %u bytes/s",
+        pResult->SetupNs, pResult->HoldNs, pResult->PeriodNs, pResult->BytesPerSecond);
+}
+
+u32 CKernel::CalibrationClock (void *)
+{
+    return StatsClock();
+}
+
+u32 CKernel::PumpClock (void *)
+{
+    return StatsClock();
+}
+
+/// @brief Logs one interval of bus statistics, on the core that isn't pumping the bus.
+void CKernel::StatsDump (const TBusStatsSnapshot &stats)
+{
+    u32 seconds = stats.Interval / 1000000;
+    m_Logger.Write (FromKernel, LogNotice, "Bus: %u bytes/s, %u syncs (%u failed), %u errors, %u resyncs (%u bits lost)",
+        stats.Interval ? (u32) ((u64) stats.Bytes * 1000000 / stats.Interval) : 0,
+        stats.Syncs, stats.SyncFailures, stats.Errors, stats.Resyncs, stats.ResyncBits);
+    m_Logger.Write (FromKernel, LogNotice, "Key-on latency over %us: %u notes, mean %u us, p50 %u us, p99 %u us, max %u us",
+        seconds, stats.Latency.GetCount(), stats.Latency.GetMean(), stats.Latency.GetPercentile(50),
+        stats.Latency.GetPercentile(99), stats.Latency.GetMax());
+
+    char line[YM_COUNT * 5 + 1];
+    unsigned len = 0;
+    for (unsigned i = 0; i < YM_COUNT; i++)
+        len += snprintf(line + len, sizeof line - len, " %u", stats.HighWater[i]);
+    m_Logger.Write (FromKernel, LogNotice, "Queue high water:%s", line);
+
+    for (unsigned i = 0; i < VGM_PLAYERS; i++) {
+        if (m_pVGM[i]->IsPlaying())
+            VGMLog(i);
+    }
+}
+
+/// @brief Logs the running totals of the queues, the journal, the overload control and
+/// the event scheduler, along with each StatsDump. The bus core keeps counting meanwhile
+/// and nothing is handed over, so a line may mix figures from slightly different moments.
+void CKernel::CountersDump ()
+{
+    u32 coalesced = 0;
+    for (int i = 0; i < YM_COUNT; i++)
+        coalesced += m_Pump.GetQueue(i).GetCoalesced();
+    m_Logger.Write (FromKernel, LogNotice, "Register writes: %u sent, %u elided, %u coalesced",
+        m_Pump.GetShadow().GetSentWrites(), m_Pump.GetShadow().GetElidedWrites(), coalesced);
+    m_Logger.Write (FromKernel, LogNotice, "Patch cache: %u hits, %u loads",
+        m_PatchHits, m_PatchLoads);
+    const TYMJournalStats &journal = m_Pump.GetJournal().GetStats();
+    m_Logger.Write (FromKernel, LogNotice, "Replay journal: %u failures, %u writes replayed in %u bytes, %u dropped, %u skipped",
+        journal.Failures, journal.Replayed, m_Pump.GetReplayBytes(), journal.Dropped, journal.Skipped);
+    m_Logger.Write (FromKernel, LogNotice, "Overload policy: %s, intake held %u times, %u held notes dropped",
+        COverloadControl::GetPolicyName(m_Overload.GetPolicy()), m_Overload.GetHolds(), m_nHeldDropped);
+    const TSerialStats &serial = m_SerialLink.GetStats();
+    if (serial.Frames || serial.BadCRC || serial.BadFrames || serial.LineErrors)
+        m_Logger.Write (FromKernel, LogNotice, "Serial link: %u frames, %u writes, %u waits, %u repeats, %u bad CRC, %u bad frames, %u out of sequence, %u without credit, %u line errors",
+            serial.Frames, serial.Writes, serial.Waits, serial.Repeats, serial.BadCRC, serial.BadFrames,
+            serial.OutOfSequence, serial.NoCredit, serial.LineErrors);
+    for (u8 i = 0; i < YM_COUNT; i++) {
+        const TOverloadStats &overload = m_Overload.GetStats(i);
+        if (overload.Episodes || overload.LimitHits)
+            m_Logger.Write (FromKernel, LogNotice, "  chip %u: %u episodes, %u limit hits, %u dropped, %u notes avoided, max depth %u",
+                i, overload.Episodes, overload.LimitHits, overload.Dropped, overload.Avoided, overload.MaxDepth);
+    }
+    static const char *const className[YMWriteClasses] = { "critical", "bulk" };
+    for (unsigned c = 0; c < YMWriteClasses; c++) {
+        u32 sent = 0, delayMax = 0;
+        u64 delayTotal = 0;
+        for (int i = 0; i < YM_COUNT; i++) {
+            TYMWriteClass eClass = (TYMWriteClass) c;
+            sent += m_Pump.GetQueue(i).GetSentCount(eClass);
+            delayTotal += m_Pump.GetQueue(i).GetDelayTotal(eClass);
+            if (m_Pump.GetQueue(i).GetDelayMax(eClass) > delayMax)
+                delayMax = m_Pump.GetQueue(i).GetDelayMax(eClass);
+        }
+        m_Logger.Write (FromKernel, LogNotice, "Queue delay (%s): %u writes, avg %u us, max %u us",
+            className[c], sent, sent ? m_Stats.ToMicroseconds((u32) (delayTotal / sent)) : 0,
+            m_Stats.ToMicroseconds(delayMax));
+    }
+    const CHistogram<EVENT_JITTER_BUCKETS> &jitter = m_Scheduler.GetJitter();
+    m_Logger.Write (FromKernel, LogNotice, "Event jitter: %u events, mean %u us, p50 %u us, p99 %u us, max %u us, %u late",
+        jitter.GetCount(), jitter.GetMean(), jitter.GetPercentile(50), jitter.GetPercentile(99),
+        jitter.GetMax(), m_Scheduler.GetLate());
+    for (unsigned b = 0; b <= jitter.Buckets; b++) {
+        if (jitter.GetBucket(b))
+            m_Logger.Write (FromKernel, LogDebug, "  %s%3u us: %u", b == jitter.Buckets ? ">=" : "< ",
+                (b == jitter.Buckets ? b : b + 1) * jitter.GetBucketWidth(), jitter.GetBucket(b));
+    }
+}
+
+void CKernel::VGMWriteHandler (void *pParam, u32 nChipMask, bool bBank, u8 nAddress, u8 nData)
+{
+    CKernel *pThis = (CKernel *) pParam;
+    assert (pThis != 0);
+    pThis->YMQueueBroadcast(nChipMask, nAddress, nData, bBank);
+}
+
+bool CKernel::SerialWriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData)
+{
+    CKernel *pThis = (CKernel *) pParam;
+    assert (pThis != 0);
+    // not past the overload watermark, nor into a full feed
+    if (   pThis->m_Pump.IsResetRequested()
+        || (pThis->m_Overload.GetOverloaded() & BIT(nChip))
+        || pThis->m_BusFeed.GetCount() == pThis->m_BusFeed.Capacity)
+        return false;
+    pThis->YMQueueData(nChip, nAddress, nData, bBank);
+    return true;
+}
+
+void CKernel::SerialSendHandler (void *pParam, const u8 *pData, unsigned nLength)
+{
+    CKernel *pThis = (CKernel *) pParam;
+    assert (pThis != 0);
+    pThis->m_Serial.Write(pData, nLength);
+}
+
+void CKernel::RestoreWriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData)
+{
+    CKernel *pThis = (CKernel *) pParam;
+    assert (pThis != 0);
+    pThis->YMQueueData(nChip, nAddress, nData, bBank);
+}
+
 void CKernel::MIDIPacketHandler (unsigned nCable, u8 *pPacket, unsigned nLength)
 {
 	assert (s_pThis != 0);
 
-	// The packet contents are just normal MIDI data - see
+	// CUSBMIDIDevice unpacks the USB-MIDI event packets itself and calls this with
+	// the MIDI bytes of one packet - see
 	// https://www.midi.org/specifications/item/table-1-summary-of-midi-message
+	// The cable's parser carries running status and SysEx across calls, and
+	// whatever note events a call yields reach m_Notes together.
+	TMIDIBatch batch;
+	batch.Count = 0;
+	batch.Free = s_pThis->m_Notes.GetFree ();
+	batch.Dropped = 0;
+	batch.Timestamp = s_pThis->m_Timer.GetClockTicks64 ();
+	batch.Arrival = StatsClock ();
+	s_pThis->m_MIDIParser[nCable % MIDI_CABLES].Parse (pPacket, nLength, MIDIMessageHandler, &batch);
+	s_pThis->m_Notes.Commit (batch.Count, batch.Dropped);
+}
 
-	if (nLength < 3)
+void CKernel::MIDIBatchAdd (TMIDIBatch *pBatch, const PlayedNote &note)
+{
+	if (pBatch->Count < pBatch->Free)
 	{
+		s_pThis->m_Notes.GetSlot (pBatch->Count++) = note;
+	}
+	else
+	{
+		pBatch->Dropped++;
+	}
+}
+
+void CKernel::SysExHandler (void *pParam, TMIDISysExEvent eEvent, const u8 *pData, unsigned nLength)
+{
+	CKernel *pThis = (CKernel *) pParam;
+	assert (pThis != 0);
+
+	TSysExAck ack;
+	switch (eEvent)
+	{
+	case SysExStart:
+		pThis->m_SysEx.Start ();
+		pThis->m_nSysExPending = 0;
+		pThis->m_nSysExFree = pThis->m_SysExFeed.GetFree ();
+		break;
+
+	case SysExData:
+		pThis->m_SysEx.Data (pData, nLength);
+		break;
+
+	case SysExEnd:
+		if (pThis->m_SysEx.End (&ack))
+		{
+			// the whole message reaches the bus at once; the credits count what is left after it,
+			// and none while a chip is overloaded, so the host holds off and queries
+			pThis->m_SysExFeed.Commit (pThis->m_nSysExPending, pThis->m_SysEx.GetDropped ());
+			unsigned nFree = pThis->m_Overload.GetOverloaded () ? 0 : pThis->m_SysExFeed.GetFree ();
+			ack.Credits = nFree < SYSEX_VALUE_MAX ? nFree : SYSEX_VALUE_MAX;
+			pThis->m_SysExAcks.Push (ack);
+		}
+		pThis->m_nSysExPending = 0;
+		break;
+
+	case SysExAbort:
+		// nothing of a message cut short is published
+		pThis->m_SysEx.Abort ();
+		pThis->m_nSysExPending = 0;
+		break;
+	}
+}
+
+bool CKernel::SysExWriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData)
+{
+	CKernel *pThis = (CKernel *) pParam;
+	assert (pThis != 0);
+
+	// not past the overload watermark, as SerialWriteHandler; the reply reports the write as dropped
+	if (pThis->m_Pump.IsResetRequested () || (pThis->m_Overload.GetOverloaded () & BIT(nChip)))
+	{
+		return false;
+	}
+
+	if (pThis->m_nSysExPending == pThis->m_nSysExFree)
+	{
+		// the bus side may have made room since the message started
+		pThis->m_nSysExFree = pThis->m_SysExFeed.GetFree ();
+		if (pThis->m_nSysExPending == pThis->m_nSysExFree)
+		{
+			return false;
+		}
+	}
+
+	YMChipCommand &slot = pThis->m_SysExFeed.GetSlot (pThis->m_nSysExPending++);
+	slot.chip = nChip;
+	slot.command = YMCommand (bBank, nAddress, nData);
+	return true;
+}
+
+void CKernel::MIDIMessageHandler (void *pParam, const TMIDIMessage &message)
+{
+	TMIDIBatch *pBatch = (TMIDIBatch *) pParam;
+	assert (pBatch != 0);
+
+	u8 ucChannel   = message.Status & 0x0F;
+	u8 ucType      = message.Status >> 4;
+
+	if (ucType == MIDI_PROGRAM_CHANGE)
+	{
+		s_pThis->m_ChannelProgram[ucChannel] = message.Data[0] % g_nPatches;
 		return;
 	}
 
-	u8 ucStatus    = pPacket[0];
-	//u8 ucChannel   = ucStatus & 0x0F;
-	u8 ucType      = ucStatus >> 4;
-	u8 ucKeyNumber = pPacket[1];
-	u8 ucVelocity  = pPacket[2];
+	u8 ucKeyNumber = message.Data[0];
+	u8 ucVelocity  = message.Data[1];
 
-    //CLogger::Get()->Write(FromKernel, LogDebug, "MIDI event: %02X %02X %02X", pPacket[0], pPacket[1], pPacket[2]);
+    //CLogger::Get()->Write(FromKernel, LogDebug, "MIDI event: %02X %02X %02X", message.Status, message.Data[0], message.Data[1]);
 
 	if (ucType == MIDI_NOTE_ON && ucVelocity > 0)
 	{
@@ -776,8 +1245,8 @@ void CKernel::MIDIPacketHandler (unsigned nCable, u8 *pPacket, unsigned nLength)
 			s_pThis->m_nFrequency = (unsigned) (s_KeyFrequency[ucKeyNumber]);
             
 
-            u16 freq = s_KeyFrequency[ucKeyNumber];
-            s_pThis->m_Notes.push({ucKeyNumber, freq, (ucVelocity/4)+0x60, true});
+            u8 patch = s_pThis->m_ChannelProgram[ucChannel];
+            MIDIBatchAdd(pBatch, {NoteEventOn, ucChannel, ucKeyNumber, (u8)((ucVelocity/4)+0x60), patch, 0, pBatch->Timestamp, pBatch->Arrival});
 		}
 		else
 		{
@@ -790,19 +1259,24 @@ void CKernel::MIDIPacketHandler (unsigned nCable, u8 *pPacket, unsigned nLength)
 	}
 	else if (ucType == MIDI_NOTE_OFF || (ucType == MIDI_NOTE_ON && ucVelocity == 0))
 	{
-        u16 freq = s_KeyFrequency[ucKeyNumber];
-            s_pThis->m_Notes.push({ucKeyNumber, freq, false});
+        if (ucKeyNumber < VOICE_KEYS)
+            MIDIBatchAdd(pBatch, {NoteEventOff, ucChannel, ucKeyNumber, 0, 0, 0, pBatch->Timestamp, pBatch->Arrival});
 		if (s_pThis->m_ucKeyNumber == ucKeyNumber)
 		{
 			s_pThis->m_ucKeyNumber = KEY_NONE;
 			s_pThis->m_nFrequency = 0;
 		}
 	}
+	else if (ucType == MIDI_PITCH_BEND)
+	{
+		s16 bend = (message.Data[1] << 7 | message.Data[0]) - 8192;
+		MIDIBatchAdd (pBatch, {NoteEventPitchBend, ucChannel, 0, 0, 0, bend, pBatch->Timestamp, pBatch->Arrival});
+	}
 	else if (ucType == MIDI_CC)
 	{
-		if (pPacket[1] == MIDI_CC_VOLUME)
+		if (message.Data[0] == MIDI_CC_VOLUME)
 		{
-			s_pThis->m_uchVolume = pPacket[2];
+			s_pThis->m_uchVolume = message.Data[1];
 			s_pThis->m_bSetVolume = TRUE;
 		}
 	}
@@ -33,76 +33,75 @@
 #include <circle/usb/usbcontroller.h>
 #include <circle/usb/usbmidi.h>
 #include <circle/usb/usbkeyboard.h>
+#include <SDCard/emmc.h>
+#include <fatfs/ff.h>
+#include "spinbus.h"
+#include "ringbuffer.h"
+#include "ymqueue.h"
+#include "spscring.h"
+#include "buscore.h"
+#include "ymshadow.h"
+#include "patches.h"
+#include "voiceallocator.h"
+#include "fnumtable.h"
+#include "eventscheduler.h"
+#include "busstats.h"
+#include "spinbuscal.h"
+#include "spinbuspump.h"
+#include "ymsnapshot.h"
+#include "deferredlog.h"
+#include "overload.h"
+#include "midiparser.h"
+#include "sysexstream.h"
+#include "seriallink.h"
+#include "vgmplayer.h"
+#include "vgmfile.h"
+#include <atomic>
 #include "queue"
 #include "vector"
 #include "map"
 
-#define YM_COUNT 20
-#define YM_CHANNELS 6
-#define SYNC_WRITE_LIMIT 100
-#define QUEUE_SIZE_LIMIT 1000
+#define NOTE_QUEUE_SIZE 256
+#define BUS_FEED_SIZE 4096
+#define MIDI_CABLES 16
+#define SYSEX_CABLE 0           // register streams come in on this cable only
+#define SYSEX_FEED_SIZE 4096
+#define SYSEX_ACK_QUEUE 16
 
 #define MIDI_NOTE_OFF	0b1000
 #define MIDI_NOTE_ON	0b1001
 #define MIDI_CC		0b1011
+#define MIDI_PROGRAM_CHANGE	0b1100
+#define MIDI_PITCH_BEND	0b1110
 #define MIDI_CC_VOLUME	7
 #define KEY_NONE	255
 
 #define USB_GADGET_MODE
+//#define SPINBUS_SIMULATOR
+// CMD_YM_BURST (0x14) is not in the FPGA gateware as shipped, which answers it with
+// ERROR_COMMAND_UNKNOWN; enable only with a gateware revision that decodes 0x14 as
+// specified in docs/Protocol.md. See hostburst.cpp for what it gains.
+//#define SPINBUS_BURST
+// CMD_YM_BROADCAST (0x16) isn't in the shipped gateware either; it needs a revision
+// that decodes 0x16 with the 24-bit chip mask of docs/Protocol.md. See hostbroadcast.cpp.
+//#define SPINBUS_BROADCAST
+// measure the fastest clean bus timing once at boot and run at it, see spinbuscal.h;
+// off, the bus runs at SPINBUS_SETUP_NS/SPINBUS_HOLD_NS
+//#define SPINBUS_CALIBRATE
+#define YM_OVERLOAD_POLICY  OverloadShed    // see overload.h
+#define YM_SETTLE_LIMIT_MS  1000    // longest wait for writes in flight before a reset
 
 #define SERIAL_BAUD 3000000
+#define SERIAL_READ_SIZE 256    // bytes taken from the UART's receive ring at a time
+#define SERIAL_DEVICE "ttyS1"   // m_Serial's name; the serial link can't share it with the log
 
 #define UART_RX_PIN 15
 #define UART_TX_PIN 18
 
-#define RET_PIN 23
-#define YM_SENT_PIN 17
-#define SCK_PIN 24
-#define RST_PIN 18
 #define BTN_PIN 3
-#define OUT_MASK (BIT(RD_PIN) | BIT(WR_PIN) | BIT(RST_PIN))
-#define D0_PIN 25
-#define D1_PIN 8
-#define D2_PIN 7
-#define D3_PIN 1
-#define D4_PIN 12
-#define D5_PIN 16
-#define D6_PIN 20
-#define D7_PIN 21
-#define DATA_MASK (BIT(D0_PIN) | BIT(D1_PIN) | BIT(D2_PIN) | BIT(D3_PIN) | BIT(D4_PIN) \
-        | BIT(D5_PIN) | BIT(D6_PIN) | BIT(D7_PIN))
-#define GET_BIT(value, n) ((value & BIT(n)) >> n)
-#define TO_DATA_OUT(value) ((value & BIT(0)) << D0_PIN) \
-              | (((value & BIT(1)) >> 1) << D1_PIN) \
-              | (((value & BIT(2)) >> 2) << D2_PIN) \
-              | (((value & BIT(3)) >> 3) << D3_PIN) \
-              | (((value & BIT(4)) >> 4) << D4_PIN) \
-              | (((value & BIT(5)) >> 5) << D5_PIN) \
-              | (((value & BIT(6)) >> 6) << D6_PIN) \
-              | (((value & BIT(7)) >> 7) << D7_PIN)
-#define FROM_DATA_IN(value) ((value & BIT(D0_PIN)) >> D0_PIN) \
-              | (((value & BIT(D1_PIN)) >> D1_PIN) << 1) \
-              | (((value & BIT(D2_PIN)) >> D2_PIN) << 2) \
-              | (((value & BIT(D3_PIN)) >> D3_PIN) << 3) \
-              | (((value & BIT(D4_PIN)) >> D4_PIN) << 4) \
-              | (((value & BIT(D5_PIN)) >> D5_PIN) << 5) \
-              | (((value & BIT(D6_PIN)) >> D6_PIN) << 6) \
-              | (((value & BIT(D7_PIN)) >> D7_PIN) << 7)
-
-
-#define CMD_NOP                 0x00
-#define CMD_RESET               0x0f
-#define CMD_DEBUG               0x7f
-#define CMD_YM_REGDATA          0x11
-#define CMD_YM_CONFIG_2612      0x15
-
-// system errors
-#define ERROR_COMMAND_UNKNOWN   0xf1 // 11110001
-#define ERROR_INVALID_STATE     0xf2 // 11110010
-#define ERROR_TOO_MANY_BYTES    0xf3 // 11110011
-// YM errors
-#define ERROR_YM_IDX_OUTOFRANGE 0xf8 // 11111000
-#define ERROR_YM_DOUBLE_SUBMIT  0xf9 // 11111001
+
+#define SD_DRIVE "SD:"
+#define VGM_PLAYERS 2
 
 enum TShutdownMode
 {
@@ -111,45 +110,50 @@ enum TShutdownMode
     ShutdownReboot
 };
 
-struct YMCommand {
-    YMCommand(bool bank, u8 address, u8 data) {
-        this->bank = bank;
-        this->address = address;
-        this->data = data;
-    }
-    bool bank;
-    u8 address;
-    u8 data;
+struct YMChipCommand {
+    u8 chip;
+    YMCommand command;
 };
 
-struct YMQueue {
-    bool sent = 0;
-    std::queue<YMCommand> queue;
-};
 
 struct YMTimedNote {
     int step = 0;
     u16 note = 0;
 };
 
-struct YMSyncResult {
-    u16 count = 0;
-    u16 ones = 0;
-    bool success = false;
-};
-
 struct TNoteInfo
 {
 	char	Key;
 	u8	KeyNumber;	// MIDI number
 };
 
+enum TNoteEvent : u8
+{
+    NoteEventOff,
+    NoteEventOn,
+    NoteEventPitchBend
+};
+
 struct PlayedNote
 {
+    TNoteEvent Event;
+    u8  Channel;    // MIDI channel
     u8  KeyNumber;
-    u16 Frequency;
     u8 Velocity;
-    bool KeyOn;
+    u8 Patch;       // index into g_Patches
+    s16 Bend;       // -8192..8191, NoteEventPitchBend only
+    u64 Timestamp;  // CTimer clock ticks when the MIDI message arrived
+    u32 Arrival;    // StatsClock () when the MIDI message arrived
+};
+
+/// @brief Note events from one MIDI buffer, built in place in m_Notes and published together.
+struct TMIDIBatch
+{
+    unsigned Count;
+    unsigned Free;      // m_Notes slots free when the buffer came in
+    unsigned Dropped;
+    u64 Timestamp;
+    u32 Arrival;
 };
 
 class CKernel
@@ -163,30 +167,57 @@ public:
     TShutdownMode Run (void);
 
     void YMTest();
-    void YMPrepare (u8 chip, u8 channelIdx);
+    void YMPrepareGlobal (u32 chipMask);
+    void YMPrepare (u8 chip, u8 channelIdx, u8 patchId = 0);
+    void YMPrepareChips (u32 chipMask, u8 channelIdx, u8 patchId = 0);
+    void YMRestore ();
+    void YMRestoreMark (bool restored);
+    bool YMRestoreSent ();
+    void YMSnapshot ();
     void YMQueueData(u8 chip, u8 address, u8 data, bool bank = 0);
-    u32 YMProcessQueue();
+    void YMQueueBroadcast(u32 chipMask, u8 address, u8 data, bool bank = 0);
+    void YMDrainFeed();
     u16 YMGetNote(u8 octave, u16 fnum);
-    u16 YMQueueNote(u8 chip, u8 channel, PlayedNote note, bool prepare);
-    u16 YMQueueNote(u8 chip, u8 channel, u16 frequency, u8 velocity = 0x7f);
+    u16 YMQueueNote(u8 chip, u8 channel, const PlayedNote &note, bool prepare);
+    void YMQueuePitchBend(u8 midiChannel, s16 bend);
+    void NoteIntake (u64 now, bool play);
+    void NoteCancel (u8 key);
+    void NoteDispatch (const PlayedNote &note, u64 now);
+    void YMQueueFnum(u8 chip, u8 channel, u16 note);
     void YMQueueNoteRaw(u8 chip, u8 channel, u16 note, u8 velocity = 0x7f);
     void YMQueueNoteStop(u8 chip, u8 channel);
-    void YMReset ();
-    YMSyncResult SpinbusSync();
-    bool YMWrite (u8 chip, YMCommand command);
-    bool YMWrite (u8 chip, u8 address, u8 data, bool bank);
-    bool WriteRead (u8 data);
-    bool WriteReadRaw (u8 data);
-    //u8 ReadData ();
+    void YMQueueVolume();
+    u8 YMCarrierLevel(const YMPatch &patch, u8 op, u8 velocity);
     void DumpValue (u32 data, u8 len);
-    void DumpError ();
+    void LogDrain ();
     void ClearQueues ();
+    void WaitSettled ();
     bool RebootCheck ();
+    void BusCoreRun ();
+    void BusCoreStart ();
+    void BusCoreStop ();
+    u8 VGMOpen ();
+    void VGMStart ();
+    void VGMStop ();
+    void VGMLog (unsigned player);
+    void StatsDump (const TBusStatsSnapshot &stats);
+    void CountersDump ();
+    void SpinbusCalibrate ();
 
 private:
 	static void MIDIPacketHandler (unsigned nCable, u8 *pPacket, unsigned nLength);
+	static void MIDIMessageHandler (void *pParam, const TMIDIMessage &message);
+	static void MIDIBatchAdd (TMIDIBatch *pBatch, const PlayedNote &note);
+	static void SysExHandler (void *pParam, TMIDISysExEvent eEvent, const u8 *pData, unsigned nLength);
+	static bool SysExWriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData);
 	static void KeyStatusHandlerRaw (unsigned char ucModifiers, const unsigned char RawKeys[6]);
 	static void USBDeviceRemovedHandler (CDevice *pDevice, void *pContext);
+	static void VGMWriteHandler (void *pParam, u32 nChipMask, bool bBank, u8 nAddress, u8 nData);
+	static bool SerialWriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData);
+	static void SerialSendHandler (void *pParam, const u8 *pData, unsigned nLength);
+	static void RestoreWriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData);
+	static u32 CalibrationClock (void *);
+	static u32 PumpClock (void *pParam);
 
     // do not change this order
     CActLED            m_ActLED;
@@ -203,73 +234,94 @@ private:
 	CUSBMIDIDevice     * volatile m_pMIDIDevice;
 	CUSBKeyboardDevice * volatile m_pKeyboard;
 
+    CEMMCDevice         m_EMMC;
+    FATFS               m_FileSystem;
+    bool                m_bFileSystem = false;
+
     // Button passthroughu
     CGPIOPin         m_BtnPin;
 
-    // Reset and communication clock
-    CGPIOPin        m_RSTPin;
-    CGPIOPin        m_SCKPin;
-
-    // 8-bit parallel send
-    CGPIOPin        m_D0Pin;
-    CGPIOPin        m_D1Pin;
-    CGPIOPin        m_D2Pin;
-    CGPIOPin        m_D3Pin;
-    CGPIOPin        m_D4Pin;
-    CGPIOPin        m_D5Pin;
-    CGPIOPin        m_D6Pin;
-    CGPIOPin        m_D7Pin;
-
-    // 1-bit serial return
-    CGPIOPin        m_RETPin;
-    CGPIOPin        m_YMSentPin;
+    // Spinbus physical layer
+    CSpinbus        *m_pBus;
 
     std::map<u8, const char*> m_CommandMap {
         { CMD_NOP, "CMD_NOP" },
         { CMD_RESET, "CMD_RESET" },
         { CMD_DEBUG, "CMD_DEBUG" },
         { CMD_YM_REGDATA, "CMD_YM_REGDATA" },
-        { CMD_YM_CONFIG_2612, "CMD_YM_CONFIG_2612" }
-    };
-    std::map<u8, const char*> m_ErrorMap {
-        { ERROR_COMMAND_UNKNOWN, "ERROR_COMMAND_UNKNOWN" },
-        { ERROR_INVALID_STATE, "ERROR_INVALID_STATE" },
-        { ERROR_TOO_MANY_BYTES, "ERROR_TOO_MANY_BYTES" },
-        { ERROR_YM_IDX_OUTOFRANGE, "ERROR_YM_IDX_OUTOFRANGE" },
-        { ERROR_YM_DOUBLE_SUBMIT, "ERROR_YM_DOUBLE_SUBMIT" }
+        { CMD_YM_BURST, "CMD_YM_BURST" },
+        { CMD_YM_CONFIG_2612, "CMD_YM_CONFIG_2612" },
+        { CMD_YM_BROADCAST, "CMD_YM_BROADCAST" }
     };
 
-    YMQueue queues[YM_COUNT];
-    std::queue<PlayedNote> m_Notes;
-
-    bool    m_DoReset;
-    
-    bool    m_Reading = false;
-    bool    m_SentState = false;
-
-    u8      m_PrevReadByte = 0;
-    u8      m_LastReadByte = 0;
-    u32     m_BytesRead = 0;
-    u8      m_BitsRead = 0;
-    u16      m_LastBits = 0;
-    
-    u8      m_ErrorData[8];
-    u8      m_ErrorCode = 0;
-    u8      m_ErrorLen = 0;
-    u8      m_ErrorBytesRead = 0;
-    bool    m_HasError = false;
-    bool    m_Synchronized = false;
+#ifdef ARM_ALLOW_MULTI_CORE
+    CBusCore        m_BusCore;
+#endif
 
-    u8      m_ChannelKeys[YM_COUNT*YM_CHANNELS] = { 0 };
-    u8      m_LastChannelKeys[YM_COUNT*YM_CHANNELS] = { 0 };
-    u8      m_NextChannel = 0;
+    // what the chips should hold, kept over a reset for a warm restart
+    CYMSnapshot m_Snapshot;
+    // end of the boot writes notes wait for, per chip, and the channels it covers
+    TYMQueueMark m_RestoreMark[YM_COUNT];
+    u8          m_RestoreChannels[YM_COUNT];
+    // what gives when a chip's queue backs up
+    COverloadControl m_Overload {YM_OVERLOAD_POLICY};
+    // YM writes handed from the voice core to the bus core while it owns the bus
+    CSPSCRing<YMChipCommand, BUS_FEED_SIZE> m_BusFeed;
+    std::atomic<bool> m_BusCoreRequested {false};
+    std::atomic<bool> m_BusCoreRunning {false};
+    // filled by MIDIPacketHandler in USB completion context, drained by Run
+    CSPSCRing<PlayedNote, NOTE_QUEUE_SIZE> m_Notes;
+    // note ons waiting out an overload or a bus reset, core 0 only
+    CRingBuffer<PlayedNote, NOTE_QUEUE_SIZE> m_HeldNotes;
+    unsigned m_nHeldDropped = 0;
+    // running status per cable, USB completion context only
+    CMIDIParser m_MIDIParser[MIDI_CABLES];
+    unsigned m_nNoteOverflows = 0;
+
+    // register streams from the host: written from the USB handler, drained with m_BusFeed
+    CSPSCRing<YMChipCommand, SYSEX_FEED_SIZE> m_SysExFeed;
+    CSPSCRing<TSysExAck, SYSEX_ACK_QUEUE> m_SysExAcks;
+    CSysExStream m_SysEx {SysExWriteHandler, this};
+    unsigned m_nSysExPending = 0;   // writes of the message in progress, built in place in m_SysExFeed
+    unsigned m_nSysExFree = 0;
+    unsigned m_nSysExOverflows = 0;
+
+    CSerialLink m_SerialLink {SerialWriteHandler, SerialSendHandler, this};
+    bool m_bSerialLink = false;     // off while the log goes to the same UART
+    // holds each event back until a fixed lookahead after its timestamp, on the YM sample grid
+    CEventScheduler m_Scheduler;
+
+    // written by whichever core owns the bus, formatted and output by core 0 in idle time
+    CDeferredLog m_Log;
+    unsigned m_nLogDropped = 0;
+
+    // latency, queue depth and bus traffic, published by whichever core owns the bus
+    CBusStats m_Stats {StatsClockRate ()};
+
+    // YM queues, shadow and journal, and the Spinbus traffic for them; runs on whichever core owns the bus
+    CSpinbusPump m_Pump {m_pBus, &m_Overload, &m_Stats, &m_Log, PumpClock};
+
+    // VGM files from the SD card, played on chips the MIDI voices leave alone
+    CVGMFile    m_VGMFile[VGM_PLAYERS];
+    CVGMPlayer *m_pVGM[VGM_PLAYERS];
+    u32         m_VGMFillMax[VGM_PLAYERS] = { 0 };  // longest Fill so far, us: what its SD reads stall the loop by
+
+    bool    m_Calibrated = false;
+
+    CVoiceAllocator m_Voices;
+    u8      m_VoiceChannel[VOICE_LIMIT] = { 0 };  // MIDI channel each voice was started from
+    u8      m_VoiceVelocity[VOICE_LIMIT] = { 0 }; // last velocity each voice was keyed with
+    s16     m_ChannelBend[16] = { 0 };
+    u8      m_ChannelProgram[16] = { 0 };
+    u32     m_PatchHits = 0;
+    u32     m_PatchLoads = 0;
 
     // MIDI control
 	unsigned m_nFrequency;		// 0 if no key pressed
 	unsigned m_nPrevFrequency;
 	u8 m_ucKeyNumber;
-	boolean m_bSetVolume;
-	u8 m_uchVolume;
+	volatile boolean m_bSetVolume;
+	u8 m_uchVolume;		// CC7, applied to every carrier on top of velocity
 	static const float s_KeyFrequency[];
 	static const TNoteInfo s_Keys[];
     
@@ -0,0 +1,103 @@
+//
+// midiparser.cpp
+//
+#include "midiparser.h"
+
+CMIDIParser::CMIDIParser (void)
+:   m_bSysEx (false),
+    m_pSysExHandler (0),
+    m_pSysExParam (0),
+    m_nErrors (0)
+{
+    Reset ();
+}
+
+void CMIDIParser::Reset (void)
+{
+    if (m_bSysEx && m_pSysExHandler)
+    {
+        (*m_pSysExHandler) (m_pSysExParam, SysExAbort, 0, 0);
+    }
+    m_nStatus = 0;
+    m_Data[0] = 0;
+    m_Data[1] = 0;
+    m_nData = 0;
+    m_nNeeded = 0;
+    m_bSysEx = false;
+}
+
+unsigned CMIDIParser::Parse (const u8 *pBuffer, unsigned nLength, TMIDIMessageHandler *pHandler, void *pParam)
+{
+    unsigned nMessages = 0;
+
+    for (const u8 *pEnd = pBuffer + nLength; pBuffer < pEnd; pBuffer++)
+    {
+        u8 nByte = *pBuffer;
+        if (nByte >= MIDI_STATUS_REALTIME)
+        {
+            // clock, start, stop etc.: may come in the middle of anything and change nothing
+            continue;
+        }
+
+        if (nByte & 0x80)
+        {
+            if (m_bSysEx && m_pSysExHandler)
+            {
+                (*m_pSysExHandler) (m_pSysExParam, nByte == MIDI_STATUS_SYSEX_END ? SysExEnd : SysExAbort, 0, 0);
+            }
+            m_nData = 0;
+            if (nByte < MIDI_STATUS_SYSEX)
+            {
+                m_nStatus = nByte;
+                m_nNeeded = 0;
+                m_bSysEx = false;
+                continue;
+            }
+            // SysEx and system common cancel running status; F7 ends SysEx
+            m_nStatus = 0;
+            m_bSysEx = nByte == MIDI_STATUS_SYSEX;
+            m_nNeeded = nByte == 0xf2 ? 2 : (nByte == 0xf1 || nByte == 0xf3) ? 1 : 0;
+            if (m_bSysEx && m_pSysExHandler)
+            {
+                (*m_pSysExHandler) (m_pSysExParam, SysExStart, 0, 0);
+            }
+            continue;
+        }
+
+        if (m_bSysEx)
+        {
+            // hand over the whole run of data bytes in one go
+            const u8 *pRun = pBuffer;
+            while (pBuffer + 1 < pEnd && !(pBuffer[1] & 0x80))
+            {
+                pBuffer++;
+            }
+            if (m_pSysExHandler)
+            {
+                (*m_pSysExHandler) (m_pSysExParam, SysExData, pRun, pBuffer + 1 - pRun);
+            }
+            continue;
+        }
+        if (m_nNeeded)
+        {
+            m_nNeeded--;
+            continue;
+        }
+        if (!m_nStatus)
+        {
+            m_nErrors++;
+            continue;
+        }
+
+        m_Data[m_nData++] = nByte;
+        if (m_nData == GetDataLength (m_nStatus))
+        {
+            TMIDIMessage message = { m_nStatus, { m_Data[0], m_nData > 1 ? m_Data[1] : (u8) 0 } };
+            (*pHandler) (pParam, message);
+            nMessages++;
+            m_nData = 0;
+        }
+    }
+
+    return nMessages;
+}
@@ -0,0 +1,89 @@
+//
+// midiparser.h
+//
+// Walks a whole buffer of MIDI input in place and hands every channel
+// message in it to a handler, instead of looking at the first three bytes.
+//
+// Parse () takes a plain MIDI byte stream, as CUSBMIDIDevice delivers it and
+// as a DIN port would: running status, real-time bytes (F8-FF) anywhere,
+// even inside another message, and SysEx and system common messages skipped
+// over. The state carries over between calls, so a message may be split
+// across buffers. Raw USB-MIDI event packets never get here: CUSBMIDIDevice
+// takes them apart itself and hands on the MIDI bytes of each, one call per
+// packet, so SysEx arrives in pieces of 1-3 bytes and is put back together.
+//
+// Stray data bytes with no status to go with them are counted and dropped.
+// SysEx goes to a separate handler, if one is set, as runs of data bytes
+// straight out of the input buffer: a start, any number of data runs, then
+// an end at F7 or an abort when another status byte cuts it short.
+//
+#ifndef _midiparser_h
+#define _midiparser_h
+
+#include "spinbus.h"
+
+#define MIDI_STATUS_SYSEX       0xf0
+#define MIDI_STATUS_SYSEX_END   0xf7
+#define MIDI_STATUS_REALTIME    0xf8
+
+struct TMIDIMessage
+{
+    u8 Status;      // channel messages only, 0x80-0xef
+    u8 Data[2];     // Data[1] is 0 for program change and channel pressure
+};
+
+typedef void TMIDIMessageHandler (void *pParam, const TMIDIMessage &message);
+
+enum TMIDISysExEvent
+{
+    SysExStart,
+    SysExData,      // pData/nLength: data bytes (no F0/F7), possibly one of several runs
+    SysExEnd,
+    SysExAbort
+};
+
+typedef void TMIDISysExHandler (void *pParam, TMIDISysExEvent eEvent, const u8 *pData, unsigned nLength);
+
+class CMIDIParser
+{
+public:
+    CMIDIParser (void);
+
+    /// @brief Forgets running status and any message in progress (aborting SysEx).
+    void Reset (void);
+
+    /// @brief Where SysEx goes; without a handler it is skipped.
+    void SetSysExHandler (TMIDISysExHandler *pHandler, void *pParam)
+    {
+        m_pSysExHandler = pHandler;
+        m_pSysExParam = pParam;
+    }
+
+    /// @return the number of messages handed to pHandler.
+    unsigned Parse (const u8 *pBuffer, unsigned nLength, TMIDIMessageHandler *pHandler, void *pParam);
+
+    /// @return data bytes dropped for want of a status so far.
+    unsigned GetErrors (void) const { return m_nErrors; }
+
+    /// @return data bytes a channel message with this status takes, 0 for anything else.
+    static unsigned GetDataLength (u8 nStatus)
+    {
+        if (nStatus < 0x80 || nStatus >= 0xf0)
+            return 0;
+        return (nStatus & 0xe0) == 0xc0 ? 1 : 2;     // program change, channel pressure
+    }
+
+private:
+    u8 m_nStatus;       // running status, 0 if none
+    u8 m_Data[2];
+    u8 m_nData;         // data bytes collected for the message in progress
+    u8 m_nNeeded;       // data bytes to skip for a system common message, or 0
+    bool m_bSysEx;
+
+    TMIDISysExHandler *m_pSysExHandler;
+    void *m_pSysExParam;
+
+    unsigned m_nErrors;
+};
+
+#endif
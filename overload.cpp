@@ -0,0 +1,113 @@
+//
+// overload.cpp
+//
+#include "overload.h"
+#include "ymshadow.h"
+
+COverloadControl::COverloadControl (TOverloadPolicy ePolicy)
+:   m_ePolicy (ePolicy)
+{
+}
+
+const char *COverloadControl::GetPolicyName (TOverloadPolicy ePolicy)
+{
+    static const char *const s_Names[OverloadPolicies] =
+    {
+        "reset", "throttle", "drop bulk", "steal voices", "shed"
+    };
+    return ePolicy < OverloadPolicies ? s_Names[ePolicy] : "unknown";
+}
+
+void COverloadControl::Clear (void)
+{
+    m_Overloaded.store (0, std::memory_order_release);
+    m_LostChips.store (0, std::memory_order_release);
+    for (unsigned i = 0; i < YM_COUNT; i++)
+        m_Lost[i].store (0, std::memory_order_relaxed);
+}
+
+bool COverloadControl::Depth (u8 nChip, unsigned nDepth)
+{
+    TOverloadStats &stats = m_Stats[nChip];
+    if (nDepth > stats.MaxDepth)
+        stats.MaxDepth = nDepth;
+
+    // only the bus side writes the mask, so a plain load and store will do
+    u32 nOverloaded = m_Overloaded.load (std::memory_order_relaxed);
+    if (!(nOverloaded & BIT(nChip)))
+    {
+        if (nDepth < OVERLOAD_HIGH)
+            return false;
+        m_Overloaded.store (nOverloaded | BIT(nChip), std::memory_order_release);
+        stats.Episodes++;
+        return true;
+    }
+
+    if (nDepth <= OVERLOAD_LOW)
+        m_Overloaded.store (nOverloaded & ~BIT(nChip), std::memory_order_release);
+    return false;
+}
+
+TOverloadAction COverloadControl::Admit (u8 nChip, const YMQueue &queue, const YMCommand &command)
+{
+    if (queue.AtLimit ())
+    {
+        m_Stats[nChip].LimitHits++;
+        if (m_ePolicy == OverloadReset)
+            return OverloadResetAll;
+        // a lost key off would leave a note hanging; the ring has room past the limit for those
+        if (command.address == YM_REG_KEY_ON && !command.bank && !queue.IsFull (YMWriteCritical))
+            return OverloadAccept;
+        Drop (nChip, command);
+        return OverloadDrop;
+    }
+
+    if (   m_ePolicy == OverloadDropBulk
+        && (m_Overloaded.load (std::memory_order_relaxed) & BIT(nChip))
+        && YMQueue::Classify (command) == YMWriteBulk)
+    {
+        Drop (nChip, command);
+        return OverloadDrop;
+    }
+
+    return OverloadAccept;
+}
+
+bool COverloadControl::HoldIntake (void)
+{
+    // VGM chips backing up is no reason to stop playing notes
+    bool bHold = m_ePolicy == OverloadThrottle && (m_Overloaded.load (std::memory_order_acquire) & m_nVoiceChips);
+    if (bHold && !m_bHolding)
+        m_nHolds++;
+    m_bHolding = bHold;
+    return bHold;
+}
+
+u32 COverloadControl::GetAvoidMask (void) const
+{
+    if (m_ePolicy != OverloadStealVoices && m_ePolicy != OverloadShed)
+        return 0;
+    return m_Overloaded.load (std::memory_order_acquire);
+}
+
+void COverloadControl::Placed (u8 nChip, u32 nAvoid)
+{
+    if (nAvoid & BIT(nChip))
+        return;
+    for (unsigned i = 0; i < YM_COUNT; i++)
+    {
+        if (nAvoid & BIT(i))
+            m_Stats[i].Avoided++;
+    }
+}
+
+void COverloadControl::Drop (u8 nChip, const YMCommand &command)
+{
+    m_Stats[nChip].Dropped++;
+    // chip-wide registers have no patch to reload; the shadow invalidation sees the next write through
+    u8 nChannel = YMQueue::Channel (command);
+    if (nChannel >= YM_CHANNELS)
+        return;
+    m_Lost[nChip].fetch_or (BIT(nChannel), std::memory_order_relaxed);
+    m_LostChips.fetch_or (BIT(nChip), std::memory_order_release);
+}
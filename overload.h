@@ -0,0 +1,120 @@
+//
+// overload.h
+//
+// What to do when a chip's queue backs up. The old answer, a reset of every
+// chip as soon as one queue reached QUEUE_SIZE_LIMIT, is still there as
+// OverloadReset; the others keep the bus running:
+//
+//   OverloadThrottle     stop taking notes off the MIDI ring while any voice
+//                        chip is overloaded; the ring absorbs the burst and
+//                        drops what doesn't fit
+//   OverloadDropBulk     drop bulk writes (patch registers) to an overloaded
+//                        chip; critical writes still go out
+//   OverloadStealVoices  keep new notes off overloaded chips, stealing the
+//                        oldest voice elsewhere if nothing else is free
+//   OverloadShed         keep new notes off overloaded chips while other
+//                        chips have free voices
+//
+// A chip counts as overloaded from the moment either of its queues reaches
+// OVERLOAD_HIGH until both are back down to OVERLOAD_LOW. Whatever the
+// policy, a write that finds the queue at QUEUE_SIZE_LIMIT can't be queued:
+// OverloadReset resets, the others drop it. A dropped write invalidates the
+// shadow register (so the next write to it goes out) and marks the channel's
+// patch as lost, so the voice side loads it again before the next note.
+//
+// Depth () and Admit () run on whichever core owns the bus; HoldIntake (),
+// GetAvoidMask () and TakeLostChips () on the voice core.
+//
+#ifndef _overload_h
+#define _overload_h
+
+#include "spinbus.h"
+#include "ymqueue.h"
+#include <atomic>
+
+#define OVERLOAD_HIGH   (QUEUE_SIZE_LIMIT * 3 / 4)
+#define OVERLOAD_LOW    (QUEUE_SIZE_LIMIT / 4)
+
+enum TOverloadPolicy
+{
+    OverloadReset,
+    OverloadThrottle,
+    OverloadDropBulk,
+    OverloadStealVoices,
+    OverloadShed,
+    OverloadPolicies
+};
+
+enum TOverloadAction
+{
+    OverloadAccept,
+    OverloadDrop,
+    OverloadResetAll
+};
+
+struct TOverloadStats
+{
+    u32 Episodes = 0;       // times the chip became overloaded
+    u32 LimitHits = 0;      // writes that found the queue at QUEUE_SIZE_LIMIT
+    u32 Dropped = 0;        // writes dropped
+    u32 Avoided = 0;        // notes placed on another chip while this one was overloaded
+    u32 MaxDepth = 0;
+};
+
+class COverloadControl
+{
+public:
+    COverloadControl (TOverloadPolicy ePolicy = OverloadReset);
+
+    void SetPolicy (TOverloadPolicy ePolicy) { m_ePolicy = ePolicy; }
+    TOverloadPolicy GetPolicy (void) const { return m_ePolicy; }
+    static const char *GetPolicyName (TOverloadPolicy ePolicy);
+    /// @brief Chips the voices are spread over (the rest belong to the VGM players).
+    void SetVoiceChips (u32 nMask) { m_nVoiceChips = nMask; }
+
+    /// @brief Forgets overload state and lost patches, e.g. when the queues were discarded.
+    /// The statistics are kept.
+    void Clear (void);
+
+    /// @brief Bus side: tracks a chip's queue depth after a push or a send.
+    /// @return true if the chip has just become overloaded.
+    bool Depth (u8 nChip, unsigned nDepth);
+
+    /// @brief Bus side: decides whether a write the shadow and coalescing let through is queued.
+    /// OverloadDrop has already been counted and the channel marked lost.
+    TOverloadAction Admit (u8 nChip, const YMQueue &queue, const YMCommand &command);
+
+    u32 GetOverloaded (void) const { return m_Overloaded.load (std::memory_order_acquire); }
+
+    /// @brief Voice side: true while MIDI intake is held back.
+    bool HoldIntake (void);
+    /// @return chips new notes should stay off, under the steal and shed policies.
+    u32 GetAvoidMask (void) const;
+    /// @brief Voice side: counts a note placed on nChip while the chips in nAvoid were overloaded.
+    void Placed (u8 nChip, u32 nAvoid);
+
+    /// @brief Voice side: takes the chips that have lost writes since the last call.
+    u32 TakeLostChips (void) { return m_LostChips.exchange (0, std::memory_order_acquire); }
+    /// @return the channels of one of those chips whose patch is no longer complete.
+    u8 TakeLostChannels (u8 nChip) { return m_Lost[nChip].exchange (0, std::memory_order_relaxed); }
+
+    const TOverloadStats &GetStats (u8 nChip) const { return m_Stats[nChip]; }
+    /// @return times intake started being held back.
+    unsigned GetHolds (void) const { return m_nHolds; }
+
+private:
+    void Drop (u8 nChip, const YMCommand &command);
+
+    TOverloadPolicy m_ePolicy;
+    u32 m_nVoiceChips = YM_MASK_ALL;
+
+    std::atomic<u32> m_Overloaded {0};
+    std::atomic<u32> m_LostChips {0};
+    std::atomic<u8> m_Lost[YM_COUNT] = {};
+
+    TOverloadStats m_Stats[YM_COUNT];
+    unsigned m_nHolds = 0;
+    bool m_bHolding = false;
+};
+
+#endif
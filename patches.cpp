@@ -0,0 +1,72 @@
+//
+// patches.cpp
+//
+#include "patches.h"
+
+const YMPatch g_Patches[] =
+{
+    {
+        "Default",
+        { 0x71, 0x0D, 0x33, 0x01 },
+        { 0x23, 0x2D, 0x26, 0x00 },
+        { 0x5F, 0x99, 0x5F, 0x92 },     // S4 original 0x94
+        { 0x05, 0x05, 0x05, 0x07 },
+        { 0x02, 0x02, 0x02, 0x02 },
+        { 0x11, 0x11, 0x11, 0xA3 },     // S4 def:A6
+        { 0x00, 0x00, 0x00, 0x00 },
+        0x32,
+        0xC0
+    },
+    {
+        "Bass",
+        { 0x02, 0x01, 0x00, 0x01 },
+        { 0x1A, 0x20, 0x18, 0x00 },
+        { 0x1F, 0x1F, 0x1F, 0x1F },
+        { 0x0C, 0x08, 0x0A, 0x06 },
+        { 0x00, 0x00, 0x00, 0x00 },
+        { 0x2F, 0x2F, 0x2F, 0x3F },
+        { 0x00, 0x00, 0x00, 0x00 },
+        0x30,
+        0xC0
+    },
+    {
+        "E.Piano",
+        { 0x01, 0x01, 0x0E, 0x01 },
+        { 0x24, 0x1E, 0x00, 0x00 },
+        { 0x1F, 0x1F, 0x1F, 0x1F },
+        { 0x08, 0x08, 0x0A, 0x0A },
+        { 0x03, 0x03, 0x03, 0x03 },
+        { 0x25, 0x25, 0x26, 0x26 },
+        { 0x00, 0x00, 0x00, 0x00 },
+        0x1C,
+        0xC0
+    },
+    {
+        "Organ",
+        { 0x01, 0x02, 0x04, 0x08 },
+        { 0x10, 0x14, 0x18, 0x10 },
+        { 0x1F, 0x1F, 0x1F, 0x1F },
+        { 0x00, 0x00, 0x00, 0x00 },
+        { 0x00, 0x00, 0x00, 0x00 },
+        { 0x0F, 0x0F, 0x0F, 0x0F },
+        { 0x00, 0x00, 0x00, 0x00 },
+        0x07,
+        0xC0
+    }
+};
+
+const unsigned g_nPatches = sizeof g_Patches / sizeof g_Patches[0];
+
+u8 YMPatchCarriers (const YMPatch &patch)
+{
+    // register order bits: 0 = S1, 1 = S3, 2 = S2, 3 = S4
+    static const u8 s_Carriers[8] =
+    {
+        0x08, 0x08, 0x08, 0x08,     // S4 only
+        0x0C,                       // S2, S4
+        0x0E, 0x0E,                 // S2, S3, S4
+        0x0F                        // all
+    };
+
+    return s_Carriers[patch.FeedbackAlgorithm & 7];
+}
@@ -0,0 +1,34 @@
+//
+// patches.h
+//
+// FM patch table. Operator arrays are in register order (S1, S3, S2, S4),
+// i.e. offsets +0, +4, +8, +C from each operator register base.
+//
+#ifndef _patches_h
+#define _patches_h
+
+#include "spinbus.h"
+
+#define PATCH_NONE  0xff
+
+struct YMPatch
+{
+    const char *Name;
+    u8 DetuneMultiply[4];   // $30+
+    u8 TotalLevel[4];       // $40+
+    u8 AttackRate[4];       // $50+ (RS/AR)
+    u8 DecayRate[4];        // $60+ (AM/DR)
+    u8 SustainRate[4];      // $70+
+    u8 ReleaseRate[4];      // $80+ (SL/RR)
+    u8 SSGEG[4];            // $90+
+    u8 FeedbackAlgorithm;   // $B0+
+    u8 PanModulation;       // $B4+
+};
+
+extern const YMPatch g_Patches[];
+extern const unsigned g_nPatches;
+
+/// @return bitmask of the carrier (output) operators of a patch, in register order.
+u8 YMPatchCarriers (const YMPatch &patch);
+
+#endif
@@ -0,0 +1,38 @@
+//
+// regstream.cpp
+//
+#include "regstream.h"
+
+CRegisterStream::CRegisterStream (TRegisterWriteHandler *pHandler, void *pParam, TRegisterWaitHandler *pWaitHandler)
+:   m_pHandler (pHandler),
+    m_pParam (pParam),
+    m_pWaitHandler (pWaitHandler)
+{
+    Begin ();
+}
+
+void CRegisterStream::Begin (void)
+{
+    m_eState = StateHeader;
+    m_nChip = 0;
+    m_bBank = false;
+    m_nLeft = 0;
+    m_nAddress = 0;
+    m_nWrites = 0;
+    m_nDropped = 0;
+    m_nSkipped = 0;
+    m_nNoWaits = 0;
+}
+
+TRegisterStreamStatus CRegisterStream::End (void) const
+{
+    if (m_eState != StateHeader)
+        return RegisterStreamTruncated;
+    if (m_nSkipped)
+        return RegisterStreamBadChip;
+    if (m_nNoWaits)
+        return RegisterStreamNoWaits;
+    if (m_nDropped)
+        return RegisterStreamOverflow;
+    return RegisterStreamOK;
+}
@@ -0,0 +1,136 @@
+//
+// regstream.h
+//
+// Decoder for packed register-write streams from a host, whatever carries
+// them. The stream is a sequence of runs of writes to one chip and bank:
+//
+//   header   chip << 1 | bank          chip < YM_COUNT
+//   count    n, 0-255                  0 is an empty run
+//   n times  address, data
+//
+// so a run of n writes takes 2n + 2 bytes. A header of REGISTER_STREAM_WAIT
+// is a wait instead, followed by its length in VGM samples (1/44100 s), low
+// byte first; transports with no time base of their own leave waits out,
+// and a stream without a wait handler skips them and says so. Bytes go in one at a time as the
+// transport unpacks them and every complete write is handed to the handler
+// at once, with no buffer in between; the handler refuses a write it has no
+// room for, and the stream counts it. Writes to a chip that doesn't exist
+// are skipped and reported, the rest of the stream still counts.
+//
+#ifndef _regstream_h
+#define _regstream_h
+
+#include "spinbus.h"
+
+#define REGISTER_STREAM_WAIT    0xff
+
+/// @brief Takes one write of the stream.
+/// @return false if it couldn't be taken (no room).
+typedef bool TRegisterWriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData);
+/// @brief Takes one wait of the stream, in VGM samples.
+typedef void TRegisterWaitHandler (void *pParam, u16 nSamples);
+
+enum TRegisterStreamStatus : u8
+{
+    RegisterStreamOK,
+    RegisterStreamOverflow,     // writes refused by the handler
+    RegisterStreamBadChip,      // runs for chips that don't exist were skipped
+    RegisterStreamTruncated,    // the stream ended in the middle of a run
+    RegisterStreamBadCommand,   // not a message this transport understands
+    RegisterStreamNoWaits       // waits were skipped, there is no wait handler
+};
+
+class CRegisterStream
+{
+public:
+    CRegisterStream (TRegisterWriteHandler *pHandler, void *pParam, TRegisterWaitHandler *pWaitHandler = 0);
+
+    /// @brief Starts a new message.
+    void Begin (void);
+
+    void Put (u8 nByte)
+    {
+        switch (m_eState)
+        {
+        case StateHeader:
+            m_nChip = nByte >> 1;
+            m_bBank = nByte & 1;
+            m_eState = nByte == REGISTER_STREAM_WAIT ? StateWaitLow : StateCount;
+            break;
+
+        case StateCount:
+            m_nLeft = nByte;
+            m_eState = nByte ? StateAddress : StateHeader;
+            if (nByte && m_nChip >= YM_COUNT)
+            {
+                m_nSkipped += nByte;
+            }
+            break;
+
+        case StateAddress:
+            m_nAddress = nByte;
+            m_eState = StateData;
+            break;
+
+        case StateData:
+            if (m_nChip < YM_COUNT)
+            {
+                if ((*m_pHandler) (m_pParam, m_nChip, m_bBank, m_nAddress, nByte))
+                    m_nWrites++;
+                else
+                    m_nDropped++;
+            }
+            m_eState = --m_nLeft ? StateAddress : StateHeader;
+            break;
+
+        case StateWaitLow:
+            m_nAddress = nByte;
+            m_eState = StateWaitHigh;
+            break;
+
+        case StateWaitHigh:
+            if (m_pWaitHandler)
+                (*m_pWaitHandler) (m_pParam, m_nAddress | nByte << 8);
+            else
+                m_nNoWaits++;
+            m_eState = StateHeader;
+            break;
+        }
+    }
+
+    /// @brief Ends the message; the worst thing that happened in it.
+    TRegisterStreamStatus End (void) const;
+
+    /// @return writes handed over since Begin ().
+    unsigned GetWrites (void) const { return m_nWrites; }
+    /// @return writes refused by the handler since Begin ().
+    unsigned GetDropped (void) const { return m_nDropped; }
+
+private:
+    enum TState : u8
+    {
+        StateHeader,
+        StateCount,
+        StateAddress,
+        StateData,
+        StateWaitLow,
+        StateWaitHigh
+    };
+
+    TRegisterWriteHandler *m_pHandler;
+    void *m_pParam;
+    TRegisterWaitHandler *m_pWaitHandler;
+
+    TState m_eState;
+    u8 m_nChip;
+    bool m_bBank;
+    u8 m_nLeft;
+    u8 m_nAddress;
+
+    unsigned m_nWrites;
+    unsigned m_nDropped;
+    unsigned m_nSkipped;
+    unsigned m_nNoWaits;
+};
+
+#endif
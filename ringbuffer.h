@@ -0,0 +1,82 @@
+//
+// ringbuffer.h
+//
+// Fixed-capacity FIFO with no heap allocation. Capacity is rounded up to a
+// power of two so indexing is a mask; push/pop/clear are all O(1).
+// Not thread safe; see spscring.h for the cross-context variant.
+//
+#ifndef _ringbuffer_h
+#define _ringbuffer_h
+
+#include "spinbus.h"
+#include <assert.h>
+
+constexpr unsigned RingCapacity (unsigned nMinimum)
+{
+    unsigned nCapacity = 1;
+    while (nCapacity < nMinimum)
+        nCapacity <<= 1;
+    return nCapacity;
+}
+
+template <typename T, unsigned MINIMUM>
+class CRingBuffer
+{
+public:
+    static constexpr unsigned Capacity = RingCapacity (MINIMUM);
+
+    unsigned size (void) const { return m_nHead - m_nTail; }
+    bool empty (void) const { return m_nHead == m_nTail; }
+    bool full (void) const { return size () == Capacity; }
+
+    T &front (void)
+    {
+        assert (!empty ());
+        return m_Items[m_nTail & Mask];
+    }
+
+    const T &front (void) const
+    {
+        assert (!empty ());
+        return m_Items[m_nTail & Mask];
+    }
+
+    void push (const T &item)
+    {
+        assert (!full ());
+        m_Items[m_nHead++ & Mask] = item;
+    }
+
+    void pop (void)
+    {
+        assert (!empty ());
+        m_nTail++;
+    }
+
+    void clear (void)
+    {
+        m_nTail = m_nHead;
+    }
+
+    // Free-running positions, for callers that keep references to queued items.
+    // A position p is still queued while p - begin_index () < size ().
+    unsigned begin_index (void) const { return m_nTail; }
+    unsigned end_index (void) const { return m_nHead; }
+    bool contains_index (unsigned index) const { return index - m_nTail < size (); }
+
+    T &at (unsigned index)
+    {
+        assert (contains_index (index));
+        return m_Items[index & Mask];
+    }
+
+private:
+    static constexpr unsigned Mask = Capacity - 1;
+
+    T           m_Items[Capacity];
+    // free-running indexes; the difference is the fill level
+    unsigned    m_nHead = 0;
+    unsigned    m_nTail = 0;
+};
+
+#endif
@@ -0,0 +1,359 @@
+//
+// seriallink.cpp
+//
+#include "seriallink.h"
+#include <assert.h>
+
+#define FRAME_OVERHEAD  4       // type, seq, crc
+
+struct TCRCTable
+{
+    u16 Entry[256];
+
+    constexpr TCRCTable (void)
+    :   Entry ()
+    {
+        for (unsigned i = 0; i < 256; i++)
+        {
+            u16 nCRC = i << 8;
+            for (unsigned j = 0; j < 8; j++)
+                nCRC = nCRC & 0x8000 ? nCRC << 1 ^ 0x1021 : nCRC << 1;
+            Entry[i] = nCRC;
+        }
+    }
+};
+
+static constexpr TCRCTable s_CRCTable;
+
+CSerialLink::CSerialLink (TRegisterWriteHandler *pWriteHandler, TSerialSendHandler *pSendHandler, void *pParam)
+:   m_pWriteHandler (pWriteHandler),
+    m_pSendHandler (pSendHandler),
+    m_pParam (pParam),
+    m_pTarget (m_Scratch),
+    m_nTargetSize (0),
+    m_nTarget (0),
+    m_nBlock (0),
+    m_bZero (false),
+    m_bStarted (false),
+    m_bLineError (false),
+    m_nAck (0xff),
+    m_bRejected (false),
+    m_nPlay (0),
+    m_nReady (0),
+    m_nPosition (0),
+    m_Stream (WriteHandler, this, WaitHandler),
+    m_nNow (0),
+    m_nStart (0),
+    m_nSamples (0),
+    m_nDue (0),
+    m_bWaiting (false),
+    m_bTimeBase (false),
+    m_bStalled (false)
+{
+}
+
+void CSerialLink::Receive (const u8 *pData, unsigned nLength)
+{
+    for (const u8 *pEnd = pData + nLength; pData < pEnd; pData++)
+    {
+        u8 nByte = *pData;
+        if (!nByte)
+        {
+            if (m_bStarted)
+                Frame ();
+            m_bStarted = false;
+            continue;
+        }
+
+        if (!m_bStarted)
+        {
+            Begin ();
+            m_bStarted = true;
+        }
+
+        if (m_nBlock)
+        {
+            Put (nByte);
+            m_nBlock--;
+            continue;
+        }
+
+        // a COBS code byte: the block before it ended with a 0, unless it was a full one
+        if (m_bZero)
+            Put (0);
+        m_nBlock = nByte - 1;
+        m_bZero = nByte != 0xff;
+    }
+}
+
+void CSerialLink::LineError (void)
+{
+    m_Stats.LineErrors++;
+    m_bLineError = m_bStarted;
+}
+
+/// @brief Picks where the frame that is starting goes: the next free buffer, if any.
+void CSerialLink::Begin (void)
+{
+    if (m_nReady < SERIAL_BUFFERS)
+    {
+        m_pTarget = m_Buffer[(m_nPlay + m_nReady) % SERIAL_BUFFERS].Data;
+        m_nTargetSize = SERIAL_FRAME_MAX;
+    }
+    else
+    {
+        m_pTarget = m_Scratch;
+        m_nTargetSize = SERIAL_SCRATCH_SIZE;
+    }
+    m_nTarget = 0;
+    m_nBlock = 0;
+    m_bZero = false;
+    m_bLineError = false;
+}
+
+/// @brief A delimiter came in: checks the frame and takes or rejects it.
+void CSerialLink::Frame (void)
+{
+    bool bScratch = m_pTarget == m_Scratch;
+    TSerialStatus eStatus = SerialOK;
+    if (m_bLineError)
+    {
+        eStatus = SerialBadCRC;
+    }
+    else if (m_nTarget > m_nTargetSize)
+    {
+        // a data frame with nowhere to go lands here too
+        eStatus = bScratch ? SerialNoCredit : SerialBadFrame;
+    }
+    else if (m_nBlock || m_nTarget < FRAME_OVERHEAD)
+    {
+        eStatus = SerialBadFrame;
+    }
+    else if (CRC16 (m_pTarget, m_nTarget - 2) != (m_pTarget[m_nTarget - 2] | m_pTarget[m_nTarget - 1] << 8))
+    {
+        eStatus = SerialBadCRC;
+    }
+
+    if (eStatus == SerialOK)
+    {
+        u8 nSequence = m_pTarget[1];
+        switch (m_pTarget[0])
+        {
+        case SerialFrameQuery:
+            Reply (SerialOK);
+            return;
+
+        case SerialFrameData:
+            if (nSequence == (u8) (m_nAck + 1))
+            {
+                if (bScratch)
+                {
+                    eStatus = SerialNoCredit;
+                    break;
+                }
+                m_Buffer[(m_nPlay + m_nReady) % SERIAL_BUFFERS].Length = m_nTarget;
+                m_nReady++;
+                m_nAck = nSequence;
+                m_bRejected = false;
+                m_Stats.Frames++;
+                Reply (SerialOK);
+                return;
+            }
+            if ((u8) (m_nAck - nSequence) < 128)
+            {
+                // sent again before our ack got through
+                m_Stats.Repeats++;
+                Reply (SerialOK);
+                return;
+            }
+            eStatus = SerialOutOfSequence;
+            break;
+
+        default:
+            eStatus = SerialBadFrame;
+            break;
+        }
+    }
+
+    switch (eStatus)
+    {
+    case SerialBadCRC:          m_Stats.BadCRC++;           break;
+    case SerialBadFrame:        m_Stats.BadFrames++;        break;
+    case SerialOutOfSequence:   m_Stats.OutOfSequence++;    break;
+    case SerialNoCredit:        m_Stats.NoCredit++;         break;
+    default:                                                break;
+    }
+
+    // the frames right behind a bad one are out of sequence too; one reply is enough
+    if (!m_bRejected)
+    {
+        m_bRejected = true;
+        Reply (eStatus);
+    }
+}
+
+void CSerialLink::Reply (TSerialStatus eStatus)
+{
+    u8 payload[3] = { eStatus, m_nAck, (u8) GetCredits () };
+    u8 reply[SERIAL_REPLY_SIZE];
+    unsigned nLength = Encode (SerialFrameReply, 0, payload, sizeof payload, reply);
+    assert (nLength == SERIAL_REPLY_SIZE);
+    (*m_pSendHandler) (m_pParam, reply, nLength);
+}
+
+void CSerialLink::Update (u64 nNow)
+{
+    m_nNow = nNow;
+    while (m_nReady)
+    {
+        if (m_bWaiting)
+        {
+            if ((s64) (nNow - m_nDue) < 0)
+                return;
+            m_bWaiting = false;
+        }
+        if (m_bStalled)
+        {
+            if (!(*m_pWriteHandler) (m_pParam, m_Stalled.Chip, m_Stalled.Bank, m_Stalled.Address, m_Stalled.Data))
+                return;
+            m_bStalled = false;
+            m_Stats.Writes++;
+        }
+
+        const TBuffer &buffer = m_Buffer[m_nPlay];
+        const u8 *pPayload = buffer.Data + 2;
+        unsigned nLength = buffer.Length - FRAME_OVERHEAD;
+        while (m_nPosition < nLength && !m_bWaiting && !m_bStalled)
+            m_Stream.Put (pPayload[m_nPosition++]);
+        if (m_nPosition < nLength || m_bStalled)
+            continue;
+
+        // played: the buffer takes the next frame
+        TRegisterStreamStatus eStream = m_Stream.End ();
+        m_Stream.Begin ();
+        m_nPosition = 0;
+        m_nPlay = (m_nPlay + 1) % SERIAL_BUFFERS;
+        m_nReady--;
+        if (eStream != RegisterStreamOK)
+            m_Stats.BadStreams++;
+        Reply (eStream == RegisterStreamOK ? SerialOK : SerialBadStream);
+    }
+}
+
+bool CSerialLink::WriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData)
+{
+    CSerialLink *pThis = (CSerialLink *) pParam;
+    if ((*pThis->m_pWriteHandler) (pThis->m_pParam, nChip, bBank, nAddress, nData))
+    {
+        pThis->m_Stats.Writes++;
+        return true;
+    }
+
+    // keep it for the next Update (); as far as the stream is concerned it is taken
+    pThis->m_Stalled = { nChip, bBank, nAddress, nData };
+    pThis->m_bStalled = true;
+    pThis->m_Stats.Stalls++;
+    return true;
+}
+
+void CSerialLink::WaitHandler (void *pParam, u16 nSamples)
+{
+    CSerialLink *pThis = (CSerialLink *) pParam;
+    pThis->m_Stats.Waits++;
+    if (!pThis->m_bTimeBase)
+    {
+        pThis->m_nStart = pThis->m_nNow;
+        pThis->m_nSamples = 0;
+        pThis->m_bTimeBase = true;
+    }
+
+    // waits add up against the time base, so they don't drift however the loop is polled
+    pThis->m_nSamples += nSamples;
+    u64 nOffset = pThis->m_nSamples * 1000000 / VGM_SAMPLE_RATE;
+    pThis->m_nDue = pThis->m_nStart + nOffset;
+    if ((s64) (pThis->m_nNow - pThis->m_nDue) > SERIAL_LATE_US)
+    {
+        // the PC fell behind (or paused); catching up in a burst would only sound worse
+        pThis->m_nStart = pThis->m_nNow - nOffset;
+        pThis->m_nDue = pThis->m_nNow;
+        pThis->m_Stats.Rebased++;
+    }
+    pThis->m_bWaiting = true;
+}
+
+unsigned CSerialLink::Encode (TSerialFrame eType, u8 nSequence, const u8 *pPayload, unsigned nLength, u8 *pOut)
+{
+    assert (nLength <= SERIAL_PAYLOAD_MAX);
+
+    u8 header[2] = { eType, nSequence };
+    u16 nCRC = CRC16 (pPayload, nLength, CRC16 (header, sizeof header));
+    u8 trailer[2] = { (u8) nCRC, (u8) (nCRC >> 8) };
+
+    // COBS: each block is a code byte (its length + 1) and up to 254 bytes that aren't 0
+    u8 *p = pOut;
+    u8 *pCode = p++;
+    u8 nCode = 1;
+    unsigned nTotal = nLength + FRAME_OVERHEAD;
+    for (unsigned i = 0; i < nTotal; i++)
+    {
+        u8 nByte = i < 2 ? header[i] : i < nTotal - 2 ? pPayload[i - 2] : trailer[i - (nTotal - 2)];
+        if (nByte)
+        {
+            *p++ = nByte;
+            nCode++;
+        }
+        if (!nByte || nCode == 0xff)
+        {
+            *pCode = nCode;
+            pCode = p++;
+            nCode = 1;
+        }
+    }
+    *pCode = nCode;
+    *p++ = 0;
+
+    return p - pOut;
+}
+
+bool CSerialLink::DecodeReply (const u8 *pFrame, unsigned nLength, TSerialReply *pReply)
+{
+    u8 frame[SERIAL_REPLY_SIZE];
+    unsigned nFrame = 0;
+    for (unsigned i = 0; i < nLength; )
+    {
+        u8 nCode = pFrame[i++];
+        if (!nCode || i + nCode - 1 > nLength)
+            return false;
+        for (unsigned j = 1; j < nCode; j++)
+        {
+            if (nFrame == sizeof frame)
+                return false;
+            frame[nFrame++] = pFrame[i++];
+        }
+        if (nCode != 0xff && i < nLength)
+        {
+            if (nFrame == sizeof frame)
+                return false;
+            frame[nFrame++] = 0;
+        }
+    }
+
+    if (   nFrame != 3 + FRAME_OVERHEAD
+        || frame[0] != SerialFrameReply
+        || CRC16 (frame, nFrame - 2) != (frame[nFrame - 2] | frame[nFrame - 1] << 8))
+    {
+        return false;
+    }
+
+    pReply->Status = (TSerialStatus) frame[2];
+    pReply->Ack = frame[3];
+    pReply->Credits = frame[4];
+    return true;
+}
+
+u16 CSerialLink::CRC16 (const u8 *pData, unsigned nLength, u16 nCRC)
+{
+    for (unsigned i = 0; i < nLength; i++)
+        nCRC = nCRC << 8 ^ s_CRCTable.Entry[(nCRC >> 8 ^ pData[i]) & 0xff];
+    return nCRC;
+}
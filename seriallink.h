@@ -0,0 +1,197 @@
+//
+// seriallink.h
+//
+// Register streams from a PC over the UART (SERIAL_BAUD, 3 Mbaud), framed,
+// checked and flow controlled.
+//
+// Every frame goes out COBS encoded and ends with a 0 byte, so after line
+// noise, an overrun or a frame cut short the receiver picks up again at the
+// next 0. Decoded, a frame is
+//
+//   type  seq  payload...  crc
+//
+// crc being CRC-16/CCITT-FALSE over type, seq and payload, low byte first.
+// PC to device:
+//
+//   SerialFrameData   payload: up to SERIAL_PAYLOAD_MAX bytes of register
+//                     stream (see regstream.h), waits included; seq counts
+//                     up by one per data frame, wrapping at 256
+//   SerialFrameQuery  no payload, seq ignored; only asks for a reply
+//
+// and back, SerialFrameReply with status, ack and credits: ack is the seq of
+// the last data frame taken in order, credits how many more data frames
+// there is room for. A reply goes out for every query, for every data frame
+// taken (or seen again: a repeat is acked, not played twice), when a frame
+// has been played and its buffer is free again, and for the first frame
+// rejected after a good one (bad CRC, malformed, out of sequence, or sent
+// without credit). On a reply with an error status the PC sends again from
+// the frame after ack; if no reply comes while frames are outstanding it
+// queries and does the same. Credits count frames the PC may have sent past
+// ack, so a PC that keeps within them never has a frame turned away for
+// lack of room.
+//
+// Received frames are decoded straight into one of SERIAL_BUFFERS frame
+// buffers: one fills from the UART while Update () plays the other into the
+// bus queues, writes as they come and waits against the caller's clock. The
+// write handler refuses a write while its chip's queue is backed up; the
+// frame then stays in its buffer, that write first, until a later Update ()
+// gets it through. So the credits reach all the way down to the chip
+// queues: the PC can't get more than two frames ahead of what they take.
+//
+// The link needs the UART to itself. CKernel doesn't start it when the log
+// goes to the same UART (logdev=ttyS1 in cmdline.txt), as log lines would
+// land in the middle of frames and replies; the log device has to be the
+// screen or another UART for the link to run.
+//
+#ifndef _seriallink_h
+#define _seriallink_h
+
+#include "spinbus.h"
+#include "regstream.h"
+#include "vgmplayer.h"
+
+#define SERIAL_PAYLOAD_MAX  1024
+#define SERIAL_FRAME_MAX    (SERIAL_PAYLOAD_MAX + 4)    // type, seq, payload, crc
+#define SERIAL_BUFFERS      2
+#define SERIAL_SCRATCH_SIZE 8       // where frames go with no buffer free; a query fits
+#define SERIAL_REPLY_SIZE   9       // a reply frame on the wire, delimiter included
+#define SERIAL_LATE_US      50000   // a wait due longer ago than this restarts the time base
+
+enum TSerialFrame : u8
+{
+    SerialFrameData  = 0x01,
+    SerialFrameQuery = 0x02,
+    SerialFrameReply = 0x81
+};
+
+enum TSerialStatus : u8
+{
+    SerialOK,
+    SerialBadCRC,
+    SerialBadFrame,         // too short, too long, unknown type, broken COBS
+    SerialOutOfSequence,
+    SerialNoCredit,         // a data frame came with both buffers taken
+    SerialBadStream         // a played frame's stream wasn't clean (see TRegisterStreamStatus)
+};
+
+struct TSerialReply
+{
+    TSerialStatus Status;
+    u8 Ack;
+    u8 Credits;
+};
+
+struct TSerialStats
+{
+    u32 Frames = 0;         // data frames taken
+    u32 Repeats = 0;        // data frames seen again
+    u32 BadCRC = 0;
+    u32 BadFrames = 0;
+    u32 OutOfSequence = 0;
+    u32 NoCredit = 0;
+    u32 BadStreams = 0;
+    u32 LineErrors = 0;     // overruns, framing and parity errors the UART reported
+    u32 Writes = 0;
+    u32 Waits = 0;
+    u32 Rebased = 0;        // times the time base was restarted after a late wait
+    u32 Stalls = 0;         // writes the handler refused at first
+};
+
+/// @brief Sends bytes to the PC.
+typedef void TSerialSendHandler (void *pParam, const u8 *pData, unsigned nLength);
+
+class CSerialLink
+{
+public:
+    /// @param pWriteHandler takes the writes of played frames, or refuses them for now.
+    CSerialLink (TRegisterWriteHandler *pWriteHandler, TSerialSendHandler *pSendHandler, void *pParam);
+
+    /// @brief Bytes from the UART, any number at a time.
+    void Receive (const u8 *pData, unsigned nLength);
+    /// @brief The UART lost or garbled something; the frame in progress is no good.
+    void LineError (void);
+
+    /// @brief Plays received frames up to the next wait that isn't due by nNow,
+    /// or the next write the handler refuses.
+    /// @param nNow CTimer clock ticks (1 MHz).
+    void Update (u64 nNow);
+
+    /// @return frame buffers free.
+    unsigned GetCredits (void) const { return SERIAL_BUFFERS - m_nReady; }
+    const TSerialStats &GetStats (void) const { return m_Stats; }
+
+    /// @brief Builds a frame (PC side).
+    /// @param pOut room for EncodedSize (nLength) bytes.
+    /// @return bytes written, delimiter included.
+    static unsigned Encode (TSerialFrame eType, u8 nSequence, const u8 *pPayload, unsigned nLength, u8 *pOut);
+    static unsigned EncodedSize (unsigned nLength) { return nLength + 4 + (nLength + 4) / 254 + 2; }
+    /// @brief Reads a reply (PC side).
+    /// @param pFrame a frame's bytes up to its delimiter.
+    /// @return false if it isn't one.
+    static bool DecodeReply (const u8 *pFrame, unsigned nLength, TSerialReply *pReply);
+
+    /// @param nCRC the CRC of the bytes before pData, to run one over several pieces.
+    static u16 CRC16 (const u8 *pData, unsigned nLength, u16 nCRC = 0xffff);
+
+private:
+    struct TBuffer
+    {
+        u8 Data[SERIAL_FRAME_MAX];
+        unsigned Length;
+    };
+
+    void Put (u8 nByte)
+    {
+        if (m_nTarget < m_nTargetSize)
+            m_pTarget[m_nTarget] = nByte;
+        m_nTarget++;
+    }
+    void Begin (void);
+    void Frame (void);
+    void Reply (TSerialStatus eStatus);
+
+    static bool WriteHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData);
+    static void WaitHandler (void *pParam, u16 nSamples);
+
+    TRegisterWriteHandler *m_pWriteHandler;
+    TSerialSendHandler *m_pSendHandler;
+    void *m_pParam;
+
+    // receive: COBS decoding straight into the buffer after the ready ones
+    TBuffer m_Buffer[SERIAL_BUFFERS];
+    u8 m_Scratch[SERIAL_SCRATCH_SIZE];
+    u8 *m_pTarget;
+    unsigned m_nTargetSize;
+    unsigned m_nTarget;         // bytes decoded so far (may run past m_nTargetSize)
+    u8 m_nBlock;                // bytes left in the current COBS block, 0 before a code byte
+    bool m_bZero;               // the current block ends with a 0 (code < 0xff)
+    bool m_bStarted;            // bytes have come in since the last delimiter
+    bool m_bLineError;
+
+    u8 m_nAck;                  // seq of the last data frame taken
+    bool m_bRejected;           // a frame has been turned away since then
+
+    // play: buffers m_nPlay, m_nPlay + 1, ... hold m_nReady frames in order
+    unsigned m_nPlay;
+    unsigned m_nReady;
+    unsigned m_nPosition;       // in the payload of the frame being played
+    CRegisterStream m_Stream;
+    u64 m_nNow;
+    u64 m_nStart;               // time base: when sample 0 was due
+    u64 m_nSamples;             // waited since then
+    u64 m_nDue;
+    bool m_bWaiting;
+    bool m_bTimeBase;
+    bool m_bStalled;            // m_Stalled was refused and goes first
+    struct
+    {
+        u8 Chip;
+        bool Bank;
+        u8 Address;
+        u8 Data;
+    } m_Stalled;
+
+    TSerialStats m_Stats;
+};
+
+#endif
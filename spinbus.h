@@ -0,0 +1,102 @@
+//
+// spinbus.h
+//
+// Spinbus protocol constants and the bus backend interface used by CKernel.
+// See docs/Protocol.md for the wire format.
+//
+#ifndef _spinbus_h
+#define _spinbus_h
+
+#ifdef SPINDASH_HOST
+#include <stdint.h>
+#include <stddef.h>
+typedef uint8_t     u8;
+typedef uint16_t    u16;
+typedef uint32_t    u32;
+typedef uint64_t    u64;
+typedef int8_t      s8;
+typedef int16_t     s16;
+typedef int32_t     s32;
+typedef int64_t     s64;
+#define BIT(n)      (1U << (n))
+#else
+#include <circle/types.h>
+#endif
+
+#define YM_COUNT 20
+#define YM_CHANNELS 6
+
+#define YM_CLOCK 7669857    // Hz, see docs/clocks.txt
+#define YM_SAMPLE_DIV 144   // YM clocks per output sample, ~53.26 kHz
+
+// default delays before and after the SCK rising edge; see spinbuscal.h to measure tighter ones
+#define SPINBUS_SETUP_NS 40
+#define SPINBUS_HOLD_NS 40
+
+#define CMD_NOP                 0x00
+#define CMD_RESET               0x0f
+#define CMD_DEBUG               0x7f
+#define CMD_YM_REGDATA          0x11
+#define CMD_YM_REG              0x12
+#define CMD_YM_READ             0x13
+#define CMD_YM_BURST            0x14
+#define CMD_YM_CONFIG_2612      0x15
+#define CMD_YM_BROADCAST        0x16
+
+// longest run of address/data pairs in one CMD_YM_BURST
+#define YM_BURST_MAX            16
+// CMD_YM_BROADCAST chip mask, one bit per chip, sent most significant byte first
+#define YM_MASK_BYTES           3
+#define YM_MASK_ALL             ((1U << YM_COUNT) - 1)
+
+// return signals
+#define RET_IDLE                0x01
+#define RET_AWAITING_DATA       0x2b
+#define RET_ACK                 0xff
+#define RET_ERROR_HEADER        0xf0d4
+
+// system errors
+#define ERROR_COMMAND_UNKNOWN   0xf1 // 11110001
+#define ERROR_INVALID_STATE     0xf2 // 11110010
+#define ERROR_TOO_MANY_BYTES    0xf3 // 11110011
+// YM errors
+#define ERROR_YM_IDX_OUTOFRANGE 0xf8 // 11111000
+#define ERROR_YM_DOUBLE_SUBMIT  0xf9 // 11111001
+
+/// @brief Physical layer of the Spinbus.
+/// CSpinbusPump does the framing and queueing on top of this and
+/// CSpinbusDecoder the return-byte decoding, so a backend only has to clock
+/// bytes and report the YM "sent" latch.
+class CSpinbus
+{
+public:
+    virtual ~CSpinbus (void) {}
+
+    /// @brief Pulses the FPGA reset line.
+    virtual void Reset (void) = 0;
+
+    /// @brief Clocks one byte out on MOSI.
+    /// @param data byte to write to the FPGA.
+    /// @return the MISO bit returned during this clock.
+    virtual bool Transfer (u8 data) = 0;
+
+    /// @brief Reads the YM "sent" latch.
+    /// @return true once every YM write submitted so far has been delivered to its chip.
+    virtual bool GetSent (void) = 0;
+
+    /// @brief Sets the delays Transfer waits after putting the byte out (setup) and
+    /// after raising SCK (hold). 0 skips the delay altogether.
+    void SetTiming (unsigned nSetupNs, unsigned nHoldNs)
+    {
+        m_nSetupNs = nSetupNs;
+        m_nHoldNs = nHoldNs;
+    }
+    unsigned GetSetupNs (void) const { return m_nSetupNs; }
+    unsigned GetHoldNs (void) const { return m_nHoldNs; }
+
+protected:
+    unsigned m_nSetupNs = SPINBUS_SETUP_NS;
+    unsigned m_nHoldNs = SPINBUS_HOLD_NS;
+};
+
+#endif
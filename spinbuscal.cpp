@@ -0,0 +1,118 @@
+//
+// spinbuscal.cpp
+//
+#include "spinbuscal.h"
+
+/// @return a delay one step shorter, but not below CAL_FLOOR_NS (nor raised to it).
+static unsigned StepDown (unsigned nNs, unsigned nStepNs)
+{
+    if (nNs <= CAL_FLOOR_NS)
+        return nNs;
+    return nNs > CAL_FLOOR_NS + nStepNs ? nNs - nStepNs : CAL_FLOOR_NS;
+}
+
+CSpinbusCalibrator::CSpinbusCalibrator (CSpinbus *pBus, TCalibrationClock *pClock, void *pParam, u32 nClockRate)
+:   m_pBus (pBus),
+    m_pClock (pClock),
+    m_pParam (pParam),
+    m_nClockRate (nClockRate),
+    m_LastBits (0),
+    m_nSteps (0),
+    m_pResult (0)
+{
+}
+
+bool CSpinbusCalibrator::Run (unsigned nStepNs)
+{
+    unsigned nSetup = m_pBus->GetSetupNs ();
+    unsigned nHold = m_pBus->GetHoldNs ();
+    m_nSteps = 0;
+    m_pResult = 0;
+
+    // the first setting with errors ends the search
+    unsigned nClean = 0;
+    while (m_nSteps < CAL_MAX_STEPS)
+    {
+        TCalibrationStep *pStep = &m_Steps[m_nSteps++];
+        pStep->SetupNs = nSetup;
+        pStep->HoldNs = nHold;
+        m_pBus->SetTiming (nSetup, nHold);
+        Measure (pStep);
+
+        if (!pStep->Clean ())
+            break;
+        nClean = m_nSteps;
+
+        if (StepDown (nSetup, nStepNs) == nSetup && StepDown (nHold, nStepNs) == nHold)
+            break;
+        nSetup = StepDown (nSetup, nStepNs);
+        nHold = StepDown (nHold, nStepNs);
+    }
+
+    if (nClean == 0)
+    {
+        m_pBus->SetTiming (m_Steps[0].SetupNs, m_Steps[0].HoldNs);
+        m_pBus->Reset ();
+        return false;
+    }
+
+    unsigned nResult = nClean - 1;
+    nResult = nResult > CAL_MARGIN_STEPS ? nResult - CAL_MARGIN_STEPS : 0;
+    m_pResult = &m_Steps[nResult];
+    m_pBus->SetTiming (m_pResult->SetupNs, m_pResult->HoldNs);
+    m_pBus->Reset ();
+    return true;
+}
+
+void CSpinbusCalibrator::Measure (TCalibrationStep *pStep)
+{
+    pStep->PeriodNs = 0;
+    pStep->BytesPerSecond = 0;
+    pStep->Bits = 0;
+    pStep->BitErrors = 0;
+    pStep->Faulted = false;
+
+    m_pBus->Reset ();
+    pStep->Synchronized = Synchronize ();
+    if (!pStep->Synchronized)
+        return;
+
+    u32 nStart = (*m_pClock) (m_pParam);
+    for (unsigned i = 0; i < CAL_PATTERN_BYTES / 8; i++)
+    {
+        u8 nByte = ReadByte (&pStep->Faulted);
+        pStep->Bits += 8;
+        pStep->BitErrors += __builtin_popcount (nByte ^ RET_IDLE);
+    }
+    u32 nTicks = (*m_pClock) (m_pParam) - nStart;
+
+    u64 nNs = (u64) nTicks * 1000000000 / m_nClockRate;
+    pStep->PeriodNs = (u32) (nNs / CAL_PATTERN_BYTES);
+    pStep->BytesPerSecond = nNs ? (u32) ((u64) CAL_PATTERN_BYTES * 1000000000 / nNs) : 0;
+}
+
+/// @brief Clocks NOPs until the last two return bytes were idle, which puts
+/// the byte boundary right after the last transfer.
+bool CSpinbusCalibrator::Synchronize (void)
+{
+    for (unsigned i = 0; i < CAL_SYNC_LIMIT; i++)
+    {
+        m_LastBits = m_LastBits << 1 | m_pBus->Transfer (CMD_NOP);
+        if (m_LastBits == (RET_IDLE << 8 | RET_IDLE))
+            return true;
+    }
+    return false;
+}
+
+/// @brief Clocks out one return byte, alternating NOP and CMD_DEBUG so that a
+/// data line latched stale turns into an unknown command.
+u8 CSpinbusCalibrator::ReadByte (bool *pFaulted)
+{
+    for (unsigned i = 0; i < 8; i++)
+    {
+        m_LastBits = m_LastBits << 1 | m_pBus->Transfer (i & 1 ? CMD_DEBUG : CMD_NOP);
+        if (m_LastBits == RET_ERROR_HEADER)
+            *pFaulted = true;
+    }
+    return m_LastBits & 0xff;
+}
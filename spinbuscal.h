@@ -0,0 +1,80 @@
+//
+// spinbuscal.h
+//
+// Finds the shortest Spinbus delays that still transfer cleanly.
+//
+// Starting from the current setup/hold delays, both are stepped down together
+// until a setting shows errors or CAL_FLOOR_NS is reached.
+// At each setting the bus is reset and synchronized, then a pattern of NOP and
+// CMD_DEBUG bytes (both ignored by the FPGA, but toggling seven data lines) is
+// clocked through while the returned idle bytes are checked bit by bit. The
+// byte period is measured with the caller's clock, so call overhead counts.
+//
+// The result is the fastest clean setting, backed off by CAL_MARGIN_STEPS steps:
+// a setting that passes one pattern can still be marginal, and a misread byte
+// in normal traffic costs a replay, so the margin is wide and the floor keeps
+// the delays clear of zero even on a bus that never shows an error.
+//
+#ifndef _spinbuscal_h
+#define _spinbuscal_h
+
+#include "spinbus.h"
+
+#define CAL_STEP_NS         5
+#define CAL_MAX_STEPS       32
+#define CAL_PATTERN_BYTES   65536   // per setting; 8192 returned idle bytes
+#define CAL_SYNC_LIMIT      100     // NOPs to find the idle pattern after a reset
+#define CAL_MARGIN_STEPS    3
+#define CAL_FLOOR_NS        15      // neither delay is stepped below this
+
+struct TCalibrationStep
+{
+    unsigned SetupNs;
+    unsigned HoldNs;
+    u32 PeriodNs;           // measured time per byte
+    u32 BytesPerSecond;
+    u32 Bits;               // return bits checked
+    u32 BitErrors;
+    bool Synchronized;      // false: the idle pattern never showed up, nothing was measured
+    bool Faulted;           // the FPGA reported an error, i.e. it misread a byte
+
+    bool Clean (void) const { return Synchronized && !Faulted && BitErrors == 0; }
+};
+
+/// @return the current time in ticks of the rate passed to CSpinbusCalibrator.
+typedef u32 TCalibrationClock (void *pParam);
+
+class CSpinbusCalibrator
+{
+public:
+    CSpinbusCalibrator (CSpinbus *pBus, TCalibrationClock *pClock, void *pParam, u32 nClockRate);
+
+    /// @brief Measures every setting from the bus's current delays down to CAL_FLOOR_NS and
+    /// leaves the bus at the chosen one (or where it started, if none was clean).
+    /// The bus is reset along the way and must be resynchronized afterwards.
+    /// @return false if not even the starting setting was clean.
+    bool Run (unsigned nStepNs = CAL_STEP_NS);
+
+    unsigned GetStepCount (void) const { return m_nSteps; }
+    const TCalibrationStep &GetStep (unsigned nStep) const { return m_Steps[nStep]; }
+    /// @return the step the bus was left at, or 0 if Run failed.
+    const TCalibrationStep *GetResult (void) const { return m_pResult; }
+
+private:
+    void Measure (TCalibrationStep *pStep);
+    bool Synchronize (void);
+    u8 ReadByte (bool *pFaulted);
+
+    CSpinbus *m_pBus;
+    TCalibrationClock *m_pClock;
+    void *m_pParam;
+    u32 m_nClockRate;
+
+    u16 m_LastBits;
+
+    TCalibrationStep m_Steps[CAL_MAX_STEPS];
+    unsigned m_nSteps;
+    const TCalibrationStep *m_pResult;
+};
+
+#endif
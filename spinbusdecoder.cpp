@@ -0,0 +1,147 @@
+//
+// spinbusdecoder.cpp
+//
+#include "spinbusdecoder.h"
+
+#define IDLE_PAIR   (RET_IDLE << 8 | RET_IDLE)
+
+CSpinbusDecoder::CSpinbusDecoder (void)
+{
+    Reset ();
+}
+
+void CSpinbusDecoder::Reset (void)
+{
+    m_State = StateHunting;
+    m_nHistory = 0;
+    m_nBits = 0;
+    m_nSinceGood = 0;
+    m_nByte = 0;
+    m_nErrorRead = 0;
+    m_nLastResyncBits = 0;
+    m_bSlipped = false;
+    m_Error = TSpinbusErrorFrame ();
+}
+
+TSpinbusEvent CSpinbusDecoder::Push (bool bBit)
+{
+    m_nHistory = m_nHistory << 1 | bBit;
+    m_nSinceGood++;
+
+    if (m_State == StateHunting)
+    {
+        return Align (m_nHistory & 0xffff, 0) ? Resynced () : SpinbusNone;
+    }
+
+    if (++m_nBits < 8)
+        return SpinbusNone;
+    m_nBits = 0;
+    return Byte (m_nHistory & 0xff);
+}
+
+TSpinbusEvent CSpinbusDecoder::Byte (u8 nByte)
+{
+    m_nByte = nByte;
+    m_Stats.Bytes++;
+
+    switch (m_State)
+    {
+    case StateAligned:
+        switch (nByte)
+        {
+        case RET_IDLE:          m_nSinceGood = 0; return SpinbusIdle;
+        case RET_ACK:           m_nSinceGood = 0; return SpinbusAck;
+        case RET_AWAITING_DATA: m_nSinceGood = 0; return SpinbusAwaitingData;
+        case RET_ERROR_HEADER >> 8:
+            m_State = StateErrorHeader;
+            return SpinbusNone;
+        default:
+            return Slip ();
+        }
+
+    case StateErrorHeader:
+        if (nByte != (RET_ERROR_HEADER & 0xff))
+            return Slip ();
+        m_State = StateErrorCode;
+        return SpinbusNone;
+
+    case StateErrorCode:
+        m_Error = TSpinbusErrorFrame ();
+        m_Error.Code = nByte;
+        m_State = StateErrorLength;
+        return SpinbusNone;
+
+    case StateErrorLength:
+        m_Error.Length = nByte < SPINBUS_ERROR_DATA ? nByte : SPINBUS_ERROR_DATA;
+        m_nErrorRead = 0;
+        if (m_Error.Length > 0)
+        {
+            m_State = StateErrorData;
+            return SpinbusNone;
+        }
+        break;
+
+    case StateErrorData:
+        m_Error.Data[m_nErrorRead++] = nByte;
+        if (m_nErrorRead < m_Error.Length)
+            return SpinbusNone;
+        break;
+
+    default:
+        return SpinbusNone;
+    }
+
+    // frame complete
+    m_State = StateAligned;
+    m_nSinceGood = 0;
+    m_Stats.Errors++;
+    return SpinbusError;
+}
+
+TSpinbusEvent CSpinbusDecoder::Slip (void)
+{
+    m_Stats.Slips++;
+    m_State = StateHunting;
+    m_bSlipped = true;
+
+    // the boundary may have moved by a few bits: look for a marker ending 1-7 bits back,
+    // which leaves that many bits of the next byte already received
+    for (unsigned nBack = 1; nBack < 8; nBack++)
+    {
+        if (Align ((m_nHistory >> nBack) & 0xffff, nBack))
+        {
+            m_Stats.LookBacks++;
+            return Resynced ();
+        }
+    }
+    return SpinbusSlip;
+}
+
+/// @return true if the window is a marker, in which case the boundary is set nBits back.
+bool CSpinbusDecoder::Align (u16 nWindow, unsigned nBits)
+{
+    if (nWindow == IDLE_PAIR)
+        m_State = StateAligned;
+    else if (nWindow == RET_ERROR_HEADER)
+        m_State = StateErrorCode;
+    else
+        return false;
+
+    m_nBits = nBits;
+    return true;
+}
+
+TSpinbusEvent CSpinbusDecoder::Resynced (void)
+{
+    m_nLastResyncBits = m_nSinceGood;
+    m_nSinceGood = 0;
+    if (!m_bSlipped)
+        return SpinbusResync;
+
+    m_bSlipped = false;
+    m_Stats.Resyncs++;
+    m_Stats.LostBits += m_nLastResyncBits;
+    if (m_nLastResyncBits > m_Stats.MaxLostBits)
+        m_Stats.MaxLostBits = m_nLastResyncBits;
+    return SpinbusResync;
+}
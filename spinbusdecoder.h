@@ -0,0 +1,107 @@
+//
+// spinbusdecoder.h
+//
+// Streaming decoder for the 1-bit Spinbus return channel (MISO).
+//
+// Push () takes one bit per transferred byte and reports each return byte as it
+// completes: idle, ack, awaiting data, or a whole error frame (F0 D4, code,
+// length, data). Bytes are only meaningful on the right 8-bit boundary; that
+// boundary is found from two idle bytes in a row (01 01) or an error header.
+//
+// A byte that isn't a return signal means the boundary slipped. The decoder
+// then looks back through the bits it already has for 01 01 or F0 D4 at the
+// other seven offsets, and otherwise keeps watching the stream until one comes
+// by. Either way it needs no NOPs from the host, so whatever command is being
+// sent carries on undisturbed.
+//
+#ifndef _spinbusdecoder_h
+#define _spinbusdecoder_h
+
+#include "spinbus.h"
+
+#define SPINBUS_ERROR_DATA      8       // error data bytes kept; longer frames are cut short
+// bits an error frame can take after its header: code, length and data
+#define SPINBUS_ERROR_FRAME_BITS ((2 + SPINBUS_ERROR_DATA) * 8)
+
+enum TSpinbusEvent
+{
+    SpinbusNone,            // mid-byte, or a byte that is part of a frame
+    SpinbusIdle,
+    SpinbusAck,
+    SpinbusAwaitingData,
+    SpinbusError,           // an error frame is complete, see GetError
+    SpinbusSlip,            // unexpected byte, the boundary is lost
+    SpinbusResync           // boundary found again
+};
+
+struct TSpinbusErrorFrame
+{
+    u8 Code;
+    u8 Length;              // data bytes, at most SPINBUS_ERROR_DATA
+    u8 Data[SPINBUS_ERROR_DATA];
+};
+
+struct TSpinbusDecoderStats
+{
+    u32 Bytes = 0;
+    u32 Errors = 0;         // error frames
+    u32 Slips = 0;
+    u32 Resyncs = 0;        // after a slip; finding the boundary after Reset doesn't count
+    u32 LookBacks = 0;      // resyncs found in the bits already received
+    u32 LostBits = 0;       // bits from the last good byte to each resync, summed
+    u32 MaxLostBits = 0;
+};
+
+class CSpinbusDecoder
+{
+public:
+    CSpinbusDecoder (void);
+
+    /// @brief Forgets the boundary, e.g. after a bus reset.
+    void Reset (void);
+
+    TSpinbusEvent Push (bool bBit);
+
+    bool IsAligned (void) const { return m_State != StateHunting; }
+    /// @return true while an error frame is coming in; the host has to keep
+    /// clocking (CMD_DEBUG) for the rest of it to arrive.
+    bool InErrorFrame (void) const { return m_State > StateAligned; }
+
+    /// @return the last complete return byte.
+    u8 GetByte (void) const { return m_nByte; }
+    /// @return the last error frame, or the part of it received so far.
+    const TSpinbusErrorFrame &GetError (void) const { return m_Error; }
+    /// @return bits lost to the last resync, counted from the last good byte.
+    unsigned GetLastResyncBits (void) const { return m_nLastResyncBits; }
+    const TSpinbusDecoderStats &GetStats (void) const { return m_Stats; }
+
+private:
+    enum TState
+    {
+        StateHunting,
+        StateAligned,
+        StateErrorHeader,   // F0 seen, D4 expected
+        StateErrorCode,
+        StateErrorLength,
+        StateErrorData
+    };
+
+    TSpinbusEvent Byte (u8 nByte);
+    TSpinbusEvent Slip (void);
+    bool Align (u16 nWindow, unsigned nBits);
+    TSpinbusEvent Resynced (void);
+
+    TState m_State;
+    u32 m_nHistory;         // newest bit in bit 0
+    unsigned m_nBits;       // bits into the current byte
+    unsigned m_nSinceGood;  // bits since the end of the last good byte
+    u8 m_nByte;
+    u8 m_nErrorRead;
+    unsigned m_nLastResyncBits;
+    bool m_bSlipped;        // hunting because of a slip, not a reset
+
+    TSpinbusErrorFrame m_Error;
+    TSpinbusDecoderStats m_Stats;
+};
+
+#endif
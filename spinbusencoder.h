@@ -0,0 +1,73 @@
+//
+// spinbusencoder.h
+//
+// GPIO pin assignment of the Spinbus, and the words that put a byte on the
+// data lines.
+//
+// g_SpinbusPins maps each byte to the GPSET0/GPCLR0 words for D0-D7, built at
+// compile time from TO_DATA_OUT, for CGPIOSpinbus::Transfer to write as they
+// are. Nothing here touches the hardware, so it also builds with
+// -DSPINDASH_HOST.
+//
+#ifndef _spinbusencoder_h
+#define _spinbusencoder_h
+
+#include "spinbus.h"
+
+#define RET_PIN 23
+#define YM_SENT_PIN 17
+#define SCK_PIN 24
+#define RST_PIN 18
+#define D0_PIN 25
+#define D1_PIN 8
+#define D2_PIN 7
+#define D3_PIN 1
+#define D4_PIN 12
+#define D5_PIN 16
+#define D6_PIN 20
+#define D7_PIN 21
+#define DATA_MASK (BIT(D0_PIN) | BIT(D1_PIN) | BIT(D2_PIN) | BIT(D3_PIN) | BIT(D4_PIN) \
+        | BIT(D5_PIN) | BIT(D6_PIN) | BIT(D7_PIN))
+#define GET_BIT(value, n) ((value & BIT(n)) >> n)
+#define TO_DATA_OUT(value) ((value & BIT(0)) << D0_PIN) \
+              | (((value & BIT(1)) >> 1) << D1_PIN) \
+              | (((value & BIT(2)) >> 2) << D2_PIN) \
+              | (((value & BIT(3)) >> 3) << D3_PIN) \
+              | (((value & BIT(4)) >> 4) << D4_PIN) \
+              | (((value & BIT(5)) >> 5) << D5_PIN) \
+              | (((value & BIT(6)) >> 6) << D6_PIN) \
+              | (((value & BIT(7)) >> 7) << D7_PIN)
+#define FROM_DATA_IN(value) ((value & BIT(D0_PIN)) >> D0_PIN) \
+              | (((value & BIT(D1_PIN)) >> D1_PIN) << 1) \
+              | (((value & BIT(D2_PIN)) >> D2_PIN) << 2) \
+              | (((value & BIT(D3_PIN)) >> D3_PIN) << 3) \
+              | (((value & BIT(D4_PIN)) >> D4_PIN) << 4) \
+              | (((value & BIT(D5_PIN)) >> D5_PIN) << 5) \
+              | (((value & BIT(D6_PIN)) >> D6_PIN) << 6) \
+              | (((value & BIT(D7_PIN)) >> D7_PIN) << 7)
+
+/// @brief Register words that put one byte on D0-D7.
+struct TSpinbusWord
+{
+    u32 Set;    // GPSET0: data lines that go high
+    u32 Clear;  // GPCLR0: data lines that go low
+};
+
+struct TSpinbusPinTable
+{
+    constexpr TSpinbusPinTable (void)
+    :   Word {}
+    {
+        for (unsigned i = 0; i < 256; i++)
+        {
+            Word[i].Set = TO_DATA_OUT(i);
+            Word[i].Clear = DATA_MASK & ~Word[i].Set;
+        }
+    }
+
+    TSpinbusWord Word[256];
+};
+
+inline constexpr TSpinbusPinTable g_SpinbusPins;
+
+#endif
@@ -0,0 +1,62 @@
+//
+// spinbusgpio.cpp
+//
+#include "spinbusgpio.h"
+#include <circle/memio.h>
+#include <circle/bcm2835.h>
+#include <assert.h>
+
+CGPIOSpinbus::CGPIOSpinbus (CTimer *pTimer)
+:   m_pTimer (pTimer),
+    m_RSTPin(RST_PIN, GPIOModeOutput),
+    m_SCKPin(SCK_PIN, GPIOModeOutput),
+    m_D0Pin(D0_PIN, GPIOModeOutput),
+    m_D1Pin(D1_PIN, GPIOModeOutput),
+    m_D2Pin(D2_PIN, GPIOModeOutput),
+    m_D3Pin(D3_PIN, GPIOModeOutput),
+    m_D4Pin(D4_PIN, GPIOModeOutput),
+    m_D5Pin(D5_PIN, GPIOModeOutput),
+    m_D6Pin(D6_PIN, GPIOModeOutput),
+    m_D7Pin(D7_PIN, GPIOModeOutput),
+    m_RETPin(RET_PIN, GPIOModeInputPullDown),
+    m_YMSentPin(YM_SENT_PIN, GPIOModeInputPullDown)
+{
+    assert (m_pTimer != 0);
+}
+
+void CGPIOSpinbus::Reset (void)
+{
+    m_RSTPin.Write(HIGH);
+    m_pTimer->usDelay(10);
+    m_RSTPin.Write(LOW);
+    m_pTimer->usDelay(20);
+}
+
+bool CGPIOSpinbus::Transfer (u8 data)
+{
+    Clock(g_SpinbusPins.Word[data]);
+    return m_RETPin.Read();
+}
+
+/// @brief Puts one byte on the data lines and pulses SCK.
+void CGPIOSpinbus::Clock (const TSpinbusWord &word)
+{
+#if RASPPI <= 4
+    // what CGPIOPin::WriteAll does, minus working out the words
+    write32(ARM_GPIO_GPSET0, word.Set);
+    write32(ARM_GPIO_GPCLR0, word.Clear);
+#else
+    CGPIOPin::WriteAll(word.Set, DATA_MASK);
+#endif
+    if (m_nSetupNs)
+        m_pTimer->nsDelay(m_nSetupNs);
+    m_SCKPin.Write(HIGH);
+    if (m_nHoldNs)
+        m_pTimer->nsDelay(m_nHoldNs);
+    m_SCKPin.Write(LOW);
+}
+
+bool CGPIOSpinbus::GetSent (void)
+{
+    return m_YMSentPin.Read();
+}
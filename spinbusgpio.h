@@ -0,0 +1,47 @@
+//
+// spinbusgpio.h
+//
+// Spinbus backend that bit-bangs the FPGA through the Pi's GPIO header.
+//
+#ifndef _spinbusgpio_h
+#define _spinbusgpio_h
+
+#include "spinbus.h"
+#include "spinbusencoder.h"
+#include <circle/gpiopin.h>
+#include <circle/timer.h>
+
+class CGPIOSpinbus : public CSpinbus
+{
+public:
+    CGPIOSpinbus (CTimer *pTimer);
+
+    void Reset (void) override;
+    bool Transfer (u8 data) override;
+    bool GetSent (void) override;
+
+private:
+    void Clock (const TSpinbusWord &word);
+
+    CTimer          *m_pTimer;
+
+    // Reset and communication clock
+    CGPIOPin        m_RSTPin;
+    CGPIOPin        m_SCKPin;
+
+    // 8-bit parallel send
+    CGPIOPin        m_D0Pin;
+    CGPIOPin        m_D1Pin;
+    CGPIOPin        m_D2Pin;
+    CGPIOPin        m_D3Pin;
+    CGPIOPin        m_D4Pin;
+    CGPIOPin        m_D5Pin;
+    CGPIOPin        m_D6Pin;
+    CGPIOPin        m_D7Pin;
+
+    // 1-bit serial return
+    CGPIOPin        m_RETPin;
+    CGPIOPin        m_YMSentPin;
+};
+
+#endif
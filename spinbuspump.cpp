@@ -0,0 +1,415 @@
+//
+// spinbuspump.cpp
+//
+#include "spinbuspump.h"
+
+CSpinbusPump::CSpinbusPump (CSpinbus *pBus, COverloadControl *pOverload, CBusStats *pStats, CDeferredLog *pLog,
+                            TSpinbusClock *pClock, void *pClockParam)
+:   m_pBus (pBus),
+    m_pOverload (pOverload),
+    m_pStats (pStats),
+    m_pLog (pLog),
+    m_pClock (pClock),
+    m_pClockParam (pClockParam)
+{
+}
+
+void CSpinbusPump::Reset (void)
+{
+    m_pBus->Reset ();
+    m_Shadow.Invalidate ();
+    m_Journal.Clear ();
+    m_pOverload->Clear ();
+    m_Decoder.Reset ();
+    m_LastReadByte = 0;
+}
+
+YMSyncResult CSpinbusPump::Sync (void)
+{
+    u8 count = 0;
+    u8 ones = 0;
+    m_Decoder.Reset ();
+    do {
+        bool bit = WriteReadRaw (CMD_NOP);
+        ones += bit;
+        m_Decoder.Push (bit);
+        // an error frame still coming out is drained by the NOPs
+        if (m_Decoder.IsAligned () && !m_Decoder.InErrorFrame ()) {
+            m_LastReadByte = RET_IDLE;
+            break;
+        }
+    } while (++count < SYNC_WRITE_LIMIT);
+    m_Synchronized = count < SYNC_WRITE_LIMIT;
+
+    if (count == SYNC_WRITE_LIMIT) {
+        m_pStats->Sync (false);
+        m_pLog->Write (MsgSyncFailed, count, m_LastBits);
+        return { count, ones, false };
+    }
+    m_pStats->Sync (true);
+    m_pLog->Write (MsgSynchronized, count, m_LastBits);
+    return { count, ones, true };
+}
+
+void CSpinbusPump::Enqueue (u8 chip, YMCommand command)
+{
+    if (!m_Shadow.Update (chip, command.bank, command.address, command.data))
+        return;
+    YMQueue &queue = m_Queues[chip];
+
+    // the low half of an fnum pair takes along the high half the shadow held back
+    u8 high;
+    if (m_Shadow.GetFnumHigh (chip, command.bank, command.address, &high)) {
+        YMCommand highCommand (command.bank, command.address + 4, high);
+        if (queue.CoalescePair (highCommand, command))
+            return;
+        if (!Queue (chip, highCommand, true)) {
+            m_Shadow.Invalidate (chip, command.bank, command.address);
+            return;
+        }
+        // admitted below the limit, so the ring has a slot left for the low half
+        Queue (chip, command, false);
+        return;
+    }
+
+    if (queue.Coalesce (command))
+        return;
+    Queue (chip, command, true);
+}
+
+/// @param bAdmit ask the overload control first; without, the write is pushed regardless.
+/// @return false if the write was dropped or a reset requested instead.
+bool CSpinbusPump::Queue (u8 chip, const YMCommand &command, bool bAdmit)
+{
+    YMQueue &queue = m_Queues[chip];
+    switch (bAdmit ? m_pOverload->Admit (chip, queue, command) : OverloadAccept) {
+    case OverloadAccept:
+        queue.Push (command, Now ());
+        m_pStats->QueueDepth (chip, queue.size ());
+        if (m_pOverload->Depth (chip, queue.GetFill ()))
+            m_pLog->Write (MsgOverloaded, chip, queue.GetFill (), m_pOverload->GetPolicy ());
+        return true;
+    case OverloadDrop:
+        // the chip keeps its old value, so the next write to the register has to go out
+        m_Shadow.Invalidate (chip, command.bank, command.address);
+        return false;
+    case OverloadResetAll:
+        m_pLog->Write (MsgQueueLimit, QUEUE_SIZE_LIMIT, chip, command.address, command.data);
+        m_bResetRequested = true;
+        return false;
+    }
+    return false;
+}
+
+u32 CSpinbusPump::Process (void)
+{
+    // If the YM commands have been sent, reset the queues
+    if (m_pBus->GetSent ()) { // Sent flag rise
+        for (int i = 0; i < YM_COUNT; i++)
+            m_Queues[i].sent = false;
+    }
+    u32 now = Now ();
+
+    Replay ();
+    if (m_Decoder.InErrorFrame ()) {
+        Recover ();
+        return m_Journal.GetReplayCount ();
+    }
+
+    // chips whose next write is identical share a single broadcast
+    for (int i = 0; m_bBroadcast && i < YM_COUNT; i++) {
+        if (!m_Queues[i].size () || m_Queues[i].sent)
+            continue;
+        YMCommand cmd = m_Queues[i].front ();
+        u32 mask = BIT(i);
+        for (int j = i + 1; j < YM_COUNT; j++) {
+            if (!m_Queues[j].size () || m_Queues[j].sent)
+                continue;
+            YMCommand &other = m_Queues[j].front ();
+            if (other.bank == cmd.bank && other.address == cmd.address && other.data == cmd.data)
+                mask |= BIT(j);
+        }
+        if (mask == BIT(i))
+            continue;
+
+        for (int j = i; j < YM_COUNT; j++) {
+            if (mask & BIT(j))
+                m_Journal.Record (j, cmd, m_nBusBytes);
+        }
+        WriteBroadcast (mask, cmd);
+        u32 stamp = Now ();
+        for (int j = i; j < YM_COUNT; j++) {
+            if (mask & BIT(j)) {
+                m_pStats->Sent (j, cmd, stamp);
+                m_Queues[j].sent = true;
+                m_Queues[j].pop (now);
+                m_pOverload->Depth (j, m_Queues[j].GetFill ());
+            }
+        }
+        if (m_Decoder.InErrorFrame ()) {
+            Recover ();
+            return m_Journal.GetReplayCount ();
+        }
+    }
+
+    // Iterate through the send queues
+    u32 remaining = 0;
+    for (int i = 0; i < YM_COUNT; i++) {
+        YMQueue &queue = m_Queues[i];
+        remaining += queue.size ();
+        // if the YM data has been latched, we can now send to the same chips again
+        // don't bother checking if there's nothing to send though
+        if (!queue.size () || queue.sent)
+            continue;
+
+        // several writes to the same bank, in send order, go out behind a single header
+        queue.sent = true;
+        YMCommand burst[YM_BURST_MAX];
+        u8 count = 0;
+        u8 limit = m_bBurst ? YM_BURST_MAX : 1;
+        bool bank = queue.front ().bank;
+        do {
+            burst[count++] = queue.front ();
+            queue.pop (now);
+        } while (count < limit && queue.size () && queue.front ().bank == bank);
+        for (u8 n = 0; n < count; n++)
+            m_Journal.Record (i, burst[n], m_nBusBytes);
+        if (count > 1)
+            WriteBurst (i, bank, burst, count);
+        else
+            Write (i, burst[0]);
+        u32 stamp = Now ();
+        for (u8 n = 0; n < count; n++)
+            m_pStats->Sent (i, burst[n], stamp);
+        m_pOverload->Depth (i, queue.GetFill ());
+
+        if (m_Decoder.InErrorFrame ()) {
+            Recover ();
+            return m_Journal.GetReplayCount ();
+        }
+    }
+    return remaining + m_Journal.GetReplayCount ();
+}
+
+void CSpinbusPump::Clear (void)
+{
+    for (int i = 0; i < YM_COUNT; i++)
+        m_Queues[i].clear ();
+    m_Shadow.Invalidate ();
+    m_Journal.Clear ();
+    m_pOverload->Clear ();
+}
+
+u32 CSpinbusPump::GetPending (void) const
+{
+    u32 count = m_Journal.GetReplayCount ();
+    for (int i = 0; i < YM_COUNT; i++)
+        count += m_Queues[i].size ();
+    return count;
+}
+
+/// @brief Resends writes an error may have lost, ahead of anything newer for the same chip.
+/// Like the queues, each chip gets one frame per sent-latch cycle.
+void CSpinbusPump::Replay (void)
+{
+    if (!m_Journal.GetReplayCount ())
+        return;
+
+    for (int i = 0; i < YM_COUNT; i++) {
+        if (m_Queues[i].sent || !m_Journal.HasReplay (i))
+            continue;
+
+        m_Queues[i].sent = true;
+        YMCommand replay[YM_BURST_MAX];
+        u8 count = m_Journal.TakeReplay (i, replay, m_bBurst ? YM_BURST_MAX : 1);
+        for (u8 n = 0; n < count; n++)
+            m_Journal.Record (i, replay[n], m_nBusBytes);
+        u32 start = m_nBusBytes;
+        if (count > 1)
+            WriteBurst (i, replay[0].bank, replay, count);
+        else
+            Write (i, replay[0]);
+        m_nReplayBytes += m_nBusBytes - start;
+
+        if (m_Decoder.InErrorFrame ())
+            return;
+    }
+}
+
+/// @brief Gets the bus going again after an error frame that couldn't be clocked out in full.
+/// Unconfirmed writes are replayed once the return channel is back; only if it doesn't
+/// come back are the queues dropped, and the chips have to be prepared again.
+void CSpinbusPump::Recover (void)
+{
+    if (!m_bReplay) {
+        m_Journal.Clear ();
+        m_bResetRequested = true;
+        Sync ();
+        return;
+    }
+
+    m_Journal.Fail ();
+    if (!Sync ().success) {
+        Clear ();
+        m_bResetRequested = true;
+    }
+}
+
+/// @brief Writes a YMCommand to the FPGA.
+/// @param chip chip index to send the command to.
+/// @param command YMCommand to sent.
+/// @return true if the write resulted in the completion of a return data byte (see GetLastReadByte).
+bool CSpinbusPump::Write (u8 chip, YMCommand command)
+{
+    return Write (chip, command.address, command.data, command.bank);
+}
+
+/// @brief Writes a YM command to the FPGA.
+/// @param chip chip index to send the command to.
+/// @param address address to write the data to.
+/// @param data data to write.
+/// @param bank 0: channels 1~3, 1: channels 4~6.
+/// @return true if the write resulted in the completion of a return data byte (see GetLastReadByte).
+bool CSpinbusPump::Write (u8 chip, u8 address, u8 data, bool bank)
+{
+    m_FrameAborted = false;
+    bool byteCompleted = false;
+
+    byteCompleted |= WriteRead (CMD_YM_REGDATA);
+    byteCompleted |= WriteRead (chip << 1 | bank);
+    byteCompleted |= WriteRead (address);
+    byteCompleted |= WriteRead (data);
+
+    return byteCompleted;
+}
+
+/// @brief Writes several YM commands to one chip as one burst.
+/// @param chip chip index to send the commands to.
+/// @param bank 0: channels 1~3, 1: channels 4~6. All commands must use this bank.
+/// @param commands commands to send, in order.
+/// @param count number of commands, 1 to YM_BURST_MAX.
+/// @return true if the write resulted in the completion of a return data byte (see GetLastReadByte).
+bool CSpinbusPump::WriteBurst (u8 chip, bool bank, const YMCommand *commands, u8 count)
+{
+    m_FrameAborted = false;
+    bool byteCompleted = false;
+
+    byteCompleted |= WriteRead (CMD_YM_BURST);
+    byteCompleted |= WriteRead (chip << 1 | bank);
+    byteCompleted |= WriteRead (count);
+    for (u8 n = 0; n < count; n++) {
+        byteCompleted |= WriteRead (commands[n].address);
+        byteCompleted |= WriteRead (commands[n].data);
+    }
+
+    return byteCompleted;
+}
+
+/// @brief Writes one YM command to several chips at once.
+/// @param chipMask chips to send the command to, bit N = chip N.
+/// @param command YMCommand to send.
+/// @return true if the write resulted in the completion of a return data byte (see GetLastReadByte).
+bool CSpinbusPump::WriteBroadcast (u32 chipMask, YMCommand command)
+{
+    m_FrameAborted = false;
+    bool byteCompleted = false;
+
+    byteCompleted |= WriteRead (CMD_YM_BROADCAST);
+    for (int shift = (YM_MASK_BYTES - 1) * 8; shift >= 0; shift -= 8)
+        byteCompleted |= WriteRead ((chipMask >> shift) & 0xff);
+    byteCompleted |= WriteRead (command.bank);
+    byteCompleted |= WriteRead (command.address);
+    byteCompleted |= WriteRead (command.data);
+
+    return byteCompleted;
+}
+
+/// @brief Writes a byte of data to the FPGA, and runs the return bit through the decoder.
+/// Once an error frame has come in, the rest of the current command is not sent:
+/// the FPGA dropped its start, so its remaining bytes would be read as commands.
+/// @param data byte to write to the FPGA.
+/// @return true if the write resulted in the completion of a return data byte (see GetLastReadByte).
+bool CSpinbusPump::WriteRead (u8 data)
+{
+    if (m_FrameAborted)
+        return false;
+
+    TSpinbusEvent event = m_Decoder.Push (WriteReadRaw (data));
+
+    // the FPGA only clocks an error frame out while it is sent something
+    for (unsigned bits = 0; m_Decoder.InErrorFrame () && bits < SPINBUS_ERROR_FRAME_BITS; bits++)
+        event = m_Decoder.Push (WriteReadRaw (CMD_DEBUG));
+
+    switch (event) {
+        case SpinbusNone:
+            return false;
+
+        case SpinbusError:
+            m_FrameAborted = true;
+            if (m_bReplay)
+                m_Journal.Fail ();
+            else
+                m_bResetRequested = true;
+            DumpError ();
+            return false;
+
+        case SpinbusSlip:
+            // an error frame may have gone by unrecognized
+            m_Synchronized = false;
+            if (m_bReplay)
+                m_Journal.Fail ();
+            return false;
+
+        case SpinbusResync:
+            m_Synchronized = true;
+            m_pStats->Resync (m_Decoder.GetLastResyncBits ());
+            return false;
+
+        default:
+            m_Journal.Acknowledge (m_nBusBytes);
+            m_LastReadByte = m_Decoder.GetByte ();
+            return true;
+    }
+}
+
+bool CSpinbusPump::WriteReadRaw (u8 data)
+{
+    bool bit = m_pBus->Transfer (data);
+    m_nBusBytes++;
+    m_pStats->AddBytes (1);
+    m_LastBits <<= 1;
+    m_LastBits |= bit;
+    return bit;
+}
+
+void CSpinbusPump::DumpError (void)
+{
+    m_nErrors++;
+    m_pStats->Error ();
+    const TSpinbusErrorFrame &error = m_Decoder.GetError ();
+    // frames from the decoder always carry at least the two data bytes the gateware sends
+    m_pLog->Write (MsgSpinbusError, error.Code, error.Length, error.Data[0], error.Data[1]);
+
+    switch (error.Code) {
+        case ERROR_COMMAND_UNKNOWN:
+            m_pLog->Write (MsgErrorUnknownCommand, error.Data[0]);
+            break;
+        case ERROR_INVALID_STATE:
+            m_pLog->Write (MsgErrorInvalidState, error.Data[1]);
+            break;
+        case ERROR_TOO_MANY_BYTES:
+            m_pLog->Write (MsgErrorTooManyBytes, error.Data[0]);
+            break;
+        case ERROR_YM_IDX_OUTOFRANGE:
+            m_pLog->Write (MsgErrorIndexRange, error.Data[1] >> 1);
+            break;
+        case ERROR_YM_DOUBLE_SUBMIT:
+            m_pLog->Write (MsgErrorDoubleSubmit, error.Data[1] >> 1);
+            break;
+        default:
+            m_pLog->Write (MsgErrorUnknownCode, error.Code);
+            break;
+    }
+
+    m_LastReadByte = 0;
+}
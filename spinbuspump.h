@@ -0,0 +1,130 @@
+//
+// spinbuspump.h
+//
+// The bus side of the YM write path: per-chip queues behind the register
+// shadow, and the pump that sends them over the Spinbus with the journal
+// replaying whatever an error may have lost. CKernel runs it on whichever
+// core owns the bus; the host tools run the same code against CSimSpinbus.
+//
+// Everything here runs on one core at a time. The overload control, the
+// statistics and the deferred log are shared with the voice side and belong
+// to the owner; the pump only does the bus side's half of each.
+//
+// Timestamps (queue delays, sent stamps for CBusStats) come from the clock
+// passed in, in the ticks the owner's CBusStats was set up with.
+//
+#ifndef _spinbuspump_h
+#define _spinbuspump_h
+
+#include "spinbus.h"
+#include "ymqueue.h"
+#include "ymshadow.h"
+#include "ymjournal.h"
+#include "spinbusdecoder.h"
+#include "overload.h"
+#include "busstats.h"
+#include "deferredlog.h"
+
+#define SYNC_WRITE_LIMIT 100
+
+struct YMSyncResult {
+    u16 count = 0;
+    u16 ones = 0;
+    bool success = false;
+};
+
+typedef u32 TSpinbusClock (void *pParam);
+
+class CSpinbusPump
+{
+public:
+    CSpinbusPump (CSpinbus *pBus, COverloadControl *pOverload, CBusStats *pStats, CDeferredLog *pLog,
+                  TSpinbusClock *pClock, void *pClockParam = 0);
+
+    /// @brief Several same-bank writes to a chip behind one CMD_YM_BURST header.
+    void SetBurst (bool bOn) { m_bBurst = bOn; }
+    /// @brief Identical writes at the front of several queues as one CMD_YM_BROADCAST.
+    void SetBroadcast (bool bOn) { m_bBroadcast = bOn; }
+    /// @brief Resend unconfirmed writes after an error (default). Without it an error
+    /// frame requests a reset, as the kernel did before the journal.
+    void SetReplay (bool bOn) { m_bReplay = bOn; }
+
+    /// @brief Resets the bus and forgets what the chips hold; follow with Sync ().
+    void Reset (void);
+    /// @brief Finds the return byte boundary after a reset by sending NOPs.
+    /// Later slips are recovered by the decoder from the regular traffic.
+    YMSyncResult Sync (void);
+
+    /// @brief Queues a write for one chip, unless the shadow says it holds the value already.
+    /// An fnum high half is held until its low half comes and then queued in front of it.
+    void Enqueue (u8 chip, YMCommand command);
+    /// @brief Sends what each chip can take this sent-latch cycle, replays first.
+    /// @return writes that were queued or waiting for a replay before this pass.
+    u32 Process (void);
+    /// @brief Drops every queued write and forgets what the chips hold.
+    void Clear (void);
+
+    bool Write (u8 chip, YMCommand command);
+    bool Write (u8 chip, u8 address, u8 data, bool bank);
+    bool WriteBurst (u8 chip, bool bank, const YMCommand *commands, u8 count);
+    bool WriteBroadcast (u32 chipMask, YMCommand command);
+    bool WriteRead (u8 data);
+    bool WriteReadRaw (u8 data);
+    void DumpError (void);
+
+    /// @brief Set by the bus side when only a reset helps: queue limit, lost sync, or an error without replay.
+    bool IsResetRequested (void) const { return m_bResetRequested; }
+    void ClearResetRequest (void) { m_bResetRequested = false; }
+
+    bool InErrorFrame (void) const { return m_Decoder.InErrorFrame (); }
+    bool IsSynchronized (void) const { return m_Synchronized; }
+    u8 GetLastReadByte (void) const { return m_LastReadByte; }
+    /// @return bytes clocked out, free-running.
+    u32 GetBusBytes (void) const { return m_nBusBytes; }
+    /// @return bytes clocked out for replays.
+    u32 GetReplayBytes (void) const { return m_nReplayBytes; }
+    /// @return error frames read back.
+    u32 GetErrors (void) const { return m_nErrors; }
+    /// @return writes still queued over all chips, replays included.
+    u32 GetPending (void) const;
+
+    YMQueue &GetQueue (u8 chip) { return m_Queues[chip]; }
+    const YMQueue &GetQueue (u8 chip) const { return m_Queues[chip]; }
+    const CYMShadow &GetShadow (void) const { return m_Shadow; }
+    const CYMJournal &GetJournal (void) const { return m_Journal; }
+
+private:
+    bool Queue (u8 chip, const YMCommand &command, bool bAdmit);
+    void Replay (void);
+    void Recover (void);
+    u32 Now (void) { return (*m_pClock) (m_pClockParam); }
+
+    CSpinbus *m_pBus;
+    COverloadControl *m_pOverload;
+    CBusStats *m_pStats;
+    CDeferredLog *m_pLog;
+    TSpinbusClock *m_pClock;
+    void *m_pClockParam;
+
+    bool m_bBurst = false;
+    bool m_bBroadcast = false;
+    bool m_bReplay = true;
+
+    YMQueue m_Queues[YM_COUNT];
+    // register state the chips will hold once the queues drain
+    CYMShadow m_Shadow;
+    // writes sent but not yet confirmed by the return channel, resent after an error
+    CYMJournal m_Journal;
+    CSpinbusDecoder m_Decoder;
+
+    volatile bool m_bResetRequested = false;
+    bool    m_FrameAborted = false;  // an error frame came in; drop the rest of the command
+    bool    m_Synchronized = false;
+    u8      m_LastReadByte = 0;
+    u16     m_LastBits = 0;
+    u32     m_nBusBytes = 0;    // journal timestamps
+    u32     m_nReplayBytes = 0;
+    u32     m_nErrors = 0;
+};
+
+#endif
@@ -0,0 +1,353 @@
+//
+// spinbussim.cpp
+//
+#include "spinbussim.h"
+#include "ymshadow.h"
+#include <string.h>
+
+CSimSpinbus::CSimSpinbus (unsigned nYMWriteNs)
+:   m_nYMWriteNs (nYMWriteNs)
+{
+    Reset ();
+    m_Stats.Resets = 0;
+}
+
+void CSimSpinbus::Reset (void)
+{
+    m_Time += SIM_RESET_NS;
+    m_Stats.Resets++;
+
+    m_Command = CMD_NOP;
+    m_ArgsNeeded = 0;
+    m_ArgsRead = 0;
+    m_BurstRemaining = 0;
+    m_Faulted = false;
+
+    // the return shifter comes out of reset mid-byte and low
+    m_ReturnShift = 0;
+    m_ReturnBits = SIM_RESET_PHASE;
+    m_ReturnHead = 0;
+    m_ReturnTail = 0;
+
+    memset (m_BusyUntil, 0, sizeof m_BusyUntil);
+    for (unsigned bank = 0; bank < 2; bank++)
+    {
+        for (unsigned address = 0; address < 256; address++)
+        {
+            for (u8 chip = 0; chip < YM_COUNT; chip++)
+                m_Registers[chip][bank][address] = YMPowerOnValue (address);
+        }
+    }
+    memset (m_KeyState, 0, sizeof m_KeyState);
+    memset (m_FnumLatch, 0, sizeof m_FnumLatch);
+}
+
+bool CSimSpinbus::Transfer (u8 data)
+{
+    m_Time += SIM_TRANSFER_NS + m_nSetupNs + m_nHoldNs;
+    m_Stats.Bytes++;
+
+    // too little setup: some of the lines that changed still show the previous byte
+    if (Marginal (m_nSetupNs, m_nMinSetupNs))
+    {
+        u8 stale = (data ^ m_LatchedData) & m_Noise;
+        if (stale)
+        {
+            data ^= stale;
+            m_Stats.TimingFaults++;
+        }
+    }
+    m_LatchedData = data;
+
+    // MISO is sampled on the same clock the byte is latched
+    if (m_ReturnBits == 0)
+    {
+        if (m_ReturnHead != m_ReturnTail)
+        {
+            m_ReturnShift = m_ReturnQueue[m_ReturnTail];
+            m_ReturnTail = (m_ReturnTail + 1) % SIM_RETURN_SIZE;
+        }
+        else
+        {
+            // the error frame is out, so this byte is a command again
+            m_ReturnShift = RET_IDLE;
+            m_Faulted = false;
+        }
+        m_ReturnBits = 8;
+    }
+    bool bit = (m_ReturnShift & 0x80) != 0;
+    m_ReturnShift <<= 1;
+    m_ReturnBits--;
+
+    if (!Glitch (data))
+        ReceiveByte (data);
+
+    // too little hold: the host reads MISO before the new bit is out
+    if (Marginal (m_nHoldNs, m_nMinHoldNs) && bit != m_LastBit)
+    {
+        m_Stats.TimingFaults++;
+        return m_LastBit;
+    }
+    m_LastBit = bit;
+    return bit;
+}
+
+void CSimSpinbus::SetTimingLimit (unsigned nMinSetupNs, unsigned nMinHoldNs)
+{
+    m_nMinSetupNs = nMinSetupNs;
+    m_nMinHoldNs = nMinHoldNs;
+}
+
+/// @return true if this transfer is hit by a violation of the limit, more likely the further below it the delay is.
+bool CSimSpinbus::Marginal (unsigned nDelay, unsigned nLimit)
+{
+    if (nDelay >= nLimit)
+        return false;
+
+    return XorShift (&m_Noise) % SIM_TIMING_SLOPE_NS < nLimit - nDelay;
+}
+
+/// @return true if the receiver glitches on this byte; it is lost along with the command it belonged to.
+bool CSimSpinbus::Glitch (u8 data)
+{
+    if (m_nGlitchPer == 0 || m_Faulted || XorShift (&m_GlitchNoise) % m_nGlitchPer != 0)
+        return false;
+
+    m_Stats.Glitches++;
+    m_ArgsNeeded = 0;
+    m_ArgsRead = 0;
+    m_BurstRemaining = 0;
+    RaiseError (ERROR_INVALID_STATE, m_Command, data);
+    return true;
+}
+
+/// @brief xorshift32, so runs are reproducible.
+u32 CSimSpinbus::XorShift (u32 *pState)
+{
+    *pState ^= *pState << 13;
+    *pState ^= *pState >> 17;
+    *pState ^= *pState << 5;
+    return *pState;
+}
+
+bool CSimSpinbus::GetSent (void)
+{
+    m_Time += SIM_POLL_NS;
+
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+    {
+        if (IsPending (chip))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void CSimSpinbus::Advance (u64 ns)
+{
+    m_Time += ns;
+}
+
+void CSimSpinbus::ReceiveByte (u8 data)
+{
+    if (m_ArgsNeeded > 0)
+    {
+        m_Args[m_ArgsRead++] = data;
+        if (m_ArgsRead == m_ArgsNeeded)
+        {
+            m_ArgsNeeded = 0;
+            ExecuteCommand ();
+        }
+        return;
+    }
+
+    if (m_BurstRemaining > 0)
+    {
+        m_Args[m_ArgsRead++] = data;
+        if (m_ArgsRead == 4)
+        {
+            // chip/bank and count stay in m_Args[0..1]; pairs land in [2..3]
+            WriteRegister (m_Args[0] >> 1, m_Args[0] & 1, m_Args[2], m_Args[3]);
+            m_BusyUntil[m_Args[0] >> 1] += m_nYMWriteNs;
+            m_ArgsRead = 2;
+            m_BurstRemaining--;
+        }
+        return;
+    }
+
+    // an error frame is being clocked out; the host drives CMD_DEBUG until it is done
+    if (m_Faulted)
+    {
+        return;
+    }
+
+    m_Command = data;
+    m_ArgsRead = 0;
+    switch (data)
+    {
+    case CMD_NOP:
+    case CMD_DEBUG:
+        return;
+
+    case CMD_RESET:
+        Reset ();
+        return;
+
+    case CMD_YM_REGDATA:
+        m_ArgsNeeded = 3;
+        return;
+
+    case CMD_YM_REG:
+    case CMD_YM_READ:
+    case CMD_YM_BURST:
+        m_ArgsNeeded = 2;
+        return;
+
+    case CMD_YM_CONFIG_2612:
+        m_ArgsNeeded = 1;
+        return;
+
+    case CMD_YM_BROADCAST:
+        m_ArgsNeeded = YM_MASK_BYTES + 3;
+        return;
+
+    default:
+        RaiseError (ERROR_COMMAND_UNKNOWN, data, 0);
+        return;
+    }
+}
+
+void CSimSpinbus::ExecuteCommand (void)
+{
+    m_Stats.Commands++;
+
+    if (m_Command == CMD_YM_BROADCAST)
+    {
+        ExecuteBroadcast ();
+        return;
+    }
+
+    u8 chip = m_Args[0] >> 1;
+    bool bank = m_Args[0] & 1;
+    if (chip >= YM_COUNT)
+    {
+        RaiseError (ERROR_YM_IDX_OUTOFRANGE, m_Command, m_Args[0]);
+        return;
+    }
+
+    switch (m_Command)
+    {
+    case CMD_YM_REGDATA:
+        if (IsPending (chip))
+        {
+            RaiseError (ERROR_YM_DOUBLE_SUBMIT, m_Command, m_Args[0]);
+            return;
+        }
+        WriteRegister (chip, bank, m_Args[1], m_Args[2]);
+        m_BusyUntil[chip] = m_Time + m_nYMWriteNs;
+        break;
+
+    case CMD_YM_BURST:
+        if (m_Args[1] == 0 || m_Args[1] > YM_BURST_MAX)
+        {
+            RaiseError (ERROR_TOO_MANY_BYTES, m_Command, m_Args[1]);
+            return;
+        }
+        if (IsPending (chip))
+        {
+            RaiseError (ERROR_YM_DOUBLE_SUBMIT, m_Command, m_Args[0]);
+            return;
+        }
+        // the chip stays busy until the last pair has been written
+        m_BusyUntil[chip] = m_Time;
+        m_BurstRemaining = m_Args[1];
+        break;
+
+    default:
+        // address-only, read and config commands have no modelled effect
+        break;
+    }
+}
+
+void CSimSpinbus::ExecuteBroadcast (void)
+{
+    u32 mask = (u32) m_Args[0] << 16 | (u32) m_Args[1] << 8 | m_Args[2];
+    bool bank = m_Args[3] & 1;
+    if (mask & ~YM_MASK_ALL)
+    {
+        RaiseError (ERROR_YM_IDX_OUTOFRANGE, m_Command, m_Args[0]);
+        return;
+    }
+
+    // all or nothing: a busy chip rejects the whole command
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+    {
+        if ((mask & BIT (chip)) && IsPending (chip))
+        {
+            RaiseError (ERROR_YM_DOUBLE_SUBMIT, m_Command, chip << 1 | bank);
+            return;
+        }
+    }
+
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+    {
+        if (mask & BIT (chip))
+        {
+            WriteRegister (chip, bank, m_Args[4], m_Args[5]);
+            m_BusyUntil[chip] = m_Time + m_nYMWriteNs;
+        }
+    }
+}
+
+void CSimSpinbus::WriteRegister (u8 chip, bool bank, u8 address, u8 data)
+{
+    m_Stats.Writes++;
+
+    if (address >= 0xa0 && address <= 0xae && (address & 3) != 3)
+    {
+        if (address & 4)
+        {
+            m_FnumLatch[chip] = data;
+            return;
+        }
+        m_Registers[chip][bank][address + 4] = m_FnumLatch[chip];
+    }
+    m_Registers[chip][bank][address] = data;
+
+    if (address == 0x28 && !bank)
+    {
+        u8 channel = data & 0x07;
+        if (channel != 3 && channel != 7)
+        {
+            channel = channel > 3 ? channel - 1 : channel;
+            m_KeyState[chip][channel] = data & 0xf0;
+            if (data & 0xf0)
+                m_KeyOns[chip][channel]++;
+        }
+    }
+}
+
+void CSimSpinbus::RaiseError (u8 code, u8 data0, u8 data1)
+{
+    m_Stats.Errors++;
+    m_Faulted = true;
+
+    QueueReturn (RET_ERROR_HEADER >> 8);
+    QueueReturn (RET_ERROR_HEADER & 0xff);
+    QueueReturn (code);
+    QueueReturn (2);
+    QueueReturn (data0);
+    QueueReturn (data1);
+}
+
+void CSimSpinbus::QueueReturn (u8 data)
+{
+    u8 next = (m_ReturnHead + 1) % SIM_RETURN_SIZE;
+    if (next == m_ReturnTail)
+    {
+        return;
+    }
+    m_ReturnQueue[m_ReturnHead] = data;
+    m_ReturnHead = next;
+}
@@ -0,0 +1,126 @@
+//
+// spinbussim.h
+//
+// Cycle-level model of the Spinbus FPGA, for running the controller without
+// the hardware attached. Builds for Circle, or natively on Linux with
+// -DSPINDASH_HOST so the queueing and decoding paths can be profiled on a
+// dev box.
+//
+// Time only advances through the bus: every Transfer costs one byte period,
+// every GetSent poll costs SIM_POLL_NS, and Reset costs SIM_RESET_NS.
+//
+// The byte period is SIM_TRANSFER_NS plus the setup and hold delays. Delays
+// below the timing limit cause errors the way marginal wiring would: data
+// lines that just changed are latched stale (setup), and MISO is sampled
+// before it has moved on (hold). The shorter the delay, the more often.
+//
+// The fnum pairs share one latch per chip, as on the YM2612: a high write
+// (A4-A6, AC-AE) only goes into the latch, and a low write (A0-A2, A8-AA)
+// sets its pair from the latch and itself. A low write after another pair's
+// high write shows up in GetRegister as the wrong high half.
+//
+// Glitches are injected separately: the command receiver loses the command it
+// is in the middle of and reports ERROR_INVALID_STATE, as after a spurious
+// clock edge, so the host's error recovery can be exercised at any timing.
+//
+#ifndef _spinbussim_h
+#define _spinbussim_h
+
+#include "spinbus.h"
+
+#define SIM_TRANSFER_NS     170     // byte period without the delays; 250 ns (4 MHz) at the defaults
+#define SIM_MIN_SETUP_NS    25      // limits that allow ~4.5 MHz, see docs/clocks.txt
+#define SIM_MIN_HOLD_NS     25
+#define SIM_TIMING_SLOPE_NS 10      // this far below a limit, every byte is affected
+#define SIM_YM_WRITE_NS     2000    // roughly the YM2612 busy period after a data write
+#define SIM_POLL_NS         50
+#define SIM_RESET_NS        30000
+#define SIM_RESET_PHASE     3       // return-bit offset after reset, so sync has work to do
+#define SIM_RETURN_SIZE     64
+
+struct TSimStats
+{
+    u64 Bytes = 0;
+    u64 Commands = 0;
+    u64 Writes = 0;
+    u64 Errors = 0;
+    u64 Resets = 0;
+    u64 TimingFaults = 0;   // bytes or return bits corrupted by a timing violation
+    u64 Glitches = 0;
+};
+
+class CSimSpinbus : public CSpinbus
+{
+public:
+    CSimSpinbus (unsigned nYMWriteNs = SIM_YM_WRITE_NS);
+
+    void Reset (void) override;
+    bool Transfer (u8 data) override;
+    bool GetSent (void) override;
+
+    /// @brief Sets the shortest setup and hold delays that still transfer reliably.
+    void SetTimingLimit (unsigned nMinSetupNs, unsigned nMinHoldNs);
+    /// @brief Makes the receiver glitch on one in nPer bytes on average; 0 turns glitches off.
+    void SetGlitchRate (unsigned nPer) { m_nGlitchPer = nPer; }
+
+    /// @brief Lets simulated time pass without touching the bus.
+    void Advance (u64 ns);
+    u64 GetTime (void) const { return m_Time; }
+
+    const TSimStats &GetStats (void) const { return m_Stats; }
+    u8 GetRegister (u8 chip, bool bank, u8 address) const { return m_Registers[chip][bank][address]; }
+    /// @return key-on operator mask (bits 4-7 of the last 0x28 write) for a channel index 0-5.
+    u8 GetKeyState (u8 chip, u8 channel) const { return m_KeyState[chip][channel]; }
+    /// @return key ons written to a channel so far, resets included; wraps.
+    u32 GetKeyOns (u8 chip, u8 channel) const { return m_KeyOns[chip][channel]; }
+
+private:
+    void ReceiveByte (u8 data);
+    void ExecuteCommand (void);
+    void ExecuteBroadcast (void);
+    void WriteRegister (u8 chip, bool bank, u8 address, u8 data);
+    void RaiseError (u8 code, u8 data0, u8 data1);
+    void QueueReturn (u8 data);
+    bool IsPending (u8 chip) const { return m_BusyUntil[chip] > m_Time; }
+    bool Marginal (unsigned nDelay, unsigned nLimit);
+    bool Glitch (u8 data);
+    static u32 XorShift (u32 *pState);
+
+    unsigned m_nYMWriteNs;
+    u64     m_Time = 0;
+
+    // timing limits and the state a violation leaves behind
+    unsigned m_nMinSetupNs = SIM_MIN_SETUP_NS;
+    unsigned m_nMinHoldNs = SIM_MIN_HOLD_NS;
+    u8      m_LatchedData = 0;
+    bool    m_LastBit = false;
+    u32     m_Noise = 0x2545f491;
+    unsigned m_nGlitchPer = 0;
+    u32     m_GlitchNoise = 0x6b43a9b5;
+
+    // command receiver
+    u8      m_Command = CMD_NOP;
+    u8      m_Args[6];
+    u8      m_ArgsNeeded = 0;
+    u8      m_ArgsRead = 0;
+    u8      m_BurstRemaining = 0;   // CMD_YM_BURST address/data pairs still to come
+    bool    m_Faulted = false;
+
+    // 1-bit return shifter
+    u8      m_ReturnShift = 0;
+    u8      m_ReturnBits = 0;
+    u8      m_ReturnQueue[SIM_RETURN_SIZE];
+    u8      m_ReturnHead = 0;
+    u8      m_ReturnTail = 0;
+
+    // YM side
+    u64     m_BusyUntil[YM_COUNT] = { 0 };
+    u8      m_Registers[YM_COUNT][2][256];
+    u8      m_KeyState[YM_COUNT][YM_CHANNELS];
+    u32     m_KeyOns[YM_COUNT][YM_CHANNELS] = {};
+    u8      m_FnumLatch[YM_COUNT];     // one high-half latch for all fnum pairs of a chip
+
+    TSimStats m_Stats;
+};
+
+#endif
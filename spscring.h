@@ -0,0 +1,98 @@
+//
+// spscring.h
+//
+// Wait-free single-producer/single-consumer ring. Safe to fill from an
+// interrupt or USB completion handler (or another core) while the main loop
+// drains it. A full ring rejects the item and counts it instead of growing.
+//
+#ifndef _spscring_h
+#define _spscring_h
+
+#include "ringbuffer.h"
+#include <atomic>
+
+template <typename T, unsigned MINIMUM>
+class CSPSCRing
+{
+public:
+    static constexpr unsigned Capacity = RingCapacity (MINIMUM);
+
+    /// @brief Producer side.
+    /// @return false (and counts an overflow) if the ring is full.
+    bool Push (const T &item)
+    {
+        unsigned nHead = m_nHead.load (std::memory_order_relaxed);
+        if (nHead - m_nTail.load (std::memory_order_acquire) == Capacity)
+        {
+            m_nOverflows++;
+            return false;
+        }
+        m_Items[nHead & Mask] = item;
+        m_nHead.store (nHead + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @brief Producer side: slots free right now, which stay free at least until Commit ().
+    unsigned GetFree (void) const
+    {
+        return Capacity - (m_nHead.load (std::memory_order_relaxed) - m_nTail.load (std::memory_order_acquire));
+    }
+
+    /// @brief Producer side: a free slot to build an item in place, nOffset past the last one published.
+    /// Only valid for nOffset < GetFree ().
+    T &GetSlot (unsigned nOffset)
+    {
+        return m_Items[(m_nHead.load (std::memory_order_relaxed) + nOffset) & Mask];
+    }
+
+    /// @brief Producer side: publishes the first nCount slots from GetSlot () with a single release.
+    /// @param nDropped items that didn't fit, counted as overflows.
+    void Commit (unsigned nCount, unsigned nDropped = 0)
+    {
+        m_nHead.store (m_nHead.load (std::memory_order_relaxed) + nCount, std::memory_order_release);
+        m_nOverflows += nDropped;
+    }
+
+    /// @brief Consumer side.
+    /// @return false if the ring is empty.
+    bool Pop (T &item)
+    {
+        unsigned nTail = m_nTail.load (std::memory_order_relaxed);
+        if (nTail == m_nHead.load (std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = m_Items[nTail & Mask];
+        m_nTail.store (nTail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// @brief Consumer side: the oldest item without removing it, or 0 if empty.
+    const T *Peek (void) const
+    {
+        unsigned nTail = m_nTail.load (std::memory_order_relaxed);
+        if (nTail == m_nHead.load (std::memory_order_acquire))
+        {
+            return 0;
+        }
+        return &m_Items[nTail & Mask];
+    }
+
+    /// @brief Either side; a snapshot that may be stale by the time it is used.
+    unsigned GetCount (void) const
+    {
+        return m_nHead.load (std::memory_order_acquire) - m_nTail.load (std::memory_order_acquire);
+    }
+
+    unsigned GetOverflows (void) const { return m_nOverflows; }
+
+private:
+    static constexpr unsigned Mask = Capacity - 1;
+
+    T                       m_Items[Capacity];
+    std::atomic<unsigned>   m_nHead {0};    // written by the producer only
+    std::atomic<unsigned>   m_nTail {0};    // written by the consumer only
+    volatile unsigned       m_nOverflows = 0;
+};
+
+#endif
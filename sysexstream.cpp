@@ -0,0 +1,152 @@
+//
+// sysexstream.cpp
+//
+#include "sysexstream.h"
+#include "midiparser.h"
+
+CSysExStream::CSysExStream (TRegisterWriteHandler *pHandler, void *pParam)
+:   m_Stream (pHandler, pParam),
+    m_nMessages (0),
+    m_nErrors (0)
+{
+    Start ();
+}
+
+void CSysExStream::Start (void)
+{
+    m_Stream.Begin ();
+    m_nHeader = 0;
+    m_bOurs = false;
+    m_nCommand = 0;
+    m_nSequence = 0;
+    m_nMSBs = 0;
+    m_nGroup = 0;
+}
+
+void CSysExStream::Header (u8 nByte)
+{
+    switch (m_nHeader++)
+    {
+    case 0:
+        m_bOurs = nByte == SYSEX_ID_NONCOMMERCIAL;
+        break;
+    case 1:
+        m_bOurs = m_bOurs && nByte == SYSEX_ID_SPINDASH;
+        break;
+    case 2:
+        // an unknown command still gets a reply, which says so
+        m_nCommand = m_bOurs ? nByte : 0;
+        break;
+    default:
+        m_nSequence = nByte;
+        break;
+    }
+    if (!m_bOurs)
+    {
+        // skip the rest
+        m_nHeader = SYSEX_HEADER_SIZE;
+        m_nCommand = 0;
+    }
+}
+
+bool CSysExStream::End (TSysExAck *pAck)
+{
+    if (!m_bOurs || m_nHeader < SYSEX_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    pAck->Sequence = m_nSequence;
+    pAck->Writes = m_Stream.GetWrites () < SYSEX_VALUE_MAX ? m_Stream.GetWrites () : SYSEX_VALUE_MAX;
+    pAck->Credits = 0;
+    switch (m_nCommand)
+    {
+    case SysExCmdWrite:
+        pAck->Status = m_Stream.End ();
+        break;
+    case SysExCmdQuery:
+        pAck->Status = RegisterStreamOK;
+        break;
+    default:
+        pAck->Status = RegisterStreamBadCommand;
+        break;
+    }
+
+    m_nMessages++;
+    if (pAck->Status != RegisterStreamOK)
+    {
+        m_nErrors++;
+    }
+    m_bOurs = false;
+    return true;
+}
+
+void CSysExStream::Abort (void)
+{
+    if (m_bOurs)
+    {
+        m_nMessages++;
+        m_nErrors++;
+    }
+    m_bOurs = false;
+}
+
+unsigned CSysExStream::Encode (TSysExCommand eCommand, u8 nSequence, const u8 *pStream, unsigned nLength, u8 *pOut)
+{
+    u8 *p = pOut;
+    *p++ = MIDI_STATUS_SYSEX;
+    *p++ = SYSEX_ID_NONCOMMERCIAL;
+    *p++ = SYSEX_ID_SPINDASH;
+    *p++ = eCommand;
+    *p++ = nSequence & 0x7f;
+
+    for (unsigned i = 0; i < nLength; i += 7)
+    {
+        unsigned nGroup = nLength - i < 7 ? nLength - i : 7;
+        u8 *pMSBs = p++;
+        *pMSBs = 0;
+        for (unsigned j = 0; j < nGroup; j++)
+        {
+            *pMSBs |= (pStream[i + j] >> 7) << j;
+            *p++ = pStream[i + j] & 0x7f;
+        }
+    }
+
+    *p++ = MIDI_STATUS_SYSEX_END;
+    return p - pOut;
+}
+
+unsigned CSysExStream::EncodeAck (const TSysExAck &ack, u8 *pOut)
+{
+    pOut[0] = MIDI_STATUS_SYSEX;
+    pOut[1] = SYSEX_ID_NONCOMMERCIAL;
+    pOut[2] = SYSEX_ID_SPINDASH;
+    pOut[3] = SysExCmdAck;
+    pOut[4] = ack.Sequence & 0x7f;
+    pOut[5] = ack.Status;
+    pOut[6] = ack.Writes & 0x7f;
+    pOut[7] = ack.Writes >> 7 & 0x7f;
+    pOut[8] = ack.Credits & 0x7f;
+    pOut[9] = ack.Credits >> 7 & 0x7f;
+    pOut[10] = MIDI_STATUS_SYSEX_END;
+    return SYSEX_ACK_SIZE;
+}
+
+bool CSysExStream::DecodeAck (const u8 *pData, unsigned nLength, TSysExAck *pAck)
+{
+    if (   nLength != SYSEX_ACK_SIZE
+        || pData[0] != MIDI_STATUS_SYSEX
+        || pData[1] != SYSEX_ID_NONCOMMERCIAL
+        || pData[2] != SYSEX_ID_SPINDASH
+        || pData[3] != SysExCmdAck
+        || pData[10] != MIDI_STATUS_SYSEX_END)
+    {
+        return false;
+    }
+
+    pAck->Sequence = pData[4];
+    pAck->Status = (TRegisterStreamStatus) pData[5];
+    pAck->Writes = pData[6] | pData[7] << 7;
+    pAck->Credits = pData[8] | pData[9] << 7;
+    return true;
+}
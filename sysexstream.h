@@ -0,0 +1,142 @@
+//
+// sysexstream.h
+//
+// Register streams from a host tracker over USB MIDI, as SysEx:
+//
+//   F0 7D 53 cmd seq payload... F7
+//
+// 7D is the non-commercial manufacturer ID, 53 ('S') picks this device out
+// of anything else using it; seq is a 7-bit sequence number the reply
+// repeats. Commands:
+//
+//   SysExCmdWrite  payload is a register stream (see regstream.h), 7-bit
+//                  packed: each group of up to seven stream bytes goes out
+//                  as one byte holding their top bits (bit i for byte i)
+//                  followed by the seven with the top bit cleared; the host
+//                  times the messages, so the stream has no waits
+//   SysExCmdQuery  no payload; only asks for a reply
+//   SysExCmdAck    the reply, device to host:
+//                  seq status writes(2) credits(2)
+//                  14-bit values low 7 bits first; status is a
+//                  TRegisterStreamStatus, writes is how many writes of the
+//                  message were taken, credits how many more the device can
+//                  take right now
+//
+// Every message for this device gets a reply, once it has been decoded.
+// Credits count writes the device has free room for after that message, and
+// are 0 while any chip's queue is past its overload watermark. A host that
+// keeps whatever it sent after the last reply within the credits that reply
+// gave never runs the device out of room. Writes that reach an overloaded
+// chip anyway are refused, since a message can't be held the way a serial
+// frame is; the reply then says RegisterStreamOverflow, and writes counts
+// only those taken. Credits only
+// come with replies, so a host that is short of them with nothing
+// outstanding sends a query. A message's writes are published together at
+// the F7, so long messages wait longer before they play; a few hundred
+// writes per message keeps USB busy without adding much latency.
+//
+// The writes are unpacked and decoded as the bytes come in, straight into
+// the register stream's handler.
+//
+#ifndef _sysexstream_h
+#define _sysexstream_h
+
+#include "spinbus.h"
+#include "regstream.h"
+
+#define SYSEX_ID_NONCOMMERCIAL  0x7d
+#define SYSEX_ID_SPINDASH       0x53
+#define SYSEX_HEADER_SIZE       4           // after F0: manufacturer, device, command, sequence
+#define SYSEX_ACK_SIZE          11          // F0 through F7
+#define SYSEX_VALUE_MAX         0x3fff      // largest 14-bit value in a reply
+
+enum TSysExCommand : u8
+{
+    SysExCmdWrite = 0x01,
+    SysExCmdAck   = 0x02,
+    SysExCmdQuery = 0x03
+};
+
+struct TSysExAck
+{
+    u8 Sequence;
+    TRegisterStreamStatus Status;
+    u16 Writes;
+    u16 Credits;
+};
+
+class CSysExStream
+{
+public:
+    CSysExStream (TRegisterWriteHandler *pHandler, void *pParam);
+
+    /// @brief F0 came in.
+    void Start (void);
+    /// @brief Data bytes of the message, any number at a time.
+    void Data (const u8 *pData, unsigned nLength)
+    {
+        for (const u8 *pEnd = pData + nLength; pData < pEnd; pData++)
+        {
+            if (m_nHeader < SYSEX_HEADER_SIZE)
+            {
+                Header (*pData);
+                continue;
+            }
+            if (m_nCommand != SysExCmdWrite)
+            {
+                return;
+            }
+            if (!m_nGroup)
+            {
+                m_nMSBs = *pData;
+                m_nGroup = 7;
+                continue;
+            }
+            m_Stream.Put (*pData | (m_nMSBs & 1) << 7);
+            m_nMSBs >>= 1;
+            m_nGroup--;
+        }
+    }
+    /// @brief F7 came in.
+    /// @return true if the message was for this device; *pAck is the reply, except Credits.
+    bool End (TSysExAck *pAck);
+    /// @brief The message was cut short; what it held is of no use.
+    void Abort (void);
+
+    /// @return messages for this device so far.
+    unsigned GetMessages (void) const { return m_nMessages; }
+    /// @return those that ended with something other than RegisterStreamOK.
+    unsigned GetErrors (void) const { return m_nErrors; }
+    /// @return writes of the current message the handler had no room for.
+    unsigned GetDropped (void) const { return m_Stream.GetDropped (); }
+
+    /// @brief Builds a message (host side).
+    /// @param pOut room for EncodedSize (nLength) bytes.
+    /// @return bytes written, F0 through F7.
+    static unsigned Encode (TSysExCommand eCommand, u8 nSequence, const u8 *pStream, unsigned nLength, u8 *pOut);
+    static unsigned EncodedSize (unsigned nLength) { return 2 + SYSEX_HEADER_SIZE + nLength + (nLength + 6) / 7; }
+
+    /// @param pOut room for SYSEX_ACK_SIZE bytes.
+    /// @return bytes written.
+    static unsigned EncodeAck (const TSysExAck &ack, u8 *pOut);
+    /// @brief Reads a reply (host side).
+    /// @return false if it isn't one.
+    static bool DecodeAck (const u8 *pData, unsigned nLength, TSysExAck *pAck);
+
+private:
+    void Header (u8 nByte);
+
+    CRegisterStream m_Stream;
+
+    u8 m_nHeader;       // header bytes seen
+    bool m_bOurs;
+    u8 m_nCommand;      // 0 while not (yet) known to be ours
+    u8 m_nSequence;
+    u8 m_nMSBs;         // top bits of the rest of the current group
+    u8 m_nGroup;        // bytes left in the current group
+
+    unsigned m_nMessages;
+    unsigned m_nErrors;
+};
+
+#endif
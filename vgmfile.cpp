@@ -0,0 +1,97 @@
+//
+// vgmfile.cpp
+//
+#include "vgmfile.h"
+
+#ifdef SPINDASH_HOST
+
+CVGMFile::CVGMFile (void)
+:   m_pFile (0)
+{
+}
+
+CVGMFile::~CVGMFile (void)
+{
+    Close ();
+}
+
+bool CVGMFile::Open (const char *pPath)
+{
+    Close ();
+    m_pFile = fopen (pPath, "rb");
+    return m_pFile != 0;
+}
+
+void CVGMFile::Close (void)
+{
+    if (m_pFile != 0)
+    {
+        fclose (m_pFile);
+        m_pFile = 0;
+    }
+}
+
+bool CVGMFile::IsOpen (void) const
+{
+    return m_pFile != 0;
+}
+
+unsigned CVGMFile::Read (void *pBuffer, unsigned nCount)
+{
+    if (m_pFile == 0)
+        return 0;
+    return fread (pBuffer, 1, nCount, m_pFile);
+}
+
+bool CVGMFile::Seek (u32 nOffset)
+{
+    return m_pFile != 0 && fseek (m_pFile, nOffset, SEEK_SET) == 0;
+}
+
+#else
+
+CVGMFile::CVGMFile (void)
+:   m_bOpen (false)
+{
+}
+
+CVGMFile::~CVGMFile (void)
+{
+    Close ();
+}
+
+bool CVGMFile::Open (const char *pPath)
+{
+    Close ();
+    m_bOpen = f_open (&m_File, pPath, FA_READ | FA_OPEN_EXISTING) == FR_OK;
+    return m_bOpen;
+}
+
+void CVGMFile::Close (void)
+{
+    if (m_bOpen)
+    {
+        f_close (&m_File);
+        m_bOpen = false;
+    }
+}
+
+bool CVGMFile::IsOpen (void) const
+{
+    return m_bOpen;
+}
+
+unsigned CVGMFile::Read (void *pBuffer, unsigned nCount)
+{
+    UINT nRead = 0;
+    if (!m_bOpen || f_read (&m_File, pBuffer, nCount, &nRead) != FR_OK)
+        return 0;
+    return nRead;
+}
+
+bool CVGMFile::Seek (u32 nOffset)
+{
+    return m_bOpen && f_lseek (&m_File, nOffset) == FR_OK;
+}
+
+#endif
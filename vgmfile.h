@@ -0,0 +1,40 @@
+//
+// vgmfile.h
+//
+// VGM byte source backed by a file: FatFs on the SD card, or stdio when built
+// natively with -DSPINDASH_HOST.
+//
+#ifndef _vgmfile_h
+#define _vgmfile_h
+
+#include "vgmplayer.h"
+
+#ifdef SPINDASH_HOST
+#include <stdio.h>
+#else
+#include <fatfs/ff.h>
+#endif
+
+class CVGMFile : public CVGMSource
+{
+public:
+    CVGMFile (void);
+    ~CVGMFile (void);
+
+    bool Open (const char *pPath);
+    void Close (void);
+    bool IsOpen (void) const;
+
+    unsigned Read (void *pBuffer, unsigned nCount) override;
+    bool Seek (u32 nOffset) override;
+
+private:
+#ifdef SPINDASH_HOST
+    FILE   *m_pFile;
+#else
+    FIL     m_File;
+    bool    m_bOpen;
+#endif
+};
+
+#endif
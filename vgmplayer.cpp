@@ -0,0 +1,407 @@
+//
+// vgmplayer.cpp
+//
+// VGM format reference: https://vgmrips.net/wiki/VGM_Specification
+//
+#include "vgmplayer.h"
+#include <string.h>
+
+#define VGM_HEADER_SIZE     0x100
+
+static u32 GetLE32 (const u8 *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (u32) p[3] << 24;
+}
+
+/// @return operand bytes of a command the player doesn't act on, or -1 if unknown.
+static int SkipLength (u8 nCommand)
+{
+    if (nCommand >= 0x30 && nCommand <= 0x3f)
+        return 1;
+    if (nCommand == 0x4f || nCommand == 0x50)   // Game Gear stereo, SN76489
+        return 1;
+    if (nCommand >= 0x40 && nCommand <= 0x5f)   // other chips' register writes
+        return 2;
+    if (nCommand >= 0xa0 && nCommand <= 0xbf)
+        return 2;
+    if (nCommand >= 0xc0 && nCommand <= 0xdf)
+        return 3;
+    if (nCommand >= 0xe1)
+        return 4;
+
+    switch (nCommand)
+    {
+    case 0x68:  return 11;  // PCM RAM write
+    case 0x90:  return 4;   // DAC stream control
+    case 0x91:  return 4;
+    case 0x92:  return 5;
+    case 0x93:  return 10;
+    case 0x94:  return 1;
+    case 0x95:  return 4;
+    default:    return -1;
+    }
+}
+
+CVGMPlayer::CVGMPlayer (TVGMWriteHandler *pHandler, void *pParam)
+:   m_pHandler (pHandler),
+    m_pParam (pParam),
+    m_pSource (0),
+    m_bPlaying (false),
+    m_bParsed (true),
+    m_nLoops (0),
+    m_nClock (0),
+    m_nDataOffset (0),
+    m_nLoopOffset (0),
+    m_nStart (0),
+    m_nSamples (0),
+    m_nActive (0),
+    m_nPos (0),
+    m_bSpareReady (false),
+    m_pPCM (0),
+    m_nPCMSize (0),
+    m_nPCMPos (0),
+    m_nBlockLeft (0),
+    m_bBlockPCM (false)
+{
+    memset (m_ChipMask, 0, sizeof m_ChipMask);
+    m_nFill[0] = m_nFill[1] = 0;
+}
+
+CVGMPlayer::~CVGMPlayer (void)
+{
+    delete [] m_pPCM;
+}
+
+bool CVGMPlayer::Start (CVGMSource *pSource, const u32 *pChipMask, u64 nNow, unsigned nLoops)
+{
+    Stop ();
+
+    m_pSource = pSource;
+    memcpy (m_ChipMask, pChipMask, sizeof m_ChipMask);
+    m_nLoops = nLoops;
+    m_Stats = TVGMStats ();
+    m_nPCMSize = 0;
+    m_nPCMPos = 0;
+    m_nBlockLeft = 0;
+
+    if (!ReadHeader () || !SeekData (m_nDataOffset))
+        return false;
+
+    m_nStart = nNow;
+    m_nSamples = 0;
+    m_bParsed = false;
+    m_bPlaying = true;
+    return true;
+}
+
+void CVGMPlayer::Stop (void)
+{
+    m_bPlaying = false;
+    m_bParsed = true;
+    m_Writes.clear ();
+}
+
+void CVGMPlayer::Fill (u64 nNow)
+{
+    if (!m_bPlaying)
+        return;
+
+    if (!m_bSpareReady)
+        LoadSpare (false);
+
+    if (!m_bParsed && m_nBlockLeft)
+    {
+        if (!TakeBlock (VGM_BLOCK_CHUNK))
+            m_bParsed = true;
+    }
+
+    // the song starts on the first Fill with nothing left to load ahead of it:
+    // not before Start's own reads, nor before the data blocks ahead of the first wait
+    if (m_nSamples == 0 && m_Writes.empty ())
+        m_nStart = nNow;
+
+    while (   !m_bParsed
+           && !m_nBlockLeft
+           && !m_Writes.full ()
+           && SongTime () <= nNow + VGM_LOOKAHEAD_US)
+    {
+        if (!ParseCommand ())
+            m_bParsed = true;
+    }
+}
+
+unsigned CVGMPlayer::Update (u64 nNow)
+{
+    unsigned nCount = 0;
+    while (!m_Writes.empty () && m_Writes.front ().Due <= nNow)
+    {
+        TWrite &write = m_Writes.front ();
+
+        u64 nLate = nNow - write.Due;
+        if (nLate > VGM_DEADLINE_US)
+            m_Stats.Misses++;
+        if (nLate > m_Stats.MaxLateness)
+            m_Stats.MaxLateness = nLate > 0xffffffff ? 0xffffffff : (u32) nLate;
+
+        if (m_ChipMask[write.Chip] != 0)
+        {
+            (*m_pHandler) (m_pParam, m_ChipMask[write.Chip], write.Bank, write.Address, write.Data);
+            m_Stats.Writes++;
+            nCount++;
+        }
+        m_Writes.pop ();
+    }
+
+    if (   m_bParsed && m_Writes.empty ()
+        && nNow >= SongTime ())
+    {
+        m_bPlaying = false;
+    }
+
+    return nCount;
+}
+
+u64 CVGMPlayer::GetNextDue (void) const
+{
+    if (m_Writes.empty ())
+        return 0;
+    return m_Writes.front ().Due;
+}
+
+bool CVGMPlayer::ReadHeader (void)
+{
+    u8 header[VGM_HEADER_SIZE];
+    memset (header, 0, sizeof header);
+    if (!m_pSource->Seek (0) || m_pSource->Read (header, sizeof header) < 0x40)
+        return false;
+    if (memcmp (header, "Vgm ", 4) != 0)
+        return false;
+
+    u32 nVersion = GetLE32 (header + 0x08);
+
+    // before 1.10 the YM2612 shared the YM2413 clock field
+    m_nClock = GetLE32 (header + (nVersion < 0x110 ? 0x10 : 0x2c)) & 0x3fffffff;
+
+    u32 nLoop = GetLE32 (header + 0x1c);
+    m_nLoopOffset = nLoop ? 0x1c + nLoop : 0;
+
+    u32 nData = nVersion >= 0x150 ? GetLE32 (header + 0x34) : 0;
+    m_nDataOffset = nData ? 0x34 + nData : 0x40;
+
+    return true;
+}
+
+/// @return false at the end of the data (after the last loop), or on a command the player can't size.
+bool CVGMPlayer::ParseCommand (void)
+{
+    u8 nCommand;
+    if (!GetByte (&nCommand))
+        return false;
+
+    u8 nAddress, nData;
+    u16 nWait;
+    switch (nCommand)
+    {
+    case 0x52:  // YM2612 port 0 / 1
+    case 0x53:
+    case 0xa2:  // second YM2612 port 0 / 1
+    case 0xa3:
+        if (!GetByte (&nAddress) || !GetByte (&nData))
+            return false;
+        QueueWrite (nCommand >= 0xa0, nCommand & 1, nAddress, nData);
+        return true;
+
+    case 0x61:
+        if (!GetWord (&nWait))
+            return false;
+        Wait (nWait);
+        return true;
+
+    case 0x62:
+        Wait (735);     // 1/60 s
+        return true;
+
+    case 0x63:
+        Wait (882);     // 1/50 s
+        return true;
+
+    case 0x66:
+        if (m_nLoopOffset == 0 || m_Stats.Loops >= m_nLoops)
+            return false;
+        m_Stats.Loops++;
+        return SeekData (m_nLoopOffset);
+
+    case 0x67: {
+        u8 nCompat, nType;
+        u32 nSize;
+        if (!GetByte (&nCompat) || !GetByte (&nType) || !GetLong (&nSize))
+            return false;
+        // Fill takes the block in from here on
+        m_nBlockLeft = nSize & 0x7fffffff;
+        m_bBlockPCM = nType == 0x00;    // only uncompressed YM2612 PCM is used
+        if (!m_bBlockPCM)
+            m_Stats.Skipped++;
+        else if (m_pPCM == 0)
+            m_pPCM = new u8[VGM_PCM_LIMIT];
+        return true;
+    }
+
+    case 0xe0:
+        return GetLong (&m_nPCMPos);
+
+    default:
+        break;
+    }
+
+    switch (nCommand & 0xf0)
+    {
+    case 0x70:
+        Wait ((nCommand & 0x0f) + 1);
+        return true;
+
+    case 0x80: {
+        // DAC write from the data block, then wait
+        u8 nSample = m_nPCMPos < m_nPCMSize ? m_pPCM[m_nPCMPos] : 0x80;
+        m_nPCMPos++;
+        QueueWrite (0, 0, 0x2a, nSample);
+        Wait (nCommand & 0x0f);
+        return true;
+    }
+
+    default:
+        break;
+    }
+
+    int nSkip = SkipLength (nCommand);
+    if (nSkip < 0)
+        return false;
+    m_Stats.Skipped++;
+    return Skip (nSkip);
+}
+
+void CVGMPlayer::QueueWrite (u8 nChip, bool bBank, u8 nAddress, u8 nData)
+{
+    m_Writes.push ({SongTime (), nChip, bBank, nAddress, nData});
+}
+
+/// @return the tick the parse position falls on.
+u64 CVGMPlayer::SongTime (void) const
+{
+    return m_nStart + m_nSamples * 1000000 / VGM_SAMPLE_RATE;
+}
+
+void CVGMPlayer::Wait (u32 nSamples)
+{
+    m_nSamples += nSamples;
+}
+
+bool CVGMPlayer::Skip (u32 nCount)
+{
+    u8 nByte;
+    while (nCount-- > 0)
+    {
+        if (!GetByte (&nByte))
+            return false;
+    }
+    return true;
+}
+
+/// @brief Copies up to nMax bytes of the current data block into the DAC data, or skips them.
+/// @return false if the file ends inside the block.
+bool CVGMPlayer::TakeBlock (u32 nMax)
+{
+    while (nMax > 0 && m_nBlockLeft > 0)
+    {
+        if (m_nPos == m_nFill[m_nActive] && !NextBuffer ())
+            return false;
+        u32 nCount = m_nFill[m_nActive] - m_nPos;
+        if (nCount > m_nBlockLeft)
+            nCount = m_nBlockLeft;
+        if (nCount > nMax)
+            nCount = nMax;
+
+        if (m_bBlockPCM && m_pPCM != 0)
+        {
+            u32 nKeep = VGM_PCM_LIMIT - m_nPCMSize < nCount ? VGM_PCM_LIMIT - m_nPCMSize : nCount;
+            memcpy (m_pPCM + m_nPCMSize, &m_Buffer[m_nActive][m_nPos], nKeep);
+            m_nPCMSize += nKeep;
+        }
+        m_nPos += nCount;
+        m_nBlockLeft -= nCount;
+        nMax -= nCount;
+    }
+    return true;
+}
+
+/// @brief Switches to the spare buffer once the active one is used up.
+/// @return false at the end of the file.
+bool CVGMPlayer::NextBuffer (void)
+{
+    // Fill normally has the spare buffer loaded before the parser gets here
+    if (!m_bSpareReady)
+    {
+        m_Stats.Underruns++;
+        LoadSpare (true);
+    }
+    if (m_nFill[m_nActive ^ 1] == 0)
+        return false;
+    m_nActive ^= 1;
+    m_nPos = 0;
+    m_nFill[m_nActive ^ 1] = 0;
+    m_bSpareReady = false;
+    return true;
+}
+
+bool CVGMPlayer::GetByte (u8 *pByte)
+{
+    if (m_nPos == m_nFill[m_nActive] && !NextBuffer ())
+        return false;
+    *pByte = m_Buffer[m_nActive][m_nPos++];
+    return true;
+}
+
+bool CVGMPlayer::GetWord (u16 *pWord)
+{
+    u8 nLow, nHigh;
+    if (!GetByte (&nLow) || !GetByte (&nHigh))
+        return false;
+    *pWord = nLow | nHigh << 8;
+    return true;
+}
+
+bool CVGMPlayer::GetLong (u32 *pLong)
+{
+    u16 nLow, nHigh;
+    if (!GetWord (&nLow) || !GetWord (&nHigh))
+        return false;
+    *pLong = nLow | (u32) nHigh << 16;
+    return true;
+}
+
+/// @brief Reads the next VGM_READ_CHUNK bytes of the spare buffer, or the rest of it with bWhole.
+void CVGMPlayer::LoadSpare (bool bWhole)
+{
+    unsigned nSpare = m_nActive ^ 1;
+    do
+    {
+        unsigned nCount = VGM_BUFFER_SIZE - m_nFill[nSpare];
+        if (!bWhole && nCount > VGM_READ_CHUNK)
+            nCount = VGM_READ_CHUNK;
+        unsigned nRead = m_pSource->Read (&m_Buffer[nSpare][m_nFill[nSpare]], nCount);
+        m_nFill[nSpare] += nRead;
+        // a short read is the end of the file
+        m_bSpareReady = nRead < nCount || m_nFill[nSpare] == VGM_BUFFER_SIZE;
+    } while (bWhole && !m_bSpareReady);
+}
+
+bool CVGMPlayer::SeekData (u32 nOffset)
+{
+    if (!m_pSource->Seek (nOffset))
+        return false;
+    m_nFill[m_nActive] = m_pSource->Read (m_Buffer[m_nActive], VGM_BUFFER_SIZE);
+    m_nPos = 0;
+    // Fill loads the spare from here
+    m_nFill[m_nActive ^ 1] = 0;
+    m_bSpareReady = false;
+    return m_nFill[m_nActive] > 0;
+}
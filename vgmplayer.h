@@ -0,0 +1,157 @@
+//
+// vgmplayer.h
+//
+// Streams YM2612 writes from a VGM file onto chips of the Spinbus array.
+//
+// Fill () tops up the reader's spare buffer and parses ahead into a ring of
+// timestamped writes, up to VGM_LOOKAHEAD_US past now; Update () hands each
+// write to the write handler once its time has come. The lookahead covers
+// the parse and data blocks, which are taken in VGM_BLOCK_CHUNK bytes per
+// Fill; those before the first wait hold back the start of the song until
+// they are in.
+//
+// The file reads are synchronous and run in Fill, on the caller's loop, so
+// nothing is handed out while one is in progress. To keep that stall short,
+// Fill reads the spare buffer in VGM_READ_CHUNK bytes (one SD sector) per
+// call rather than whole; only an underrun, where the parser catches up with
+// a spare buffer that isn't complete yet, and the seek at a loop point read a
+// whole buffer at once.
+//
+// Time is CTimer clock ticks (1 MHz), passed in by the caller, so the player
+// can run against the simulated bus on the host.
+//
+#ifndef _vgmplayer_h
+#define _vgmplayer_h
+
+#include "spinbus.h"
+#include "ringbuffer.h"
+
+#define VGM_SAMPLE_RATE     44100       // VGM wait unit
+#define VGM_BUFFER_SIZE     4096        // bytes per reader buffer, two of them
+#define VGM_WRITE_AHEAD     4096        // parsed writes waiting for their time
+#define VGM_LOOKAHEAD_US    20000
+#define VGM_DEADLINE_US     23          // about one VGM sample; later than this counts as a miss
+#define VGM_PCM_LIMIT       (1024*1024) // YM2612 DAC data kept from data blocks
+#define VGM_READ_CHUNK      512         // spare buffer bytes read per Fill
+#define VGM_BLOCK_CHUNK     VGM_READ_CHUNK  // data block bytes taken in per Fill, as many as are read
+#define VGM_CHIPS           2           // YM2612s a VGM file can address (dual chip bit)
+
+/// @brief Sequential byte source for CVGMPlayer.
+class CVGMSource
+{
+public:
+    virtual ~CVGMSource (void) {}
+
+    /// @return number of bytes read, 0 at the end of the file.
+    virtual unsigned Read (void *pBuffer, unsigned nCount) = 0;
+    /// @brief Moves the read position to an absolute file offset.
+    virtual bool Seek (u32 nOffset) = 0;
+};
+
+/// @brief Receives a write once it is due.
+/// @param nChipMask Spinbus chips the write goes to, bit N = chip N.
+typedef void TVGMWriteHandler (void *pParam, u32 nChipMask, bool bBank, u8 nAddress, u8 nData);
+
+struct TVGMStats
+{
+    u32 Writes = 0;
+    u32 Misses = 0;         // writes handed out more than VGM_DEADLINE_US late
+    u32 MaxLateness = 0;    // ticks
+    u32 Underruns = 0;      // buffer switches the spare buffer wasn't complete for
+    u32 Loops = 0;
+    u32 Skipped = 0;        // commands for other chips, and unsupported data
+};
+
+class CVGMPlayer
+{
+public:
+    CVGMPlayer (TVGMWriteHandler *pHandler, void *pParam);
+    ~CVGMPlayer (void);
+
+    /// @brief Reads the header and starts playback at nNow.
+    /// @param pChipMask Spinbus chips each of the file's YM2612s is played on (VGM_CHIPS entries).
+    /// Several chips in one mask play that YM2612 in unison.
+    /// @param nLoops how many times to repeat the looped section; 0 plays the file once.
+    /// @return false if the source isn't a VGM file.
+    bool Start (CVGMSource *pSource, const u32 *pChipMask, u64 nNow, unsigned nLoops = 0);
+    void Stop (void);
+    bool IsPlaying (void) const { return m_bPlaying; }
+
+    /// @brief Refills the reader and parses ahead. Call often; it returns quickly when nothing is needed.
+    void Fill (u64 nNow);
+
+    /// @brief Hands every write due by nNow to the handler.
+    /// @return number of writes handed out.
+    unsigned Update (u64 nNow);
+
+    /// @return the time the next parsed write is due, or 0 if none is waiting.
+    u64 GetNextDue (void) const;
+
+    const TVGMStats &GetStats (void) const { return m_Stats; }
+    u32 GetYM2612Clock (void) const { return m_nClock; }
+
+private:
+    struct TWrite
+    {
+        u64 Due;
+        u8  Chip;       // YM2612 index within the file
+        bool Bank;
+        u8  Address;
+        u8  Data;
+    };
+
+    bool ReadHeader (void);
+    bool ParseCommand (void);
+    void QueueWrite (u8 nChip, bool bBank, u8 nAddress, u8 nData);
+    u64 SongTime (void) const;
+    void Wait (u32 nSamples);
+    bool Skip (u32 nCount);
+    bool TakeBlock (u32 nMax);
+
+    bool NextBuffer (void);
+    bool GetByte (u8 *pByte);
+    bool GetWord (u16 *pWord);
+    bool GetLong (u32 *pLong);
+    void LoadSpare (bool bWhole);
+    bool SeekData (u32 nOffset);
+
+    TVGMWriteHandler *m_pHandler;
+    void *m_pParam;
+    CVGMSource *m_pSource;
+
+    u32  m_ChipMask[VGM_CHIPS];
+    bool m_bPlaying;
+    bool m_bParsed;     // end of data reached, nothing more to parse
+    unsigned m_nLoops;
+
+    // header
+    u32  m_nClock;
+    u32  m_nDataOffset;
+    u32  m_nLoopOffset;
+
+    // song position: samples since Start, and the tick sample 0 fell on
+    u64  m_nStart;
+    u64  m_nSamples;
+
+    // two buffers: the parser reads the active one while Fill loads the spare
+    u8   m_Buffer[2][VGM_BUFFER_SIZE];
+    unsigned m_nFill[2];
+    unsigned m_nActive;
+    unsigned m_nPos;
+    bool m_bSpareReady;
+
+    // YM2612 DAC data from 0x67 data blocks
+    u8  *m_pPCM;
+    u32  m_nPCMSize;
+    u32  m_nPCMPos;
+    // what is left of the data block being read, taken a chunk per Fill so a
+    // block of a megabyte doesn't hold up the caller's loop
+    u32  m_nBlockLeft;
+    bool m_bBlockPCM;   // keep it as DAC data, else skip it
+
+    CRingBuffer<TWrite, VGM_WRITE_AHEAD> m_Writes;
+
+    TVGMStats m_Stats;
+};
+
+#endif
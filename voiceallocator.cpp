@@ -0,0 +1,170 @@
+//
+// voiceallocator.cpp
+//
+#include "voiceallocator.h"
+#include <assert.h>
+
+CVoiceAllocator::CVoiceAllocator (void)
+{
+    Reset (1, 1);
+}
+
+void CVoiceAllocator::Reset (unsigned nGroups, unsigned nPerGroup)
+{
+    m_nVoices = nGroups * nPerGroup;
+    m_nPerGroup = nPerGroup;
+    assert (m_nVoices <= VOICE_LIMIT);
+    m_nActive = 0;
+
+    m_Free = { VOICE_NONE, VOICE_NONE };
+    m_Active = { VOICE_NONE, VOICE_NONE };
+    for (unsigned i = 0; i < VOICE_PATCH_LISTS; i++)
+        m_PatchFree[i] = { VOICE_NONE, VOICE_NONE };
+    for (unsigned i = 0; i < VOICE_KEYS; i++) {
+        m_KeyVoice[i] = VOICE_NONE;
+        m_LastVoice[i] = VOICE_NONE;
+    }
+
+    for (unsigned i = 0; i < m_nVoices; i++) {
+        u16 voice = (i % nGroups) * nPerGroup + i / nGroups;
+        m_Key[voice] = VOICE_KEY_NONE;
+        m_Patch[voice] = PATCH_NONE;
+        Append (m_Free, LinkMain, voice);
+        Append (PatchList (PATCH_NONE), LinkPatch, voice);
+    }
+}
+
+TVoiceAllocation CVoiceAllocator::NoteOn (u8 key, u8 patch, u32 avoidGroups, bool steal)
+{
+    assert (key < VOICE_KEYS);
+    TVoiceAllocation result = { VOICE_NONE, false, false, VOICE_KEY_NONE };
+
+    u16 voice = m_KeyVoice[key];
+    if (voice != VOICE_NONE) {
+        // already sounding: retrigger in place, and count it as the newest note
+        result.Voice = voice;
+        result.Retrigger = true;
+        Remove (m_Active, LinkMain, voice);
+        Append (m_Active, LinkMain, voice);
+        return result;
+    }
+
+    // the voice this key used last, if it is free and still holds the patch
+    voice = m_LastVoice[key];
+    if (voice == VOICE_NONE || m_Key[voice] != VOICE_KEY_NONE || m_Patch[voice] != patch || Avoided (voice, avoidGroups)) {
+        voice = VOICE_NONE;
+        // any free voice with the patch loaded
+        if (patch < VOICE_PATCH_LISTS - 1)
+            voice = First (PatchList (patch).Head, LinkPatch, avoidGroups);
+        // the free voice released longest ago
+        if (voice == VOICE_NONE)
+            voice = First (m_Free.Head, LinkMain, avoidGroups);
+        // only free voices in avoided groups left
+        if (voice == VOICE_NONE && !steal)
+            voice = m_Free.Head;
+    }
+
+    if (voice == VOICE_NONE) {
+        // nothing free (outside the avoided groups, if stealing): steal the oldest sounding voice
+        voice = First (m_Active.Head, LinkMain, avoidGroups);
+        if (voice == VOICE_NONE)
+            voice = m_Free.Head;
+    }
+    if (voice == VOICE_NONE) {
+        // every voice is sounding, and all of them in avoided groups
+        voice = m_Active.Head;
+        assert (voice != VOICE_NONE);
+    }
+    if (m_Key[voice] != VOICE_KEY_NONE) {
+        result.Stolen = true;
+        result.StolenKey = m_Key[voice];
+        Release (voice);
+    }
+
+    Activate (voice, key);
+    result.Voice = voice;
+    return result;
+}
+
+u16 CVoiceAllocator::NoteOff (u8 key)
+{
+    assert (key < VOICE_KEYS);
+
+    u16 voice = m_KeyVoice[key];
+    if (voice != VOICE_NONE)
+        Release (voice);
+    return voice;
+}
+
+void CVoiceAllocator::SetPatch (u16 voice, u8 patch)
+{
+    assert (voice < m_nVoices);
+    if (m_Patch[voice] == patch)
+        return;
+    // a free voice moves to the back of the new patch's list
+    if (m_Key[voice] == VOICE_KEY_NONE) {
+        Remove (PatchList (m_Patch[voice]), LinkPatch, voice);
+        Append (PatchList (patch), LinkPatch, voice);
+    }
+    m_Patch[voice] = patch;
+}
+
+u16 CVoiceAllocator::First (u16 voice, TLink link, u32 avoidGroups) const
+{
+    if (!avoidGroups)
+        return voice;
+    while (voice != VOICE_NONE && Avoided (voice, avoidGroups))
+        voice = m_Next[link][voice];
+    return voice;
+}
+
+void CVoiceAllocator::Activate (u16 voice, u8 key)
+{
+    Remove (m_Free, LinkMain, voice);
+    Remove (PatchList (m_Patch[voice]), LinkPatch, voice);
+    Append (m_Active, LinkMain, voice);
+
+    m_Key[voice] = key;
+    m_KeyVoice[key] = voice;
+    m_LastVoice[key] = voice;
+    m_nActive++;
+}
+
+void CVoiceAllocator::Release (u16 voice)
+{
+    u8 key = m_Key[voice];
+    assert (key != VOICE_KEY_NONE);
+
+    Remove (m_Active, LinkMain, voice);
+    Append (m_Free, LinkMain, voice);
+    Append (PatchList (m_Patch[voice]), LinkPatch, voice);
+
+    m_Key[voice] = VOICE_KEY_NONE;
+    m_KeyVoice[key] = VOICE_NONE;
+    m_nActive--;
+}
+
+void CVoiceAllocator::Append (TList &list, TLink link, u16 voice)
+{
+    m_Prev[link][voice] = list.Tail;
+    m_Next[link][voice] = VOICE_NONE;
+    if (list.Tail != VOICE_NONE)
+        m_Next[link][list.Tail] = voice;
+    else
+        list.Head = voice;
+    list.Tail = voice;
+}
+
+void CVoiceAllocator::Remove (TList &list, TLink link, u16 voice)
+{
+    u16 prev = m_Prev[link][voice];
+    u16 next = m_Next[link][voice];
+    if (prev != VOICE_NONE)
+        m_Next[link][prev] = next;
+    else
+        list.Head = next;
+    if (next != VOICE_NONE)
+        m_Prev[link][next] = prev;
+    else
+        list.Tail = prev;
+}
@@ -0,0 +1,104 @@
+//
+// voiceallocator.h
+//
+// Constant-time voice allocation over all YM channels.
+//
+// Free voices sit on a FIFO (oldest released first) and also on a list per
+// loaded patch, so a voice that already holds the requested patch can be
+// found without a scan. Sounding voices sit on an LRU list; when nothing is
+// free the oldest one is stolen.
+//
+// Under overload, NoteOn () can be told to keep off some groups (chips). That
+// walks the lists past the voices of those groups, so it is no longer
+// constant time, but it is bounded by the voice count and only happens while
+// a chip is overloaded.
+//
+#ifndef _voiceallocator_h
+#define _voiceallocator_h
+
+#include "spinbus.h"
+#include "patches.h"
+
+#define VOICE_LIMIT         (64*YM_CHANNELS)
+#define VOICE_NONE          0xffff
+#define VOICE_KEYS          128
+#define VOICE_KEY_NONE      0xff
+#define VOICE_PATCH_LISTS   16  // patch ids from here on share the last list
+
+struct TVoiceAllocation
+{
+    u16 Voice;
+    bool Stolen;        // the voice was sounding another key, which must be keyed off
+    bool Retrigger;     // the key was already sounding on this voice
+    u8  StolenKey;
+};
+
+class CVoiceAllocator
+{
+public:
+    CVoiceAllocator (void);
+
+    /// @brief Frees every voice and forgets loaded patches.
+    /// Voices are handed out spreading across groups first (voice = group * nPerGroup + index),
+    /// so consecutive notes land on different chips.
+    void Reset (unsigned nGroups, unsigned nPerGroup);
+
+    /// @param avoidGroups groups (bit per group) new notes should keep off.
+    /// @param steal with avoidGroups set, steal the oldest sounding voice outside them before
+    /// taking a free voice inside them; otherwise a free voice anywhere comes first.
+    /// A voice in an avoided group is only used if there is no other.
+    TVoiceAllocation NoteOn (u8 key, u8 patch, u32 avoidGroups = 0, bool steal = false);
+
+    /// @return the voice the key was sounding on, or VOICE_NONE.
+    u16 NoteOff (u8 key);
+
+    /// @brief Records which patch a voice now holds.
+    /// Free voices are reused in the order their patch was set, so set patches
+    /// across groups first as well to keep consecutive notes on different chips.
+    void SetPatch (u16 voice, u8 patch);
+    u8 GetPatch (u16 voice) const { return m_Patch[voice]; }
+    u8 GetKey (u16 voice) const { return m_Key[voice]; }
+
+    unsigned GetVoiceCount (void) const { return m_nVoices; }
+    unsigned GetActiveCount (void) const { return m_nActive; }
+
+private:
+    enum TLink { LinkMain, LinkPatch, LinkCount };
+
+    struct TList
+    {
+        u16 Head;
+        u16 Tail;
+    };
+
+    void Append (TList &list, TLink link, u16 voice);
+    void Remove (TList &list, TLink link, u16 voice);
+    TList &PatchList (u8 patch) { return m_PatchFree[patch < VOICE_PATCH_LISTS ? patch : VOICE_PATCH_LISTS - 1]; }
+
+    /// @return the first voice from here on along a link outside avoidGroups, or VOICE_NONE.
+    u16 First (u16 voice, TLink link, u32 avoidGroups) const;
+    bool Avoided (u16 voice, u32 avoidGroups) const { return voice / m_nPerGroup < 32 && (avoidGroups & BIT(voice / m_nPerGroup)); }
+
+    void Activate (u16 voice, u8 key);
+    void Release (u16 voice);
+
+    unsigned m_nVoices;
+    unsigned m_nPerGroup;
+    unsigned m_nActive;
+
+    u8  m_Key[VOICE_LIMIT];         // VOICE_KEY_NONE when free
+    u8  m_Patch[VOICE_LIMIT];
+    u16 m_Prev[LinkCount][VOICE_LIMIT];
+    u16 m_Next[LinkCount][VOICE_LIMIT];
+
+    // main link: every voice is on exactly one of these
+    TList m_Free;
+    TList m_Active;
+    // patch link: free voices only
+    TList m_PatchFree[VOICE_PATCH_LISTS];
+
+    u16 m_KeyVoice[VOICE_KEYS];     // voice sounding each key
+    u16 m_LastVoice[VOICE_KEYS];    // voice that last sounded each key
+};
+
+#endif
@@ -0,0 +1,194 @@
+//
+// ymjournal.cpp
+//
+#include "ymjournal.h"
+
+/// @return true for A4-A6 and AC-AE, which only land with the next low half.
+static bool IsFnumHigh (const YMCommand &command)
+{
+    return (command.address & 0xf4) == 0xa4 && (command.address & 3) != 3;
+}
+
+static bool IsFnumLow (const YMCommand &command)
+{
+    return (command.address & 0xf4) == 0xa0 && (command.address & 3) != 3;
+}
+
+/// @return true if low is the low half that goes with high.
+static bool IsFnumPair (const YMCommand &high, const YMCommand &low)
+{
+    return IsFnumHigh (high) && low.bank == high.bank && low.address == high.address - 4;
+}
+
+static bool IsKeyOn (const YMCommand &command)
+{
+    return !command.bank && command.address == YM_REG_KEY_ON;
+}
+
+CYMJournal::CYMJournal (void)
+{
+    Clear ();
+}
+
+void CYMJournal::Clear (void)
+{
+    for (unsigned i = 0; i < YM_COUNT; i++)
+    {
+        m_Sent[i].clear ();
+        m_Replay[i].clear ();
+    }
+    m_Order.clear ();
+    m_nUnconfirmed = 0;
+    m_nReplays = 0;
+}
+
+void CYMJournal::Record (u8 nChip, const YMCommand &command, u32 nByte)
+{
+    CRingBuffer<TEntry, YM_JOURNAL_SIZE> &sent = m_Sent[nChip];
+    if (sent.full ())
+    {
+        // the oldest write is all but confirmed by now; losing it only matters if an error follows right away
+        YMCommand oldest = sent.front ().Command;
+        sent.pop ();
+        m_nUnconfirmed--;
+        m_Stats.Dropped++;
+        // a low half left behind would be replayed into whatever high the latch holds
+        if (IsFnumPair (oldest, sent.front ().Command))
+        {
+            sent.pop ();
+            m_nUnconfirmed--;
+            m_Stats.Dropped++;
+        }
+    }
+    sent.push ({command, nByte});
+    m_nUnconfirmed++;
+
+    // only full of entries for dropped writes while nothing is acknowledged; a write
+    // whose entry goes is confirmed along with the next one to its chip
+    if (m_Order.full ())
+        m_Order.pop ();
+    m_Order.push ({nChip, nByte});
+}
+
+void CYMJournal::Acknowledge (u32 nByte)
+{
+    u32 nBefore = nByte - SPINBUS_ACK_LAG;
+    while (!m_Order.empty () && (s32) (m_Order.front ().Byte - nBefore) <= 0)
+    {
+        u8 nChip = m_Order.front ().Chip;
+        m_Order.pop ();
+        Confirm (nChip, nBefore);
+    }
+}
+
+/// @brief Drops a chip's writes from frames that started at or before nBefore.
+void CYMJournal::Confirm (u8 nChip, u32 nBefore)
+{
+    CRingBuffer<TEntry, YM_JOURNAL_SIZE> &sent = m_Sent[nChip];
+    while (!sent.empty () && (s32) (sent.front ().Byte - nBefore) <= 0)
+    {
+        // a high half stays until its low half is confirmed too, so the pair is replayed
+        // whole; the low half's own entry in m_Order brings it back here
+        if (IsFnumHigh (sent.front ().Command))
+        {
+            if (sent.size () < 2)
+                break;
+            TEntry &low = sent.at (sent.begin_index () + 1);
+            if (IsFnumPair (sent.front ().Command, low.Command))
+            {
+                if ((s32) (low.Byte - nBefore) > 0)
+                    break;
+                sent.pop ();
+                m_nUnconfirmed--;
+            }
+        }
+        sent.pop ();
+        m_nUnconfirmed--;
+    }
+}
+
+void CYMJournal::Fail (void)
+{
+    m_Stats.Failures++;
+    // every unconfirmed write becomes a replay, so nothing is left to acknowledge
+    m_Order.clear ();
+    if (m_nUnconfirmed == 0)
+        return;
+
+    for (unsigned i = 0; i < YM_COUNT; i++)
+    {
+        CRingBuffer<TEntry, YM_JOURNAL_SIZE> &sent = m_Sent[i];
+        CRingBuffer<YMCommand, 2 * YM_JOURNAL_SIZE> &replay = m_Replay[i];
+        if (sent.empty ())
+            continue;
+
+        // writes still waiting from an earlier failure were queued after the ones that went out again since
+        YMCommand writes[2 * YM_JOURNAL_SIZE];
+        unsigned nWrites = 0;
+        while (!sent.empty ())
+        {
+            writes[nWrites++] = sent.front ().Command;
+            sent.pop ();
+            m_nUnconfirmed--;
+        }
+        while (!replay.empty ())
+        {
+            if (nWrites < 2 * YM_JOURNAL_SIZE)
+                writes[nWrites++] = replay.front ();
+            else
+                m_Stats.Dropped++;
+            replay.pop ();
+            m_nReplays--;
+        }
+
+        for (unsigned n = 0; n < nWrites; n++)
+        {
+            const YMCommand &command = writes[n];
+            if (!command.bank && command.address == YM_REG_DAC)
+            {
+                m_Stats.Skipped++;
+                continue;
+            }
+            if (IsKeyOn (command))
+            {
+                // only the channel's last key on/off, which can't make a new edge
+                bool bLater = false;
+                for (unsigned k = n + 1; k < nWrites && !bLater; k++)
+                    bLater = IsKeyOn (writes[k]) && (writes[k].data & 7) == (command.data & 7);
+                if (bLater)
+                {
+                    m_Stats.Skipped++;
+                    continue;
+                }
+            }
+            // a high half goes with the low half after it; the last write may be a high half
+            // whose low half is still queued, and goes out right after the replay
+            if (   (IsFnumHigh (command) && n + 1 < nWrites && !IsFnumPair (command, writes[n + 1]))
+                || (IsFnumLow (command) && (n == 0 || !IsFnumPair (writes[n - 1], command))))
+            {
+                m_Stats.Dropped++;
+                continue;
+            }
+            replay.push (command);
+            m_nReplays++;
+        }
+    }
+}
+
+unsigned CYMJournal::TakeReplay (u8 nChip, YMCommand *pCommands, unsigned nMax)
+{
+    CRingBuffer<YMCommand, 2 * YM_JOURNAL_SIZE> &replay = m_Replay[nChip];
+    unsigned nCount = 0;
+    while (   nCount < nMax && !replay.empty ()
+           && (nCount == 0 || replay.front ().bank == pCommands[0].bank))
+    {
+        // leave a high half for the next burst rather than send it without its low half
+        if (nCount > 0 && nCount == nMax - 1 && IsFnumHigh (replay.front ()))
+            break;
+        pCommands[nCount++] = replay.front ();
+        replay.pop ();
+    }
+    m_nReplays -= nCount;
+    m_Stats.Replayed += nCount;
+    return nCount;
+}
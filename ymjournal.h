@@ -0,0 +1,106 @@
+//
+// ymjournal.h
+//
+// Per-chip journal of YM writes that went out on the bus but aren't known to
+// have arrived, so an error only costs a resend of those writes instead of a
+// reset and a full prepare of every chip.
+//
+// The return channel has no per-command ack, but it does tell us when nothing
+// went wrong: the FPGA puts an error frame out as soon as the byte that caused
+// it is in, so a return byte that starts shifting after a frame and comes in
+// idle (or ack) means the frame was taken. Writes are stamped with the bus
+// byte their frame started on; Acknowledge () drops every write whose frame
+// has been followed by such a byte, walking the writes in the order they went
+// out, so an acknowledgement only looks at the chips it confirms something
+// for. An error frame or a lost return boundary
+// turns whatever is left into replays, which go out ahead of anything newer
+// for the same chip.
+//
+// Most registers hold state, so resending one that did arrive after all is
+// harmless. Two don't: key on/off (0x28) starts a note on the 0 to 1 edge of
+// an operator's bit, and the DAC (0x2A) plays each byte as a sample. Only the
+// last key on/off per channel is replayed, which leaves the keys as they were
+// meant to be without a second edge, and DAC bytes are never replayed, as a
+// late sample is worse than a lost one. Fnum halves share the chip's latch
+// (see ymshadow.h), so they are dropped, confirmed and replayed as high+low
+// pairs; a low half that would go out without its high is dropped instead.
+//
+#ifndef _ymjournal_h
+#define _ymjournal_h
+
+#include "spinbus.h"
+#include "ymqueue.h"
+#include "ymshadow.h"
+#include "ringbuffer.h"
+
+#define YM_JOURNAL_SIZE     64      // unconfirmed writes kept per chip
+// bus bytes from the start of a frame to a return byte that proves no error came of it:
+// the longest frame (a full burst) plus a return byte that was already under way
+#define SPINBUS_ACK_LAG     (3 + 2 * YM_BURST_MAX + 8 + 5)
+
+struct TYMJournalStats
+{
+    u32 Failures = 0;       // errors and slips that turned the journal into replays
+    u32 Replayed = 0;       // writes resent
+    u32 Dropped = 0;        // writes that fell out of a full journal and can't be replayed
+    u32 Skipped = 0;        // key on/off and DAC writes left out of a replay on purpose
+};
+
+class CYMJournal
+{
+public:
+    CYMJournal (void);
+
+    /// @brief Forgets everything, e.g. after a reset or when the queues were discarded.
+    void Clear (void);
+
+    /// @brief Records a write before its frame goes out.
+    /// @param nByte free-running bus byte count at the start of the frame.
+    void Record (u8 nChip, const YMCommand &command, u32 nByte);
+
+    /// @brief Confirms writes from frames that started at least SPINBUS_ACK_LAG bytes before nByte.
+    /// @param nByte bus byte count at the end of an idle or ack return byte.
+    void Acknowledge (u32 nByte);
+
+    /// @brief Marks every unconfirmed write to be sent again, but for the key on/off and DAC writes above.
+    void Fail (void);
+
+    bool HasReplay (u8 nChip) const { return !m_Replay[nChip].empty (); }
+    /// @return number of writes waiting to be replayed, over all chips.
+    unsigned GetReplayCount (void) const { return m_nReplays; }
+
+    /// @brief Takes the next writes to replay to one chip, all to the same bank.
+    /// A burst doesn't end on an fnum high half while its low half is still to come.
+    /// They are not journaled again until Record () is called for them.
+    /// @return number of writes in pCommands, at most nMax.
+    unsigned TakeReplay (u8 nChip, YMCommand *pCommands, unsigned nMax);
+
+    const TYMJournalStats &GetStats (void) const { return m_Stats; }
+
+private:
+    struct TEntry
+    {
+        YMCommand Command;
+        u32 Byte;
+    };
+
+    struct TOrder
+    {
+        u8  Chip;
+        u32 Byte;
+    };
+
+    void Confirm (u8 nChip, u32 nBefore);
+
+    CRingBuffer<TEntry, YM_JOURNAL_SIZE> m_Sent[YM_COUNT];
+    // the chip of every recorded write, in bus order; entries for writes that have
+    // since left the journal are passed over harmlessly
+    CRingBuffer<TOrder, YM_COUNT * YM_JOURNAL_SIZE> m_Order;
+    CRingBuffer<YMCommand, 2 * YM_JOURNAL_SIZE> m_Replay[YM_COUNT];
+    unsigned m_nUnconfirmed;    // over all chips, so Fail can skip an empty journal
+    unsigned m_nReplays;
+
+    TYMJournalStats m_Stats;
+};
+
+#endif
@@ -0,0 +1,275 @@
+//
+// ymqueue.cpp
+//
+#include "ymqueue.h"
+#include "ymshadow.h"
+#include <string.h>
+
+YMQueue::YMQueue (void)
+{
+    memset (m_nQueued, 0, sizeof m_nQueued);
+    memset (m_nSent, 0, sizeof m_nSent);
+    memset (m_nQueuedTotal, 0, sizeof m_nQueuedTotal);
+    memset (m_nSentTotal, 0, sizeof m_nSentTotal);
+    memset (m_Pending, 0, sizeof m_Pending);
+    m_Barrier = 0;
+}
+
+TYMWriteClass YMQueue::Classify (const YMCommand &command)
+{
+    if (command.address == YM_REG_KEY_ON && !command.bank)
+        return YMWriteCritical;
+    switch (command.address & 0xf0) {
+    case 0x40:  // TL, carries velocity and volume
+    case 0xa0:  // block/fnum
+        return YMWriteCritical;
+    default:
+        return YMWriteBulk;
+    }
+}
+
+u8 YMQueue::Channel (const YMCommand &command)
+{
+    if (command.address == YM_REG_KEY_ON && !command.bank) {
+        u8 channel = command.data & 0x07;
+        if (channel == 3 || channel == 7)
+            return YM_CHANNELS;
+        return channel > 3 ? channel - 1 : channel;
+    }
+    if (command.address < 0x30 || (command.address & 3) == 3)
+        return YM_CHANNELS;
+    // channel 3's per-operator fnums in special mode (A8-AA, AC-AE) all belong to channel 3
+    if ((command.address & 0xf8) == 0xa8)
+        return command.bank ? YM_CHANNELS : 2;
+    return (command.address & 3) + (command.bank ? 3 : 0);
+}
+
+static bool IsFnum (u8 address)
+{
+    return (address & 0xf0) == 0xa0 && (address & 3) != 3;
+}
+
+bool YMQueue::Coalesce (const YMCommand &command)
+{
+    if ((command.address == YM_REG_KEY_ON && !command.bank) || IsFnum(command.address))
+        return false;
+
+    TYMWriteClass eClass = Classify(command);
+    auto &queue = m_Queue[eClass];
+    unsigned index = m_Pending[command.bank][command.address];
+    if (!queue.contains_index(index))
+        return false;
+
+    TEntry &pending = queue.at(index);
+    if (pending.Sent)
+        return false;
+    if (pending.Command.bank != command.bank || pending.Command.address != command.address)
+        return false;
+
+    // don't reach back across a write of the other class to the same channel
+    if (pending.After != m_nQueued[eClass ^ 1][pending.Channel] || pending.AfterWide != AfterWide(pending, eClass))
+        return false;
+
+    // don't reach back across a key on/off that is still queued
+    if (eClass == YMWriteCritical && m_HasBarrier && queue.contains_index(m_Barrier)
+        && index - queue.begin_index() < m_Barrier - queue.begin_index())
+        return false;
+
+    pending.Command.data = command.data;
+    m_nCoalesced++;
+    return true;
+}
+
+bool YMQueue::CoalescePair (const YMCommand &high, const YMCommand &low)
+{
+    // the newest low write, with the high half it was queued behind
+    auto &queue = m_Queue[YMWriteCritical];
+    unsigned index = m_Pending[low.bank][low.address];
+    if (!queue.contains_index(index) || index == queue.begin_index())
+        return false;
+    if (m_Pending[high.bank][high.address] != index - 1)
+        return false;
+
+    TEntry &pendingHigh = queue.at(index - 1);
+    TEntry &pendingLow = queue.at(index);
+    if (pendingHigh.Sent || pendingLow.Sent)
+        return false;
+    if (   pendingHigh.Command.bank != high.bank || pendingHigh.Command.address != high.address
+        || pendingLow.Command.bank != low.bank || pendingLow.Command.address != low.address)
+        return false;
+
+    // the same rules as Coalesce, for the pair as a whole
+    if (   pendingHigh.After != m_nQueued[YMWriteBulk][pendingHigh.Channel]
+        || pendingHigh.AfterWide != AfterWide(pendingHigh, YMWriteCritical))
+        return false;
+    if (m_HasBarrier && queue.contains_index(m_Barrier)
+        && index - 1 - queue.begin_index() < m_Barrier - queue.begin_index())
+        return false;
+
+    pendingHigh.Command.data = high.data;
+    pendingLow.Command.data = low.data;
+    m_nCoalesced += 2;
+    return true;
+}
+
+void YMQueue::Push (const YMCommand &command, u32 nNow)
+{
+    TYMWriteClass eClass = Classify(command);
+    u8 channel = Channel(command);
+    auto &queue = m_Queue[eClass];
+
+    unsigned index = queue.end_index();
+    TEntry entry = {command, channel, m_nQueued[eClass ^ 1][channel], 0, nNow, false};
+    entry.AfterWide = AfterWide(entry, eClass);
+    queue.push(entry);
+    m_nQueued[eClass][channel]++;
+    m_nQueuedTotal[eClass]++;
+    if (eClass == YMWriteCritical)
+        m_nCriticalPending++;
+    m_Pending[command.bank][command.address] = index;
+    m_pNext = 0;
+
+    if (command.address == YM_REG_KEY_ON && !command.bank) {
+        m_Barrier = index;
+        m_HasBarrier = true;
+    }
+    else if ((command.address & 0xf4) == 0xa4 && (command.address & 3) != 3) {
+        // a new fnum high half must be followed by its own low half, so the
+        // low write queued after this one may not fold into an earlier slot
+        m_Pending[command.bank][command.address - 4] = index;
+    }
+}
+
+void YMQueue::pop (u32 nNow)
+{
+    TEntry &entry = Next();
+    TYMWriteClass eClass = m_NextClass;
+    m_pNext = 0;
+
+    m_nSent[eClass][entry.Channel]++;
+    m_nSentTotal[eClass]++;
+    m_nCriticalRun = eClass == YMWriteCritical ? m_nCriticalRun + 1 : 0;
+
+    u32 delay = nNow - entry.Queued;
+    m_nSentCount[eClass]++;
+    m_nDelayTotal[eClass] += delay;
+    if (delay > m_nDelayMax[eClass])
+        m_nDelayMax[eClass] = delay;
+
+    if (eClass == YMWriteBulk) {
+        m_Queue[YMWriteBulk].pop();
+        m_bLatchOpen = false;
+        return;
+    }
+
+    // the chip has a single fnum latch, so a high half pins the next write to its low half
+    u8 address = entry.Command.address;
+    m_bLatchOpen = (address & 0xf4) == 0xa4 && (address & 3) != 3;
+    m_nLatchChannel = entry.Channel;
+
+    // critical writes may leave from the middle; drop them once they reach the front
+    auto &critical = m_Queue[YMWriteCritical];
+    entry.Sent = true;
+    m_nCriticalPending--;
+    while (!critical.empty() && critical.front().Sent)
+        critical.pop();
+}
+
+void YMQueue::clear (void)
+{
+    for (unsigned i = 0; i < YMWriteClasses; i++)
+        m_Queue[i].clear();
+    memset (m_nQueued, 0, sizeof m_nQueued);
+    memset (m_nSent, 0, sizeof m_nSent);
+    memset (m_nQueuedTotal, 0, sizeof m_nQueuedTotal);
+    memset (m_nSentTotal, 0, sizeof m_nSentTotal);
+    m_nCriticalPending = 0;
+    m_nCriticalRun = 0;
+    m_bLatchOpen = false;
+    m_pNext = 0;
+}
+
+void YMQueue::Mark (TYMQueueMark *pMark) const
+{
+    memcpy (pMark->Queued, m_nQueued, sizeof pMark->Queued);
+}
+
+bool YMQueue::IsSent (const TYMQueueMark &mark, u8 nChannelMask) const
+{
+    for (unsigned c = 0; c < YMWriteClasses; c++) {
+        for (u8 channel = 0; channel <= YM_CHANNELS; channel++) {
+            if ((nChannelMask & BIT(channel)) && (s32) (m_nSent[c][channel] - mark.Queued[c][channel]) < 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+/// @return the count AfterWide holds for an entry queued now.
+u32 YMQueue::AfterWide (const TEntry &entry, TYMWriteClass eClass) const
+{
+    if (eClass == YMWriteCritical)
+        return m_nQueued[YMWriteBulk][YM_CHANNELS];
+    return entry.Channel == YM_CHANNELS ? m_nQueuedTotal[YMWriteCritical] : 0;
+}
+
+/// @return true if no write of the other class to the same channel queued before this one is still unsent,
+/// counting chip-wide bulk writes as writes to every channel.
+bool YMQueue::Ready (const TEntry &entry, TYMWriteClass eClass) const
+{
+    if ((s32) (m_nSent[eClass ^ 1][entry.Channel] - entry.After) < 0)
+        return false;
+    if (eClass == YMWriteCritical)
+        return (s32) (m_nSent[YMWriteBulk][YM_CHANNELS] - entry.AfterWide) >= 0;
+    // critical writes queued later wait for this one, so none of them can be in the count yet
+    return entry.Channel != YM_CHANNELS || (s32) (m_nSentTotal[YMWriteCritical] - entry.AfterWide) >= 0;
+}
+
+YMQueue::TEntry &YMQueue::Next (void)
+{
+    // front () and pop () both ask for the same write
+    if (m_pNext)
+        return *m_pNext;
+
+    // the oldest critical write whose channel has nothing older left to wait for
+    auto &critical = m_Queue[YMWriteCritical];
+    TEntry *pCritical = 0;
+    u32 blocked = 0;
+    unsigned scanned = 0;
+    for (unsigned i = critical.begin_index(); i != critical.end_index(); i++) {
+        TEntry &entry = critical.at(i);
+        if (entry.Sent)
+            continue;
+        // an open latch has to find its low half wherever it is
+        if (!m_bLatchOpen && scanned++ == YM_SCHED_WINDOW)
+            break;
+        if (m_bLatchOpen && entry.Channel != m_nLatchChannel) {
+            blocked |= BIT(entry.Channel);
+            continue;
+        }
+        bool unblocked = entry.Channel == YM_CHANNELS ? blocked == 0 : !(blocked & (BIT(entry.Channel) | BIT(YM_CHANNELS)));
+        if (unblocked && Ready(entry, YMWriteCritical)) {
+            pCritical = &entry;
+            break;
+        }
+        blocked |= BIT(entry.Channel);
+    }
+
+    auto &bulk = m_Queue[YMWriteBulk];
+    TEntry *pBulk = !bulk.empty() && Ready(bulk.front(), YMWriteBulk) ? &bulk.front() : 0;
+
+    if (pCritical && (!pBulk || m_bLatchOpen || m_nCriticalRun < YM_CRITICAL_RUN)) {
+        m_NextClass = YMWriteCritical;
+        m_pNext = pCritical;
+    }
+    else if (pBulk) {
+        m_NextClass = YMWriteBulk;
+        m_pNext = pBulk;
+    }
+    else {
+        // unreachable while anything is queued: the oldest pending write is always ready
+        m_NextClass = m_nCriticalPending ? YMWriteCritical : YMWriteBulk;
+        m_pNext = &m_Queue[m_NextClass].front();
+    }
+    return *m_pNext;
+}
@@ -0,0 +1,149 @@
+//
+// ymqueue.h
+//
+// Per-chip queue of pending YM register writes.
+//
+#ifndef _ymqueue_h
+#define _ymqueue_h
+
+#include "spinbus.h"
+#include "ringbuffer.h"
+
+#define QUEUE_SIZE_LIMIT 1000
+
+// critical writes sent back to back before a ready bulk write gets a turn
+#define YM_CRITICAL_RUN 8
+// how many pending critical writes the scheduler looks at for one that isn't blocked
+#define YM_SCHED_WINDOW 32
+
+struct YMCommand {
+    YMCommand() {}
+    YMCommand(bool bank, u8 address, u8 data) {
+        this->bank = bank;
+        this->address = address;
+        this->data = data;
+    }
+    bool bank;
+    u8 address;
+    u8 data;
+};
+
+enum TYMWriteClass
+{
+    YMWriteCritical,    // key on/off, fnum and TL: what a note-on waits for
+    YMWriteBulk,        // everything else, mostly patch loads
+    YMWriteClasses
+};
+
+/// @brief Position behind the writes queued at one moment, per class and channel; see YMQueue::IsSent.
+struct TYMQueueMark
+{
+    u32 Queued[YMWriteClasses][YM_CHANNELS + 1];
+};
+
+/// @brief Writes for one chip, scheduled in two classes.
+/// Critical writes overtake bulk writes, but never a bulk write to the same channel
+/// that was queued before them (and vice versa), so a key on still waits for its own
+/// patch load, just not for the patch loads of the other five channels. A critical
+/// write held up that way doesn't hold up critical writes for other channels either.
+/// Chip-wide bulk writes (0x22, 0x27, 0x2B) count as writes to every channel, so
+/// nothing of either class passes them in either direction.
+/// Per channel, writes stay in order and a new write is folded into a still-pending
+/// write to the same register. Key on/off (0x28) is an ordering barrier: nothing
+/// queued before it is ever changed by a write queued after it. The fnum registers
+/// share one high-half latch per chip, so their halves are queued back to back and
+/// only ever folded together, with CoalescePair.
+class YMQueue
+{
+public:
+    YMQueue (void);
+
+    static TYMWriteClass Classify (const YMCommand &command);
+    /// @return the channel a write belongs to, 0-5, or YM_CHANNELS for chip-wide registers.
+    static u8 Channel (const YMCommand &command);
+
+    /// @brief Queues a write, or updates a pending write to the same register in place.
+    /// Never folds an fnum half on its own.
+    /// @return true if the write was folded into a pending one (the queue did not grow).
+    bool Coalesce (const YMCommand &command);
+    /// @brief Folds an fnum pair into the newest pending pair for the same registers, both halves or neither.
+    /// @return true if the pair was folded.
+    bool CoalescePair (const YMCommand &high, const YMCommand &low);
+    /// @param nNow clock ticks (the pump's clock), for the queueing delay statistics.
+    void Push (const YMCommand &command, u32 nNow);
+
+    /// @return the total number of pending writes in both classes.
+    unsigned size (void) const { return m_nCriticalPending + m_Queue[YMWriteBulk].size(); }
+    /// @return true once either class holds QUEUE_SIZE_LIMIT writes, counting critical
+    /// writes that were sent out of order but still take up a slot.
+    bool AtLimit (void) const { return GetFill () >= QUEUE_SIZE_LIMIT; }
+    /// @return the slots taken in the fuller class, the figure AtLimit () checks.
+    unsigned GetFill (void) const { return m_Queue[YMWriteCritical].size() > m_Queue[YMWriteBulk].size() ? m_Queue[YMWriteCritical].size() : m_Queue[YMWriteBulk].size(); }
+    /// @return true if a class has no slot left at all, past QUEUE_SIZE_LIMIT.
+    bool IsFull (TYMWriteClass eClass) const { return m_Queue[eClass].full(); }
+    /// @return the write to send next. Only valid while size () > 0.
+    YMCommand &front (void) { return Next ().Command; }
+    /// @param nNow clock ticks (the pump's clock), for the queueing delay statistics.
+    void pop (u32 nNow);
+    void clear (void);
+
+    /// @brief Marks the end of what is queued now.
+    void Mark (TYMQueueMark *pMark) const;
+    /// @return true once every write queued before the mark to the channels in nChannelMask
+    /// (bit N = channel N, bit YM_CHANNELS = chip-wide registers) has been sent, however
+    /// many writes to other channels were queued after the mark and overtook them.
+    bool IsSent (const TYMQueueMark &mark, u8 nChannelMask) const;
+
+    u32 GetCoalesced (void) const { return m_nCoalesced; }
+    u32 GetSentCount (TYMWriteClass eClass) const { return m_nSentCount[eClass]; }
+    u64 GetDelayTotal (TYMWriteClass eClass) const { return m_nDelayTotal[eClass]; }
+    u32 GetDelayMax (TYMWriteClass eClass) const { return m_nDelayMax[eClass]; }
+
+    bool sent = 0;
+
+private:
+    struct TEntry
+    {
+        YMCommand Command;
+        u8  Channel;    // 0-5, or YM_CHANNELS for chip-wide registers
+        u32 After;      // writes of the other class to this channel queued before this one
+        u32 AfterWide;  // critical: chip-wide bulk writes queued before; chip-wide bulk: critical writes queued before
+        u32 Queued;     // clock ticks at Push
+        bool Sent;      // critical writes only: sent ahead of an older one, awaiting removal
+    };
+
+    u32 AfterWide (const TEntry &entry, TYMWriteClass eClass) const;
+    bool Ready (const TEntry &entry, TYMWriteClass eClass) const;
+    TEntry &Next (void);
+
+    // one slot more than the limit: COverloadControl::Admit stops CSpinbusPump::Enqueue
+    // there, and the slot past it takes the low half of a pair admitted just below, or a key off
+    CRingBuffer<TEntry, QUEUE_SIZE_LIMIT + 1> m_Queue[YMWriteClasses];
+    unsigned m_nCriticalPending = 0;
+    // set by Next, which keeps its pick until the next pop, push or clear
+    TEntry *m_pNext = 0;
+    TYMWriteClass m_NextClass = YMWriteCritical;
+    // channel whose fnum high half was just sent, which its low half must follow directly
+    u8 m_nLatchChannel = YM_CHANNELS;
+    bool m_bLatchOpen = false;
+
+    // free-running per-channel counts, for the cross-class dependencies
+    u32 m_nQueued[YMWriteClasses][YM_CHANNELS + 1];
+    u32 m_nSent[YMWriteClasses][YM_CHANNELS + 1];
+    u32 m_nQueuedTotal[YMWriteClasses];
+    u32 m_nSentTotal[YMWriteClasses];
+    unsigned m_nCriticalRun = 0;
+
+    // queue position of the newest write to each register, in its class's ring
+    unsigned m_Pending[2][256];
+    // queue position of the newest key on/off write
+    unsigned m_Barrier;
+    bool m_HasBarrier = false;
+
+    u32 m_nCoalesced = 0;
+    u32 m_nSentCount[YMWriteClasses] = { 0 };
+    u64 m_nDelayTotal[YMWriteClasses] = { 0 };
+    u32 m_nDelayMax[YMWriteClasses] = { 0 };
+};
+
+#endif
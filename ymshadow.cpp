@@ -0,0 +1,117 @@
+//
+// ymshadow.cpp
+//
+#include "ymshadow.h"
+#include <string.h>
+
+static int FnumLatchBit (u8 address)
+{
+    if ((address & 3) == 3)
+        return -1;
+
+    switch (address & 0xfc)
+    {
+    case 0xa0:  return address & 3;         // channel fnum
+    case 0xa8:  return 3 + (address & 3);   // channel 3 special mode operator fnum
+    default:    return -1;
+    }
+}
+
+CYMShadow::CYMShadow (void)
+:   m_nSent (0),
+    m_nElided (0)
+{
+    Invalidate ();
+}
+
+void CYMShadow::Invalidate (void)
+{
+    memset (m_Valid, 0, sizeof m_Valid);
+    memset (m_HighHeld, 0, sizeof m_HighHeld);
+    memset (m_HighChanged, 0, sizeof m_HighChanged);
+}
+
+void CYMShadow::Invalidate (u8 chip)
+{
+    memset (m_Valid[chip], 0, sizeof m_Valid[chip]);
+    memset (m_HighHeld[chip], 0, sizeof m_HighHeld[chip]);
+    memset (m_HighChanged[chip], 0, sizeof m_HighChanged[chip]);
+}
+
+void CYMShadow::Invalidate (u8 chip, bool bank, u8 address)
+{
+    // either half of an fnum pair: the next low write has to take the pair out again
+    if (FnumLatchBit ((u8) (address - 4)) >= 0)
+        address -= 4;
+    m_Valid[chip][bank][address / 32] &= ~BIT(address % 32);
+}
+
+bool CYMShadow::Update (u8 chip, bool bank, u8 address, u8 data)
+{
+    u32 &valid = m_Valid[chip][bank][address / 32];
+    bool known = (valid & BIT(address % 32)) != 0;
+
+    bool send;
+    if (address == YM_REG_KEY_ON && !bank)
+    {
+        // key on/off is a strobe, not state
+        send = true;
+    }
+    else if (FnumLatchBit ((u8) (address - 4)) >= 0)
+    {
+        // high half: held for the low write
+        u8 bit = BIT(FnumLatchBit ((u8) (address - 4)));
+        if (!known || m_Value[chip][bank][address] != data)
+            m_HighChanged[chip][bank] |= bit;
+        m_HighHeld[chip][bank] |= bit;
+        m_Value[chip][bank][address] = data;
+        valid |= BIT(address % 32);
+        return false;
+    }
+    else if (FnumLatchBit (address) >= 0)
+    {
+        // low half: goes out with the high half if either changed
+        u8 bit = BIT(FnumLatchBit (address));
+        bool high = (m_Valid[chip][bank][(address + 4) / 32] & BIT((address + 4) % 32)) != 0;
+        send = !known || m_Value[chip][bank][address] != data || (m_HighChanged[chip][bank] & bit);
+        if (send && high)
+            m_nSent++;
+        else if (!send && (m_HighHeld[chip][bank] & bit))
+            m_nElided++;
+        m_HighHeld[chip][bank] &= ~bit;
+        m_HighChanged[chip][bank] &= ~bit;
+    }
+    else
+    {
+        send = !known || m_Value[chip][bank][address] != data;
+    }
+
+    m_Value[chip][bank][address] = data;
+    valid |= BIT(address % 32);
+
+    if (send)
+        m_nSent++;
+    else
+        m_nElided++;
+
+    return send;
+}
+
+bool CYMShadow::GetFnumHigh (u8 chip, bool bank, u8 address, u8 *pData) const
+{
+    if (FnumLatchBit (address) < 0)
+    {
+        return false;
+    }
+    return Get (chip, bank, address + 4, pData);
+}
+
+bool CYMShadow::Get (u8 chip, bool bank, u8 address, u8 *pData) const
+{
+    if (!(m_Valid[chip][bank][address / 32] & BIT(address % 32)))
+    {
+        return false;
+    }
+    *pData = m_Value[chip][bank][address];
+    return true;
+}
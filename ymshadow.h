@@ -0,0 +1,64 @@
+//
+// ymshadow.h
+//
+// Shadow copy of both register banks of every YM chip, as last queued.
+// Lets the queueing stage drop writes that would not change chip state.
+//
+// The block/fnum registers come in pairs, and a chip has a single latch for
+// the high halves of all of them (A4-A6 and AC-AE, either bank): a high write
+// only lands with the next low write, whichever register that is. So a high
+// write is never sent on its own. It is held in the shadow, and the low write
+// takes it along (high, then low) if either half changed, as
+// CYMSnapshot::RestoreFnum does; if neither did, both are dropped.
+//
+#ifndef _ymshadow_h
+#define _ymshadow_h
+
+#include "spinbus.h"
+
+#define YM_REG_KEY_ON   0x28
+#define YM_REG_DAC      0x2a
+
+/// @return what a YM2612 register holds after reset, the same in either bank: zero, except pan (B4-B6) with both outputs on.
+static inline u8 YMPowerOnValue (u8 address)
+{
+    return address >= 0xb4 && address <= 0xb6 ? 0xc0 : 0x00;
+}
+
+class CYMShadow
+{
+public:
+    CYMShadow (void);
+
+    /// @brief Forgets everything, e.g. after a reset or when queued writes were discarded.
+    void Invalidate (void);
+    void Invalidate (u8 chip);
+    void Invalidate (u8 chip, bool bank, u8 address);
+
+    /// @brief Records a write about to be queued.
+    /// @return false if the chip already holds this value and the write can be dropped,
+    /// or if it is an fnum high half, which waits for its low half.
+    bool Update (u8 chip, bool bank, u8 address, u8 data);
+    /// @return true and the high half in pData if address is the low half of an fnum pair
+    /// whose high half is known; queue it right in front of the low write.
+    bool GetFnumHigh (u8 chip, bool bank, u8 address, u8 *pData) const;
+
+    /// @return true and the value in pData if the register has been written since the last invalidate.
+    bool Get (u8 chip, bool bank, u8 address, u8 *pData) const;
+
+    u32 GetSentWrites (void) const { return m_nSent; }
+    u32 GetElidedWrites (void) const { return m_nElided; }
+
+private:
+    u8  m_Value[YM_COUNT][2][256];
+    u32 m_Valid[YM_COUNT][2][256 / 32];
+    // fnum high halves held for their low write, one bit per low register
+    // (A0-A2 -> 0-2, A8-AA -> 3-5): written since the last low write, and changed
+    u8  m_HighHeld[YM_COUNT][2];
+    u8  m_HighChanged[YM_COUNT][2];
+
+    u32 m_nSent;
+    u32 m_nElided;
+};
+
+#endif
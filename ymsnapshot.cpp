@@ -0,0 +1,134 @@
+//
+// ymsnapshot.cpp
+//
+#include "ymsnapshot.h"
+#include <string.h>
+
+CYMSnapshot::CYMSnapshot (void)
+{
+    Clear ();
+}
+
+void CYMSnapshot::Clear (void)
+{
+    memset (m_Valid, 0, sizeof m_Valid);
+    memset (m_Patch, PATCH_NONE, sizeof m_Patch);
+    memset (m_Sounding, 0, sizeof m_Sounding);
+    m_bValid = false;
+}
+
+void CYMSnapshot::Take (const CYMShadow &shadow)
+{
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+    {
+        for (unsigned bank = 0; bank < 2; bank++)
+        {
+            for (unsigned address = 0; address < 256; address++)
+            {
+                if (address == YM_REG_KEY_ON && !bank)
+                    continue;
+                if (shadow.Get (chip, bank, address, &m_Value[chip][bank][address]))
+                    m_Valid[chip][bank][address / 32] |= BIT(address % 32);
+            }
+        }
+    }
+    m_bValid = true;
+}
+
+void CYMSnapshot::SetChannel (u8 nChip, u8 nChannel, u8 nPatch, bool bSounding)
+{
+    m_Patch[nChip][nChannel] = nPatch;
+    m_Sounding[nChip][nChannel] = bSounding;
+}
+
+unsigned CYMSnapshot::Restore (u32 nChipMask, TYMRestoreHandler *pHandler, void *pParam, unsigned *pDeferred) const
+{
+    unsigned nCount = 0;
+
+    // LFO, timers, channel 3 mode, DAC; 0x28 is key on/off
+    for (u8 chip = 0; chip < YM_COUNT; chip++)
+    {
+        if (!(nChipMask & BIT(chip)))
+            continue;
+        for (u8 address = 0x21; address < 0x30; address++)
+        {
+            if (address != YM_REG_KEY_ON)
+                nCount += RestoreRegister (chip, 0, address, pHandler, pParam);
+        }
+    }
+
+    unsigned nDeferred = 0;
+    for (unsigned pass = 0; pass < 2; pass++)
+    {
+        bool bSounding = pass == 0;
+        for (u8 channel = 0; channel < YM_CHANNELS; channel++)
+        {
+            for (u8 chip = 0; chip < YM_COUNT; chip++)
+            {
+                if (!(nChipMask & BIT(chip)) || m_Sounding[chip][channel] != bSounding)
+                    continue;
+                unsigned nWrites = RestoreChannel (chip, channel, pHandler, pParam);
+                nCount += nWrites;
+                if (!bSounding)
+                    nDeferred += nWrites;
+            }
+        }
+    }
+
+    if (pDeferred != 0)
+        *pDeferred = nDeferred;
+    return nCount;
+}
+
+unsigned CYMSnapshot::RestoreChannel (u8 nChip, u8 nChannel, TYMRestoreHandler *pHandler, void *pParam) const
+{
+    bool bank = nChannel > 2;
+    u8 chMod = nChannel % 3;
+    unsigned nCount = 0;
+
+    for (u8 base = 0x30; base < 0xa0; base += 0x10)
+    {
+        for (u8 op = 0; op < 4; op++)
+            nCount += RestoreRegister (nChip, bank, base + chMod + op*4, pHandler, pParam);
+    }
+    nCount += RestoreRegister (nChip, bank, 0xb0 + chMod, pHandler, pParam);
+    nCount += RestoreRegister (nChip, bank, 0xb4 + chMod, pHandler, pParam);
+    nCount += RestoreFnum (nChip, bank, 0xa0 + chMod, pHandler, pParam);
+
+    // channel 3's per-operator fnums in special mode
+    if (!bank && chMod == 2)
+    {
+        for (u8 n = 0; n < 3; n++)
+            nCount += RestoreFnum (nChip, bank, 0xa8 + n, pHandler, pParam);
+    }
+
+    return nCount;
+}
+
+unsigned CYMSnapshot::RestoreRegister (u8 nChip, bool bBank, u8 nAddress, TYMRestoreHandler *pHandler, void *pParam) const
+{
+    u8 nData = Get (nChip, bBank, nAddress);
+    if (nData == YMPowerOnValue (nAddress))
+        return 0;
+    (*pHandler) (pParam, nChip, bBank, nAddress, nData);
+    return 1;
+}
+
+/// @brief The high half only takes effect with the low write after it, so both go out if either differs.
+unsigned CYMSnapshot::RestoreFnum (u8 nChip, bool bBank, u8 nLow, TYMRestoreHandler *pHandler, void *pParam) const
+{
+    u8 nHigh = nLow + 4;
+    if (   Get (nChip, bBank, nHigh) == YMPowerOnValue (nHigh)
+        && Get (nChip, bBank, nLow) == YMPowerOnValue (nLow))
+        return 0;
+    (*pHandler) (pParam, nChip, bBank, nHigh, Get (nChip, bBank, nHigh));
+    (*pHandler) (pParam, nChip, bBank, nLow, Get (nChip, bBank, nLow));
+    return 2;
+}
+
+u8 CYMSnapshot::Get (u8 nChip, bool bBank, u8 nAddress) const
+{
+    if (!(m_Valid[nChip][bBank][nAddress / 32] & BIT(nAddress % 32)))
+        return YMPowerOnValue (nAddress);
+    return m_Value[nChip][bBank][nAddress];
+}
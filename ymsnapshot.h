@@ -0,0 +1,63 @@
+//
+// ymsnapshot.h
+//
+// Register image the chips are meant to hold, kept across a bus reset so a
+// warm restart only has to write what differs from the power-on defaults
+// instead of preparing every channel from scratch.
+//
+// The image is merged from the shadow: registers the shadow knows replace the
+// snapshot's, the others are kept, so it survives the shadow being
+// invalidated in between. Alongside it each channel keeps its patch (for the
+// voice allocator's patch cache) and whether it was sounding, which decides
+// restore order: global registers first, then sounding channels, then the
+// rest. Key on/off is never restored; a reset leaves every channel keyed off.
+//
+#ifndef _ymsnapshot_h
+#define _ymsnapshot_h
+
+#include "spinbus.h"
+#include "ymshadow.h"
+#include "patches.h"
+
+/// @brief Receives each register write of a restore, in order.
+typedef void TYMRestoreHandler (void *pParam, u8 nChip, bool bBank, u8 nAddress, u8 nData);
+
+class CYMSnapshot
+{
+public:
+    CYMSnapshot (void);
+
+    void Clear (void);
+    /// @return true once something has been taken.
+    bool IsValid (void) const { return m_bValid; }
+
+    /// @brief Merges the registers the shadow knows into the image.
+    void Take (const CYMShadow &shadow);
+    /// @brief Records what a channel holds besides its registers.
+    void SetChannel (u8 nChip, u8 nChannel, u8 nPatch, bool bSounding);
+    u8 GetPatch (u8 nChip, u8 nChannel) const { return m_Patch[nChip][nChannel]; }
+    bool IsSounding (u8 nChip, u8 nChannel) const { return m_Sounding[nChip][nChannel]; }
+
+    /// @brief Hands out the writes that bring freshly reset chips to the image.
+    /// Channels go channel-major over the chips, like the full prepare.
+    /// @param nChipMask chips to restore, bit N = chip N.
+    /// @param pDeferred if not 0, gets how many of the writes (the last ones) are
+    /// for channels that weren't sounding (see IsSounding).
+    /// @return number of writes handed out.
+    unsigned Restore (u32 nChipMask, TYMRestoreHandler *pHandler, void *pParam, unsigned *pDeferred = 0) const;
+
+private:
+    unsigned RestoreRegister (u8 nChip, bool bBank, u8 nAddress, TYMRestoreHandler *pHandler, void *pParam) const;
+    unsigned RestoreFnum (u8 nChip, bool bBank, u8 nLow, TYMRestoreHandler *pHandler, void *pParam) const;
+    unsigned RestoreChannel (u8 nChip, u8 nChannel, TYMRestoreHandler *pHandler, void *pParam) const;
+    /// @return the image's value, or the power-on value if the register was never written.
+    u8 Get (u8 nChip, bool bBank, u8 nAddress) const;
+
+    u8   m_Value[YM_COUNT][2][256];
+    u32  m_Valid[YM_COUNT][2][256 / 32];
+    u8   m_Patch[YM_COUNT][YM_CHANNELS];
+    bool m_Sounding[YM_COUNT][YM_CHANNELS];
+    bool m_bValid;
+};
+
+#endif